@@ -0,0 +1,610 @@
+/** Functions supporting asynchronous file I/O
+ *
+ * @author Krishna Garg
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <atomic>
+#include "asyncio.hpp"
+
+/** Parse the name of an I/O engine
+ *
+ * @param name is "sync", "thread" or "uring"
+ * @param engine receives the engine
+ * @return zero (0) if success or -1 if the name is unknown
+ */
+int io_engine_parse (const char *name, IO_ENGINE *engine) {
+  if (strcmp(name, "sync") == 0) {
+    *engine = IO_SYNC;
+  } else if (strcmp(name, "thread") == 0) {
+    *engine = IO_THREAD;
+  } else if (strcmp(name, "uring") == 0) {
+    *engine = IO_URING;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+/** Name of an I/O engine, as printed
+ *
+ * @param engine is the engine
+ * @return "sync", "thread" or "uring"
+ */
+const char *io_engine_name (IO_ENGINE engine) {
+  switch (engine) {
+  case IO_THREAD:
+    return "thread";
+  case IO_URING:
+    return "uring";
+  default:
+    return "sync";
+  }
+}
+
+/** Allocate an I/O buffer, aligned as O_DIRECT needs
+ *
+ * @return IO_BUFFER bytes, or NULL if out of memory
+ */
+static char *alloc_buffer (void) {
+  void *p = NULL;
+  if (posix_memalign(&p, IO_ALIGN, IO_BUFFER) != 0) {
+    return NULL;
+  }
+  return (char *) p;
+}
+
+/** Load a ring index the kernel writes */
+static inline unsigned load_acquire (unsigned *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+/** Store a ring index the kernel reads */
+static inline void store_release (unsigned *p, unsigned v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+/** Ctor for IoQueue. Nothing is set up until open().
+ */
+IoQueue::IoQueue () {
+  engine = IO_SYNC;
+  ring_fd = -1;
+  sq_ring = cq_ring = MAP_FAILED;
+  sq_bytes = cq_bytes = sqe_bytes = 0;
+  sqes = (struct io_uring_sqe *) MAP_FAILED;
+  sq_tail = sq_mask = sq_array = NULL;
+  cq_head = cq_tail = cq_mask = NULL;
+  cqes = NULL;
+  queued = 0;
+  inflight = 0;
+  enters = 0;
+  stopping = false;
+}
+
+/** Dtor for IoQueue. Waits for what is in flight and tears down the ring
+ *  or stops the helper thread.
+ */
+IoQueue::~IoQueue () {
+  close();
+}
+
+/** Wait for every request in flight, dropping the results
+ */
+void IoQueue::drain (void) {
+  uint64_t tag;
+  ssize_t result;
+  while (inflight + queued > 0) {
+    if (wait(&tag, &result) != 0) {
+      break;
+    }
+  }
+}
+
+/** Tear down whatever open() set up
+ */
+void IoQueue::close (void) {
+  drain();
+  if (helper.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+      work.notify_all();
+    }
+    helper.join();
+  }
+  if (sqes != MAP_FAILED) {
+    munmap(sqes, sqe_bytes);
+  }
+  if ((cq_ring != MAP_FAILED) && (cq_ring != sq_ring)) {
+    munmap(cq_ring, cq_bytes);
+  }
+  if (sq_ring != MAP_FAILED) {
+    munmap(sq_ring, sq_bytes);
+  }
+  if (ring_fd >= 0) {
+    ::close(ring_fd);
+  }
+  ring_fd = -1;
+  sq_ring = cq_ring = MAP_FAILED;
+  sqes = (struct io_uring_sqe *) MAP_FAILED;
+  engine = IO_SYNC;
+}
+
+/** Set up the queue
+ *
+ * @param engine is IO_URING or IO_THREAD; IO_URING falls back to
+ *   IO_THREAD if the ring cannot be set up
+ * @param depth is the most requests that will be in flight at once
+ * @return zero (0) if success or -1 on error
+ */
+int IoQueue::open (IO_ENGINE engine, unsigned depth) {
+  close();
+  if (engine == IO_URING) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (fd >= 0) {
+      ring_fd = fd;
+      sq_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+      cq_bytes = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+      if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_bytes = cq_bytes = (sq_bytes > cq_bytes) ? sq_bytes : cq_bytes;
+      }
+      sq_ring = mmap(NULL, sq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+      if (sq_ring != MAP_FAILED) {
+        cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq_ring
+          : mmap(NULL, cq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+      }
+      sqe_bytes = p.sq_entries * sizeof(struct io_uring_sqe);
+      if (cq_ring != MAP_FAILED) {
+        sqes = (struct io_uring_sqe *) mmap(NULL, sqe_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                            fd, IORING_OFF_SQES);
+      }
+      if (sqes != MAP_FAILED) {
+        char *sq = (char *) sq_ring;
+        char *cq = (char *) cq_ring;
+        sq_tail = (unsigned *) (sq + p.sq_off.tail);
+        sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+        sq_array = (unsigned *) (sq + p.sq_off.array);
+        cq_head = (unsigned *) (cq + p.cq_off.head);
+        cq_tail = (unsigned *) (cq + p.cq_off.tail);
+        cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+        this->engine = IO_URING;
+        return 0;
+      }
+      close();
+    }
+  }
+  // the portable way
+  stopping = false;
+  todo.clear();
+  done.clear();
+  try {
+    helper = std::thread(&IoQueue::serve, this);
+  } catch (const std::system_error &) {
+    errno = EAGAIN;
+    return -1;
+  }
+  this->engine = IO_THREAD;
+  return 0;
+}
+
+/** Run requests with pread/pwrite until told to stop. Runs on the helper
+ *  thread.
+ */
+void IoQueue::serve (void) {
+  std::unique_lock<std::mutex> guard(lock);
+  for (;;) {
+    work.wait(guard, [&]() {return !todo.empty() || stopping;});
+    if (todo.empty()) {
+      return;
+    }
+    Request r = todo.front();
+    todo.pop_front();
+    guard.unlock();
+    ssize_t n;
+    do {
+      n = r.write ? pwrite(r.fd, r.buf, r.len, r.off) : pread(r.fd, r.buf, r.len, r.off);
+    } while ((n < 0) && (errno == EINTR));
+    r.result = (n < 0) ? -errno : n;
+    guard.lock();
+    done.push_back(r);
+    finished.notify_one();
+  }
+}
+
+/** Start a read or write without waiting for it
+ *
+ * @param write is true to write buf, false to read into it
+ * @param fd is the file
+ * @param buf is the buffer, which must stay put until wait() hands back tag
+ * @param len is the number of bytes
+ * @param off is the file offset
+ * @param tag is handed back by wait() when this request completes
+ */
+void IoQueue::submit (bool write, int fd, char *buf, size_t len, off_t off, uint64_t tag) {
+  if (engine == IO_URING) {
+    unsigned tail = *sq_tail;       // only this thread moves the tail
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *e = &sqes[index];
+    memset(e, 0, sizeof(*e));
+    e->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    e->fd = fd;
+    e->addr = (uint64_t) (uintptr_t) buf;
+    e->len = len;
+    e->off = off;
+    e->user_data = tag;
+    sq_array[index] = index;
+    store_release(sq_tail, tail + 1);
+    queued++;
+    // hand it to the kernel now, so it runs while the caller works; if that
+    // fails it stays queued and wait() submits it
+    int n = syscall(__NR_io_uring_enter, ring_fd, queued, 0, 0, NULL, 0);
+    enters++;
+    if (n > 0) {
+      inflight += n;
+      queued -= n;
+    }
+    return;
+  }
+  Request r = {write, fd, buf, len, off, tag, 0};
+  std::lock_guard<std::mutex> guard(lock);
+  todo.push_back(r);
+  inflight++;
+  work.notify_one();
+}
+
+/** Wait for a request to complete
+ *
+ * @param tag receives the tag it was started with
+ * @param result receives the bytes moved, or -errno
+ * @return zero (0) if success or -1 if nothing is in flight or io_uring
+ *   failed
+ */
+int IoQueue::wait (uint64_t *tag, ssize_t *result) {
+  if (engine == IO_URING) {
+    for (;;) {
+      unsigned head = *cq_head;     // only this thread moves the head
+      if (head != load_acquire(cq_tail)) {
+        struct io_uring_cqe *c = &cqes[head & *cq_mask];
+        *tag = c->user_data;
+        *result = c->res;
+        store_release(cq_head, head + 1);
+        inflight--;
+        return 0;
+      }
+      if (inflight + queued == 0) {
+        errno = EINVAL;
+        return -1;
+      }
+      int n = syscall(__NR_io_uring_enter, ring_fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+      enters++;
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return -1;
+      }
+      inflight += n;
+      queued -= n;
+    }
+  }
+  std::unique_lock<std::mutex> guard(lock);
+  if (inflight == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  finished.wait(guard, [&]() {return !done.empty();});
+  *tag = done.front().tag;
+  *result = done.front().result;
+  done.pop_front();
+  inflight--;
+  return 0;
+}
+
+/** Ctor for AsyncReader. Nothing is read until open().
+ */
+AsyncReader::AsyncReader () {
+  fd = -1;
+  length = next_off = 0;
+  started = used = 0;
+  pos = 0;
+  error = 0;
+}
+
+/** Dtor for AsyncReader. Waits for the reads in flight, which still use
+ *  the buffers.
+ */
+AsyncReader::~AsyncReader () {
+  queue.drain();
+  for (size_t i = 0; i < bufs.size(); i++) {
+    free(bufs[i].data);
+  }
+}
+
+/** Start reading a file
+ *
+ * @param fd is a regular file, read from offset 0; it is not closed
+ * @param engine is IO_URING or IO_THREAD
+ * @return zero (0) if success or -1 on error (errno is EINVAL if fd is not
+ *   a regular file)
+ */
+int AsyncReader::open (int fd, IO_ENGINE engine) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return -1;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (queue.open(engine, IO_DEPTH) != 0) {
+    return -1;
+  }
+  this->fd = fd;
+  length = st.st_size;
+  bufs.resize(IO_DEPTH);
+  for (size_t i = 0; i < bufs.size(); i++) {
+    if ((bufs[i].data = alloc_buffer()) == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  while ((started - used < bufs.size()) && (next_off < length)) {
+    start();
+  }
+  return 0;
+}
+
+/** Start the read of the next part of the file into the next free buffer
+ */
+void AsyncReader::start (void) {
+  Buffer &b = bufs[started % bufs.size()];
+  b.off = next_off;
+  b.want = (length - next_off < IO_BUFFER) ? length - next_off : IO_BUFFER;
+  b.size = 0;
+  b.ready = false;
+  // a whole buffer even at the end of the file, which O_DIRECT wants
+  queue.submit(false, fd, b.data, IO_BUFFER, b.off, started);
+  started++;
+  next_off += IO_BUFFER;
+}
+
+/** Read the file
+ *
+ * Waits only when the buffer the bytes come from is still being read.
+ *
+ * @param buf receives the bytes
+ * @param n is the room at buf
+ * @return the number of bytes read, 0 at end of file or -1 on error
+ */
+ssize_t AsyncReader::read (char *buf, size_t n) {
+  size_t done = 0;
+  while ((done < n) && (used < started) && (error == 0)) {
+    Buffer &b = bufs[used % bufs.size()];
+    while (!b.ready) {
+      uint64_t tag;
+      ssize_t result;
+      if (queue.wait(&tag, &result) != 0) {
+        error = errno;
+        break;
+      }
+      Buffer &r = bufs[tag % bufs.size()];
+      r.ready = true;
+      if (result < 0) {
+        error = -result;
+        break;
+      }
+      r.size = result;
+      // a short read, which regular files seldom give: read the rest here,
+      // from the last IO_ALIGN boundary on as O_DIRECT needs
+      while (r.size < r.want) {
+        size_t at = r.size / IO_ALIGN * IO_ALIGN;
+        ssize_t got = pread(fd, r.data + at, IO_BUFFER - at, r.off + at);
+        if ((got < 0) && (errno == EINTR)) {
+          continue;
+        }
+        if (got < 0) {
+          error = errno;
+          break;
+        }
+        if (at + got <= r.size) {
+          break;                    // the file shrank: take what there is
+        }
+        r.size = at + got;
+      }
+      if (error != 0) {
+        break;
+      }
+      if (r.size > r.want) {
+        r.size = r.want;            // the file grew: stop where it ended when opened
+      }
+    }
+    if (error != 0) {
+      break;
+    }
+    size_t k = (b.size - pos < n - done) ? b.size - pos : n - done;
+    memcpy(buf + done, b.data + pos, k);
+    pos += k;
+    done += k;
+    if (pos == b.size) {
+      used++;
+      pos = 0;
+      if (next_off < length) {
+        start();
+      }
+    }
+  }
+  if ((done == 0) && (error != 0)) {
+    errno = error;
+    return -1;
+  }
+  return done;
+}
+
+/** Ctor for AsyncWriter. Nothing is written until open().
+ */
+AsyncWriter::AsyncWriter () {
+  fd = -1;
+  direct = false;
+  offset = length = 0;
+  current = 0;
+  fill = 0;
+  error = 0;
+}
+
+/** Dtor for AsyncWriter. Waits for the writes in flight but does not
+ *  write what is left in the current buffer; close() does that.
+ */
+AsyncWriter::~AsyncWriter () {
+  queue.drain();
+  for (size_t i = 0; i < bufs.size(); i++) {
+    free(bufs[i].data);
+  }
+}
+
+/** Start writing a file
+ *
+ * @param fd is the file, written from offset 0; it is not closed
+ * @param engine is IO_URING or IO_THREAD
+ * @param direct is true if fd was opened with O_DIRECT
+ * @return zero (0) if success or -1 on error
+ */
+int AsyncWriter::open (int fd, IO_ENGINE engine, bool direct) {
+  if (queue.open(engine, IO_DEPTH) != 0) {
+    return -1;
+  }
+  this->fd = fd;
+  this->direct = direct;
+  bufs.resize(IO_DEPTH);
+  for (size_t i = 0; i < bufs.size(); i++) {
+    bufs[i].busy = false;
+    bufs[i].size = 0;
+    if ((bufs[i].data = alloc_buffer()) == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** Wait for a write to complete and free its buffer
+ *
+ * @return zero (0) if success or -1 on error
+ */
+int AsyncWriter::reap (void) {
+  uint64_t tag;
+  ssize_t result;
+  if (queue.wait(&tag, &result) != 0) {
+    error = errno;
+    return -1;
+  }
+  Buffer &b = bufs[tag % bufs.size()];
+  b.busy = false;
+  if (result < 0) {
+    error = -result;
+    return -1;
+  }
+  // a short write: write the rest here, with O_DIRECT from the last
+  // IO_ALIGN boundary on (b.size is a multiple of it then)
+  off_t off = (off_t) (tag * IO_BUFFER);
+  size_t done = result;
+  while (done < b.size) {
+    size_t at = direct ? done / IO_ALIGN * IO_ALIGN : done;
+    ssize_t n = pwrite(fd, b.data + at, b.size - at, off + at);
+    if ((n < 0) && (errno == EINTR)) {
+      continue;
+    }
+    if ((n <= 0) || (at + n <= done)) {
+      error = (n < 0) ? errno : EIO;
+      return -1;
+    }
+    done = at + n;
+  }
+  return 0;
+}
+
+/** Start writing the current buffer and move on to the next, waiting for
+ *  it if it is still being written
+ *
+ * @param len is the number of bytes to write from the current buffer
+ * @return zero (0) if success or -1 on error
+ */
+int AsyncWriter::flush (size_t len) {
+  Buffer &b = bufs[current % bufs.size()];
+  b.size = len;
+  b.busy = true;
+  queue.submit(true, fd, b.data, len, offset, current);
+  offset += IO_BUFFER;
+  current++;
+  fill = 0;
+  while (bufs[current % bufs.size()].busy) {
+    if (reap() != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** Write bytes after those already written
+ *
+ * @param data is the bytes
+ * @param n is the number of bytes
+ * @return zero (0) if success or -1 on error
+ */
+int AsyncWriter::write (const char *data, size_t n) {
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+  while (n > 0) {
+    Buffer &b = bufs[current % bufs.size()];
+    size_t k = (IO_BUFFER - fill < n) ? IO_BUFFER - fill : n;
+    memcpy(b.data + fill, data, k);
+    fill += k;
+    length += k;
+    data += k;
+    n -= k;
+    if ((fill == IO_BUFFER) && (flush(IO_BUFFER) != 0)) {
+      errno = error;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** Write what is left and wait for every write
+ *
+ * @return zero (0) if success or -1 on error
+ */
+int AsyncWriter::close (void) {
+  if ((fill > 0) && (error == 0)) {
+    size_t len = fill;
+    if (direct) {
+      len = (fill + IO_ALIGN - 1) / IO_ALIGN * IO_ALIGN;
+      memset(bufs[current % bufs.size()].data + fill, 0, len - fill);
+    }
+    flush(len);
+  }
+  for (size_t i = 0; i < bufs.size(); i++) {
+    while (bufs[i].busy && (error == 0)) {
+      reap();
+    }
+  }
+  if ((error == 0) && direct && (ftruncate(fd, length) != 0)) {
+    error = errno;
+  }
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,193 @@
+/** Asynchronous file I/O: large buffers read ahead of and written behind
+ *  the caller, with io_uring or a helper thread
+ *
+ * @author Krishna Garg
+ */
+
+#ifndef ASYNCIO_HPP
+#define ASYNCIO_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// bytes per I/O buffer
+#define IO_BUFFER (4 << 20)
+// buffers in flight per file
+#define IO_DEPTH (4)
+// alignment of buffers, offsets and lengths, as O_DIRECT needs
+#define IO_ALIGN (4096)
+
+/** @brief How file I/O is done
+ */
+typedef enum {
+  IO_SYNC,                  /**< read() and stdio on the caller's thread, one call at a time */
+  IO_THREAD,                /**< pread/pwrite on a helper thread */
+  IO_URING                  /**< io_uring, submitted and reaped on the caller's thread */
+} IO_ENGINE;
+
+int io_engine_parse(const char *name, IO_ENGINE *engine);
+const char *io_engine_name(IO_ENGINE engine);
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/** @brief Reads and writes of whole buffers at file offsets, submitted
+ *  without waiting and completed in any order
+ *
+ * With IO_URING the requests go on an io_uring set up with raw system
+ * calls, one io_uring_enter to submit each and one to wait whenever no
+ * completion is there yet. With IO_THREAD a
+ * helper thread runs them with pread/pwrite, one after the other, and
+ * that is also what open() falls back to where io_uring cannot be set up
+ * (an old kernel, or a sandbox that forbids it).
+ */
+class IoQueue {
+private:
+  /** @brief One read or write for the helper thread */
+  struct Request {
+    bool write;                     /**< pwrite, else pread */
+    int fd;                         /**< the file */
+    char *buf;                      /**< the buffer */
+    size_t len;                     /**< bytes to move */
+    off_t off;                      /**< file offset */
+    uint64_t tag;                   /**< handed back by wait() */
+    ssize_t result;                 /**< bytes moved, or -errno */
+  };
+
+  IO_ENGINE engine;                 /**< IO_URING or IO_THREAD once open */
+  int ring_fd;                      /**< the io_uring, -1 if none */
+  void *sq_ring;                    /**< mapped submission ring */
+  void *cq_ring;                    /**< mapped completion ring, may be sq_ring */
+  size_t sq_bytes;                  /**< size of the sq_ring mapping */
+  size_t cq_bytes;                  /**< size of the cq_ring mapping */
+  struct io_uring_sqe *sqes;        /**< mapped submission entries */
+  size_t sqe_bytes;                 /**< size of the sqes mapping */
+  unsigned *sq_tail;                /**< next entry the kernel will see */
+  unsigned *sq_mask;                /**< index mask of the submission ring */
+  unsigned *sq_array;               /**< entry of each submission slot */
+  unsigned *cq_head;                /**< next completion to reap */
+  unsigned *cq_tail;                /**< one past the last completion */
+  unsigned *cq_mask;                /**< index mask of the completion ring */
+  struct io_uring_cqe *cqes;        /**< the completions */
+  unsigned queued;                  /**< entries filled in but not yet taken by the kernel */
+  unsigned inflight;                /**< requests submitted and not yet reaped */
+  uint64_t enters;                  /**< io_uring_enter calls made */
+
+  std::deque<Request> todo;         /**< requests for the helper thread */
+  std::deque<Request> done;         /**< requests it has run */
+  std::mutex lock;                  /**< guards todo, done and stopping */
+  std::condition_variable work;     /**< a request was queued or stopping set */
+  std::condition_variable finished; /**< a request was run */
+  std::thread helper;               /**< runs serve() */
+  bool stopping;                    /**< the helper thread must stop */
+
+  void serve(void);
+  void close(void);
+public:
+  IoQueue();
+  ~IoQueue();
+  IoQueue(const IoQueue &) = delete;
+  IoQueue &operator=(const IoQueue &) = delete;
+  int open(IO_ENGINE engine, unsigned depth);
+  void submit(bool write, int fd, char *buf, size_t len, off_t off, uint64_t tag);
+  int wait(uint64_t *tag, ssize_t *result);
+  void drain(void);
+  /** @return the engine in use, IO_THREAD if io_uring could not be set up */
+  IO_ENGINE kind() const {return engine;}
+  /** @return the io_uring_enter calls made so far */
+  uint64_t ring_enters() const {return enters;}
+};
+
+/** @brief Reads a regular file IO_DEPTH buffers ahead of the caller
+ *
+ * open() starts reads of the first IO_DEPTH * IO_BUFFER bytes; read()
+ * copies out of the oldest buffer, waiting only for the one it needs, and
+ * sends each buffer back for the next part of the file once it is used
+ * up. The file is read up to the size it had when opened. The descriptor
+ * may be opened with O_DIRECT.
+ */
+class AsyncReader {
+private:
+  /** @brief One buffer and the part of the file it holds */
+  struct Buffer {
+    char *data;                     /**< IO_BUFFER bytes, IO_ALIGN aligned */
+    off_t off;                      /**< file offset read from */
+    size_t want;                    /**< bytes of the file from off, at most IO_BUFFER */
+    size_t size;                    /**< bytes read into it */
+    bool ready;                     /**< the read has completed */
+  };
+
+  IoQueue queue;                    /**< the reads in flight */
+  int fd;                           /**< the file, not owned */
+  off_t length;                     /**< size of the file */
+  off_t next_off;                   /**< offset of the next read to start */
+  std::vector<Buffer> bufs;         /**< the buffers, used in turn */
+  uint64_t started;                 /**< reads started */
+  uint64_t used;                    /**< buffers used up */
+  size_t pos;                       /**< bytes of the current buffer used */
+  int error;                        /**< errno of a failed read, 0 if none */
+
+  void start(void);
+public:
+  AsyncReader();
+  ~AsyncReader();
+  AsyncReader(const AsyncReader &) = delete;
+  AsyncReader &operator=(const AsyncReader &) = delete;
+  int open(int fd, IO_ENGINE engine);
+  ssize_t read(char *buf, size_t n);
+  /** @return the engine in use */
+  IO_ENGINE kind() const {return queue.kind();}
+  /** @return the io_uring_enter calls made so far */
+  uint64_t ring_enters() const {return queue.ring_enters();}
+};
+
+/** @brief Writes a file from the start, IO_DEPTH buffers behind the caller
+ *
+ * write() copies into the current buffer and, once it is full, starts
+ * writing it and moves on to the next, waiting only when every buffer is
+ * still being written. close() writes the rest and waits for all of it.
+ * With O_DIRECT the last buffer is padded to IO_ALIGN and the file is
+ * then truncated to the bytes written.
+ */
+class AsyncWriter {
+private:
+  /** @brief One buffer and whether it is being written */
+  struct Buffer {
+    char *data;                     /**< IO_BUFFER bytes, IO_ALIGN aligned */
+    size_t size;                    /**< bytes being written from it */
+    bool busy;                      /**< a write of it is in flight */
+  };
+
+  IoQueue queue;                    /**< the writes in flight */
+  int fd;                           /**< the file, not owned */
+  bool direct;                      /**< fd was opened with O_DIRECT */
+  off_t offset;                     /**< file offset of the current buffer */
+  off_t length;                     /**< bytes written, not counting padding */
+  std::vector<Buffer> bufs;         /**< the buffers, used in turn */
+  uint64_t current;                 /**< number of the buffer being filled */
+  size_t fill;                      /**< bytes in the current buffer */
+  int error;                        /**< errno of a failed write, 0 if none */
+
+  int reap(void);
+  int flush(size_t len);
+public:
+  AsyncWriter();
+  ~AsyncWriter();
+  AsyncWriter(const AsyncWriter &) = delete;
+  AsyncWriter &operator=(const AsyncWriter &) = delete;
+  int open(int fd, IO_ENGINE engine, bool direct);
+  int write(const char *data, size_t n);
+  int close(void);
+  /** @return the engine in use */
+  IO_ENGINE kind() const {return queue.kind();}
+  /** @return the io_uring_enter calls made so far */
+  uint64_t ring_enters() const {return queue.ring_enters();}
+};
+
+#endif // ASYNCIO_HPP
@@ -0,0 +1,536 @@
+/** Benchmark of the parse, read, sort, lookup and print paths
+ *
+ * Writes a federal and a cs2303 file of the requested size with ZipSynth
+ * (or reuses them if they are already there), then times:
+ *  - readln_fed and readln_cs2303 reading every line of the files
+ *  - LineBlockReader and Zipfed::parse_fields_federal over the federal file
+ *    as fed2cs2303 reads it, plain and gzip compressed, and the gzip file
+ *    only decompressed, to show decompression overlapping the parsing
+ *  - parse_zip_federal and parse_zip_cs2303 on every line, lines being
+ *    read in batches first so only the parser is timed. The records of a
+ *    batch are kept on an arena (a std::pmr::monotonic_buffer_resource
+ *    released after each batch), and for comparison again on the heap
+ *    (the _heap paths)
+ *  - Zipfed::print(FILE *) of every cs2303 record to /dev/null
+ *  - ZipTable::load_cs2303 of the whole mapped cs2303 file
+ *  - ZipTable::sort_by_city
+ *  - CityIndex::build, and CityIndex::lookup of cities drawn from the table
+ *  - ZipIndex::build, and ZipIndex::find and find_batch of zips drawn from
+ *    the table
+ *
+ * Results are written to stdout as one JSON object, so runs can be kept and
+ * diffed. For each path it gives the records and bytes handled, the time,
+ * records/s, ns/record, bytes/s, the heap allocations made while it was
+ * timed and the peak resident memory while the path ran (the peak is reset
+ * between paths where the kernel allows it).
+ *
+ * usage:
+ *    bench [-n rows] [-s seed] [-j threads] [-d dir]
+ *
+ * @author Krishna Garg
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <memory_resource>
+#include "zipfed.hpp"
+#include "csvscan.hpp"
+#include "ziptable.hpp"
+#include "zipindex.hpp"
+#include "zipsynth.hpp"
+#include "zipstats.hpp"
+
+// lines read before each timed parse
+#define BATCH (65536)
+// most city lookups timed
+#define MAX_LOOKUPS (1000000)
+// bytes of the arena the records of a batch are kept on
+#define ARENA_BYTES (BATCH * 256)
+// bytes read per block by the block paths, as fed2cs2303 reads
+#define READ_BLOCK (4 << 20)
+// most columns of a federal record looked at
+#define MAX_FIELDS (12)
+
+/** Seconds elapsed since a starting time
+ *
+ * @param t0 is the starting time
+ * @return elapsed wall clock seconds
+ */
+static double since (std::chrono::steady_clock::time_point t0) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+/** Start measuring peak memory again from the current resident size
+ */
+static void reset_peak (void) {
+  FILE *f = fopen("/proc/self/clear_refs", "w");
+  if (f != NULL) {
+    fputs("5", f);
+    fclose(f);
+  }
+}
+
+/** Peak resident memory since the last reset_peak, or of the process
+ *
+ * @return the peak in kilobytes
+ */
+static long peak_kb (void) {
+  char line[256];
+  long kb = -1;
+  FILE *f = fopen("/proc/self/status", "r");
+  if (f != NULL) {
+    while (fgets(line, sizeof(line), f) != NULL) {
+      if (strncmp(line, "VmHWM:", 6) == 0) {
+        kb = atol(line + 6);
+      }
+    }
+    fclose(f);
+  }
+  if (kb < 0) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    kb = usage.ru_maxrss;
+  }
+  return kb;
+}
+
+/** Append the result of one path to the JSON results
+ *
+ * @param json is the results so far
+ * @param name is the path that was timed
+ * @param records is the number of records handled
+ * @param bytes is the number of bytes handled, 0 if it does not apply
+ * @param secs is the time taken
+ * @param allocs is the number of heap allocations made
+ */
+static void report (std::string &json, const char *name, size_t records, size_t bytes, double secs,
+                    uint64_t allocs) {
+  char line[512];
+  if (secs <= 0) {
+    secs = 1e-9;
+  }
+  snprintf(line, sizeof(line),
+           "%s    {\"name\": \"%s\", \"records\": %zu, \"bytes\": %zu, \"seconds\": %.6f, "
+           "\"records_per_sec\": %.0f, \"ns_per_record\": %.2f, \"bytes_per_sec\": %.0f, "
+           "\"allocations\": %llu, \"peak_rss_kb\": %ld}",
+           json.empty() ? "" : ",\n", name, records, bytes, secs, records / secs,
+           (records > 0) ? secs * 1e9 / records : 0.0, bytes / secs, (unsigned long long) allocs, peak_kb());
+  json += line;
+  fprintf(stderr, "%-24s %10.1f ms %8.1f ns/record %10llu allocations\n", name, secs * 1e3,
+          (records > 0) ? secs * 1e9 / records : 0.0, (unsigned long long) allocs);
+}
+
+/** Write a synthetic file unless a file of that name is already there
+ *
+ * @param path is the file to write
+ * @param rows is the number of records
+ * @param seed is the seed of the records
+ * @param cs2303 is true for cs2303 format, false for federal
+ * @return zero (0) if success or non-zero on error.
+ */
+static int generate (const char *path, uint64_t rows, uint64_t seed, bool cs2303) {
+  struct stat st;
+  if (stat(path, &st) == 0) {
+    return 0;
+  }
+  std::string tmp = std::string(path) + ".tmp";
+  FILE *out = fopen(tmp.c_str(), "w");
+  if (out == NULL) {
+    return -1;
+  }
+  ZipSynth synth(rows, seed);
+  std::string buf;
+  if (!cs2303) {
+    buf = ZipSynth::federal_header();
+    buf += "\r\n";
+  }
+  for (uint64_t done = 0; done < rows; ) {
+    for (int i = 0; (i < BATCH) && (done < rows); i++, done++) {
+      if (cs2303) {
+        synth.cs2303(buf);
+      } else {
+        synth.federal(buf);
+      }
+    }
+    fwrite(buf.data(), 1, buf.size(), out);
+    buf.clear();
+  }
+  if ((fclose(out) != 0) || (rename(tmp.c_str(), path) != 0)) {
+    return -1;
+  }
+  return 0;
+}
+
+/** Write a gzip copy of a file unless it is already there
+ *
+ * @param path is the file to compress
+ * @param gzpath is the compressed file to write
+ * @return zero (0) if success or non-zero on error.
+ */
+static int compress_copy (const char *path, const char *gzpath) {
+  struct stat st;
+  if (stat(gzpath, &st) == 0) {
+    return 0;
+  }
+  MappedFile in;
+  std::string tmp = std::string(gzpath) + ".tmp";
+  if (in.open(path) != 0) {
+    return -1;
+  }
+  gzFile out = gzopen(tmp.c_str(), "wb6");
+  if (out == NULL) {
+    return -1;
+  }
+  bool ok = true;
+  for (size_t at = 0; ok && (at < in.size()); at += READ_BLOCK) {
+    unsigned n = (in.size() - at < READ_BLOCK) ? in.size() - at : READ_BLOCK;
+    ok = (gzwrite(out, in.data() + at, n) == (int) n);
+  }
+  if ((gzclose(out) != Z_OK) || !ok || (rename(tmp.c_str(), gzpath) != 0)) {
+    return -1;
+  }
+  return 0;
+}
+
+/** Time reading a federal file in blocks of lines, as fed2cs2303 does,
+ *  and parsing every record of it if asked
+ *
+ * @param json receives the result
+ * @param name is the name of the path
+ * @param path is the file to read, plain or compressed
+ * @param parse is true to scan and parse the records, false to only read
+ * @return zero (0) if success or non-zero on error.
+ */
+static int run_blocks (std::string &json, const char *name, const char *path, bool parse) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  std::string_view fields[MAX_FIELDS];
+  Zipfed zip;
+  const char *block;
+  long size;
+  size_t records = 0;
+  size_t bytes = 0;
+  int status = 0;
+
+  reset_peak();
+  uint64_t allocs = allocations();
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  {
+    LineBlockReader reader(fd, READ_BLOCK);
+    bool header = true;
+    while ((status == 0) && ((size = reader.next(&block)) > 0)) {
+      bytes += size;
+      if (!parse) {
+        continue;
+      }
+      CsvIndexScanner scanner(block, size);
+      int n;
+      if (header) {
+        scanner.next(fields, MAX_FIELDS);
+        header = false;
+      }
+      while ((n = scanner.next(fields, MAX_FIELDS)) != EOF) {
+        status = zip.parse_fields_federal(fields, n);
+        records++;
+      }
+    }
+    status = (size < 0) ? -1 : status;
+  }
+  double secs = since(t0);
+  close(fd);
+  report(json, name, records, bytes, secs, allocations() - allocs);
+  return status;
+}
+
+/** Time a line reader over a whole file
+ *
+ * @param json receives the result
+ * @param name is the name of the reader
+ * @param path is the file to read
+ * @param readln is the reader
+ * @return zero (0) if success or non-zero on error.
+ */
+static int run_readln (std::string &json, const char *name, const char *path,
+                       ssize_t (*readln)(char **, size_t *, FILE *)) {
+  FILE *in = fopen(path, "r");
+  if (in == NULL) {
+    return -1;
+  }
+  char *line = NULL;
+  size_t cap = 0;
+  size_t lines = 0;
+  size_t bytes = 0;
+  ssize_t len;
+
+  reset_peak();
+  uint64_t allocs = allocations();
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  while ((len = readln(&line, &cap, in)) > 0) {
+    lines++;
+    bytes += len;
+  }
+  double secs = since(t0);
+  report(json, name, lines, bytes, secs, allocations() - allocs);
+  free(line);
+  fclose(in);
+  return 0;
+}
+
+/** Time a parser over every line of a file, and print(FILE *) over the
+ *  parsed records if asked. Lines are read a batch at a time so only the
+ *  parsing and printing are timed.
+ *
+ * The records of a batch are made in a std::pmr::vector, on an arena that
+ * is released when the batch is done, or on the heap as a plain
+ * std::vector<Zipfed> would be.
+ *
+ * @param json receives the results
+ * @param path is the file to read
+ * @param federal is true for federal lines (the header line is skipped)
+ * @param arena is true to keep the records on the arena, false for the heap
+ * @return zero (0) if success or non-zero on error.
+ */
+static int run_parse (std::string &json, const char *path, bool federal, bool arena) {
+  FILE *in = fopen(path, "r");
+  FILE *sink = fopen("/dev/null", "w");
+  if ((in == NULL) || (sink == NULL)) {
+    return -1;
+  }
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  std::string text;               // a batch of lines, each ending in '\0'
+  std::vector<size_t> starts;     // offset of each line of the batch in text
+  std::vector<char> block(arena ? ARENA_BYTES : 0);
+  std::pmr::monotonic_buffer_resource pool(block.data(), block.size());
+  std::pmr::memory_resource *mem = arena ? &pool : std::pmr::new_delete_resource();
+  size_t records = 0;
+  size_t bytes = 0;
+  double parse_secs = 0;
+  double print_secs = 0;
+  uint64_t parse_allocs = 0;
+  uint64_t print_allocs = 0;
+  int status = 0;
+
+  reset_peak();
+  if (federal) {
+    len = readln_fed(&line, &cap, in);
+  }
+  bool more = true;
+  while (more && (status == 0)) {
+    text.clear();
+    starts.clear();
+    while ((starts.size() < BATCH) &&
+           ((len = federal ? readln_fed(&line, &cap, in) : readln_cs2303(&line, &cap, in)) > 0)) {
+      starts.push_back(text.size());
+      text.append(line, strlen(line) + 1);
+      bytes += len;
+    }
+    more = (starts.size() == BATCH);
+
+    uint64_t allocs = allocations();
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    {
+      std::pmr::vector<Zipfed> zips(mem);
+      zips.reserve(starts.size());
+      for (size_t i = 0; i < starts.size(); i++) {
+        char *p = &text[starts[i]];
+        Zipfed &zip = zips.emplace_back();
+        if ((federal ? zip.parse_zip_federal(p) : zip.parse_zip_cs2303(p)) != 0) {
+          status = -4;
+          break;
+        }
+      }
+      parse_secs += since(t0);
+      parse_allocs += allocations() - allocs;
+
+      if (!federal && arena) {
+        allocs = allocations();
+        t0 = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < zips.size(); i++) {
+          zips[i].print(sink);
+        }
+        fflush(sink);
+        print_secs += since(t0);
+        print_allocs += allocations() - allocs;
+      }
+    }
+    // the records of the batch are gone: the arena can be used again
+    pool.release();
+    records += starts.size();
+  }
+  if (status == 0) {
+    std::string name(federal ? "parse_zip_federal" : "parse_zip_cs2303");
+    report(json, arena ? name.c_str() : (name + "_heap").c_str(), records, bytes, parse_secs, parse_allocs);
+    if (!federal && arena) {
+      report(json, "print_file", records, 0, print_secs, print_allocs);
+    }
+  }
+  free(line);
+  fclose(in);
+  fclose(sink);
+  return status;
+}
+
+/** main function to drive the benchmark
+ *
+ * @param argc is the number of input strings
+ * @param argv is array of cmd line args - bench [-n rows] [-s seed] [-j threads] [-d dir]
+ * @return 0 for success. non-zero for error
+ */
+int main (int argc, char *argv[]) {
+  uint64_t rows = 1000000;
+  uint64_t seed = 2303;
+  int threads = 1;
+  const char *dir = "/tmp";
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:j:d:")) != -1) {
+    if ((opt == 'n') && (atoll(optarg) > 0)) {
+      rows = strtoull(optarg, NULL, 10);
+    } else if (opt == 's') {
+      seed = strtoull(optarg, NULL, 10);
+    } else if ((opt == 'j') && (atoi(optarg) > 0)) {
+      threads = atoi(optarg);
+    } else if (opt == 'd') {
+      dir = optarg;
+    } else {
+      break;
+    }
+  }
+  if ((optind != argc) || (opt != -1)) {
+    fprintf(stderr, "usage: %s [-n rows] [-s seed] [-j threads] [-d dir]\n", argv[0]);
+    return -1;
+  }
+  // operator new only counts the allocations every path reports while statistics are on
+  stats.on = true;
+
+  char fedfile[512];
+  char gzfile[520];
+  char csfile[512];
+  snprintf(fedfile, sizeof(fedfile), "%s/zipbench-%llu-%llu-fed.csv", dir,
+           (unsigned long long) rows, (unsigned long long) seed);
+  snprintf(gzfile, sizeof(gzfile), "%s.gz", fedfile);
+  snprintf(csfile, sizeof(csfile), "%s/zipbench-%llu-%llu-cs2303.csv", dir,
+           (unsigned long long) rows, (unsigned long long) seed);
+
+  std::string json;
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  if ((generate(fedfile, rows, seed, false) != 0) || (generate(csfile, rows, seed, true) != 0) ||
+      (compress_copy(fedfile, gzfile) != 0)) {
+    fprintf(stderr, "cannot write test files in %s\n", dir);
+    return -3;
+  }
+  fprintf(stderr, "test files ready in %.1f s: %s %s\n", since(t0), fedfile, csfile);
+
+  if ((run_readln(json, "readln_fed", fedfile, readln_fed) != 0) ||
+      (run_parse(json, fedfile, true, true) != 0) ||
+      (run_parse(json, fedfile, true, false) != 0) ||
+      (run_blocks(json, "blocks_fed", fedfile, true) != 0) ||
+      (run_blocks(json, "gunzip_fed", gzfile, false) != 0) ||
+      (run_blocks(json, "blocks_fed_gz", gzfile, true) != 0) ||
+      (run_readln(json, "readln_cs2303", csfile, readln_cs2303) != 0) ||
+      (run_parse(json, csfile, false, true) != 0) ||
+      (run_parse(json, csfile, false, false) != 0)) {
+    fprintf(stderr, "cannot read or parse the test files\n");
+    return -2;
+  }
+
+  MappedFile in;
+  ZipTable table;
+  CityIndex index;
+  reset_peak();
+  uint64_t allocs = allocations();
+  t0 = std::chrono::steady_clock::now();
+  if ((in.open(csfile) != 0) || (table.load_cs2303(in.data(), in.size()) != 0)) {
+    fprintf(stderr, "cannot load %s\n", csfile);
+    return -2;
+  }
+  report(json, "load_cs2303", table.size(), in.size(), since(t0), allocations() - allocs);
+  size_t size = in.size();
+  in.close();
+
+  reset_peak();
+  allocs = allocations();
+  t0 = std::chrono::steady_clock::now();
+  table.sort_by_city(threads);
+  report(json, "sort_by_city", table.size(), 0, since(t0), allocations() - allocs);
+
+  reset_peak();
+  allocs = allocations();
+  t0 = std::chrono::steady_clock::now();
+  index.build(table);
+  report(json, "index_build", table.size(), 0, since(t0), allocations() - allocs);
+
+  // look up the cities of records picked at random, so common names are
+  // asked for as often as they appear
+  size_t lookups = std::min((size_t) MAX_LOOKUPS, table.size());
+  std::vector<std::string_view> queries(lookups);
+  uint64_t r = seed;
+  for (size_t q = 0; q < lookups; q++) {
+    r = r * 6364136223846793005ULL + 1442695040888963407ULL;
+    queries[q] = table.get_city((r >> 33) % table.size());
+  }
+  size_t found = 0;
+  reset_peak();
+  allocs = allocations();
+  t0 = std::chrono::steady_clock::now();
+  for (size_t q = 0; q < lookups; q++) {
+    size_t count;
+    index.lookup(queries[q].data(), queries[q].size(), &count);
+    found += count;
+  }
+  report(json, "city_lookup", lookups, 0, since(t0), allocations() - allocs);
+
+  ZipIndex zips;
+  reset_peak();
+  allocs = allocations();
+  t0 = std::chrono::steady_clock::now();
+  zips.build(table);
+  report(json, "zip_index_build", table.size(), 0, since(t0), allocations() - allocs);
+
+  std::vector<uint32_t> codes(lookups);
+  for (size_t q = 0; q < lookups; q++) {
+    r = r * 6364136223846793005ULL + 1442695040888963407ULL;
+    codes[q] = table.get_zip((r >> 33) % table.size());
+  }
+  size_t records = 0;
+  reset_peak();
+  allocs = allocations();
+  t0 = std::chrono::steady_clock::now();
+  for (size_t q = 0; q < lookups; q++) {
+    records += (zips.find(codes[q]) != NULL);
+  }
+  report(json, "zip_lookup", lookups, 0, since(t0), allocations() - allocs);
+
+  std::vector<const ZipEntry *> entries(lookups);
+  reset_peak();
+  allocs = allocations();
+  t0 = std::chrono::steady_clock::now();
+  zips.find_batch(codes.data(), lookups, entries.data());
+  for (size_t q = 0; q < lookups; q++) {
+    records -= (entries[q] != NULL);
+  }
+  report(json, "zip_lookup_batch", lookups, 0, since(t0), allocations() - allocs);
+  if (records != 0) {
+    fprintf(stderr, "find and find_batch disagree\n");
+    return -2;
+  }
+
+  printf("{\n  \"rows\": %llu,\n  \"seed\": %llu,\n  \"threads\": %d,\n  \"cs2303_bytes\": %zu,\n"
+         "  \"cities\": %zu,\n  \"zips_per_lookup\": %.2f,\n  \"results\": [\n%s\n  ]\n}\n",
+         (unsigned long long) rows, (unsigned long long) seed, threads, size, table.city_count(),
+         (double) found / lookups, json.c_str());
+  return 0;
+}
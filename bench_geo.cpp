@@ -0,0 +1,213 @@
+/** Benchmark of the spatial index against a linear scan
+ *
+ * Loads a cs2303 file (new.csv by default) into a ZipTable, builds a
+ * GeoIndex over it and answers the same random points with both
+ * GeoIndex::nearest / within and nearest_scan / within_scan:
+ *  - k nearest for k = 1 and k = 10
+ *  - every zip within 10 km and within 50 km
+ * Each answer of the index is compared with the scan's, zip by zip and
+ * distance by distance, and the speedup is reported.
+ *
+ * It then times haversine_batch from one origin to every record with each
+ * kernel and reports the largest error of the polynomial kernels against
+ * the libm reference.
+ *
+ * usage:
+ *    bench_geo [cs2303_file [queries]]
+ *
+ * @author Krishna Garg
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <chrono>
+#include "ziptable.hpp"
+#include "zipindex.hpp"
+#include "geodist.hpp"
+#include "csvscan.hpp"
+
+// the linear scan is only run on this many of the query points
+#define SCAN_QUERIES (200)
+// origins timed for distance-to-all
+#define BATCH_ORIGINS (50)
+
+/** Seconds elapsed since a starting time
+ *
+ * @param t0 is the starting time
+ * @return elapsed wall clock seconds
+ */
+static double since (std::chrono::steady_clock::time_point t0) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+/** Next number of a fixed pseudo random sequence, so every run asks the
+ *  same points
+ *
+ * @param state is the state of the sequence
+ * @return a number in [0, 1)
+ */
+static double next_random (uint64_t *state) {
+  *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (*state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/** Time one kind of query with the index and with the scan and check that
+ *  both give the same answers
+ *
+ * @param name is the kind of query
+ * @param table is the table searched
+ * @param geo is the index over table
+ * @param points are lat, lon pairs to ask about
+ * @param k is the number of nearest zips wanted, 0 to use km
+ * @param km is the radius searched when k is 0
+ * @return zero (0) if every answer matched, else -1
+ */
+static int run (const char *name, const ZipTable &table, const GeoIndex &geo,
+                const std::vector<double> &points, size_t k, double km) {
+  std::vector<GeoHit> hits;
+  std::vector<GeoHit> want;
+  size_t queries = points.size() / 2;
+  size_t scanned = std::min(queries, (size_t) SCAN_QUERIES);
+  size_t found = 0;
+  int status = 0;
+
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  for (size_t q = 0; q < queries; q++) {
+    found += (k > 0) ? geo.nearest(points[2 * q], points[2 * q + 1], k, hits)
+                     : geo.within(points[2 * q], points[2 * q + 1], km, hits);
+  }
+  double index_secs = since(t0);
+
+  double scan_secs = 0;
+  for (size_t q = 0; q < scanned; q++) {
+    double lat = points[2 * q];
+    double lon = points[2 * q + 1];
+    t0 = std::chrono::steady_clock::now();
+    if (k > 0) {
+      nearest_scan(table, lat, lon, k, want);
+    } else {
+      within_scan(table, lat, lon, km, want);
+    }
+    scan_secs += since(t0);
+
+    if (k > 0) {
+      geo.nearest(lat, lon, k, hits);
+    } else {
+      geo.within(lat, lon, km, hits);
+    }
+    bool same = (hits.size() == want.size());
+    for (size_t i = 0; same && (i < hits.size()); i++) {
+      same = (hits[i].rec == want[i].rec) && (hits[i].km == want[i].km);
+    }
+    if (!same) {
+      fprintf(stderr, "%s: answers differ at %f,%f\n", name, lat, lon);
+      status = -1;
+    }
+  }
+
+  double index_ns = index_secs * 1e9 / queries;
+  double scan_ns = scan_secs * 1e9 / scanned;
+  printf("%-14s %10.0f ns/query index %12.0f ns/query scan %8.1fx %8.1f zips/query %s\n",
+         name, index_ns, scan_ns, scan_ns / index_ns, (double) found / queries,
+         (status == 0) ? "exact" : "MISMATCH");
+  return status;
+}
+
+/** Time distance-to-all with one kernel and compare it with the reference
+ *
+ * @param kernel is the kernel to time
+ * @param table is the table whose columns are measured
+ * @param points are lat, lon pairs used as origins
+ * @param ref receives (GEO_SCALAR) or holds the reference distances from
+ *   the first origin
+ */
+static void run_batch (GEO_KERNEL kernel, const ZipTable &table, const std::vector<double> &points,
+                       std::vector<float> &ref) {
+  size_t n = table.size();
+  size_t origins = std::min(points.size() / 2, (size_t) BATCH_ORIGINS);
+  std::vector<float> km(n);
+
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  for (size_t q = 0; q < origins; q++) {
+    haversine_batch(points[2 * q], points[2 * q + 1], table.lat_data(), table.lon_data(), n,
+                    km.data(), kernel);
+  }
+  double secs = since(t0) / origins;
+
+  haversine_batch(points[0], points[1], table.lat_data(), table.lon_data(), n, km.data(), kernel);
+  if (kernel == GEO_SCALAR) {
+    ref = km;
+  }
+  double abs_err = 0;
+  double rel_err = 0;
+  for (size_t i = 0; i < n; i++) {
+    double e = fabs((double) km[i] - ref[i]);
+    abs_err = std::max(abs_err, e);
+    if (ref[i] > 1.0) {
+      rel_err = std::max(rel_err, e / ref[i]);
+    }
+  }
+  printf("distance to all, %-6s %9.3f ms %7.2f ns/point   max error %.4f km, %.2e relative\n",
+         geo_kernel_name(kernel), secs * 1e3, secs * 1e9 / n, abs_err, rel_err);
+}
+
+/** main function to drive the benchmark
+ *
+ * @param argc is the number of input strings
+ * @param argv is array of cmd line args - bench_geo [cs2303_file [queries]]
+ * @return 0 if the index matched the scan everywhere, non-zero otherwise
+ */
+int main (int argc, char *argv[]) {
+  const char *path = (argc > 1) ? argv[1] : "new.csv";
+  size_t queries = (argc > 2) ? atol(argv[2]) : 100000;
+  MappedFile in;
+  ZipTable table;
+  GeoIndex geo;
+
+  if ((in.open(path) != 0) || (table.load_cs2303(in.data(), in.size()) != 0)) {
+    fprintf(stderr, "cannot load %s\n", path);
+    return -2;
+  }
+  in.close();
+  if ((table.size() == 0) || (queries == 0)) {
+    fprintf(stderr, "nothing to do\n");
+    return -1;
+  }
+
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  geo.build(table);
+  printf("%zu records, index built in %.1f ms, %zu bytes\n", table.size(), since(t0) * 1e3, geo.memory());
+
+  // ask about points spread over the area the records cover
+  float lat_lo = table.get_lat(0), lat_hi = lat_lo;
+  float lon_lo = table.get_lon(0), lon_hi = lon_lo;
+  for (size_t i = 1; i < table.size(); i++) {
+    lat_lo = std::min(lat_lo, table.get_lat(i));
+    lat_hi = std::max(lat_hi, table.get_lat(i));
+    lon_lo = std::min(lon_lo, table.get_lon(i));
+    lon_hi = std::max(lon_hi, table.get_lon(i));
+  }
+  std::vector<double> points(2 * queries);
+  uint64_t seed = 2303;
+  for (size_t q = 0; q < queries; q++) {
+    points[2 * q] = lat_lo + (lat_hi - lat_lo) * next_random(&seed);
+    points[2 * q + 1] = lon_lo + (lon_hi - lon_lo) * next_random(&seed);
+  }
+
+  int status = 0;
+  status |= run("nearest 1", table, geo, points, 1, 0);
+  status |= run("nearest 10", table, geo, points, 10, 0);
+  status |= run("within 10 km", table, geo, points, 0, 10);
+  status |= run("within 50 km", table, geo, points, 0, 50);
+
+  std::vector<float> ref;
+  run_batch(GEO_SCALAR, table, points, ref);
+  run_batch(GEO_POLY, table, points, ref);
+  if (geo_kernel_best() == GEO_AVX2) {
+    run_batch(GEO_AVX2, table, points, ref);
+  }
+  return status;
+}
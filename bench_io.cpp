@@ -0,0 +1,236 @@
+/** Benchmark of the I/O engines on the conversion path of fed2cs2303
+ *
+ * Converts a federal file to cs2303 records the way fed2cs2303 does
+ * (LineBlockReader, CsvIndexScanner, Zipfed::parse_fields_federal,
+ * Zipfed::print) once with each I/O engine:
+ *  - sync: read() of each block and fwrite() of each block of output,
+ *    which is what fed2cs2303 does without --io
+ *  - thread: AsyncReader and AsyncWriter with pread/pwrite on a helper
+ *    thread
+ *  - uring: AsyncReader and AsyncWriter on an io_uring
+ * and with -D the thread and uring engines again with the files opened
+ * O_DIRECT.
+ *
+ * Every record is kept, as with the filter "state != ZZ". The input is read
+ * once before the runs so each sees it equally cached (O_DIRECT runs bypass
+ * the cache). The output is not synced, so without -D it is timed into the
+ * page cache.
+ *
+ * Results are written to stdout as one JSON object. For each engine it
+ * gives the records and bytes read, the time, GB/s of input, the system
+ * calls that read or wrote data (the syscr and syscw counts of
+ * /proc/self/io, which include the helper thread's, plus io_uring_enter
+ * calls) and those per record.
+ *
+ * usage:
+ *    bench_io [-D] federal_file [output_file]
+ *
+ * @author Krishna Garg
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string>
+#include <chrono>
+#include "zipfed.hpp"
+#include "csvscan.hpp"
+#include "asyncio.hpp"
+
+// bytes read per block, as fed2cs2303 reads on one thread
+#define READ_BLOCK (4 << 20)
+// most columns of a federal record looked at
+#define MAX_FIELDS (12)
+// output written when no output file is given
+#define DEFAULT_OUTPUT "bench_io.out"
+
+/** Seconds elapsed since a starting time
+ *
+ * @param t0 is the starting time
+ * @return elapsed wall clock seconds
+ */
+static double since (std::chrono::steady_clock::time_point t0) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+/** System calls that read or wrote data so far, from /proc/self/io
+ *
+ * @return syscr + syscw, or 0 if the kernel does not say
+ */
+static uint64_t io_syscalls (void) {
+  char line[256];
+  uint64_t n = 0;
+  FILE *f = fopen("/proc/self/io", "r");
+  if (f != NULL) {
+    while (fgets(line, sizeof(line), f) != NULL) {
+      if ((strncmp(line, "syscr:", 6) == 0) || (strncmp(line, "syscw:", 6) == 0)) {
+        n += strtoull(line + 6, NULL, 10);
+      }
+    }
+    fclose(f);
+  }
+  return n;
+}
+
+/** Append the result of one engine to the JSON results
+ *
+ * @param json is the results so far
+ * @param name is the engine that was timed
+ * @param records is the number of records converted
+ * @param bytes is the number of input bytes
+ * @param secs is the time taken
+ * @param syscalls is the number of data system calls made
+ */
+static void report (std::string &json, const char *name, size_t records, size_t bytes, double secs,
+                    uint64_t syscalls) {
+  char line[512];
+  if (secs <= 0) {
+    secs = 1e-9;
+  }
+  snprintf(line, sizeof(line),
+           "%s    {\"name\": \"%s\", \"records\": %zu, \"bytes\": %zu, \"seconds\": %.6f, "
+           "\"gb_per_sec\": %.3f, \"syscalls\": %llu, \"syscalls_per_record\": %.6f}",
+           json.empty() ? "" : ",\n", name, records, bytes, secs, bytes / secs / 1e9,
+           (unsigned long long) syscalls, records ? (double) syscalls / records : 0.0);
+  json += line;
+}
+
+/** Convert the federal file with one engine
+ *
+ * @param json receives the result
+ * @param name is the name of the run
+ * @param inpath is the federal file
+ * @param outpath is the file to write
+ * @param engine is the I/O engine
+ * @param direct is true to open both files O_DIRECT
+ * @return zero (0) if success or non-zero on error.
+ */
+static int run_convert (std::string &json, const char *name, const char *inpath, const char *outpath,
+                        IO_ENGINE engine, bool direct) {
+  int flags = direct ? O_DIRECT : 0;
+  int fd = open(inpath, O_RDONLY | flags);
+  if (fd < 0) {
+    return -1;
+  }
+  int out = open(outpath, O_WRONLY | O_CREAT | O_TRUNC | flags, 0666);
+  if (out < 0) {
+    close(fd);
+    return -1;
+  }
+  std::string_view fields[MAX_FIELDS];
+  Zipfed zip;
+  std::string text;
+  const char *block;
+  long size = 0;
+  size_t records = 0;
+  size_t bytes = 0;
+  int status = 0;
+
+  uint64_t calls = io_syscalls();
+  uint64_t enters = 0;
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  {
+    AsyncReader async_in;
+    AsyncWriter async_out;
+    FILE *file = NULL;
+    if (engine == IO_SYNC) {
+      file = fdopen(dup(out), "w");
+      status = (file == NULL) ? -1 : 0;
+    } else if ((async_in.open(fd, engine) != 0) || (async_out.open(out, engine, direct) != 0)) {
+      status = -1;
+    } else if ((engine == IO_URING) && (async_in.kind() != IO_URING)) {
+      fprintf(stderr, "io_uring cannot be set up here, %s ran on a helper thread\n", name);
+    }
+    LineBlockReader reader(fd, READ_BLOCK, (engine == IO_SYNC) ? NULL : &async_in);
+    bool header = true;
+    while ((status == 0) && ((size = reader.next(&block)) > 0)) {
+      bytes += size;
+      CsvIndexScanner scanner(block, size);
+      int n;
+      if (header) {
+        scanner.next(fields, MAX_FIELDS);
+        header = false;
+      }
+      text.clear();
+      while ((status == 0) && ((n = scanner.next(fields, MAX_FIELDS)) != EOF)) {
+        status = zip.parse_fields_federal(fields, n);
+        zip.print(text, FLOAT_FIXED);
+        records++;
+      }
+      if (engine == IO_SYNC) {
+        fwrite(text.data(), 1, text.size(), file);
+      } else if (async_out.write(text.data(), text.size()) != 0) {
+        status = -1;
+      }
+    }
+    if (size < 0) {
+      status = -1;
+    }
+    if (file != NULL) {
+      status = (fclose(file) != 0) ? -1 : status;
+    } else if (async_out.close() != 0) {
+      status = -1;
+    }
+    enters = async_in.ring_enters() + async_out.ring_enters();
+  }
+  double secs = since(t0);
+  calls = io_syscalls() - calls + enters;
+  close(fd);
+  close(out);
+  report(json, name, records, bytes, secs, calls);
+  return status;
+}
+
+/** main function: warm the input, then convert it with each engine
+ *
+ * @param argc is the number of input strings - 2 to 4
+ * @param argv is array of cmd line args - bench_io [-D] federal_file [output_file]
+ * @return 0 for success. non-zero for error
+ */
+int main (int argc, char *argv[]) {
+  bool direct = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "D")) != -1) {
+    if (opt != 'D') {
+      optind = argc + 1;
+      break;
+    }
+    direct = true;
+  }
+  if ((argc - optind < 1) || (argc - optind > 2)) {
+    fprintf(stderr, "usage: %s [-D] federal_file [output_file]\n", argv[0]);
+    return -1;
+  }
+  const char *inpath = argv[optind];
+  const char *outpath = (argc - optind == 2) ? argv[optind + 1] : DEFAULT_OUTPUT;
+
+  // read it once, so every run finds it cached alike
+  {
+    std::string json;
+    if (run_convert(json, "warm", inpath, outpath, IO_SYNC, false) != 0) {
+      fprintf(stderr, "cannot convert %s to %s\n", inpath, outpath);
+      return -2;
+    }
+  }
+
+  std::string json;
+  int status = 0;
+  status |= run_convert(json, "sync", inpath, outpath, IO_SYNC, false);
+  status |= run_convert(json, "thread", inpath, outpath, IO_THREAD, false);
+  status |= run_convert(json, "uring", inpath, outpath, IO_URING, false);
+  if (direct) {
+    status |= run_convert(json, "thread_direct", inpath, outpath, IO_THREAD, true);
+    status |= run_convert(json, "uring_direct", inpath, outpath, IO_URING, true);
+  }
+  printf("{\n  \"file\": \"%s\",\n  \"runs\": [\n%s\n  ]\n}\n", inpath, json.c_str());
+  if (argc - optind < 2) {
+    unlink(outpath);
+  }
+  if (status != 0) {
+    fprintf(stderr, "a run failed: %s\n", strerror(errno));
+  }
+  return (status != 0) ? -3 : 0;
+}
@@ -0,0 +1,248 @@
+/** Micro-benchmark for the federal CSV scanners
+ *
+ * Builds a federal format file in memory from the records of a cs2303 file
+ * (new.csv by default), replicated to the requested size, then times:
+ *  - the line-at-a-time path: copy each line out, parse_zip_federal (strtok)
+ *  - CsvScanner (memchr state machine) + parse_fields_federal
+ *  - CsvIndexScanner with each instruction set + parse_fields_federal
+ *    (the FederalSchema parser, unrolled at compile time)
+ *  - CsvIndexScanner + the parser of a ColumnMap built from the federal
+ *    header at run time, as zipagg -H parses
+ *  - building the structural index alone with each instruction set
+ *
+ * usage:
+ *    bench_scan [cs2303_file [megabytes]]
+ *
+ * @author Krishna Garg
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "zipfed.hpp"
+#include "csvscan.hpp"
+#include "zipschema.hpp"
+
+// columns of a federal record the parser looks at
+#define MAX_FIELDS (12)
+
+/** Convert the cs2303 records of a file to federal format lines
+ *
+ * @param path is the cs2303 file to read
+ * @param out receives one federal line per record, each ending in \r\n
+ * @return the number of records converted, or -1 on error
+ */
+static long federal_sample (const char *path, std::string &out) {
+  MappedFile in;
+  std::string_view f[MAX_FIELDS];
+  char line[512];
+  long n = 0;
+  int count;
+
+  if (in.open(path) != 0) {
+    return -1;
+  }
+  CsvScanner scanner(in.data(), in.size());
+  while ((count = scanner.next(f, MAX_FIELDS)) != -1) {
+    if (count < 6) {
+      continue;
+    }
+    n++;
+    int len = snprintf(line, sizeof(line),
+                       "%ld,\"%.*s\",\"%.*s\",\"%.*s\",\"%.*s\",\"PRIMARY\",%.*s,%.*s,0.38,-0.87,0.3,"
+                       "\"NA\",\"US\",\"%.*s, %.*s\",\"NA-US-%.*s-%.*s\",\"false\",,,,\r\n",
+                       n, (int) f[0].size(), f[0].data(), (int) f[1].size(), f[1].data(),
+                       (int) f[2].size(), f[2].data(), (int) f[3].size(), f[3].data(),
+                       (int) f[4].size(), f[4].data(), (int) f[5].size(), f[5].data(),
+                       (int) f[2].size(), f[2].data(), (int) f[3].size(), f[3].data(),
+                       (int) f[3].size(), f[3].data(), (int) f[2].size(), f[2].data());
+    out.append(line, len);
+  }
+  return n;
+}
+
+/** Seconds elapsed since a starting time
+ *
+ * @param t0 is the starting time
+ * @return elapsed wall clock seconds
+ */
+static double since (std::chrono::steady_clock::time_point t0) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+/** Print one result line
+ *
+ * @param name is the path that was timed
+ * @param secs is the elapsed time
+ * @param bytes is the number of input bytes processed
+ * @param records is the number of records parsed (0 if not applicable)
+ */
+static void report (const char *name, double secs, size_t bytes, long records) {
+  printf("%-24s %9.1f ms %8.0f MB/s", name, secs * 1e3, bytes / secs / 1e6);
+  if (records > 0) {
+    printf(" %8.1f ns/record", secs * 1e9 / records);
+  }
+  printf("\n");
+}
+
+/** Time the legacy path: copy each line into a buffer (as getdelim does),
+ *  strip the terminator and tokenize it with parse_zip_federal.
+ *
+ * @param data is the federal text
+ * @param size is the number of bytes of text
+ * @return the number of records parsed
+ */
+static long run_strtok (const char *data, size_t size) {
+  std::vector<char> line(1024);
+  const char *p = data;
+  const char *end = data + size;
+  long n = 0;
+  Zipfed zip;
+
+  while (p < end) {
+    const char *nl = (const char *) memchr(p, '\n', end - p);
+    size_t len = (nl != NULL) ? nl - p + 1 : end - p;
+    if (len + 1 > line.size()) {
+      line.resize(len + 1);
+    }
+    memcpy(line.data(), p, len);
+    line[len] = '\0';
+    p += len;
+    for (long i = (long) len - 1; i >= 0 && (line[i] == '\n' || line[i] == '\r'); i--) {
+      line[i] = '\0';
+    }
+    if ((line[0] != '\0') && (zip.parse_zip_federal(line.data()) == 0)) {
+      n++;
+    }
+  }
+  return n;
+}
+
+/** Time a scanner class, optionally followed by parse_fields_federal
+ *
+ * @param scanner is a freshly constructed scanner over the federal text
+ * @param parse is false to only split records into fields
+ * @return the number of records split or parsed
+ */
+template <class Scanner>
+static long run_scanner (Scanner &scanner, bool parse) {
+  std::string_view f[MAX_FIELDS];
+  long n = 0;
+  int count;
+  Zipfed zip;
+
+  while ((count = scanner.next(f, MAX_FIELDS)) != -1) {
+    if (!parse) {
+      n += (f[1].size() > 0);      // touch a field so the split is not elided
+    } else if (zip.parse_fields_federal(f, count) == 0) {
+      n++;
+    }
+  }
+  return n;
+}
+
+/** Time CsvIndexScanner followed by the parser of a ColumnMap, found from
+ *  the names of the federal header
+ *
+ * @param text is the federal text, without its header line
+ * @return the number of records parsed, or -1 if the map cannot be built
+ */
+static long run_mapped (const std::string &text) {
+  static const std::string_view header[] = {
+    "RecordNumber", "Zipcode", "ZipCodeType", "City", "State", "LocationType", "Lat", "Long"
+  };
+  std::string_view f[MAX_FIELDS];
+  std::string error;
+  ColumnMap map;
+  long n = 0;
+  int count;
+  Zipfed zip;
+
+  if (map.build(header, sizeof(header) / sizeof(header[0]), error) != 0) {
+    return -1;
+  }
+  CsvIndexScanner scanner(text.data(), text.size());
+  while ((count = scanner.next(f, MAX_FIELDS)) != -1) {
+    if (zip.parse_fields(map, f, count) == 0) {
+      n++;
+    }
+  }
+  return n;
+}
+
+/** main function: build the sample, then time each path
+ *
+ * @param argc is the number of input strings - 1 to 3
+ * @param argv is array of cmd line args - bench_scan [cs2303_file [megabytes]]
+ * @return 0 for success. non-zero for error
+ */
+int main (int argc, char *argv[]) {
+  const char *path = (argc > 1) ? argv[1] : "new.csv";
+  size_t target = ((argc > 2) ? atol(argv[2]) : 256) * 1000000UL;
+  std::string sample;
+  std::string text;
+
+  if (federal_sample(path, sample) <= 0) {
+    fprintf(stderr, "cannot read records from %s - exiting\n", path);
+    return -1;
+  }
+  text.reserve(target + sample.size());
+  while (text.size() < target) {
+    text += sample;
+  }
+  printf("input: %zu bytes of federal records, best isa %s\n", text.size(), scan_isa_name(scan_isa_best()));
+
+  std::chrono::steady_clock::time_point t0;
+  long records;
+  const SCAN_ISA isas[] = {SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2};
+  const size_t window = 1 << 20;
+  std::vector<uint32_t> index(window);
+
+  // the index alone, one window at a time as CsvIndexScanner builds it
+  for (int i = 0; i < 3; i++) {
+    if (isas[i] > scan_isa_best()) {
+      continue;
+    }
+    std::string name = std::string("index only ") + scan_isa_name(isas[i]);
+    t0 = std::chrono::steady_clock::now();
+    for (size_t off = 0; off < text.size(); off += window) {
+      size_t len = (text.size() - off < window) ? text.size() - off : window;
+      structural_index(text.data() + off, len, index.data(), isas[i]);
+    }
+    report(name.c_str(), since(t0), text.size(), 0);
+  }
+
+  t0 = std::chrono::steady_clock::now();
+  records = run_strtok(text.data(), text.size());
+  report("getline + strtok", since(t0), text.size(), records);
+
+  // split only measures the scanners, split + parse the whole ingest path
+  for (int parse = 0; parse < 2; parse++) {
+    const char *what = parse ? "parse" : "split";
+    std::string name = std::string(what) + " state machine";
+    t0 = std::chrono::steady_clock::now();
+    CsvScanner state(text.data(), text.size());
+    records = run_scanner(state, parse);
+    report(name.c_str(), since(t0), text.size(), records);
+
+    for (int i = 0; i < 3; i++) {
+      if (isas[i] > scan_isa_best()) {
+        continue;
+      }
+      name = std::string(what) + " indexed " + scan_isa_name(isas[i]);
+      t0 = std::chrono::steady_clock::now();
+      CsvIndexScanner scanner(text.data(), text.size(), isas[i]);
+      records = run_scanner(scanner, parse);
+      report(name.c_str(), since(t0), text.size(), records);
+    }
+  }
+
+  std::string name = std::string("parse mapped ") + scan_isa_name(scan_isa_best());
+  t0 = std::chrono::steady_clock::now();
+  records = run_mapped(text);
+  report(name.c_str(), since(t0), text.size(), records);
+  return 0;
+}
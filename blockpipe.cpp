@@ -0,0 +1,185 @@
+/** Functions supporting the block pipeline of zipagg and zipjoin
+ *
+ * @author Krishna Garg
+ */
+
+#include <string.h>
+#include "blockpipe.hpp"
+#include "zipstats.hpp"
+
+/** Constructor of a pipeline with every block free
+ *
+ * @param count is the number of blocks, at least 1
+ * @param in_order is true if a writer takes the finished blocks back in
+ *   input order, false if a block is free once its worker is done
+ */
+BlockPipe::BlockPipe (size_t count, bool in_order)
+  : blocks(count), ordered(in_order), read(0), taken(0), written(0), eof(false), status(0) {
+  for (size_t i = 0; i < blocks.size(); i++) {
+    blocks[i].state = BLOCK_FREE;
+  }
+}
+
+/** Copy input lines into the next block once it is free and hand it to the
+ *  workers
+ *
+ * @param data is the text of complete lines
+ * @param size is the number of bytes of text
+ * @return zero (0) if success or the status a worker or the writer failed with
+ */
+int BlockPipe::feed (const char *data, size_t size) {
+  Block *b;
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    freed.wait(guard, [&]() {
+      return (blocks[read % blocks.size()].state == BLOCK_FREE) || (status != 0);
+    });
+    if (status != 0) {
+      return status;
+    }
+    b = &blocks[read % blocks.size()];
+  }
+  b->in.assign(data, size);
+  std::lock_guard<std::mutex> guard(lock);
+  b->state = BLOCK_READ;
+  read++;
+  filled.notify_one();
+  return 0;
+}
+
+/** Read the input a block at a time into the pipeline until it ends, or
+ *  until a worker or the writer fails (see error). Runs on the reader
+ *  thread; the time spent reading and the bytes read go to the stats.
+ *
+ * @param reader is the input
+ * @param block is a block already taken from reader, such as what is left
+ *   of the first one once its header line is taken off
+ * @param size is the number of bytes of block, 0 if none, or negative if
+ *   reading it failed
+ * @return zero (0) if success or -2 if the input cannot be read
+ */
+int BlockPipe::pump (LineBlockReader &reader, const char *block, long size) {
+  while (size >= 0) {
+    if (size > 0) {
+      if (feed(block, size) != 0) {
+        return 0;
+      }
+      stats.count(COUNT_BYTES_IN, size);
+    }
+    PhaseTimer timer(PHASE_READ);
+    size = reader.next(&block);
+    if (size == 0) {
+      break;
+    }
+  }
+  return (size < 0) ? -2 : 0;
+}
+
+/** Say that no more blocks will be read, so the workers and the writer
+ *  return once they have taken every block
+ */
+void BlockPipe::close (void) {
+  std::lock_guard<std::mutex> guard(lock);
+  eof = true;
+  filled.notify_all();
+  done.notify_all();
+}
+
+/** Take the next block read, in input order. Called by the workers.
+ *
+ * @return the block, or NULL once the input ended and every block is taken
+ */
+Block *BlockPipe::take (void) {
+  std::unique_lock<std::mutex> guard(lock);
+  filled.wait(guard, [&]() {return (taken < read) || eof;});
+  if (taken == read) {
+    return NULL;
+  }
+  Block *b = &blocks[taken++ % blocks.size()];
+  b->state = BLOCK_WORKING;
+  return b;
+}
+
+/** Hand back a block a worker is done with: to the writer in an ordered
+ *  pipeline, else to the reader
+ *
+ * @param b is the block, from take
+ * @param failed is zero if the worker succeeded, else its status, which
+ *   stops the reader
+ */
+void BlockPipe::finish (Block *b, int failed) {
+  std::lock_guard<std::mutex> guard(lock);
+  b->state = ordered ? BLOCK_DONE : BLOCK_FREE;
+  if (failed != 0) {
+    status = failed;
+  }
+  if (!ordered || (failed != 0)) {
+    freed.notify_all();
+  }
+  if (ordered) {
+    done.notify_all();
+  }
+}
+
+/** Wait for the next block in input order to be finished. Called by the
+ *  writer of an ordered pipeline.
+ *
+ * @return the block, or NULL once the input ended and every block is
+ *   released
+ */
+Block *BlockPipe::next_done (void) {
+  std::unique_lock<std::mutex> guard(lock);
+  done.wait(guard, [&]() {
+    return ((written < read) && (blocks[written % blocks.size()].state == BLOCK_DONE)) ||
+           (eof && (written == read));
+  });
+  if (written == read) {
+    return NULL;
+  }
+  return &blocks[written % blocks.size()];
+}
+
+/** Free a block the writer is done with for the reader
+ *
+ * @param b is the block, from next_done
+ */
+void BlockPipe::release (Block *b) {
+  std::lock_guard<std::mutex> guard(lock);
+  b->state = BLOCK_FREE;
+  written++;
+  freed.notify_all();
+}
+
+/** Stop the reader, as when the writer cannot write
+ *
+ * @param failed is the nonzero status to stop with
+ */
+void BlockPipe::fail (int failed) {
+  std::lock_guard<std::mutex> guard(lock);
+  status = failed;
+  freed.notify_all();
+}
+
+/** Status a worker or the writer failed with
+ *
+ * @return zero (0) if none failed, else the status of the last to fail
+ */
+int BlockPipe::error (void) {
+  std::lock_guard<std::mutex> guard(lock);
+  return status;
+}
+
+/** Take the first line off a block, as a header line is
+ *
+ * @param block is the block; it is moved past the line
+ * @param size is the number of bytes of block, made smaller by the line
+ * @return the line, with its line end if it has one
+ */
+std::string_view take_line (const char **block, long *size) {
+  const char *nl = (const char *) memchr(*block, '\n', *size);
+  long skip = (nl != NULL) ? nl + 1 - *block : *size;
+  std::string_view line(*block, skip);
+  *block += skip;
+  *size -= skip;
+  return line;
+}
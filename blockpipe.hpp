@@ -0,0 +1,75 @@
+/** Ring of input blocks passed from a reader thread to worker threads,
+ *  and on to a writer thread in input order, as zipagg and zipjoin run
+ *
+ * @author Krishna Garg
+ */
+
+#ifndef BLOCKPIPE_HPP
+#define BLOCKPIPE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include "csvscan.hpp"
+
+/** @brief Where a block is in the pipeline
+ */
+typedef enum {
+  BLOCK_FREE,               /**< waiting to be read into */
+  BLOCK_READ,               /**< holds input, waiting for a worker */
+  BLOCK_WORKING,            /**< a worker has it */
+  BLOCK_DONE                /**< holds output, waiting for the writer */
+} BLOCK_STATE;
+
+/** @brief Input lines and what a worker made of them
+ */
+struct Block {
+  std::string in;                   /**< complete input lines */
+  std::string out;                  /**< output of the worker, for the writer */
+  BLOCK_STATE state;                /**< where it is in the pipeline */
+};
+
+/** @brief The blocks in flight and the positions of the pipeline stages
+ *
+ * Block n of the input goes through blocks[n % blocks.size()], so the
+ * number of blocks bounds the memory used whatever the size of the input.
+ * The reader (pump) waits for the next block to be free, workers take
+ * blocks in input order (take) and hand them back (finish). In an ordered
+ * pipe a finished block then waits for the writer, which takes the blocks
+ * back in input order (next_done, release); otherwise it is free again as
+ * soon as its worker is done.
+ */
+class BlockPipe {
+private:
+  std::vector<Block> blocks;        /**< the ring of blocks */
+  bool ordered;                     /**< finished blocks go to a writer */
+  uint64_t read;                    /**< blocks read so far */
+  uint64_t taken;                   /**< blocks handed to workers so far */
+  uint64_t written;                 /**< blocks the writer released so far */
+  bool eof;                         /**< no more blocks will be read */
+  int status;                       /**< nonzero once a worker or the writer failed */
+  std::mutex lock;                  /**< guards all of the above */
+  std::condition_variable freed;    /**< a block was freed, or a stage failed */
+  std::condition_variable filled;   /**< a block was read, or the input ended */
+  std::condition_variable done;     /**< a block was finished, or the input ended */
+
+  int feed(const char *data, size_t size);
+public:
+  BlockPipe(size_t count, bool in_order);
+  int pump(LineBlockReader &reader, const char *block, long size);
+  void close();
+  Block *take();
+  void finish(Block *b, int failed);
+  Block *next_done();
+  void release(Block *b);
+  void fail(int failed);
+  int error();
+};
+
+std::string_view take_line(const char **block, long *size);
+
+#endif
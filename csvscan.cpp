@@ -0,0 +1,723 @@
+/** Functions supporting zero-copy ingestion of CSV files
+ *
+ * @author Krishna Garg
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "csvscan.hpp"
+
+// preferred number of input bytes covered by one structural index window
+#define SCAN_WINDOW (256 * 1024)
+
+/** Default ctor for MappedFile. Nothing is open until open() is called.
+ */
+MappedFile::MappedFile () {
+  base = NULL;
+  length = 0;
+  mapped = false;
+}
+
+/** Dtor for MappedFile. Unmaps or frees the file contents.
+ */
+MappedFile::~MappedFile () {
+  close();
+}
+
+/** Open a file by name and make its contents available
+ *
+ * @param path is the path/name of the file to open
+ * @return zero (0) if success or non-zero on error.
+ */
+int MappedFile::open (const char *path) {
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  int rc = open(fd);
+  ::close(fd);
+  return rc;
+}
+
+/** Make the contents of an open file descriptor available
+ *
+ * Regular files are mapped with mmap. Other descriptors (pipes, terminals)
+ * and compressed files are read to end of file, decompressed, into a heap
+ * buffer. The descriptor is not closed.
+ *
+ * @param fd is the open file descriptor to read
+ * @return zero (0) if success or non-zero on error.
+ */
+int MappedFile::open (int fd) {
+  struct stat st;
+
+  close();
+  if (fstat(fd, &st) != 0) {
+    return -1;
+  }
+
+  if (S_ISREG(st.st_mode)) {
+    length = st.st_size;
+    if (length == 0) {
+      return 0;
+    }
+    void *p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if ((p != MAP_FAILED) && (compression_of(p, length) == COMPRESS_NONE)) {
+      madvise(p, length, MADV_SEQUENTIAL);
+      base = (char *) p;
+      mapped = true;
+      return 0;
+    }
+    if (p != MAP_FAILED) {
+      munmap(p, length);
+    }
+    length = 0;
+  }
+
+  // not mappable, read the whole stream doubling the buffer as it fills
+  InputStream in(fd);
+  size_t cap = 1 << 16;
+  base = (char *) malloc(cap);
+  if (base == NULL) {
+    return -1;
+  }
+  for (;;) {
+    if (length == cap) {
+      char *bigger = (char *) realloc(base, cap * 2);
+      if (bigger == NULL) {
+        close();
+        return -1;
+      }
+      base = bigger;
+      cap *= 2;
+    }
+    ssize_t n = in.read(base + length, cap - length);
+    if (n < 0) {
+      close();
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    length += n;
+  }
+  return 0;
+}
+
+/** Release the file contents. Safe to call more than once.
+ */
+void MappedFile::close (void) {
+  if (base != NULL) {
+    if (mapped) {
+      munmap(base, length);
+    } else {
+      free(base);
+    }
+  }
+  base = NULL;
+  length = 0;
+  mapped = false;
+}
+
+/** Ctor for LineBlockReader
+ *
+ * @param fd is the open descriptor to read. It is not closed.
+ * @param block is the size of the blocks to read in bytes
+ * @param async is an AsyncReader opened on fd to read it through, or NULL.
+ *   It is not deleted.
+ */
+LineBlockReader::LineBlockReader (int fd, size_t block, AsyncReader *async) : in(fd, async) {
+  cap = (block > 0) ? block : 1;
+  buf = (char *) malloc(cap);
+  used = 0;
+  given = 0;
+  eof = false;
+}
+
+/** Dtor for LineBlockReader. Frees the block buffer.
+ */
+LineBlockReader::~LineBlockReader () {
+  free(buf);
+}
+
+/** Read the next block of complete lines
+ *
+ * The block stays valid until the next call. At end of input a last line
+ * without a terminator is returned as a block of its own.
+ *
+ * @param block is set to the first byte of the block
+ * @return the number of bytes in the block, 0 at end of input or -1 on error
+ */
+long LineBlockReader::next (const char **block) {
+  if (buf == NULL) {
+    return -1;
+  }
+
+  // carry the partial line left from the last block to the front
+  memmove(buf, buf + given, used - given);
+  used -= given;
+  given = 0;
+
+  for (;;) {
+    while (!eof && (used < cap)) {
+      ssize_t n = in.read(buf + used, cap - used);
+      if (n < 0) {
+        return -1;
+      }
+      if (n == 0) {
+        eof = true;
+      }
+      used += n;
+    }
+    if (eof) {
+      given = used;                 // everything left, terminated or not
+      break;
+    }
+    const char *nl = (const char *) memrchr(buf, '\n', used);
+    if (nl != NULL) {
+      given = nl + 1 - buf;
+      break;
+    }
+    // one line longer than the whole buffer, make room for more of it
+    char *bigger = (char *) realloc(buf, cap * 2);
+    if (bigger == NULL) {
+      return -1;
+    }
+    buf = bigger;
+    cap *= 2;
+  }
+  *block = buf;
+  return given;
+}
+
+/** Ctor for CsvScanner
+ *
+ * @param data is the first byte of the CSV text
+ * @param size is the number of bytes of CSV text
+ */
+CsvScanner::CsvScanner (const char *data, size_t size) {
+  pos = data;
+  end = data + size;
+}
+
+/** Test whether a character ends an unquoted field
+ *
+ * @param c is the character to test
+ * @return true for ',', '\r' and '\n'
+ */
+static inline bool ends_field (char c) {
+  return (c == ',') || (c == '\n') || (c == '\r');
+}
+
+/** Replace the doubled quotes of the quoted fields of a record with single
+ *  ones. The fields holding one are copied into a scratch buffer without
+ *  them, and their views moved there.
+ *
+ * @param fields are the fields of the record
+ * @param count is the number of fields
+ * @param record is the first byte of the record
+ * @param scratch receives the copies
+ */
+static void unescape_quotes (std::string_view *fields, int count, const char *record, std::string &scratch) {
+  // a quoted field starts just after its opening quote, and every quote
+  // inside it is half of a pair; quotes in unquoted fields are data
+  auto escaped = [record](std::string_view f) {
+    return (f.data() > record) && (f.data()[-1] == '"') && (memchr(f.data(), '"', f.size()) != NULL);
+  };
+  size_t room = 0;
+  for (int i = 0; i < count; i++) {
+    if (escaped(fields[i])) {
+      room += fields[i].size();
+    }
+  }
+  // reserved up front so no copy moves while the views are handed out
+  scratch.clear();
+  scratch.reserve(room);
+  for (int i = 0; i < count; i++) {
+    std::string_view f = fields[i];
+    if (!escaped(f)) {
+      continue;
+    }
+    size_t at = scratch.size();
+    for (size_t j = 0; j < f.size(); j++) {
+      scratch.push_back(f[j]);
+      j += (f[j] == '"');
+    }
+    fields[i] = std::string_view(scratch.data() + at, scratch.size() - at);
+  }
+}
+
+/** Scan the next record and split it into fields
+ *
+ * A quote only opens a quoted field at the start of a field. Inside a
+ * quoted field a doubled quote ("") stands for one quote and a single
+ * quote closes it; anything between the closing quote and the next comma
+ * is ignored. The end of a quoted field is found with memchr and that of
+ * an unquoted field by a tight loop over its bytes, so the bytes of a
+ * field are looked at once and nothing else is done per byte.
+ *
+ * @param fields is the array to fill with views of the fields. A field
+ *   that held "" is a copy in the scanner, valid until the next call.
+ * @param max is the number of entries in fields. Extra fields are skipped.
+ * @return the number of fields stored, or -1 at the end of the data
+ */
+int CsvScanner::next (std::string_view *fields, int max) {
+  const char *p = pos;
+  bool escaped = false;            // a quoted field of the record holds ""
+  int count = 0;
+
+  // skip blank lines and the second byte of two byte line terminators
+  while ((p < end) && ((*p == '\n') || (*p == '\r'))) {
+    p++;
+  }
+  if (p >= end) {
+    pos = end;
+    return -1;
+  }
+
+  const char *record = p;
+  for (;;) {
+    const char *start;             // first byte of the field
+    const char *stop;              // one past the last byte of the field
+
+    if (*p == '"') {
+      start = ++p;
+      for (;;) {
+        const char *q = (const char *) memchr(p, '"', end - p);
+        if (q == NULL) {
+          p = end;                  // unterminated quote runs to end of data
+          break;
+        }
+        if ((q + 1 < end) && (q[1] == '"')) {
+          p = q + 2;                // "" is an escaped quote, keep going
+          escaped = true;
+          continue;
+        }
+        p = q;
+        break;
+      }
+      stop = p;
+      // ignore anything between the closing quote and the delimiter
+      while ((p < end) && !ends_field(*p)) {
+        p++;
+      }
+    } else {
+      start = p;
+      while ((p < end) && !ends_field(*p)) {
+        p++;
+      }
+      stop = p;
+    }
+
+    // p is at the delimiter that ends the field [start, stop), or at end
+    if (count < max) {
+      fields[count] = std::string_view(start, stop - start);
+    }
+    count++;
+    if ((p >= end) || (*p++ != ',')) {
+      break;
+    }
+    if (p >= end) {
+      // a comma at the very end leaves one empty field
+      if (count < max) {
+        fields[count] = std::string_view(p, 0);
+      }
+      count++;
+      break;
+    }
+  }
+  pos = p;
+  count = (count < max) ? count : max;
+  if (escaped) {
+    unescape_quotes(fields, count, record, scratch);
+  }
+  return count;
+}
+
+/** Test whether a character is one the structural index records
+ *
+ * @param c is the character to test
+ * @return true for ',', '"', '\r' and '\n'
+ */
+static inline bool is_structural (char c) {
+  return (c == ',') || (c == '"') || (c == '\r') || (c == '\n');
+}
+
+/** Build a structural index one byte at a time. Used on any CPU and for the
+ *  tail of the input the vector versions leave over.
+ *
+ * @param data is the first byte to scan
+ * @param size is the number of bytes to scan
+ * @param base is added to every offset written
+ * @param out receives the offsets of the structural characters
+ * @return the number of offsets written
+ */
+static size_t index_scalar (const char *data, size_t size, uint32_t base, uint32_t *out) {
+  size_t n = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (is_structural(data[i])) {
+      out[n++] = base + i;
+    }
+  }
+  return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/** Append the offsets of the set bits of a compare mask
+ *
+ * @param mask has bit i set if byte i of the block is structural
+ * @param base is the offset of byte 0 of the block
+ * @param out receives the offsets
+ * @return the number of offsets written
+ */
+static inline size_t emit_mask (uint32_t mask, uint32_t base, uint32_t *out) {
+  size_t n = 0;
+  while (mask != 0) {
+    out[n++] = base + __builtin_ctz(mask);
+    mask &= mask - 1;
+  }
+  return n;
+}
+
+/** Build a structural index 16 bytes at a time with SSE2
+ *
+ * @param data is the first byte to scan
+ * @param size is the number of bytes to scan
+ * @param out receives the offsets of the structural characters
+ * @return the number of offsets written
+ */
+__attribute__((target("sse2")))
+static size_t index_sse2 (const char *data, size_t size, uint32_t *out) {
+  const __m128i comma = _mm_set1_epi8(',');
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  size_t n = 0;
+  size_t i = 0;
+
+  for (; i + 16 <= size; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (data + i));
+    __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, quote)),
+                               _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+    n += emit_mask(_mm_movemask_epi8(hit), i, out + n);
+  }
+  return n + index_scalar(data + i, size - i, i, out + n);
+}
+
+/** Build a structural index 32 bytes at a time with AVX2
+ *
+ * @param data is the first byte to scan
+ * @param size is the number of bytes to scan
+ * @param out receives the offsets of the structural characters
+ * @return the number of offsets written
+ */
+__attribute__((target("avx2")))
+static size_t index_avx2 (const char *data, size_t size, uint32_t *out) {
+  const __m256i comma = _mm256_set1_epi8(',');
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  size_t n = 0;
+  size_t i = 0;
+
+  for (; i + 32 <= size; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (data + i));
+    __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, comma), _mm256_cmpeq_epi8(v, quote)),
+                                  _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+    n += emit_mask((uint32_t) _mm256_movemask_epi8(hit), i, out + n);
+  }
+  return n + index_scalar(data + i, size - i, i, out + n);
+}
+#endif
+
+/** Find the best instruction set the running CPU supports
+ *
+ * @return SCAN_AVX2, SCAN_SSE2 or SCAN_SCALAR
+ */
+SCAN_ISA scan_isa_best (void) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2")) {
+    return SCAN_AVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return SCAN_SSE2;
+  }
+#endif
+  return SCAN_SCALAR;
+}
+
+/** Name of an instruction set, for reports
+ *
+ * @param isa is the instruction set
+ * @return a printable name
+ */
+const char *scan_isa_name (SCAN_ISA isa) {
+  switch (isa) {
+  case SCAN_SCALAR:
+    return "scalar";
+  case SCAN_SSE2:
+    return "sse2";
+  case SCAN_AVX2:
+    return "avx2";
+  default:
+    return "auto";
+  }
+}
+
+/** Record the offsets of every ',', '"', '\r' and '\n' in a buffer
+ *
+ * @param data is the first byte to scan
+ * @param size is the number of bytes to scan, less than 4GB
+ * @param out receives the offsets, must have room for size entries
+ * @param isa is the instruction set to use. An instruction set the CPU does
+ *   not support is replaced by the best one it does.
+ * @return the number of offsets written
+ */
+size_t structural_index (const char *data, size_t size, uint32_t *out, SCAN_ISA isa) {
+  SCAN_ISA best = scan_isa_best();
+  if ((isa == SCAN_AUTO) || (isa > best)) {
+    isa = best;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  if (isa == SCAN_AVX2) {
+    return index_avx2(data, size, out);
+  }
+  if (isa == SCAN_SSE2) {
+    return index_sse2(data, size, out);
+  }
+#endif
+  return index_scalar(data, size, 0, out);
+}
+
+/** Ctor for CsvIndexScanner
+ *
+ * @param data is the first byte of the CSV text
+ * @param size is the number of bytes of CSV text
+ * @param isa is the instruction set used to build the index
+ */
+CsvIndexScanner::CsvIndexScanner (const char *data, size_t size, SCAN_ISA isa) {
+  pos = data;
+  end = data + size;
+  wbeg = data;
+  wend = data;
+  count = 0;
+  cursor = 0;
+  window = SCAN_WINDOW;
+  this->isa = isa;
+}
+
+/** Index the window of input that starts at a given byte
+ *
+ * The window is cut back to just after its last line terminator so records
+ * do not straddle windows. A single line longer than the window gets a
+ * window of its own.
+ *
+ * @param from is the first byte of the new window
+ * @param want is the preferred size of the window in bytes
+ */
+void CsvIndexScanner::refill (const char *from, size_t want) {
+  wbeg = from;
+  wend = ((size_t) (end - from) > want) ? from + want : end;
+  if (wend < end) {
+    const char *nl = (const char *) memrchr(wbeg, '\n', wend - wbeg);
+    if (nl != NULL) {
+      wend = nl + 1;
+    } else {
+      nl = (const char *) memchr(wend, '\n', end - wend);
+      wend = (nl != NULL) ? nl + 1 : end;
+    }
+  }
+  if (index.size() < (size_t) (wend - wbeg)) {
+    index.resize(wend - wbeg);
+  }
+  count = structural_index(wbeg, wend - wbeg, index.data(), isa);
+  cursor = 0;
+}
+
+/** Scan the next record and split it into fields
+ *
+ * Field rules are the same as CsvScanner::next. A quoted field may contain
+ * line terminators; if one runs past the end of the window the window is
+ * rebuilt from the start of the record with twice the size.
+ *
+ * @param fields is the array to fill with views of the fields. A field
+ *   that held "" is a copy in the scanner, valid until the next call.
+ * @param max is the number of entries in fields. Extra fields are skipped.
+ * @return the number of fields stored, or -1 at the end of the data
+ */
+int CsvIndexScanner::next (std::string_view *fields, int max) {
+  size_t want = window;
+
+  // skip blank lines and the second byte of two byte line terminators
+  while ((pos < end) && ((*pos == '\n') || (*pos == '\r'))) {
+    pos++;
+  }
+  if (pos >= end) {
+    return -1;
+  }
+  if (pos >= wend) {
+    refill(pos, want);
+  }
+
+  const char *record = pos;
+  bool escaped = false;             // a quoted field of the record holds ""
+
+restart:
+  const uint32_t *idx = index.data();
+  size_t limit = wend - wbeg;       // offset that stands for end of window
+  size_t k = cursor;
+  size_t off = pos - wbeg;
+  int nfields = 0;
+
+  while ((k < count) && (idx[k] < off)) {
+    k++;
+  }
+  for (;;) {
+    size_t first;                   // first byte of the field
+    size_t last;                    // one past the last byte of the field
+    size_t delim;                   // offset of the delimiter after the field
+
+    if ((off < limit) && (wbeg[off] == '"')) {
+      // quoted field, find the closing quote skipping "" pairs
+      first = off + 1;
+      k++;
+      for (;;) {
+        if (k >= count) {
+          if (wend < end) {
+            want *= 2;              // record runs past the window, grow it
+            refill(pos, want);
+            goto restart;
+          }
+          last = limit;             // unterminated quote
+          break;
+        }
+        if (wbeg[idx[k]] != '"') {
+          k++;
+        } else if ((k + 1 < count) && (idx[k + 1] == idx[k] + 1) && (wbeg[idx[k + 1]] == '"')) {
+          k += 2;
+          escaped = true;
+        } else {
+          last = idx[k++];
+          break;
+        }
+      }
+      // ignore anything between the closing quote and the delimiter
+      while ((k < count) && (wbeg[idx[k]] == '"')) {
+        k++;
+      }
+    } else {
+      first = off;
+      while ((k < count) && (wbeg[idx[k]] == '"')) {
+        k++;                        // quotes inside an unquoted field are data
+      }
+      last = (k < count) ? idx[k] : limit;
+    }
+    delim = (k < count) ? idx[k] : limit;
+    if (last > delim) {
+      last = delim;
+    }
+
+    if (nfields < max) {
+      fields[nfields] = std::string_view(wbeg + first, last - first);
+    }
+    nfields++;
+
+    char c = (delim < limit) ? wbeg[delim] : '\n';
+    off = (delim < limit) ? delim + 1 : limit;
+    k++;
+    if (c != ',') {
+      pos = wbeg + off;
+      cursor = k;
+      nfields = (nfields < max) ? nfields : max;
+      if (escaped) {
+        unescape_quotes(fields, nfields, record, scratch);
+      }
+      return nfields;
+    }
+  }
+}
+
+/** Function to read a line from the US FED and return pointer to the 
+ * line of data represented as a C-String (i.e. NULL terminated string)
+ *
+ * @lineptr is a pointer to the dynamically allocated buffer to fill.
+ *   If the pointer is NULL, a buffer will be allocated to hold the line.
+ *   If the buffer is too small to hold the line, realloc will be called
+ *   to allocate a larger buffer. If the buffer is reallocated, n will
+ *   be set to new size.
+ * @n is a pointer to the size of the buffer pointer to be lineptr. If
+ *   memory is reallocated for lineptr, the size of n will be incremented
+ *   accordingly. The parameter n will always specify the size of buffer
+ *   pointed at by lineptr.
+ * @fptr is the FILE pointer to the open file to read.
+ * @return number bytes (chars) read or -1 on error
+ */
+ssize_t readln_fed (char **lineptr, size_t *n, FILE *stream) {
+  ssize_t bytes_read = -1;  // -1 will signify error reading line
+  const int delim = '\n';   // each line terminated with \r\n
+
+  // Verify the file is open
+  if (stream == NULL) {
+    return (ssize_t) -1;
+  }
+
+  // Each line of the FED ZIP CSV file is terminated by \n\r, so we
+  // read up to and including the \r for the entire line
+  bytes_read = getdelim (lineptr, n, delim, stream);
+
+  // Remove the \n\r at the end of the line by replacing with NULL terminator
+  // Expect length of at least 2 for the \n\r at end of a line
+  for (int i = bytes_read - 1; i >= 0; i--) {
+    if (((*lineptr)[i] == '\n') || ((*lineptr)[i] == '\r')) {
+      (*lineptr)[i] = '\0';
+    }
+  }
+    
+  return bytes_read;
+}
+
+/** Function to read a line from the US FED and return pointer to the 
+ * line of data represented as a C-String (i.e. NULL terminated string)
+ *
+ * @lineptr is a pointer to the dynamically allocated buffer to fill.
+ *   If the pointer is NULL, a buffer will be allocated to hold the line.
+ *   If the buffer is too small to holsd the line, realloc will be called
+ *   to allocate a larger buffer. If the buffer is reallocated, n will
+ *   be set to new size.
+ * @n is a pointer to the size of the buffer pointer to be lineptr. If
+ *   memory is reallocated for lineptr, the size of n will be incremented
+ *   accordingly. The parameter n will always specify the size of buffer
+ *   pointed at by lineptr.
+ * @fptr is the FILE pointer to the open file to read.
+ * @return number bytes (chars) read or -1 on error
+ */
+ssize_t readln_cs2303 (char **lineptr, size_t *n, FILE *stream) {
+  ssize_t bytes_read = -1;  // -1 will signify error reading line
+  const int delim = '\n';   // each line terminated with \n
+
+  // Verify the file is open
+  if (stream == NULL) {
+    return (ssize_t) -1;
+  }
+
+  // Each line of the FED ZIP CSV file is terminated by \n\r, so we
+  // read up to and including the \r for the entire line
+  bytes_read = getdelim (lineptr, n, delim, stream);
+
+  // Remove the \n at the end of the line by replacing with NULL terminator
+  // Expect length of at least 2 for the \n\r at end of a line
+  for (int i = bytes_read - 1; i >= 0; i--) {
+    if ((*lineptr)[i] == '\n') {
+      (*lineptr)[i] = '\0';
+    }
+  }
+  //should return a linked list of zipfed
+  return bytes_read;
+}
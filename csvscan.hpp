@@ -0,0 +1,142 @@
+/** Zero-copy ingestion of CSV files
+ *
+ * @author Krishna Garg
+ */
+
+#ifndef CSVSCAN_HPP
+#define CSVSCAN_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "decompress.hpp"
+
+/** @brief Read-only view of a whole input file
+ *
+ * Regular files are memory mapped. Anything that cannot be mapped (a pipe or
+ * a terminal on stdin) is read into a single heap buffer instead, so callers
+ * always see the complete input as one contiguous range of bytes. gzip and
+ * zstd files are decompressed into the heap buffer.
+ */
+class MappedFile {
+private:
+  char *base;                       /**< first byte of the file contents */
+  size_t length;                    /**< number of bytes in the file */
+  bool mapped;                      /**< true if base came from mmap */
+public:
+  MappedFile();
+  ~MappedFile();
+  int open(const char *path);
+  int open(int fd);
+  void close(void);
+  /** @return pointer to the first byte of the file */
+  const char *data() const {return base;}
+  /** @return the number of bytes in the file */
+  size_t size() const {return length;}
+};
+
+/** @brief Reads a stream in large blocks that end on a line boundary
+ *
+ * Used where the input cannot or should not be held in memory as a whole,
+ * such as a pipe on stdin or a file larger than memory. Each block handed
+ * out holds only complete lines; the partial line at the end of a read is
+ * carried over to the front of the next block. Memory use is the block
+ * size, or the longest line if that is longer.
+ *
+ * gzip and zstd input is decompressed on its own thread while the blocks
+ * are parsed (see InputStream), so callers read it like any other. Given
+ * an AsyncReader, the file is also read ahead of the parser.
+ */
+class LineBlockReader {
+private:
+  InputStream in;                   /**< descriptor being read */
+  char *buf;                        /**< block buffer */
+  size_t cap;                       /**< size of buf */
+  size_t used;                      /**< bytes of buf holding data */
+  size_t given;                     /**< bytes of buf handed out last time */
+  bool eof;                         /**< true once read returned 0 */
+public:
+  LineBlockReader(int fd, size_t block, AsyncReader *async = NULL);
+  ~LineBlockReader();
+  long next(const char **block);
+};
+
+/** @brief Single pass CSV record scanner
+ *
+ * Walks a buffer once and splits it into records and fields, finding the
+ * closing quote of a quoted field with memchr. Fields are returned as
+ * string_views into the buffer, which is never modified. Surrounding double
+ * quotes are removed from quoted fields, commas inside quotes do not split
+ * the field, and a doubled quote ("") inside one stands for a quote: such a
+ * field is copied without the extra quotes into a buffer of the scanner.
+ * Lines end in \n, \r\n or \n\r; blank lines are skipped.
+ *
+ * On the federal sample of bench_scan it splits about 2.5 times as fast as
+ * the getline + strtok loop it replaced (about 190 against 490 ns a record)
+ * and, quoted fields being found with memchr, somewhat faster than
+ * CsvIndexScanner, which is faster on unquoted input such as cs2303 files.
+ */
+class CsvScanner {
+private:
+  const char *pos;                  /**< next unread byte */
+  const char *end;                  /**< one past the last byte */
+  std::string scratch;              /**< fields that held "", unescaped */
+public:
+  CsvScanner(const char *data, size_t size);
+  int next(std::string_view *fields, int max);
+  /** @return pointer to the next unread byte */
+  const char *position() const {return pos;}
+};
+
+/** @brief Instruction set used to find structural characters
+ */
+typedef enum {
+  SCAN_AUTO,                /**< best one the running CPU supports */
+  SCAN_SCALAR,              /**< one byte at a time, any CPU */
+  SCAN_SSE2,                /**< 16 bytes at a time */
+  SCAN_AVX2                 /**< 32 bytes at a time */
+} SCAN_ISA;
+
+SCAN_ISA scan_isa_best(void);
+const char *scan_isa_name(SCAN_ISA isa);
+size_t structural_index(const char *data, size_t size, uint32_t *out, SCAN_ISA isa);
+
+/** @brief CSV record scanner driven by a structural index
+ *
+ * Produces the same records and fields as CsvScanner, but instead of
+ * looking at every byte it first builds an index of the positions of the
+ * structural characters (',', '"', '\r' and '\n') for a window of the input
+ * with SIMD compares, then finds field boundaries by walking that index.
+ * Only the bytes at indexed positions are examined while splitting. With
+ * AVX2 it splits unquoted input about 1.7 times as fast as CsvScanner, but
+ * the quoted federal sample of bench_scan about 20% slower; with SCAN_SCALAR
+ * building the index costs more than it saves.
+ */
+class CsvIndexScanner {
+private:
+  const char *pos;                  /**< next unread byte */
+  const char *end;                  /**< one past the last byte */
+  const char *wbeg;                 /**< first byte of the indexed window */
+  const char *wend;                 /**< one past the last indexed byte */
+  std::vector<uint32_t> index;      /**< structural offsets from wbeg */
+  size_t count;                     /**< number of valid entries in index */
+  size_t cursor;                    /**< first entry at or after pos */
+  size_t window;                    /**< preferred window size in bytes */
+  SCAN_ISA isa;                     /**< instruction set for the index */
+  std::string scratch;              /**< fields that held "", unescaped */
+
+  void refill(const char *from, size_t want);
+public:
+  CsvIndexScanner(const char *data, size_t size, SCAN_ISA isa = SCAN_AUTO);
+  int next(std::string_view *fields, int max);
+};
+
+// line at a time readers of the original programs, a getdelim per line
+ssize_t readln_fed(char **lineptr, size_t *n, FILE *stream);
+ssize_t readln_cs2303(char **lineptr, size_t *n, FILE *stream);
+
+#endif // CSVSCAN_HPP
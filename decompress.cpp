@@ -0,0 +1,421 @@
+/** Functions supporting compressed input
+ *
+ * @author Krishna Garg
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "decompress.hpp"
+
+// bytes of compressed input read at a time
+#define COMPRESSED_READ (256 << 10)
+
+/** Tell the format of a stream from its first bytes
+ *
+ * @param data is the start of the stream
+ * @param size is the number of bytes at data, MAGIC_BYTES is enough
+ * @return the compression, COMPRESS_NONE for anything not recognised
+ */
+COMPRESSION compression_of (const void *data, size_t size) {
+  const unsigned char *b = (const unsigned char *) data;
+  if ((size >= 2) && (b[0] == 0x1f) && (b[1] == 0x8b)) {
+    return COMPRESS_GZIP;
+  }
+  if ((size >= 4) && (b[0] == 0x28) && (b[1] == 0xb5) && (b[2] == 0x2f) && (b[3] == 0xfd)) {
+    return COMPRESS_ZSTD;
+  }
+  return COMPRESS_NONE;
+}
+
+/** Name of a compression, as printed
+ *
+ * @param c is the compression
+ * @return "none", "gzip" or "zstd"
+ */
+const char *compression_name (COMPRESSION c) {
+  switch (c) {
+  case COMPRESS_GZIP:
+    return "gzip";
+  case COMPRESS_ZSTD:
+    return "zstd";
+  default:
+    return "none";
+  }
+}
+
+/** Read a descriptor, or the AsyncReader reading it ahead
+ *
+ * @param fd is the descriptor
+ * @param async reads fd if not NULL
+ * @param buf receives the bytes
+ * @param n is the room at buf
+ * @return the number of bytes read, 0 at end of input or -1 on error
+ */
+static ssize_t read_source (int fd, AsyncReader *async, char *buf, size_t n) {
+  if (async != NULL) {
+    return async->read(buf, n);
+  }
+  for (;;) {
+    ssize_t got = ::read(fd, buf, n);
+    if ((got >= 0) || (errno != EINTR)) {
+      return got;
+    }
+  }
+}
+
+/** Ctor for DecompressReader. Starts the decompression thread.
+ *
+ * @param fd is the compressed input; it is not closed
+ * @param async reads fd ahead if not NULL; it is not deleted
+ * @param kind is its format, COMPRESS_GZIP or COMPRESS_ZSTD
+ * @param head is the start of the input, already read from fd
+ * @param size is the number of bytes at head
+ */
+DecompressReader::DecompressReader (int fd, AsyncReader *async, COMPRESSION kind, const char *head, size_t size)
+  : fd(fd), async(async), kind(kind), head(head, head + size), ring(DECOMPRESS_BLOCKS) {
+  for (size_t i = 0; i < ring.size(); i++) {
+    ring[i].data.resize(DECOMPRESS_BLOCK);
+    ring[i].size = 0;
+  }
+  filled = 0;
+  taken = 0;
+  offset = 0;
+  finished = false;
+  stopping = false;
+  error = 0;
+  thread = std::thread(&DecompressReader::decompress, this);
+}
+
+/** Dtor for DecompressReader. Stops the thread, which may first have to
+ *  finish a read of the input.
+ */
+DecompressReader::~DecompressReader () {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+    empty.notify_all();
+  }
+  thread.join();
+}
+
+/** Read compressed input: what the caller read first, then the descriptor
+ *
+ * @param buf receives the bytes
+ * @param n is the room at buf
+ * @return the number of bytes read, 0 at end of input or -1 on error
+ */
+ssize_t DecompressReader::read_input (char *buf, size_t n) {
+  if (!head.empty()) {
+    size_t k = (head.size() < n) ? head.size() : n;
+    memcpy(buf, head.data(), k);
+    head.erase(head.begin(), head.begin() + k);
+    return k;
+  }
+  return read_source(fd, async, buf, n);
+}
+
+/** Wait for a block to fill. Runs on the decompression thread.
+ *
+ * @return the block, emptied, or NULL if the reader is gone
+ */
+DecompressReader::Block *DecompressReader::next_free (void) {
+  std::unique_lock<std::mutex> guard(lock);
+  empty.wait(guard, [&]() {return (filled - taken < ring.size()) || stopping;});
+  if (stopping) {
+    return NULL;
+  }
+  Block *b = &ring[filled % ring.size()];
+  b->size = 0;
+  return b;
+}
+
+/** Hand the block being filled to the reader. Runs on the decompression
+ *  thread.
+ *
+ * @param last is true if no block follows
+ * @param status is nonzero if the input turned out to be damaged
+ */
+void DecompressReader::publish (bool last, int status) {
+  std::lock_guard<std::mutex> guard(lock);
+  filled++;
+  finished = last;
+  error = status;
+  full.notify_one();
+}
+
+/** Decompress the whole input into the ring. Runs on its own thread.
+ *
+ * gzip input may hold several members and zstd input several frames, one
+ * after the other, as concatenating compressed files makes. Input that
+ * ends in the middle of a member or frame is an error.
+ */
+void DecompressReader::decompress (void) {
+  std::vector<char> in(COMPRESSED_READ);
+  bool eof = false;                 // all of the input has been read
+  bool complete = true;             // the last member or frame was complete
+  int status = 0;
+  Block *b = next_free();
+  if (b == NULL) {
+    return;
+  }
+
+  if (kind == COMPRESS_GZIP) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, 15 + 16) != Z_OK) {
+      publish(true, -1);
+      return;
+    }
+    for (;;) {
+      if ((z.avail_in == 0) && !eof) {
+        ssize_t n = read_input(in.data(), in.size());
+        if (n < 0) {
+          status = -1;
+          break;
+        }
+        eof = (n == 0);
+        z.next_in = (Bytef *) in.data();
+        z.avail_in = n;
+      }
+      if ((z.avail_in == 0) && eof) {
+        break;
+      }
+      z.next_out = (Bytef *) b->data.data() + b->size;
+      z.avail_out = DECOMPRESS_BLOCK - b->size;
+      int rc = inflate(&z, Z_NO_FLUSH);
+      b->size = DECOMPRESS_BLOCK - z.avail_out;
+      if (rc == Z_STREAM_END) {
+        complete = true;
+        inflateReset(&z);           // another member may follow
+      } else if ((rc == Z_OK) || (rc == Z_BUF_ERROR)) {
+        complete = false;
+      } else {
+        status = -1;
+        break;
+      }
+      if (b->size == DECOMPRESS_BLOCK) {
+        publish(false, 0);
+        if ((b = next_free()) == NULL) {
+          inflateEnd(&z);
+          return;
+        }
+      }
+    }
+    inflateEnd(&z);
+  } else {
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *ds = ZSTD_createDStream();
+    ZSTD_inBuffer zin = {in.data(), 0, 0};
+    if ((ds == NULL) || ZSTD_isError(ZSTD_initDStream(ds))) {
+      ZSTD_freeDStream(ds);
+      publish(true, -1);
+      return;
+    }
+    for (;;) {
+      if ((zin.pos == zin.size) && !eof) {
+        ssize_t n = read_input(in.data(), in.size());
+        if (n < 0) {
+          status = -1;
+          break;
+        }
+        eof = (n == 0);
+        zin.size = n;
+        zin.pos = 0;
+      }
+      if ((zin.pos == zin.size) && eof) {
+        break;
+      }
+      ZSTD_outBuffer zout = {b->data.data(), DECOMPRESS_BLOCK, b->size};
+      size_t rc = ZSTD_decompressStream(ds, &zout, &zin);
+      b->size = zout.pos;
+      if (ZSTD_isError(rc)) {
+        status = -1;
+        break;
+      }
+      complete = (rc == 0);         // 0 once a frame is done, and the next starts by itself
+      if (b->size == DECOMPRESS_BLOCK) {
+        publish(false, 0);
+        if ((b = next_free()) == NULL) {
+          ZSTD_freeDStream(ds);
+          return;
+        }
+      }
+    }
+    ZSTD_freeDStream(ds);
+#else
+    status = -1;                    // built without zstd
+#endif
+  }
+  publish(true, ((status == 0) && !complete) ? -1 : status);
+}
+
+/** Read decompressed bytes
+ *
+ * Waits for the decompression thread only when every block it filled has
+ * been read.
+ *
+ * @param buf receives the bytes
+ * @param n is the room at buf
+ * @return the number of bytes read (less than n only at the end of the
+ *   input), 0 at the end of the input or -1 if the input is damaged
+ *   (errno is EIO)
+ */
+ssize_t DecompressReader::read (char *buf, size_t n) {
+  size_t done = 0;
+  while (done < n) {
+    Block *b;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      full.wait(guard, [&]() {return (taken < filled) || finished;});
+      if (taken == filled) {
+        if ((error != 0) && (done == 0)) {
+          errno = EIO;
+          return -1;
+        }
+        break;
+      }
+      b = &ring[taken % ring.size()];
+    }
+    // the thread leaves the block alone until it is taken
+    size_t k = (b->size - offset < n - done) ? b->size - offset : n - done;
+    memcpy(buf + done, b->data.data() + offset, k);
+    offset += k;
+    done += k;
+    if (offset == b->size) {
+      std::lock_guard<std::mutex> guard(lock);
+      taken++;
+      offset = 0;
+      empty.notify_one();
+    }
+  }
+  return done;
+}
+
+/** Ctor for InputStream. Nothing is read until the first read().
+ *
+ * @param fd is the descriptor to read; it is not closed
+ * @param async is an AsyncReader opened on fd to read it through, or NULL;
+ *   it is not deleted
+ */
+InputStream::InputStream (int fd, AsyncReader *async) {
+  this->fd = fd;
+  this->async = async;
+  decoder = NULL;
+  have = 0;
+  given = 0;
+  sniffed = false;
+  kind = COMPRESS_NONE;
+}
+
+/** Dtor for InputStream. Stops the decompression thread, if any.
+ */
+InputStream::~InputStream () {
+  delete decoder;
+}
+
+/** Read the first bytes of the stream and start decompressing it if it
+ *  is compressed
+ *
+ * @return zero (0) if success or -1 on error (errno is ENOTSUP for zstd
+ *   input when built without zstd)
+ */
+int InputStream::sniff (void) {
+  sniffed = true;
+  while (have < MAGIC_BYTES) {
+    ssize_t got = read_source(fd, async, magic + have, MAGIC_BYTES - have);
+    if ((got < 0) && (errno == EINTR)) {
+      continue;
+    }
+    if (got < 0) {
+      return -1;
+    }
+    if (got == 0) {
+      break;
+    }
+    have += got;
+  }
+  kind = compression_of(magic, have);
+#ifndef HAVE_ZSTD
+  if (kind == COMPRESS_ZSTD) {
+    errno = ENOTSUP;
+    return -1;
+  }
+#endif
+  if (kind != COMPRESS_NONE) {
+    decoder = new DecompressReader(fd, async, kind, magic, have);
+    have = 0;
+  }
+  return 0;
+}
+
+/** Read plain bytes from the stream, decompressed if it is compressed
+ *
+ * @param buf receives the bytes
+ * @param n is the room at buf
+ * @return the number of bytes read, 0 at end of input or -1 on error
+ */
+ssize_t InputStream::read (char *buf, size_t n) {
+  if (!sniffed && (sniff() != 0)) {
+    have = given = 0;
+    kind = COMPRESS_NONE;
+    return -1;
+  }
+  if (decoder != NULL) {
+    return decoder->read(buf, n);
+  }
+  if (given < have) {
+    size_t k = (have - given < n) ? have - given : n;
+    memcpy(buf, magic + given, k);
+    given += k;
+    return k;
+  }
+  return read_source(fd, async, buf, n);
+}
+
+/** @brief What a FILE made by open_input reads from */
+struct InputCookie {
+  int fd;                           /**< the file, closed with the FILE unless stdin */
+  InputStream in;                   /**< reads it */
+  explicit InputCookie(int fd) : fd(fd), in(fd) {}
+};
+
+/** read function of the FILE made by open_input */
+static ssize_t input_read (void *cookie, char *buf, size_t n) {
+  return ((InputCookie *) cookie)->in.read(buf, n);
+}
+
+/** close function of the FILE made by open_input */
+static int input_close (void *cookie) {
+  InputCookie *c = (InputCookie *) cookie;
+  int fd = c->fd;
+  delete c;                         // stops the decompression thread first
+  return (fd != STDIN_FILENO) ? ::close(fd) : 0;
+}
+
+/** Open a file for reading through stdio, decompressing it if it is gzip
+ *  or zstd compressed, so line readers such as readln_fed can read
+ *  compressed files as they are
+ *
+ * @param path is the file to read, "-" for stdin
+ * @return the stream, or NULL on error
+ */
+FILE *open_input (const char *path) {
+  int fd = (strcmp(path, "-") == 0) ? STDIN_FILENO : ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  cookie_io_functions_t io = {input_read, NULL, NULL, input_close};
+  InputCookie *c = new InputCookie(fd);
+  FILE *f = fopencookie(c, "r", io);
+  if (f == NULL) {
+    input_close(c);
+  }
+  return f;
+}
@@ -0,0 +1,112 @@
+/** Reading gzip and zstd compressed input as if it were plain
+ *
+ * @author Krishna Garg
+ */
+
+#ifndef DECOMPRESS_HPP
+#define DECOMPRESS_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "asyncio.hpp"
+
+// bytes of decompressed output per block of the ring
+#define DECOMPRESS_BLOCK (1 << 20)
+// blocks in the ring: how far decompression may run ahead of the reader
+#define DECOMPRESS_BLOCKS (4)
+// bytes looked at to tell the format of a stream
+#define MAGIC_BYTES (4)
+
+/** @brief How a stream is compressed
+ */
+typedef enum {
+  COMPRESS_NONE,            /**< plain bytes */
+  COMPRESS_GZIP,            /**< gzip (one or more members) */
+  COMPRESS_ZSTD             /**< zstd (one or more frames) */
+} COMPRESSION;
+
+COMPRESSION compression_of(const void *data, size_t size);
+const char *compression_name(COMPRESSION c);
+
+/** @brief Decompresses a file descriptor on its own thread
+ *
+ * The thread reads the compressed stream and decompresses it into a ring
+ * of DECOMPRESS_BLOCKS blocks of DECOMPRESS_BLOCK bytes, waiting when all
+ * of them are full; read() copies out of the oldest full block and hands it
+ * back. Decompression thus runs ahead of whatever parses the output, by at
+ * most the ring, and the two overlap.
+ */
+class DecompressReader {
+private:
+  /** @brief One block of decompressed output */
+  struct Block {
+    std::vector<char> data;         /**< DECOMPRESS_BLOCK bytes */
+    size_t size;                    /**< bytes of data in use */
+  };
+
+  int fd;                           /**< compressed input, not owned */
+  AsyncReader *async;               /**< reads fd ahead if not NULL, not owned */
+  COMPRESSION kind;                 /**< its format */
+  std::vector<char> head;           /**< input already read from fd by the caller */
+  std::vector<Block> ring;          /**< the blocks */
+  uint64_t filled;                  /**< blocks the thread has filled */
+  uint64_t taken;                   /**< blocks the reader has used up */
+  size_t offset;                    /**< bytes of the current block already read */
+  bool finished;                    /**< the thread has filled its last block */
+  bool stopping;                    /**< the reader is gone, the thread must stop */
+  int error;                        /**< nonzero once the input is damaged or unreadable */
+  std::mutex lock;                  /**< guards the positions and flags */
+  std::condition_variable full;     /**< a block was filled or the thread finished */
+  std::condition_variable empty;    /**< a block was used up or the reader left */
+  std::thread thread;               /**< runs decompress() */
+
+  void decompress(void);
+  Block *next_free(void);
+  void publish(bool last, int status);
+  ssize_t read_input(char *buf, size_t n);
+public:
+  DecompressReader(int fd, AsyncReader *async, COMPRESSION kind, const char *head, size_t size);
+  ~DecompressReader();
+  DecompressReader(const DecompressReader &) = delete;
+  DecompressReader &operator=(const DecompressReader &) = delete;
+  ssize_t read(char *buf, size_t n);
+};
+
+/** @brief A file descriptor read as plain bytes, whatever its compression
+ *
+ * The first read looks at the first MAGIC_BYTES of the stream. Plain input
+ * is then read from the descriptor as it is; gzip or zstd input goes
+ * through a DecompressReader. Works on pipes, since nothing is read twice.
+ * Given an AsyncReader opened on the descriptor, reads go through it, so
+ * the file is read ahead whether it is compressed or not.
+ */
+class InputStream {
+private:
+  int fd;                           /**< descriptor being read, not owned */
+  AsyncReader *async;               /**< reads fd ahead if not NULL, not owned */
+  DecompressReader *decoder;        /**< set for compressed input */
+  char magic[MAGIC_BYTES];          /**< first bytes of plain input, not yet returned */
+  size_t have;                      /**< bytes in magic */
+  size_t given;                     /**< bytes of magic returned */
+  bool sniffed;                     /**< the format is known */
+  COMPRESSION kind;                 /**< the format, once sniffed */
+  int sniff(void);
+public:
+  explicit InputStream(int fd, AsyncReader *async = NULL);
+  ~InputStream();
+  InputStream(const InputStream &) = delete;
+  InputStream &operator=(const InputStream &) = delete;
+  ssize_t read(char *buf, size_t n);
+  /** @return the format of the stream, COMPRESS_NONE until the first read */
+  COMPRESSION compression() const {return kind;}
+};
+
+FILE *open_input(const char *path);
+
+#endif // DECOMPRESS_HPP
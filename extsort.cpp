@@ -0,0 +1,662 @@
+/** External merge sort of zip code records, for inputs larger than memory
+ *
+ * @author Krishna Garg
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <thread>
+#include "extsort.hpp"
+
+// most bytes of a city or state name, as ZipTable allows
+#define MAX_NAME (255)
+// smallest block worth reading a run in; fewer runs are merged at once rather than use smaller ones
+#define MIN_BLOCK (256 << 10)
+// largest block a run is read or written in
+#define MAX_BLOCK (8 << 20)
+// smallest memory budget used
+#define MIN_MEMORY (1 << 20)
+// most run files open at once
+#define MAX_FAN_IN (256)
+// fewest entries worth sorting on a thread of their own
+#define MIN_SORT_SLICE (65536)
+
+/** @brief Fixed part of a packed record, followed by the state and city
+ */
+struct RecordHead {
+  uint32_t zip;                     /**< zip code as a number */
+  float lat;                        /**< latitude */
+  float lon;                        /**< longitude */
+  uint8_t digits;                   /**< digits the zip is written with */
+  uint8_t type;                     /**< ZIPCODE_TYPE */
+  uint8_t state_len;                /**< bytes of the state */
+  uint8_t city_len;                 /**< bytes of the city */
+};
+
+/** Read the head of a packed record, which may not be aligned
+ *
+ * @param rec is the record
+ * @return its head
+ */
+static inline RecordHead head_of (const char *rec) {
+  RecordHead h;
+  memcpy(&h, rec, sizeof(h));
+  return h;
+}
+
+/** Bytes of a packed record
+ *
+ * @param h is its head
+ * @return the size of head, state and city
+ */
+static inline size_t record_size (const RecordHead &h) {
+  return sizeof(RecordHead) + h.state_len + h.city_len;
+}
+
+/** Write all of a buffer to a descriptor
+ *
+ * @param fd is the descriptor
+ * @param data is the buffer
+ * @param size is the number of bytes
+ * @return zero (0) if success or non-zero on error.
+ */
+static int write_all (int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
+
+/** Parse a comma separated list of sort keys
+ *
+ * @param list holds zip, type, city, state, lat and lon, most significant first
+ * @param keys is set to the keys
+ * @param error is set to what is wrong on error
+ * @return zero (0) if success or non-zero on error.
+ */
+int parse_sort_keys (const char *list, std::vector<FIELD_KIND> &keys, std::string &error) {
+  static const struct {
+    const char *name;
+    FIELD_KIND kind;
+  } names[] = {
+    {"zip", FIELD_ZIP}, {"type", FIELD_TYPE}, {"city", FIELD_CITY},
+    {"state", FIELD_STATE}, {"lat", FIELD_LAT}, {"lon", FIELD_LON}
+  };
+
+  keys.clear();
+  std::string_view rest(list);
+  while (!rest.empty()) {
+    size_t comma = rest.find(',');
+    std::string_view name = rest.substr(0, comma);
+    rest = (comma == std::string_view::npos) ? std::string_view() : rest.substr(comma + 1);
+    bool found = false;
+    for (const auto &n : names) {
+      if (name == n.name) {
+        keys.push_back(n.kind);
+        found = true;
+      }
+    }
+    if (!found) {
+      error = "unknown sort key \"" + std::string(name) + "\"";
+      return -1;
+    }
+  }
+  if (keys.empty()) {
+    error = "no sort key";
+    return -1;
+  }
+  return 0;
+}
+
+/** @brief Reads the records of a run file back in large blocks
+ *
+ * A record handed out stays in the buffer until the next one is taken, so
+ * the merge can hold the current record of every run at once.
+ */
+class ExternalSort::RunReader {
+private:
+  int fd;                           /**< the run file */
+  std::vector<char> buf;            /**< block of the file */
+  size_t pos;                       /**< next unread byte of buf */
+  size_t len;                       /**< bytes of buf holding data */
+  bool eof;                         /**< the whole file has been read */
+public:
+  /** Start reading a run from its beginning
+   *
+   * @param run is the run file
+   * @param size is the block size
+   */
+  RunReader(int run, size_t size) : fd(run), buf(size), pos(0), len(0), eof(false) {
+    lseek(fd, 0, SEEK_SET);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  /** Take the next record
+   *
+   * @param rec is set to the record
+   * @return 1 for a record, 0 at the end of the run or -1 on error
+   */
+  int next(const char **rec) {
+    size_t need = sizeof(RecordHead);
+    for (int pass = 0; pass < 2; pass++) {
+      while (len - pos < need) {
+        if (eof) {
+          return (len == pos) ? 0 : -1;
+        }
+        memmove(buf.data(), buf.data() + pos, len - pos);
+        len -= pos;
+        pos = 0;
+        ssize_t got = read(fd, buf.data() + len, buf.size() - len);
+        if ((got < 0) && (errno == EINTR)) {
+          continue;
+        }
+        if (got < 0) {
+          return -1;
+        }
+        eof = (got == 0);
+        len += got;
+      }
+      need = record_size(head_of(buf.data() + pos));
+    }
+    *rec = buf.data() + pos;
+    pos += need;
+    return 1;
+  }
+};
+
+/** Set up a sort
+ *
+ * @param sort_keys are the keys, most significant first
+ * @param memory is the budget in bytes for the records being sorted and
+ *   the blocks of the merge, at least MIN_MEMORY
+ * @param dir is the directory for the run files
+ * @param nthreads is the number of threads to sort each run with
+ */
+ExternalSort::ExternalSort (const std::vector<FIELD_KIND> &sort_keys, size_t memory, const char *dir, int nthreads)
+  : keys(sort_keys), budget(std::max(memory, (size_t) MIN_MEMORY)), tmpdir(dir), threads((nthreads < 1) ? 1 : nthreads),
+    buf(NULL), cap(0), used(0), slots(0), tree(NULL), last(-1) {
+  // a run goes through a block of its own as it is written
+  block = std::min((size_t) MAX_BLOCK, std::max((size_t) MIN_BLOCK, budget / 16));
+  fan_in = std::min((size_t) MAX_FAN_IN, std::max((size_t) 2, budget / MIN_BLOCK - 1));
+  // the records take about half of a run and the entries the rest
+  size_t run = (budget > 2 * block) ? budget - block : block;
+  cap = run / 2;
+  slots = (run - cap) / sizeof(Entry);
+  buf = (char *) malloc(cap);
+  entries.reserve(slots);
+}
+
+/** Close the run files and free the buffers
+ */
+ExternalSort::~ExternalSort () {
+  release();
+  for (size_t r = 0; r < runs.size(); r++) {
+    if (runs[r] >= 0) {
+      close(runs[r]);
+    }
+  }
+}
+
+/** Free the merge and the run buffer
+ */
+void ExternalSort::release (void) {
+  delete tree;
+  tree = NULL;
+  for (size_t r = 0; r < readers.size(); r++) {
+    delete readers[r];
+  }
+  readers.clear();
+  free(buf);
+  buf = NULL;
+  cap = 0;
+  std::vector<Entry>().swap(entries);
+}
+
+/** Note what went wrong
+ *
+ * @param what is the error
+ * @return -1
+ */
+int ExternalSort::fail (const std::string &what) {
+  if (message.empty()) {
+    message = what;
+  }
+  return -1;
+}
+
+/** Order preserving 16 byte prefix of the keys of a record: prefixes that
+ *  differ order two records, equal ones need compare unless both hold
+ *  every key whole
+ *
+ * The keys are laid out big-endian one after the other for as long as
+ * they fit: zip in 4 bytes, type in 1, lat and lon in 4 as integers that
+ * order like the floats, and the state and city as their bytes and a '\0',
+ * which sorts a name before any longer one it starts. A key that does not
+ * fit whole ends the prefix with as many of its bytes as fit.
+ *
+ * @param rec is the packed record
+ * @param whole is set to true if the prefix holds every key whole
+ * @return the prefix
+ */
+ExternalSort::Prefix ExternalSort::prefix (const char *rec, bool *whole) const {
+  RecordHead h = head_of(rec);
+  const char *state = rec + sizeof(RecordHead);
+  unsigned char bytes[16] = {0};
+  size_t at = 0;
+
+  *whole = true;
+  for (size_t k = 0; k < keys.size(); k++) {
+    unsigned char key[16] = {0};
+    size_t len = 4;
+    uint32_t bits;
+    auto big_endian = [&key](uint32_t v) {
+      for (size_t i = 0; i < 4; i++) {
+        key[i] = v >> (24 - 8 * i);
+      }
+    };
+    switch (keys[k]) {
+    case FIELD_ZIP:
+      big_endian(h.zip);
+      break;
+    case FIELD_TYPE:
+      key[0] = h.type;
+      len = 1;
+      break;
+    case FIELD_LAT:
+    case FIELD_LON:
+      memcpy(&bits, (keys[k] == FIELD_LAT) ? &h.lat : &h.lon, sizeof(bits));
+      // negative floats order backwards as integers, positive ones after them
+      big_endian((bits & 0x80000000u) ? ~bits : (bits | 0x80000000u));
+      break;
+    case FIELD_STATE:
+      len = h.state_len + 1;
+      memcpy(key, state, std::min(len - 1, sizeof(key)));
+      break;
+    default:
+      len = h.city_len + 1;
+      memcpy(key, state + h.state_len, std::min(len - 1, sizeof(key)));
+      break;
+    }
+    size_t take = std::min(len, sizeof(bytes) - at);
+    memcpy(bytes + at, key, take);
+    at += take;
+    if (take < len) {
+      *whole = false;
+      break;
+    }
+  }
+  Prefix p = {0, 0};
+  for (size_t i = 0; i < 8; i++) {
+    p.hi = (p.hi << 8) | bytes[i];
+    p.lo = (p.lo << 8) | bytes[8 + i];
+  }
+  return p;
+}
+
+/** Compare two records by the sort keys
+ *
+ * @param a is the first record
+ * @param pa is its prefix
+ * @param b is the second record
+ * @param pb is its prefix
+ * @param whole is true if both prefixes hold every key whole
+ * @return negative, zero or positive as a sorts before, with or after b
+ */
+int ExternalSort::compare (const char *a, const Prefix &pa, const char *b, const Prefix &pb, bool whole) const {
+  if (pa.hi != pb.hi) {
+    return (pa.hi < pb.hi) ? -1 : 1;
+  }
+  if ((pa.lo != pb.lo) || whole) {
+    return (pa.lo < pb.lo) ? -1 : (pa.lo > pb.lo);
+  }
+  RecordHead ha = head_of(a);
+  RecordHead hb = head_of(b);
+  for (size_t k = 0; k < keys.size(); k++) {
+    int c = 0;
+    switch (keys[k]) {
+    case FIELD_ZIP:
+      c = (ha.zip < hb.zip) ? -1 : (ha.zip > hb.zip);
+      break;
+    case FIELD_TYPE:
+      c = (int) ha.type - (int) hb.type;
+      break;
+    case FIELD_CITY:
+      c = std::string_view(a + sizeof(RecordHead) + ha.state_len, ha.city_len).compare(
+          std::string_view(b + sizeof(RecordHead) + hb.state_len, hb.city_len));
+      break;
+    case FIELD_STATE:
+      c = std::string_view(a + sizeof(RecordHead), ha.state_len).compare(
+          std::string_view(b + sizeof(RecordHead), hb.state_len));
+      break;
+    case FIELD_LAT:
+      c = (ha.lat < hb.lat) ? -1 : (ha.lat > hb.lat);
+      break;
+    default:
+      c = (ha.lon < hb.lon) ? -1 : (ha.lon > hb.lon);
+      break;
+    }
+    if (c != 0) {
+      return c;
+    }
+  }
+  return 0;
+}
+
+/** Order of the current records of two merge sources: exhausted sources
+ *  last, equal records by source number
+ *
+ * @param a is the first source
+ * @param b is the second source
+ * @return true if a's record is taken before b's
+ */
+bool ExternalSort::SourceOrder::operator() (int a, int b) const {
+  const Source &sa = (*sources)[a];
+  const Source &sb = (*sources)[b];
+  if ((sa.rec == NULL) || (sb.rec == NULL)) {
+    return (sb.rec == NULL) && ((sa.rec != NULL) || (a < b));
+  }
+  int c = sort->compare(sa.rec, sa.prefix, sb.rec, sb.prefix, sa.whole && sb.whole);
+  return (c < 0) || ((c == 0) && (a < b));
+}
+
+/** Move a merge source to its next record
+ *
+ * @param s is the source
+ * @return zero (0) if success or non-zero if a run file cannot be read
+ */
+int ExternalSort::advance (Source &s) {
+  if (s.reader == NULL) {
+    if (s.pos < s.end) {
+      s.rec = buf + entries[s.pos].off;
+      s.prefix = entries[s.pos].prefix;
+      s.whole = entries[s.pos].whole;
+    } else {
+      s.rec = NULL;
+    }
+    s.pos++;
+    return 0;
+  }
+  int got = s.reader->next(&s.rec);
+  if (got <= 0) {
+    s.rec = NULL;
+    return (got < 0) ? fail(std::string("cannot read a run: ") + strerror(errno)) : 0;
+  }
+  bool whole;
+  s.prefix = prefix(s.rec, &whole);
+  s.whole = whole;
+  return 0;
+}
+
+/** Pack a record into the run, first writing the run out if it is full
+ *
+ * @param zip is the record
+ * @return zero (0) if success or non-zero on error.
+ */
+int ExternalSort::add (const Zipfed &zip) {
+  std::string_view city = zip.get_city();
+  std::string_view state = zip.get_state();
+  if ((city.size() > MAX_NAME) || (state.size() > MAX_NAME)) {
+    return fail("a city or state name is longer than " + std::to_string(MAX_NAME) + " bytes");
+  }
+  if (buf == NULL) {
+    return fail("out of memory for the run buffer");
+  }
+  RecordHead h;
+  h.zip = zip.get_zip();
+  h.lat = zip.get_lat();
+  h.lon = zip.get_lon();
+  h.digits = zip.get_zip_digits();
+  h.type = (uint8_t) zip.get_type();
+  h.state_len = state.size();
+  h.city_len = city.size();
+  size_t size = record_size(h);
+
+  if ((used + size > cap) || (entries.size() == slots)) {
+    if (entries.empty()) {
+      return fail("the memory budget is too small for one record");
+    }
+    if (spill() != 0) {
+      return -1;
+    }
+  }
+  char *rec = buf + used;
+  memcpy(rec, &h, sizeof(h));
+  memcpy(rec + sizeof(h), state.data(), state.size());
+  memcpy(rec + sizeof(h) + state.size(), city.data(), city.size());
+  bool whole;
+  Prefix p = prefix(rec, &whole);
+  entries.push_back(Entry{p, used, whole});
+  used += size;
+  return 0;
+}
+
+/** Sort the entries of the run in memory, one slice per thread
+ *
+ * @return a merge source for each sorted slice, at its first record
+ */
+std::vector<ExternalSort::Source> ExternalSort::sort_run (void) {
+  size_t n = entries.size();
+  size_t slices = std::max((size_t) 1, std::min((size_t) threads, n / MIN_SORT_SLICE));
+  std::vector<Source> sources(slices);
+  for (size_t t = 0; t < slices; t++) {
+    sources[t] = Source{NULL, {0, 0}, false, NULL, n * t / slices, n * (t + 1) / slices};
+  }
+
+  // ties go by offset, which is input order, so the sort is stable
+  auto slice = [this](size_t lo, size_t hi) {
+    std::sort(entries.begin() + lo, entries.begin() + hi, [this](const Entry &a, const Entry &b) {
+      int c = compare(buf + a.off, a.prefix, buf + b.off, b.prefix, a.whole && b.whole);
+      return (c < 0) || ((c == 0) && (a.off < b.off));
+    });
+  };
+  std::vector<std::thread> workers;
+  for (size_t t = 1; t < slices; t++) {
+    workers.push_back(std::thread(slice, sources[t].pos, sources[t].end));
+  }
+  slice(sources[0].pos, sources[0].end);
+  for (size_t t = 0; t < workers.size(); t++) {
+    workers[t].join();
+  }
+  for (size_t t = 0; t < slices; t++) {
+    advance(sources[t]);
+  }
+  return sources;
+}
+
+/** Make an unlinked temporary file in the temp directory
+ *
+ * @return its descriptor, or -1 on error
+ */
+int ExternalSort::temp_file (void) {
+  std::string path = tmpdir + "/zipsortXXXXXX";
+  int fd = mkstemp(&path[0]);
+  if (fd < 0) {
+    fail("cannot create a run file in " + tmpdir + ": " + strerror(errno));
+    return -1;
+  }
+  unlink(path.c_str());
+  return fd;
+}
+
+/** Sort the run in memory and write it to a run file, merging the sorted
+ *  slices on the way out
+ *
+ * @return zero (0) if success or non-zero on error.
+ */
+int ExternalSort::spill (void) {
+  int fd = temp_file();
+  if (fd < 0) {
+    return -1;
+  }
+  runs.push_back(fd);
+  std::vector<Source> sources = sort_run();
+  LoserTree<SourceOrder> merge(sources.size(), SourceOrder{this, &sources});
+  std::vector<char> out(block);
+  size_t have = 0;
+  int w;
+  while (sources[w = merge.winner()].rec != NULL) {
+    size_t size = record_size(head_of(sources[w].rec));
+    if (have + size > out.size()) {
+      if (write_all(fd, out.data(), have) != 0) {
+        return fail(std::string("cannot write a run: ") + strerror(errno));
+      }
+      have = 0;
+    }
+    memcpy(out.data() + have, sources[w].rec, size);
+    have += size;
+    advance(sources[w]);
+    merge.replay();
+  }
+  if (write_all(fd, out.data(), have) != 0) {
+    return fail(std::string("cannot write a run: ") + strerror(errno));
+  }
+  entries.clear();
+  used = 0;
+  return 0;
+}
+
+/** Merge neighbouring runs into one new run file
+ *
+ * @param from is the first run to merge
+ * @param to is one past the last
+ * @return the descriptor of the new run, or -1 on error
+ */
+int ExternalSort::merge_runs (size_t from, size_t to) {
+  int fd = temp_file();
+  if (fd < 0) {
+    return -1;
+  }
+  size_t size_each = std::min((size_t) MAX_BLOCK, budget / (to - from + 1));
+  std::vector<RunReader> group;
+  group.reserve(to - from);
+  std::vector<Source> sources(to - from);
+  for (size_t r = from; r < to; r++) {
+    group.emplace_back(runs[r], size_each);
+    sources[r - from] = Source{NULL, {0, 0}, false, &group.back(), 0, 0};
+    advance(sources[r - from]);
+  }
+  LoserTree<SourceOrder> merge(sources.size(), SourceOrder{this, &sources});
+  std::vector<char> out(size_each);
+  size_t have = 0;
+  int w;
+  while (message.empty() && (sources[w = merge.winner()].rec != NULL)) {
+    size_t size = record_size(head_of(sources[w].rec));
+    if (have + size > out.size()) {
+      if (write_all(fd, out.data(), have) != 0) {
+        close(fd);
+        fail(std::string("cannot write a run: ") + strerror(errno));
+        return -1;
+      }
+      have = 0;
+    }
+    memcpy(out.data() + have, sources[w].rec, size);
+    have += size;
+    advance(sources[w]);
+    merge.replay();
+  }
+  if (!message.empty() || (write_all(fd, out.data(), have) != 0)) {
+    close(fd);
+    fail(std::string("cannot write a run: ") + strerror(errno));
+    return -1;
+  }
+  return fd;
+}
+
+/** End the input: sort what is left and set up the merge that next()
+ *  takes the records from
+ *
+ * @return zero (0) if success or non-zero on error.
+ */
+int ExternalSort::finish (void) {
+  if (!message.empty()) {
+    return -1;
+  }
+  if (runs.empty()) {
+    // it all fit in memory: merge the sorted slices straight to the caller
+    merging = sort_run();
+  } else {
+    if (!entries.empty() && (spill() != 0)) {
+      return -1;
+    }
+    free(buf);
+    buf = NULL;
+    std::vector<Entry>().swap(entries);
+
+    // merge groups of neighbouring runs until one merge can take them all
+    while (runs.size() > fan_in) {
+      std::vector<int> merged;
+      for (size_t from = 0; from < runs.size(); from += fan_in) {
+        size_t to = std::min(runs.size(), from + fan_in);
+        int fd = (to - from == 1) ? dup(runs[from]) : merge_runs(from, to);
+        if (fd < 0) {
+          for (size_t m = 0; m < merged.size(); m++) {
+            close(merged[m]);
+          }
+          return -1;
+        }
+        for (size_t r = from; r < to; r++) {
+          close(runs[r]);
+          runs[r] = -1;
+        }
+        merged.push_back(fd);
+      }
+      runs.swap(merged);
+    }
+
+    size_t size_each = std::min((size_t) MAX_BLOCK, budget / (runs.size() + 1));
+    merging.resize(runs.size());
+    for (size_t r = 0; r < runs.size(); r++) {
+      readers.push_back(new RunReader(runs[r], size_each));
+      merging[r] = Source{NULL, {0, 0}, false, readers[r], 0, 0};
+      if (advance(merging[r]) != 0) {
+        return -1;
+      }
+    }
+  }
+  tree = new LoserTree<SourceOrder>(merging.size(), SourceOrder{this, &merging});
+  last = -1;
+  return 0;
+}
+
+/** Take the next record in sorted order
+ *
+ * @param out is set to the record
+ * @return 1 for a record, 0 when all have been taken or -1 on error
+ */
+int ExternalSort::next (SortedRecord *out) {
+  if (tree == NULL) {
+    return fail("the sort was not finished");
+  }
+  if (last >= 0) {
+    if (advance(merging[last]) != 0) {
+      return -1;
+    }
+    tree->replay();
+  }
+  last = tree->winner();
+  const char *rec = merging[last].rec;
+  if (rec == NULL) {
+    return 0;
+  }
+  RecordHead h = head_of(rec);
+  out->zip = h.zip;
+  out->digits = h.digits;
+  out->type = (ZIPCODE_TYPE) h.type;
+  out->state = std::string_view(rec + sizeof(RecordHead), h.state_len);
+  out->city = std::string_view(rec + sizeof(RecordHead) + h.state_len, h.city_len);
+  out->lat = h.lat;
+  out->lon = h.lon;
+  return 1;
+}
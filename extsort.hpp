@@ -0,0 +1,174 @@
+/** External merge sort of zip code records, for inputs larger than memory
+ *
+ * @author Krishna Garg
+ */
+
+#ifndef EXTSORT_HPP
+#define EXTSORT_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include "zipfed.hpp"
+
+int parse_sort_keys(const char *list, std::vector<FIELD_KIND> &keys, std::string &error);
+
+/** @brief A record as it comes out of the sort
+ *
+ * The city and state point into the sorter's buffers and stay valid until
+ * the next record is taken.
+ */
+struct SortedRecord {
+  uint32_t zip;                     /**< zip code as a number */
+  uint8_t digits;                   /**< digits the zip is written with */
+  ZIPCODE_TYPE type;                /**< zip code type */
+  std::string_view city;            /**< city name */
+  std::string_view state;           /**< state code */
+  float lat;                        /**< latitude */
+  float lon;                        /**< longitude */
+};
+
+/** @brief Tournament tree of losers for a k-way merge
+ *
+ * Each internal node keeps the source that lost the match played there and
+ * node 0 the overall winner, so after the winner advances only the matches
+ * on its path to the root are replayed: log2(k) compares per record, each
+ * against a loser already in hand. less(a, b) orders the current records
+ * of sources a and b; it must put exhausted sources last and break ties by
+ * source number for the merge to be stable.
+ */
+template <class Less>
+class LoserTree {
+private:
+  std::vector<int> tree;            /**< [0] the winner, [1..k-1] the losers */
+  size_t k;                         /**< number of sources */
+  Less less;                        /**< order of the current records */
+public:
+  /** Play the first round
+   *
+   * @param sources is the number of sources, at least 1
+   * @param order is the less(a, b) of the current records of two sources
+   */
+  LoserTree(size_t sources, Less order) : tree(sources), k(sources), less(order) {
+    std::vector<int> win(2 * k);
+    for (size_t s = 0; s < k; s++) {
+      win[k + s] = s;
+    }
+    for (size_t n = k - 1; n > 0; n--) {
+      int a = win[2 * n];
+      int b = win[2 * n + 1];
+      win[n] = less(b, a) ? b : a;
+      tree[n] = less(b, a) ? a : b;
+    }
+    tree[0] = win[1];
+  }
+  /** @return the source holding the smallest record */
+  int winner() const {return tree[0];}
+  /** Find the new winner after the current winner's source advanced */
+  void replay() {
+    int s = tree[0];
+    for (size_t n = (k + s) / 2; n > 0; n /= 2) {
+      if (less(tree[n], s)) {
+        std::swap(tree[n], s);
+      }
+    }
+    tree[0] = s;
+  }
+};
+
+/** @brief Sorts any number of records in a fixed amount of memory
+ *
+ * Records added are packed into a run buffer of the memory budget: a 16
+ * byte head (zip, lat, lon, digits, type and the two lengths) followed by
+ * the state and city bytes, plus a sort entry holding an order preserving
+ * 16 byte prefix of its keys, which decides most compares without looking
+ * at the records. When the buffer is full the run is
+ * sorted, in slices on several threads, and the slices are merged through
+ * a LoserTree into a temporary file in the same packed form. The files are
+ * unlinked as soon as they are made, so nothing is left behind.
+ *
+ * finish() then merges the runs, again with a LoserTree, reading each one
+ * in large sequential blocks; if there are more runs than blocks of a
+ * useful size fit in the budget, groups of neighbouring runs are merged
+ * first. A sort that fits in memory writes no file at all. Equal records
+ * keep their input order.
+ */
+class ExternalSort {
+private:
+  /** @brief First 16 bytes of the keys of a record, in an order
+   *  preserving form (see prefix())
+   */
+  struct Prefix {
+    uint64_t hi;                    /**< bytes 0 to 7, big-endian */
+    uint64_t lo;                    /**< bytes 8 to 15, big-endian */
+  };
+  /** @brief Entry of the run being sorted */
+  struct Entry {
+    Prefix prefix;                  /**< keys, in an order preserving form */
+    uint64_t off : 63;              /**< record offset in the run buffer */
+    uint64_t whole : 1;             /**< prefix holds every key whole */
+  };
+  class RunReader;
+  /** @brief One sorted sequence being merged: a run file or a slice of
+   *  the sorted entries of the run in memory
+   */
+  struct Source {
+    const char *rec;                /**< current record, NULL when exhausted */
+    Prefix prefix;                  /**< prefix of its keys */
+    bool whole;                     /**< prefix holds every key whole */
+    RunReader *reader;              /**< run file being read, NULL for a slice */
+    size_t pos;                     /**< next entry of the slice */
+    size_t end;                     /**< one past the last entry of the slice */
+  };
+  /** @brief Order of the current records of two sources, for LoserTree */
+  struct SourceOrder {
+    const ExternalSort *sort;       /**< the sort, for its keys */
+    const std::vector<Source> *sources; /**< the sources being merged */
+    bool operator()(int a, int b) const;
+  };
+
+  std::vector<FIELD_KIND> keys;     /**< sort keys, most significant first */
+  size_t budget;                    /**< bytes of memory to use */
+  size_t block;                     /**< bytes per read or write of a run file */
+  size_t fan_in;                    /**< most runs merged at once */
+  std::string tmpdir;               /**< where run files are made */
+  int threads;                      /**< threads to sort a run with */
+  char *buf;                        /**< packed records of the run */
+  size_t cap;                       /**< size of buf */
+  size_t used;                      /**< bytes of buf in use */
+  std::vector<Entry> entries;       /**< sort entries of the run */
+  size_t slots;                     /**< most entries a run may have */
+  std::vector<int> runs;            /**< descriptors of the run files, in input order */
+  std::vector<RunReader *> readers; /**< the runs of the final merge */
+  std::vector<Source> merging;      /**< sources of the final merge */
+  LoserTree<SourceOrder> *tree;     /**< the final merge, once finish() is done */
+  int last;                         /**< source of the record next() gave last, -1 before */
+  std::string message;              /**< what went wrong */
+
+  int compare(const char *a, const Prefix &pa, const char *b, const Prefix &pb, bool whole) const;
+  Prefix prefix(const char *rec, bool *whole) const;
+  int advance(Source &s);
+  std::vector<Source> sort_run(void);
+  int spill(void);
+  int merge_runs(size_t from, size_t to);
+  int temp_file(void);
+  void release(void);
+  int fail(const std::string &what);
+public:
+  ExternalSort(const std::vector<FIELD_KIND> &keys, size_t memory, const char *tmpdir, int threads = 1);
+  ~ExternalSort();
+  ExternalSort(const ExternalSort &) = delete;
+  ExternalSort &operator=(const ExternalSort &) = delete;
+  int add(const Zipfed &zip);
+  int finish(void);
+  int next(SortedRecord *out);
+  /** @return the number of runs written to temporary files */
+  size_t run_count() const {return runs.size();}
+  /** @return what went wrong, after an error */
+  const std::string &error() const {return message;}
+};
+
+#endif // EXTSORT_HPP
@@ -8,115 +8,469 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <string>
-#include <forward_list>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include "zipfed.hpp"
+#include "csvscan.hpp"
+#include "ziptable.hpp"
+#include "zipindex.hpp"
+#include "snapshot.hpp"
+#include "zipfilter.hpp"
+#include "zipstats.hpp"
+#include "asyncio.hpp"
 
 // size of fully qualified path/file name with null terminator
 #define SZ_FILENAME (129)
+// most columns of a federal record we look at
+#define MAX_FIELDS (12)
+// bytes of input read at a time, per worker thread
+#define BLOCK_SIZE (4 << 20)
+// smallest slice of input handed to one worker thread
+#define MIN_CHUNK (256 << 10)
+// slices per worker thread, more slices balance uneven work better
+#define CHUNKS_PER_THREAD (4)
+// records kept when no filter is given, the extract this program was written for
+#define DEFAULT_FILTER "state = MA"
+// outputs of a split run, one per state code (see state_intern)
+#define STATE_CODES (256)
+// what %s becomes for records whose state is not 2 characters
+#define OTHER_STATE "other"
 
-/** Function to read a line from the US FED and return pointer to the 
- * line of data represented as a C-String (i.e. NULL terminated string)
- *
- * @lineptr is a pointer to the dynamically allocated buffer to fill.
- *   If the pointer is NULL, a buffer will be allocated to hold the line.
- *   If the buffer is too small to hold the line, realloc will be called
- *   to allocate a larger buffer. If the buffer is reallocated, n will
- *   be set to new size.
- * @n is a pointer to the size of the buffer pointer to be lineptr. If
- *   memory is reallocated for lineptr, the size of n will be incremented
- *   accordingly. The parameter n will always specify the size of buffer
- *   pointed at by lineptr.
- * @fptr is the FILE pointer to the open file to read.
- * @return number bytes (chars) read or -1 on error
+/** @brief How records are converted, shared by every worker thread
  */
-ssize_t readln_fed (char **lineptr, size_t *n, FILE *stream) {
-  ssize_t bytes_read = -1;  // -1 will signify error reading line
-  const int delim = '\n';   // each line terminated with \r\n
+struct Convert {
+  FLOAT_FORMAT floats;              /**< how lat/lon are written */
+  const ZipFilter *filter;          /**< records that are written */
+  bool split;                       /**< one output per state instead of one */
+};
 
-  // Verify the file is open
-  if (stream == NULL) {
-    return (ssize_t) -1;
+/** @brief Files converted records are written to
+ *
+ * Either one file, or in a split run one file per state whose name is a
+ * pattern with %s replaced by the state. Files of a split run are created
+ * when the first record of their state is written. With --io the single
+ * file is written through an AsyncWriter instead of stdio.
+ */
+struct Output {
+  const char *name;                 /**< file name, or pattern holding %s */
+  std::vector<FILE *> files;        /**< file of each output, NULL until used */
+  AsyncWriter *async;               /**< writes the single output if not NULL */
+};
+
+/** @brief One newline aligned slice of the input and its converted output
+ */
+struct Chunk {
+  const char *begin;                /**< first byte of the slice */
+  size_t size;                      /**< number of bytes in the slice */
+  std::vector<std::string> out;     /**< converted records of the slice, per output */
+  int status;                       /**< zero if every record parsed */
+  bool done;                        /**< set once out and status are final */
+};
+
+/** Parse, filter and format every record of one slice of input into the
+ *  slice's own output buffers. Runs on a worker thread. Header lines, as
+ *  cat a.csv b.csv leaves in the input, are skipped.
+ *
+ * @chunk is the slice to convert; out and status are filled in
+ * @convert is how records are converted
+ */
+static void convert_chunk (Chunk &chunk, const Convert &convert) {
+  std::string_view fields[MAX_FIELDS];
+  int nfields;
+  Zipfed zip;               // reused for every record of the slice
+
+  CsvIndexScanner scanner(chunk.begin, chunk.size);
+  chunk.out.resize(convert.split ? STATE_CODES : 1);
+  for (size_t i = 0; i < chunk.out.size(); i++) {
+    chunk.out[i].clear();
+  }
+  if (!convert.split) {
+    chunk.out[0].reserve(chunk.size / 2);
+  }
+  chunk.status = 0;
+  uint64_t rows = 0;        // records found, counted once per slice
+  uint64_t dropped = 0;     // records the filter dropped
+  while ((nfields = scanner.next(fields, MAX_FIELDS)) != EOF) {
+    int parsed = zip.parse_fields_federal(fields, nfields);
+    if (parsed == -3) {
+      continue;             // the header of a file concatenated onto the input
+    }
+    rows++;
+    if (parsed != 0) {
+      chunk.status = -4;
+      break;
+    }
+    if (convert.filter->match(zip)) {
+      zip.print(chunk.out[convert.split ? state_intern(zip.get_state()) : 0], convert.floats);
+    } else {
+      dropped++;
+    }
+  }
+  stats.count(COUNT_ROWS_READ, rows);
+  stats.count(COUNT_ROWS_PARSED, rows - (chunk.status != 0));
+  stats.count(COUNT_ROWS_FILTERED, dropped);
+}
+
+/** Write the output buffers of a converted slice to their files
+ *
+ * @param out are the buffers, one per output
+ * @param output are the files; files of a split run are created here
+ * @return zero (0) if success or non-zero if a file cannot be created.
+ */
+static int write_chunk (const std::vector<std::string> &out, Output &output) {
+  PhaseTimer timer(PHASE_WRITE);
+  for (size_t i = 0; i < out.size(); i++) {
+    if (out[i].empty()) {
+      continue;
+    }
+    if (output.async != NULL) {
+      if (output.async->write(out[i].data(), out[i].size()) != 0) {
+        fprintf(stderr, "cannot write %s - exiting\n", output.name);
+        return -3;
+      }
+      stats.count(COUNT_BYTES_OUT, out[i].size());
+      continue;
+    }
+    if (output.files[i] == NULL) {
+      // only split runs get here, the single output is opened up front
+      std::string_view state = state_name(i);
+      std::string name(output.name);
+      name.replace(name.find("%s"), 2, state.empty() ? OTHER_STATE : std::string(state));
+      output.files[i] = fopen(name.c_str(), "w");
+      if (output.files[i] == NULL) {
+        fprintf(stderr, "cannot open %s for output - exiting\n", name.c_str());
+        return -3;
+      }
+    }
+    fwrite(out[i].data(), 1, out[i].size(), output.files[i]);
+    stats.count(COUNT_BYTES_OUT, out[i].size());
+  }
+  return 0;
+}
+
+/** Convert one block of federal records with several worker threads
+ *
+ * The block is cut into newline aligned slices. Worker threads take slices
+ * in input order and convert each into its own buffer. When ordered is set
+ * the buffers are written in input order, so the output is byte-identical
+ * to the single threaded conversion; otherwise each buffer is written as
+ * soon as it is finished.
+ *
+ * @param data is the first byte of the block, it holds complete lines
+ * @param size is the number of bytes in the block
+ * @param output are the files to write converted records to
+ * @param threads is the number of worker threads
+ * @param ordered is true to keep the output in input order
+ * @param convert is how records are converted
+ * @return zero (0) if success or non-zero on error.
+ */
+static int convert_parallel (const char *data, size_t size, Output &output, int threads, bool ordered,
+                             const Convert &convert) {
+  const char *end = data + size;
+  const char *p = data;
+
+  // cut the block into slices that end just after a newline
+  size_t want = size / ((size_t) threads * CHUNKS_PER_THREAD) + 1;
+  if (want < MIN_CHUNK) {
+    want = MIN_CHUNK;
+  }
+  std::vector<Chunk> chunks;
+  while (p < end) {
+    const char *stop = ((size_t) (end - p) > want) ? p + want : end;
+    if (stop < end) {
+      const char *nl = (const char *) memchr(stop, '\n', end - stop);
+      stop = (nl != NULL) ? nl + 1 : end;
+    }
+    Chunk c;
+    c.begin = p;
+    c.size = stop - p;
+    c.status = 0;
+    c.done = false;
+    chunks.push_back(c);
+    p = stop;
   }
 
-  // Each line of the FED ZIP CSV file is terminated by \n\r, so we
-  // read up to and including the \r for the entire line
-  bytes_read = getdelim (lineptr, n, delim, stream);
+  std::mutex lock;
+  std::condition_variable finished;
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
 
-  // Remove the \n\r at the end of the line by replacing with NULL terminator
-  // Expect length of at least 2 for the \n\r at end of a line
-  for (int i = bytes_read - 1; i >= 0; i--) {
-    if (((*lineptr)[i] == '\n') || ((*lineptr)[i] == '\r')) {
-      (*lineptr)[i] = '\0';
+  for (int t = 0; t < threads; t++) {
+    workers.push_back(std::thread([&]() {
+      size_t i;
+      while ((i = next.fetch_add(1)) < chunks.size()) {
+        convert_chunk(chunks[i], convert);
+        std::lock_guard<std::mutex> guard(lock);
+        chunks[i].done = true;
+        finished.notify_all();
+      }
+    }));
+  }
+
+  // write each buffer once it is finished, releasing it right after
+  int status = 0;
+  std::vector<bool> written(chunks.size(), false);
+  for (size_t n = 0; n < chunks.size(); n++) {
+    size_t i = n;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      if (ordered) {
+        finished.wait(guard, [&]() {return chunks[i].done;});
+      } else {
+        for (;;) {
+          for (i = 0; i < chunks.size() && (written[i] || !chunks[i].done); i++) {
+          }
+          if (i < chunks.size()) {
+            break;
+          }
+          finished.wait(guard);
+        }
+      }
+    }
+    written[i] = true;
+    if (chunks[i].status != 0) {
+      status = chunks[i].status;
+    } else if (status == 0) {
+      status = write_chunk(chunks[i].out, output);
+    }
+    std::vector<std::string>().swap(chunks[i].out);
+  }
+
+  for (size_t t = 0; t < workers.size(); t++) {
+    workers[t].join();
+  }
+  return status;
+}
+
+/** Open a file, with O_DIRECT if asked and the file system allows it
+ *
+ * @param name is the file
+ * @param flags are the open flags
+ * @param direct is true to ask for O_DIRECT, and set to whether it was used
+ * @return the descriptor, or -1 on error
+ */
+static int open_file (const char *name, int flags, bool *direct) {
+  int fd = -1;
+  if (*direct) {
+    fd = open(name, flags | O_DIRECT, 0666);
+    if ((fd < 0) && (errno == EINVAL)) {
+      fprintf(stderr, "%s does not allow O_DIRECT, using the page cache\n", name);
     }
   }
-    
-  return bytes_read;
+  if (fd < 0) {
+    *direct = false;
+    fd = open(name, flags, 0666);
+  }
+  return fd;
+}
+
+/** Write a snapshot of a converted cs2303 file for zipcode -s
+ *
+ * @param outfile is the cs2303 file just written
+ * @param snapfile is the snapshot file to create
+ * @param threads is the number of threads to sort with
+ * @return zero (0) if success or non-zero on error.
+ */
+static int write_snapshot (const char *outfile, const char *snapfile, int threads) {
+  MappedFile converted;
+  ZipTable table;
+  CityIndex index;
+
+  PhaseTimer timer(PHASE_SNAPSHOT);
+  if ((converted.open(outfile) != 0) ||
+      (table.load_cs2303(converted.data(), converted.size()) != 0)) {
+    return -1;
+  }
+  table.sort_by_city(threads);
+  index.build(table);
+  return Snapshot::write(snapfile, table, index, outfile);
 }
 
 /** main function to drive program. Input and output file names specified
  * on command line.
  *
  * usage:
- *    fed2cs2301 input_file output_file
+ *    fed2cs2303 [-j threads [-u]] [-g] [-f filter] [-S snapshot_file] [--io=engine [--direct]] [--stats[=json]] input_file output_file
  *
- * The input file must already exist. Output file will be created.
+ * The input file must already exist. Output file will be created. Either
+ * name may be "-" for stdin / stdout, so the program can sit in a pipeline.
+ * Records are written in input order.
  *
  * Approach:
  * 1) Open both input and output files, or fail with error
- * 2) Read a line from input. This is a record of federal zip code data
+ * 2) Read a block of complete lines from input. These are records of
+ *    federal zip code data
  *    Note: the first line of the file is header info, not data, ignore it
- * 3) Parse the input line to populate a ZIP_FEDERAL structure
- * 4) Write the ZIP_FEDERAL structure to output file 1 record / line
+ * 3) Scan each record of the block and parse its fields into a Zipfed
+ * 4) Format the Zipfed into an output buffer 1 record / line
  *    Note: no column header information will be written out, just  data fields
- * 5) Close output and input files and exit cleanly
+ * 5) Write the buffer and go back to 2) until end of input
+ * 6) Close output and input files and exit cleanly
+ *
+ * Records stream straight from the input block to the output buffer, so
+ * memory use stays at a few blocks whatever the size of the input.
+ *
+ * With -j the records of each block are converted by that many worker
+ * threads (see convert_parallel); the output is byte-identical to the
+ * single threaded conversion unless -u allows slices to be written as they
+ * finish.
+ *
+ * Lat/lon are written with six decimals, exactly as printf("%f") would
+ * write them. With -g they are written as the shortest text that reads
+ * back as the same float instead ("42.36" rather than "42.360001").
  *
- * @param argc is the number of input strings - will be 3
+ * Only records that pass the filter given with -f are written, by default
+ * "state = MA" (see ZipFilter for the language), for example
+ *    -f "state in (MA,NH,RI) and type != PO_BOX and zip between 01000 and 02799"
+ * The filter is compiled once before the input is read.
+ *
+ * If the output file name holds "%s" the records are split by state in the
+ * same single pass: each goes to the file named by replacing %s with its
+ * state ("other" if it has none), so
+ *    fed2cs2303 -f "type != MILITARY" national.csv out/%s.csv
+ * writes one file per state. Only files that get records are created.
+ *
+ * With --stats the time spent reading, converting, writing and writing the
+ * snapshot, the rows read, parsed and filtered out, the bytes in and out and
+ * the heap allocations are printed on stderr at the end, as text or with
+ * --stats=json as JSON.
+ *
+ * With -S the output file is also loaded, sorted by city and saved as a
+ * binary snapshot that zipcode -s maps at startup instead of parsing the
+ * output file again. The output must then be a regular file, not "-".
+ *
+ * --io picks how the files are read and written: "sync" (the default)
+ * reads with read() and writes with stdio; "thread" and "uring" keep
+ * IO_DEPTH buffers of IO_BUFFER bytes being read ahead of the parser and
+ * written behind it, with pread/pwrite on a helper thread or with io_uring
+ * (see AsyncReader, AsyncWriter). This applies to a regular input file and
+ * to a single output file that is not "-"; the others are read and written
+ * as with "sync". --direct also opens them with O_DIRECT, bypassing the
+ * page cache, which suits inputs much larger than memory.
+ *
+ * @param argc is the number of input strings - 3 plus any options
  * @param argv is array of cmd line args -
- *        fed2cs2301 existing_input_file output_file_to_create
+ *        fed2cs2303 [-j threads [-u]] [-g] [-f filter] [-S snapshot_file] [--io=engine [--direct]] [--stats[=json]] existing_input_file output_file_to_create
  * @return 0 for success. non-zero for error
  */
 int main (int argc, char *argv[]) {
   char infile[SZ_FILENAME];  // Path/name of input file
   char outfile[SZ_FILENAME]; // Path/name of output file
-  FILE *fdIn;
-  FILE *fdOut;
+  int fdIn;                  // input descriptor, read in blocks
+  int fdOut = -1;            // output descriptor, when written asynchronously
+  Output output;             // file, or files of a split run, to write
+  IO_ENGINE engine = IO_SYNC; // how the files are read and written
+  bool direct = false;       // open them with O_DIRECT
+  bool direct_out;           // the output was opened with O_DIRECT
+  AsyncReader async_in;      // reads the input ahead, with --io
+  AsyncWriter async_out;     // writes the output behind, with --io
 
-  ssize_t chars_read;        // number of chars read for line of input
-  char *inbuf = NULL;        // input file has 1 record per line to buffer
-  size_t sz_inbuf = 0;       // current size of the input record
+  const char *block;         // block of complete input lines
+  long sz_block;             // number of bytes in the block
+  bool header = true;        // the first line still has to be skipped
+  int status = 0;            // nonzero once a record fails to parse
 
-  std::forward_list<Zipfed *> llist; // singly linked list of pointers to Zipfed instances
+  int threads = 0;           // worker threads, 0 converts on this thread
+  bool ordered = true;       // write parallel output in input order
+  const char *snapfile = NULL; // snapshot of the output to write, if any
+  const char *expr = DEFAULT_FILTER; // records to keep
+  ZipFilter filter;
+  Convert convert;
+  int opt;
+  static const struct option longopts[] = {
+    {"stats", optional_argument, NULL, 'T'},
+    {"io", required_argument, NULL, 'I'},
+    {"direct", no_argument, NULL, 'D'},
+    {NULL, 0, NULL, 0}
+  };
   
   /* Open input and output files specified on command line
    * Common sense error checking on cmd line parameters
    */
-  if (argc != 3) {
-    fprintf(stderr, "usage: %s input_file output_file\n", argv[0]);
+  convert.floats = FLOAT_FIXED;    // lat/lon as printf("%f") unless -g
+  convert.filter = &filter;
+  while ((opt = getopt_long(argc, argv, "j:uS:gf:", longopts, NULL)) != -1) {
+    if (opt == 'j') {
+      threads = atoi(optarg);
+    } else if (opt == 'u') {
+      ordered = false;
+    } else if (opt == 'S') {
+      snapfile = optarg;
+    } else if (opt == 'g') {
+      convert.floats = FLOAT_SHORTEST;
+    } else if (opt == 'f') {
+      expr = optarg;
+    } else if (opt == 'D') {
+      direct = true;
+    } else if ((opt == 'I') && (io_engine_parse(optarg, &engine) != 0)) {
+      threads = -1;
+      break;
+    } else if ((opt == 'T') && (stats.option(optarg) != 0)) {
+      threads = -1;         // --stats= something other than json or human
+      break;
+    } else if ((opt != 'T') && (opt != 'I')) {
+      threads = -1;
+      break;
+    }
+  }
+  convert.split = (argc - optind == 2) && (strstr(argv[optind + 1], "%s") != NULL);
+  if ((argc - optind != 2) || (threads < 0) || (direct && (engine == IO_SYNC)) ||
+      ((snapfile != NULL) && ((strcmp(argv[optind + 1], "-") == 0) || convert.split))) {
+    fprintf(stderr, "usage: %s [-j threads [-u]] [-g] [-f filter] [-S snapshot_file] [--io=engine [--direct]] [--stats[=json]] input_file output_file\n", argv[0]);
+    return -1;
+  }
+  if (filter.compile(expr) != 0) {
+    fprintf(stderr, "bad filter: %s\n", filter.error().c_str());
     return -1;
   }
   
-  strncpy(infile, argv[1], SZ_FILENAME-1);
-  strncpy(outfile, argv[2], SZ_FILENAME-1);
+  strncpy(infile, argv[optind], SZ_FILENAME-1);
+  strncpy(outfile, argv[optind + 1], SZ_FILENAME-1);
+  output.name = outfile;
 
   /* Open input and output files - return error on failure
    * input for reading. output for writing
    */
-  //freopen(argv[2], "w", stdout);
-  
-  fdIn = fopen(infile, "r");
-  if (fdIn == NULL) {
+  bool direct_in = direct;
+  fdIn = (strcmp(infile, "-") == 0) ? STDIN_FILENO : open_file(infile, O_RDONLY, &direct_in);
+  if (fdIn < 0) {
     fprintf(stderr, "cannot open %s for input - exiting\n", infile);
     return -2;
   }
-  fdOut = fopen(outfile, "w");
-  if (fdOut == NULL) {
-    fprintf(stderr, "cannot open %s for output - exiting\n", outfile);
-    fclose(fdIn);
-    return -3;
+  // anything but a regular file, such as a pipe, is read as with sync
+  bool read_async = (engine != IO_SYNC) && (async_in.open(fdIn, engine) == 0);
+  output.files.assign(convert.split ? STATE_CODES : 1, NULL);
+  output.async = NULL;
+  if (!convert.split && (engine != IO_SYNC) && (strcmp(outfile, "-") != 0)) {
+    direct_out = direct;
+    fdOut = open_file(outfile, O_WRONLY | O_CREAT | O_TRUNC, &direct_out);
+    if ((fdOut < 0) || (async_out.open(fdOut, engine, direct_out) != 0)) {
+      fprintf(stderr, "cannot open %s for output - exiting\n", outfile);
+      close(fdIn);
+      return -3;
+    }
+    output.async = &async_out;
+  } else if (!convert.split) {
+    output.files[0] = (strcmp(outfile, "-") == 0) ? stdout : fopen(outfile, "w");
+    if (output.files[0] == NULL) {
+      fprintf(stderr, "cannot open %s for output - exiting\n", outfile);
+      close(fdIn);
+      return -3;
+    }
   }
+  LineBlockReader reader(fdIn, BLOCK_SIZE * (threads > 0 ? threads : 1), read_async ? &async_in : NULL);
+  Chunk chunk;               // output buffer of the single threaded path
   
-  /* Now a loop to read each line of the input file formatted and structured
+  /* Now a loop to read each block of the input file formatted and structured
    * as downloaded from US Government. Then, each line is loaded into our
    * zip code data structure before writing it out to the output file.
    *
@@ -126,68 +480,74 @@ int main (int argc, char *argv[]) {
    *  - each record will be written to ouput on its own line
    *  - read until EOF on input or error either reading or writing
    */
-  // Just read and discard first line of input, it's column names
-  chars_read = readln_fed (&inbuf, &sz_inbuf, fdIn);
-
-  // Now loop to process each line of zip code data in CSV format
-  while ((chars_read = readln_fed (&inbuf, &sz_inbuf, fdIn)) != EOF) {
-    if (chars_read == 0) {  // not EOF, but nothing to process
-      continue;
+  while (status == 0) {
+    {
+      PhaseTimer timer(PHASE_READ);
+      sz_block = reader.next(&block);
+    }
+    if (sz_block <= 0) {
+      break;
+    }
+    stats.count(COUNT_BYTES_IN, sz_block);
+    if (header) {
+      // Just skip the first line of input, it's column names
+      const char *nl = (const char *) memchr(block, '\n', sz_block);
+      long skip = (nl != NULL) ? nl + 1 - block : sz_block;
+      block += skip;
+      sz_block -= skip;
+      header = false;
     }
 
-    // write the buffer to stdout for debugging
-#ifdef DEBUG
-    printf("inbuf: %s\n", inbuf);
-#endif
-    
-    // for each input line we create a new object instance of Zipfed, have the object
-    // parse the input record and initialize itself with the parse result
-    // Nonzero return indicates error parsing
-    Zipfed *pZipfed = new Zipfed();
-    if(pZipfed->parse_zip_federal(inbuf) != 0) {
-      fprintf (stderr, "failed to process input record - exiting\n");
-      fclose (fdIn);
-      fclose(fdOut);
-      return -4;
-    }
-    
-    // write the structure to stdout to verify processing during development
-    /* printf ("DEBUG: "); */
-    /* pZipfed->print(); */
-
-    // Add the zip code record into the linked list
-    llist.push_front(pZipfed);
-  }
-
-  // Now iterate through the list to make sure it's all there
-  // zipprint will print the struct to output stream
-  if(argc == 2){
-  	for(std::forward_list<Zipfed *>::iterator it = llist.begin(); it != llist.end(); it++) {
-    		Zipfed * pTmpZipfed = *it;
-   		pTmpZipfed->print();
- 	 }
-  }
-
-  if(argc == 3){
-  	for(std::forward_list<Zipfed *>::iterator it = llist.begin(); it != llist.end(); it++) {
-    		Zipfed * pTmpZipfed = *it;
-   		pTmpZipfed->print(fdOut);
- 	 }
-  }
-  /* Free memory before exiting
-   * keep deleting the head until list is empty.
-   * this code is responsible for freeing the zip code data struct
-   * the linked list will free the node form the linked list
-   */
-  while (!llist.empty()) {
-    llist.pop_front();
+    if (threads > 0) {
+      // the writes happen inside, so count only the rest as converting
+      uint64_t t0 = stats.on ? stats_clock() : 0;
+      uint64_t w0 = stats.time(PHASE_WRITE);
+      status = convert_parallel(block, sz_block, output, threads, ordered, convert);
+      if (stats.on) {
+        stats.add_time(PHASE_CONVERT, stats_clock() - t0 - (stats.time(PHASE_WRITE) - w0));
+      }
+    } else {
+      chunk.begin = block;
+      chunk.size = sz_block;
+      {
+        PhaseTimer timer(PHASE_CONVERT);
+        convert_chunk(chunk, convert);
+      }
+      status = chunk.status;
+      if (status == 0) {
+        status = write_chunk(chunk.out, output);
+      }
+    }
+  }
+  if (sz_block < 0) {
+    fprintf (stderr, "cannot read %s - exiting\n", infile);
+    status = -2;
+  } else if (status == -4) {
+    fprintf (stderr, "failed to process input record - exiting\n");
   }
-  
-    
-  return 0;
-}	
-  
-  
-  
 
-  
+  if (fdIn != STDIN_FILENO) {
+    close(fdIn);
+  }
+  if (fdOut >= 0) {
+    int rc = async_out.close();
+    if (((close(fdOut) != 0) || (rc != 0)) && (status == 0)) {
+      fprintf (stderr, "cannot write %s - exiting\n", outfile);
+      status = -3;
+    }
+  }
+  for (size_t i = 0; i < output.files.size(); i++) {
+    if ((output.files[i] != NULL) && (fclose(output.files[i]) != 0) && (status == 0)) {
+      fprintf (stderr, "cannot write %s - exiting\n", outfile);
+      status = -3;
+    }
+  }
+  if ((status == 0) && (snapfile != NULL) && (write_snapshot(outfile, snapfile, (threads > 0) ? threads : 1) != 0)) {
+    fprintf (stderr, "cannot write snapshot %s - exiting\n", snapfile);
+    status = -5;
+  }
+  if (stats.on) {
+    stats.print(stderr);
+  }
+  return status;
+}
@@ -0,0 +1,30 @@
+/** Great-circle distances, one at a time or in bulk
+ *
+ * @author Krishna Garg
+ */
+
+#ifndef GEODIST_HPP
+#define GEODIST_HPP
+
+#include <stddef.h>
+
+// mean radius of the earth used for all distances
+#define EARTH_RADIUS_KM (6371.0088)
+
+/** @brief Kernel used by haversine_batch
+ */
+typedef enum {
+  GEO_AUTO,                 /**< fastest one the running CPU supports */
+  GEO_SCALAR,               /**< haversine_km per point, the reference */
+  GEO_POLY,                 /**< float polynomials, one point at a time */
+  GEO_AVX2                  /**< float polynomials, 8 points at a time with FMA */
+} GEO_KERNEL;
+
+double haversine_km(double lat1, double lon1, double lat2, double lon2);
+
+GEO_KERNEL geo_kernel_best(void);
+const char *geo_kernel_name(GEO_KERNEL kernel);
+void haversine_batch(double lat, double lon, const float *lats, const float *lons, size_t n,
+                     float *km, GEO_KERNEL kernel = GEO_AUTO);
+
+#endif // GEODIST_HPP
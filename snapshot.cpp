@@ -0,0 +1,352 @@
+/** Functions supporting binary snapshots of the zip code table
+ *
+ * File layout (native byte order):
+ *   SnapshotHeader
+ *   sections, each starting on a SNAP_ALIGN boundary, in SECTION order
+ * The checksum in the header covers every byte after the header.
+ *
+ * @author Krishna Garg
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include "snapshot.hpp"
+
+// every section starts on a cache line
+#define SNAP_ALIGN (64)
+
+static const char SNAP_MAGIC[8] = {'Z', 'I', 'P', 'S', 'N', 'A', 'P', '\0'};
+
+/** @brief Sections of a snapshot, in file order */
+typedef enum {
+  SEC_ZIPS,                 /**< ZipTable zips */
+  SEC_DIGITS,               /**< ZipTable digits */
+  SEC_STATES,               /**< ZipTable states */
+  SEC_TYPES,                /**< ZipTable types */
+  SEC_LATS,                 /**< ZipTable lats */
+  SEC_LONS,                 /**< ZipTable lons */
+  SEC_CITIES,               /**< ZipTable cities */
+  SEC_POOL,                 /**< ZipTable pool */
+  SEC_SLOTS,                /**< CityIndex slots */
+  SEC_HASHES,               /**< CityIndex hashes */
+  SEC_ENTRIES,              /**< CityIndex entries */
+  SEC_KEYS,                 /**< CityIndex keys */
+  SEC_RUNS,                 /**< CityIndex zips */
+  SEC_RUN_DIGITS,           /**< CityIndex digits */
+  SEC_COUNT                 /**< number of sections */
+} SECTION;
+
+/** @brief Fixed size header at the start of a snapshot file */
+struct SnapshotHeader {
+  char magic[8];            /**< SNAP_MAGIC */
+  uint32_t version;         /**< SNAPSHOT_VERSION */
+  uint32_t sections;        /**< SEC_COUNT */
+  uint64_t file_size;       /**< size of the whole file */
+  uint64_t checksum;        /**< Checksum of everything after the header */
+  uint64_t source_size;     /**< size of the CSV file the data came from */
+  int64_t source_mtime;     /**< its modification time in nanoseconds */
+  uint64_t records;         /**< number of records in the table */
+  uint64_t cities;          /**< number of distinct names in the pool */
+  uint32_t index_mask;      /**< CityIndex mask */
+  uint32_t reserved;        /**< zero */
+  char states[256][2];      /**< name of every state code used */
+  uint64_t offset[SEC_COUNT]; /**< file offset of each section */
+  uint64_t size[SEC_COUNT]; /**< size of each section in bytes */
+};
+
+/** Default ctor for Checksum. Starts with no bytes.
+ */
+Checksum::Checksum () {
+  h = 0x243f6a8885a308d3ULL;
+  carry = 0;
+  have = 0;
+  total = 0;
+}
+
+/** Mix one 8 byte word into a hash
+ *
+ * @param h is the hash so far
+ * @param w is the word
+ * @return the new hash
+ */
+static inline uint64_t mix (uint64_t h, uint64_t w) {
+  h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+  return h ^ (h >> 29);
+}
+
+/** Add bytes to the checksum
+ *
+ * @param data is the first byte to add
+ * @param size is the number of bytes to add
+ */
+void Checksum::add (const void *data, size_t size) {
+  const unsigned char *p = (const unsigned char *) data;
+  total += size;
+
+  // finish a word left incomplete by the last call
+  while ((have > 0) && (size > 0)) {
+    carry |= (uint64_t) *p++ << (8 * have);
+    size--;
+    if (++have == 8) {
+      h = mix(h, carry);
+      carry = 0;
+      have = 0;
+    }
+  }
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    h = mix(h, w);
+  }
+  for (; size > 0; size--) {
+    carry |= (uint64_t) *p++ << (8 * have++);
+  }
+}
+
+/** The checksum of the bytes added so far
+ *
+ * @return the 64 bit checksum
+ */
+uint64_t Checksum::value (void) const {
+  uint64_t v = h;
+  if (have > 0) {
+    v = mix(v, carry);
+  }
+  return mix(v, total);
+}
+
+/** Size and modification time of a file
+ *
+ * @param path is the file to look at, NULL for none
+ * @param size is set to the size of the file (0 if there is none)
+ * @param mtime is set to its modification time in ns (0 if there is none)
+ * @return zero (0) if success or non-zero if the file cannot be found
+ */
+static int source_identity (const char *path, uint64_t *size, int64_t *mtime) {
+  struct stat st;
+  *size = 0;
+  *mtime = 0;
+  if (path == NULL) {
+    return 0;
+  }
+  if (stat(path, &st) != 0) {
+    return -1;
+  }
+  *size = st.st_size;
+  *mtime = (int64_t) st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  return 0;
+}
+
+/** Write a sorted table and its city index to a snapshot file
+ *
+ * The file is written under a temporary name and renamed into place, so a
+ * reader never sees a partly written snapshot.
+ *
+ * @param path is the snapshot file to create
+ * @param table is the table, sorted by city
+ * @param index is the city index built from table
+ * @param source is the CSV file the table was loaded from, or NULL
+ * @return zero (0) if success or non-zero on error.
+ */
+int Snapshot::write (const char *path, const ZipTable &table, const CityIndex &index, const char *source) {
+  SnapshotHeader header;
+  const void *data[SEC_COUNT];
+  std::string tmp = std::string(path) + ".tmp";
+  static const char zeros[SNAP_ALIGN] = {0};
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAP_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.sections = SEC_COUNT;
+  header.records = table.size();
+  header.cities = table.distinct;
+  header.index_mask = index.mask;
+  if (source_identity(source, &header.source_size, &header.source_mtime) != 0) {
+    return -1;
+  }
+  for (int code = 1; code < 256; code++) {
+    std::string_view name = state_name(code);
+    memcpy(header.states[code], name.data(), name.size());
+  }
+
+  data[SEC_ZIPS] = table.zips.data();
+  header.size[SEC_ZIPS] = table.zips.size() * sizeof(uint32_t);
+  data[SEC_DIGITS] = table.digits.data();
+  header.size[SEC_DIGITS] = table.digits.size();
+  data[SEC_STATES] = table.states.data();
+  header.size[SEC_STATES] = table.states.size();
+  data[SEC_TYPES] = table.types.data();
+  header.size[SEC_TYPES] = table.types.size();
+  data[SEC_LATS] = table.lats.data();
+  header.size[SEC_LATS] = table.lats.size() * sizeof(float);
+  data[SEC_LONS] = table.lons.data();
+  header.size[SEC_LONS] = table.lons.size() * sizeof(float);
+  data[SEC_CITIES] = table.cities.data();
+  header.size[SEC_CITIES] = table.cities.size() * sizeof(uint32_t);
+  data[SEC_POOL] = table.pool.data();
+  header.size[SEC_POOL] = table.pool.size();
+  data[SEC_SLOTS] = index.slots.data();
+  header.size[SEC_SLOTS] = index.slots.size() * sizeof(uint32_t);
+  data[SEC_HASHES] = index.hashes.data();
+  header.size[SEC_HASHES] = index.hashes.size() * sizeof(uint32_t);
+  data[SEC_ENTRIES] = index.entries.data();
+  header.size[SEC_ENTRIES] = index.entries.size() * sizeof(CityIndex::Entry);
+  data[SEC_KEYS] = index.keys.data();
+  header.size[SEC_KEYS] = index.keys.size();
+  data[SEC_RUNS] = index.zips.data();
+  header.size[SEC_RUNS] = index.zips.size() * sizeof(uint32_t);
+  data[SEC_RUN_DIGITS] = index.digits.data();
+  header.size[SEC_RUN_DIGITS] = index.digits.size();
+
+  // lay the sections out and checksum them, padding included
+  Checksum sum;
+  uint64_t off = (sizeof(header) + SNAP_ALIGN - 1) / SNAP_ALIGN * SNAP_ALIGN;
+  sum.add(zeros, off - sizeof(header));
+  for (int s = 0; s < SEC_COUNT; s++) {
+    header.offset[s] = off;
+    sum.add(data[s], header.size[s]);
+    off += header.size[s];
+    uint64_t pad = (SNAP_ALIGN - off % SNAP_ALIGN) % SNAP_ALIGN;
+    sum.add(zeros, pad);
+    off += pad;
+  }
+  header.file_size = off;
+  header.checksum = sum.value();
+
+  FILE *out = fopen(tmp.c_str(), "wb");
+  if (out == NULL) {
+    return -1;
+  }
+  bool ok = (fwrite(&header, sizeof(header), 1, out) == 1);
+  off = sizeof(header);
+  for (int s = 0; ok && (s < SEC_COUNT); s++) {
+    ok = (fwrite(zeros, 1, header.offset[s] - off, out) == header.offset[s] - off);
+    ok = ok && (fwrite(data[s], 1, header.size[s], out) == header.size[s]);
+    off = header.offset[s] + header.size[s];
+  }
+  ok = ok && (fwrite(zeros, 1, header.file_size - off, out) == header.file_size - off);
+  ok = (fclose(out) == 0) && ok;
+  if (!ok || (rename(tmp.c_str(), path) != 0)) {
+    remove(tmp.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+/** Open a snapshot and attach a table and city index to it
+ *
+ * @param path is the snapshot file
+ * @param source is the CSV file the snapshot must have been made from, or
+ *   NULL to accept the snapshot whatever it was made from
+ * @param table is attached to the snapshot's columns
+ * @param index is attached to the snapshot's city index
+ * @return zero (0) if success, -1 if the snapshot cannot be read, -2 if it
+ *   is not a snapshot of this version, -3 if it is damaged and -4 if the
+ *   source file changed since it was written
+ */
+int Snapshot::open (const char *path, const char *source, ZipTable &table, CityIndex &index) {
+  SnapshotHeader header;
+  uint64_t size;
+  int64_t mtime;
+
+  if (file.open(path) != 0) {
+    return -1;
+  }
+  if (file.size() < sizeof(header)) {
+    file.close();
+    return -2;
+  }
+  memcpy(&header, file.data(), sizeof(header));
+  if ((memcmp(header.magic, SNAP_MAGIC, sizeof(header.magic)) != 0) ||
+      (header.version != SNAPSHOT_VERSION) || (header.sections != SEC_COUNT)) {
+    file.close();
+    return -2;
+  }
+  if (header.file_size != file.size()) {
+    file.close();
+    return -3;
+  }
+  for (int s = 0; s < SEC_COUNT; s++) {
+    if ((header.offset[s] % SNAP_ALIGN != 0) || (header.offset[s] > file.size()) ||
+        (header.size[s] > file.size() - header.offset[s])) {
+      file.close();
+      return -3;
+    }
+  }
+  if ((header.size[SEC_ZIPS] != header.records * sizeof(uint32_t)) ||
+      (header.size[SEC_DIGITS] != header.records) ||
+      (header.size[SEC_STATES] != header.records) ||
+      (header.size[SEC_TYPES] != header.records) ||
+      (header.size[SEC_LATS] != header.records * sizeof(float)) ||
+      (header.size[SEC_LONS] != header.records * sizeof(float)) ||
+      (header.size[SEC_CITIES] != header.records * sizeof(uint32_t)) ||
+      (header.size[SEC_SLOTS] != ((uint64_t) header.index_mask + 1) * sizeof(uint32_t)) ||
+      (header.size[SEC_HASHES] != header.size[SEC_SLOTS]) ||
+      (header.size[SEC_ENTRIES] % sizeof(CityIndex::Entry) != 0) ||
+      (header.size[SEC_RUN_DIGITS] * sizeof(uint32_t) != header.size[SEC_RUNS])) {
+    file.close();
+    return -3;
+  }
+
+  Checksum sum;
+  sum.add(file.data() + sizeof(header), file.size() - sizeof(header));
+  if (sum.value() != header.checksum) {
+    file.close();
+    return -3;
+  }
+
+  if (source != NULL) {
+    if ((source_identity(source, &size, &mtime) != 0) ||
+        (size != header.source_size) || (mtime != header.source_mtime)) {
+      file.close();
+      return -4;
+    }
+  }
+
+  const char *base = file.data();
+  size_t n = header.records;
+  table.zips.attach((const uint32_t *) (base + header.offset[SEC_ZIPS]), n);
+  table.digits.attach((const uint8_t *) (base + header.offset[SEC_DIGITS]), n);
+  table.types.attach((const uint8_t *) (base + header.offset[SEC_TYPES]), n);
+  table.lats.attach((const float *) (base + header.offset[SEC_LATS]), n);
+  table.lons.attach((const float *) (base + header.offset[SEC_LONS]), n);
+  table.cities.attach((const uint32_t *) (base + header.offset[SEC_CITIES]), n);
+  table.pool.attach(base + header.offset[SEC_POOL], header.size[SEC_POOL]);
+  table.slots.clear();
+  table.distinct = header.cities;
+
+  // state codes are handed out per process; they normally match the ones
+  // in the file, otherwise the state column is translated into a copy
+  const uint8_t *states = (const uint8_t *) (base + header.offset[SEC_STATES]);
+  uint8_t remap[256];
+  bool same = true;
+  remap[0] = 0;
+  for (int code = 1; code < 256; code++) {
+    size_t len = strnlen(header.states[code], 2);
+    remap[code] = (len == 0) ? 0 : state_intern(std::string_view(header.states[code], len));
+    same = same && ((len == 0) || (remap[code] == code));
+  }
+  if (same) {
+    table.states.attach(states, n);
+  } else {
+    std::vector<uint8_t> codes(n);
+    for (size_t i = 0; i < n; i++) {
+      codes[i] = remap[states[i]];
+    }
+    table.states.assign(std::move(codes));
+  }
+
+  index.slots.attach((const uint32_t *) (base + header.offset[SEC_SLOTS]), header.index_mask + 1);
+  index.hashes.attach((const uint32_t *) (base + header.offset[SEC_HASHES]), header.index_mask + 1);
+  index.entries.attach((const CityIndex::Entry *) (base + header.offset[SEC_ENTRIES]),
+                       header.size[SEC_ENTRIES] / sizeof(CityIndex::Entry));
+  index.keys.attach(base + header.offset[SEC_KEYS], header.size[SEC_KEYS]);
+  index.zips.attach((const uint32_t *) (base + header.offset[SEC_RUNS]),
+                    header.size[SEC_RUNS] / sizeof(uint32_t));
+  index.digits.attach((const uint8_t *) (base + header.offset[SEC_RUN_DIGITS]), header.size[SEC_RUN_DIGITS]);
+  index.mask = header.index_mask;
+  return 0;
+}
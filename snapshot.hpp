@@ -0,0 +1,55 @@
+/** Binary snapshots of a sorted zip code table and its city index
+ *
+ * @author Krishna Garg
+ */
+
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include "csvscan.hpp"
+#include "ziptable.hpp"
+#include "zipindex.hpp"
+
+// bumped whenever the layout of the file changes
+#define SNAPSHOT_VERSION (2)
+
+/** @brief Running checksum of a byte stream
+ *
+ * A 64 bit multiply / xor-shift hash over 8 byte words. Bytes can be added
+ * in pieces of any size; the result only depends on the bytes, not on how
+ * they were split.
+ */
+class Checksum {
+private:
+  uint64_t h;                       /**< hash of the whole words so far */
+  uint64_t carry;                   /**< bytes of an incomplete word */
+  unsigned have;                    /**< number of bytes in carry */
+  uint64_t total;                   /**< number of bytes added */
+public:
+  Checksum();
+  void add(const void *data, size_t size);
+  uint64_t value(void) const;
+};
+
+/** @brief A snapshot file opened for reading
+ *
+ * A snapshot holds the columns of a ZipTable already sorted by city, its
+ * string pool and a prebuilt CityIndex, each section aligned so it can be
+ * used in place. Opening one maps the file, checks its version, size and
+ * checksum and that the CSV file it was made from has not changed since,
+ * then attaches a table and an index to the mapped sections. Nothing is
+ * parsed, sorted or copied.
+ *
+ * The Snapshot must stay alive while the attached table and index are used.
+ */
+class Snapshot {
+private:
+  MappedFile file;                  /**< the mapped snapshot */
+public:
+  int open(const char *path, const char *source, ZipTable &table, CityIndex &index);
+  static int write(const char *path, const ZipTable &table, const CityIndex &index, const char *source);
+};
+
+#endif // SNAPSHOT_HPP
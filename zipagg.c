@@ -0,0 +1,345 @@
+/** Program to summarise zip code records: counts, distinct cities and zip
+ * codes, centroids and bounding boxes per state, type, city or zip3, in
+ * one multithreaded pass over the input.
+ *
+ * @author Krishna Garg
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include "zipfed.hpp"
+#include "zipschema.hpp"
+#include "csvscan.hpp"
+#include "blockpipe.hpp"
+#include "zipfilter.hpp"
+#include "zipgroup.hpp"
+#include "zipstats.hpp"
+
+// bytes of input handed to a worker at a time
+#define BLOCK_SIZE (1 << 20)
+// blocks per worker thread, so reading overlaps the aggregation
+#define BLOCKS_PER_THREAD (3)
+// most columns of a record looked at, also for files with a header (-H)
+#define MAX_FIELDS (32)
+// groupings computed when none is given
+#define DEFAULT_KEYS "state"
+// aggregates computed when none is given
+#define DEFAULT_AGGS "count"
+
+/** @brief How records are aggregated, shared by every worker thread
+ */
+struct Aggregate {
+  std::vector<Grouping> groupings;  /**< the group-bys, all computed in the one pass */
+  const ZipFilter *filter;          /**< records that are aggregated */
+  bool cs2303;                      /**< the input is in cs2303 format, else federal */
+  ColumnMap columns;                /**< where the columns are, with -H */
+  bool mapped;                      /**< the columns were found from the header (-H) */
+};
+
+/** Parse, filter and aggregate every record of a block into a worker's
+ *  own tables; federal header lines, as cat a.csv b.csv leaves in the
+ *  input, are skipped
+ *
+ * @param in is the block of complete lines
+ * @param agg is how records are aggregated
+ * @param tables are the worker's tables, one per grouping
+ * @return zero (0) if success or -4 if a record failed to parse
+ */
+static int aggregate_block (const std::string &in, const Aggregate &agg, std::vector<GroupTable> &tables) {
+  std::string_view fields[MAX_FIELDS];
+  int nfields;
+  Zipfed zip;
+  uint64_t rows = 0;
+  uint64_t dropped = 0;
+  int status = 0;
+
+  CsvIndexScanner scanner(in.data(), in.size());
+  while ((nfields = scanner.next(fields, MAX_FIELDS)) != EOF) {
+    int parsed;
+    if (agg.mapped) {
+      parsed = zip.parse_fields(agg.columns, fields, nfields);
+    } else if (agg.cs2303) {
+      parsed = zip.parse_fields<Cs2303Schema>(fields, nfields);
+    } else {
+      parsed = zip.parse_fields<FederalSchema>(fields, nfields);
+    }
+    if (parsed == -3) {
+      continue;                // the header of a file concatenated onto the input
+    }
+    rows++;
+    if (parsed != 0) {
+      status = -4;
+      break;
+    }
+    if (!agg.filter->match(zip)) {
+      dropped++;
+      continue;
+    }
+    for (size_t t = 0; t < tables.size(); t++) {
+      tables[t].add(zip);
+    }
+  }
+  stats.count(COUNT_ROWS_READ, rows);
+  stats.count(COUNT_ROWS_PARSED, rows - (status != 0));
+  stats.count(COUNT_ROWS_FILTERED, dropped);
+  return status;
+}
+
+/** Worker thread: aggregate blocks until the input ends
+ *
+ * @param pipe is the pipeline; blocks are free again once aggregated, the
+ *   order they finish in does not matter since every group is merged in
+ *   the end
+ * @param agg is how records are aggregated
+ * @param tables are the worker's own tables, one per grouping
+ * @param convert receives the time spent aggregating
+ */
+static void aggregate_worker (BlockPipe &pipe, const Aggregate &agg, std::vector<GroupTable> &tables,
+                              PhaseTotal &convert) {
+  Block *b;
+  while ((b = pipe.take()) != NULL) {
+    int status;
+    {
+      PhaseTimer timer(convert);
+      status = aggregate_block(b->in, agg, tables);
+    }
+    pipe.finish(b, status);
+  }
+}
+
+/** main function to drive program
+ *
+ * usage:
+ *    zipagg [-j threads] [-c | -H] [-k keys]... [-a aggregates] [-f filter] [-g] [--json] [--stats[=json]] input_file output_file
+ *
+ * input_file is the federal zip code file (or a cs2303 file with -c, see
+ * fed2cs2303, or with -H any CSV file whose header line names its zip,
+ * city and state columns, and maybe type, lat and lon; see ColumnMap). Its records are grouped by the keys given with -k, a comma
+ * separated list of state, type, city and zip3 (the first 3 digits of the
+ * zip code), or "total" for one group of every record; default "state".
+ * -k may be given several times, and every grouping is computed in the
+ * same pass over the input. For each group the aggregates given with -a
+ * are written, a comma separated list of
+ *    count     the number of records
+ *    cities    the number of distinct city names
+ *    zips      the number of distinct zip codes
+ *    centroid  the mean lat and lon
+ *    bbox      the smallest and largest lat and lon
+ *    all       all of the above
+ * default "count". Only records that pass the filter given with -f (see
+ * ZipFilter, default every record) are aggregated. For example
+ *    zipagg -k state -k state,type -k state,city -a count,cities,centroid,bbox national.csv summary.csv
+ *
+ * The output is CSV: for each grouping a header line and then a line per
+ * group, ordered by its keys, with a blank line between groupings. With
+ * --json it is one JSON object holding an array of groups per grouping.
+ * Either file name may be "-" for stdin / stdout.
+ *
+ * Approach:
+ * 1) Read the input in blocks of complete lines on this thread
+ * 2) Worker threads (-j, default 1) parse and filter the records of each
+ *    block and add them to tables of their own, a hash table of groups
+ *    per grouping (see GroupTable), so adding a record takes no lock
+ * 3) Once the input ends, merge the tables of every worker into the first
+ *    worker's and write the groups in key order
+ *
+ * Memory use is BLOCKS_PER_THREAD blocks per worker plus the groups,
+ * whatever the size of the input.
+ *
+ * With -g lat/lon are written as the shortest text that reads back as the
+ * same float. With --stats the time spent reading, aggregating (convert,
+ * summed over the workers) and writing, the rows and the bytes are printed
+ * on stderr at the end.
+ *
+ * @param argc is the number of input strings
+ * @param argv is array of cmd line args -
+ *        zipagg [-j threads] [-c | -H] [-k keys]... [-a aggregates] [-f filter] [-g] [--json] [--stats[=json]] input_file output_file
+ * @return 0 for success. non-zero for error
+ */
+int main (int argc, char *argv[]) {
+  std::vector<const char *> keys;   // the -k lists
+  const char *aggs = DEFAULT_AGGS;
+  const char *expr = NULL;
+  FLOAT_FORMAT floats = FLOAT_FIXED;
+  bool json = false;
+  int threads = 1;
+  ZipFilter filter;
+  Aggregate agg;
+  std::string error;
+  int opt;
+  static const struct option longopts[] = {
+    {"stats", optional_argument, NULL, 'T'},
+    {"json", no_argument, NULL, 'J'},
+    {NULL, 0, NULL, 0}
+  };
+
+  agg.cs2303 = false;
+  agg.mapped = false;
+  agg.filter = &filter;
+  while ((opt = getopt_long(argc, argv, "j:cHk:a:f:g", longopts, NULL)) != -1) {
+    if ((opt == 'j') && (atoi(optarg) > 0)) {
+      threads = atoi(optarg);
+    } else if (opt == 'c') {
+      agg.cs2303 = true;
+    } else if (opt == 'H') {
+      agg.mapped = true;
+    } else if (opt == 'k') {
+      keys.push_back(optarg);
+    } else if (opt == 'a') {
+      aggs = optarg;
+    } else if (opt == 'f') {
+      expr = optarg;
+    } else if (opt == 'g') {
+      floats = FLOAT_SHORTEST;
+    } else if (opt == 'J') {
+      json = true;
+    } else if ((opt == 'T') && (stats.option(optarg) == 0)) {
+      continue;
+    } else {
+      break;
+    }
+  }
+  if ((argc - optind != 2) || (opt != -1) || (agg.cs2303 && agg.mapped)) {
+    fprintf(stderr, "usage: %s [-j threads] [-c | -H] [-k keys]... [-a aggregates] [-f filter] [-g] [--json] [--stats[=json]] input_file output_file\n", argv[0]);
+    return -1;
+  }
+  if (keys.empty()) {
+    keys.push_back(DEFAULT_KEYS);
+  }
+  agg.groupings.resize(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (parse_grouping(keys[i], aggs, agg.groupings[i], error) != 0) {
+      fprintf(stderr, "bad grouping: %s\n", error.c_str());
+      return -1;
+    }
+  }
+  if ((expr != NULL) && (filter.compile(expr) != 0)) {
+    fprintf(stderr, "bad filter: %s\n", filter.error().c_str());
+    return -1;
+  }
+  const char *infile = argv[optind];
+  const char *outfile = argv[optind + 1];
+
+  int fdIn = (strcmp(infile, "-") == 0) ? STDIN_FILENO : open(infile, O_RDONLY);
+  if (fdIn < 0) {
+    fprintf(stderr, "cannot open %s for input - exiting\n", infile);
+    return -2;
+  }
+  FILE *out = (strcmp(outfile, "-") == 0) ? stdout : fopen(outfile, "w");
+  if (out == NULL) {
+    fprintf(stderr, "cannot open %s for output - exiting\n", outfile);
+    close(fdIn);
+    return -3;
+  }
+
+  BlockPipe pipe(threads * BLOCKS_PER_THREAD, false);
+  std::vector<std::vector<GroupTable>> tables(threads);
+  for (int t = 0; t < threads; t++) {
+    for (size_t i = 0; i < agg.groupings.size(); i++) {
+      tables[t].push_back(GroupTable(agg.groupings[i]));
+    }
+  }
+  std::vector<PhaseTotal> converts(threads, PhaseTotal(PHASE_CONVERT));
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.push_back(std::thread(aggregate_worker, std::ref(pipe), std::cref(agg), std::ref(tables[t]),
+                                  std::ref(converts[t])));
+  }
+
+  LineBlockReader reader(fdIn, BLOCK_SIZE);
+  const char *block;
+  long sz_block;
+  {
+    PhaseTimer timer(PHASE_READ);
+    sz_block = reader.next(&block);
+  }
+  int status = 0;
+  if (!agg.cs2303 && (sz_block > 0)) {
+    // the federal file starts with column names, as -H files do
+    std::string_view first = take_line(&block, &sz_block);
+    stats.count(COUNT_BYTES_IN, first.size());
+    if (agg.mapped) {
+      // no worker looks at the map before the first block is handed over
+      std::string_view names[MAX_FIELDS];
+      CsvScanner scanner(first.data(), first.size());
+      int count = scanner.next(names, MAX_FIELDS);
+      if (agg.columns.build(names, (count == EOF) ? 0 : count, error) != 0) {
+        fprintf(stderr, "cannot use %s: %s - exiting\n", infile, error.c_str());
+        status = -4;
+      }
+    }
+  }
+  // read each block into the next free one, until the input ends
+  if ((status == 0) && (pipe.pump(reader, block, sz_block) != 0)) {
+    fprintf(stderr, "cannot read %s - exiting\n", infile);
+    status = -2;
+  }
+  pipe.close();
+  for (size_t t = 0; t < workers.size(); t++) {
+    workers[t].join();
+    converts[t].report();
+  }
+  if ((status == 0) && (pipe.error() != 0)) {
+    fprintf(stderr, "failed to process input record - exiting\n");
+    status = pipe.error();
+  }
+  if (fdIn != STDIN_FILENO) {
+    close(fdIn);
+  }
+
+  if (status == 0) {
+    std::string text;
+    {
+      PhaseTimer timer(PHASE_CONVERT);
+      for (int t = 1; t < threads; t++) {
+        for (size_t i = 0; i < agg.groupings.size(); i++) {
+          tables[0][i].merge(tables[t][i]);
+        }
+        std::vector<GroupTable>().swap(tables[t]);
+      }
+    }
+    PhaseTimer timer(PHASE_WRITE);
+    if (json) {
+      text += "{\n  \"groupings\": [";
+    }
+    for (size_t i = 0; i < agg.groupings.size(); i++) {
+      if (json) {
+        text += (i == 0) ? "\n    {\"keys\": [" : ",\n    {\"keys\": [";
+        for (size_t k = 0; k < agg.groupings[i].keys.size(); k++) {
+          text += (k == 0) ? "\"" : ", \"";
+          text += group_key_name(agg.groupings[i].keys[k]);
+          text += '"';
+        }
+        text += "], \"groups\": ";
+        tables[0][i].write_json(text, floats);
+        text += '}';
+      } else {
+        if (i > 0) {
+          text += '\n';
+        }
+        tables[0][i].write_csv(text, floats);
+      }
+    }
+    if (json) {
+      text += "\n  ]\n}\n";
+    }
+    fwrite(text.data(), 1, text.size(), out);
+    stats.count(COUNT_BYTES_OUT, text.size());
+  }
+  if ((fclose(out) != 0) && (status == 0)) {
+    fprintf(stderr, "cannot write %s - exiting\n", outfile);
+    status = -3;
+  }
+  if (stats.on) {
+    stats.print(stderr);
+  }
+  return status;
+}
@@ -8,198 +8,637 @@
 #include <iostream>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <algorithm>
 #include <string>
-#include <forward_list>
+#include <chrono>
+#include <vector>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
 #include "zipfed.hpp"
+#include "ziptable.hpp"
+#include "zipindex.hpp"
+#include "csvscan.hpp"
+#include "snapshot.hpp"
+#include "zipstats.hpp"
+#include "zipserver.hpp"
 
 // size of fully qualified path/file name with null terminator
 #define SZ_FILENAME (129)
-#define CITY_NAME (500)
-/** Function to read a line from the US FED and return pointer to the 
- * line of data represented as a C-String (i.e. NULL terminated string)
- *
- * @lineptr is a pointer to the dynamically allocated buffer to fill.
- *   If the pointer is NULL, a buffer will be allocated to hold the line.
- *   If the buffer is too small to holsd the line, realloc will be called
- *   to allocate a larger buffer. If the buffer is reallocated, n will
- *   be set to new size.
- * @n is a pointer to the size of the buffer pointer to be lineptr. If
- *   memory is reallocated for lineptr, the size of n will be incremented
- *   accordingly. The parameter n will always specify the size of buffer
- *   pointed at by lineptr.
- * @fptr is the FILE pointer to the open file to read.
- * @return number bytes (chars) read or -1 on error
- */
-ssize_t readln_cs2303 (char **lineptr, size_t *n, FILE *stream) {
-  ssize_t bytes_read = -1;  // -1 will signify error reading line
-  const int delim = '\n';   // each line terminated with \n
+// cities answered per name search unless -m says otherwise
+#define MAX_MATCHES (10)
+// quiet time after the input file changes before --watch reloads it
+#define WATCH_SETTLE_MS (200)
+// how often replaced datasets are checked again while workers may read them
+#define RECLAIM_MS (10)
 
-  // Verify the file is open
-  if (stream == NULL) {
-    return (ssize_t) -1;
+/** Load a cs2303 file into the table, sort it and build the city index
+* @infile is the cs2303 file to load
+* @table is filled with the records of the file, sorted by city
+* @index is built from the sorted table
+* @threads is the number of threads to sort with
+* @t0 is set to the time the index build started
+* @t1 is set to the time the index build finished
+* @returns 0 for success, -2 if the file cannot be opened, -4 if a record
+*   cannot be parsed
+*/
+static int load_table(const char *infile, ZipTable &table, CityIndex &index, int threads,
+                      std::chrono::steady_clock::time_point *t0,
+                      std::chrono::steady_clock::time_point *t1){
+  MappedFile fdIn;           // whole input file, mapped read-only
+  
+  /* Open input files - return error on failure
+   * input for reading
+   */
+  {
+    PhaseTimer timer(PHASE_LOAD);
+    if (fdIn.open(infile) != 0) {
+      fprintf(stderr, "cannot open %s for input - exiting\n", infile);
+      return -2;
+    }
+  
+    /* Now parse each line of the input file into the table. Each line of the
+     * input is a zip code record; every field is stored in its own column.
+     */
+    if (table.load_cs2303(fdIn.data(), fdIn.size()) != 0) {
+      fprintf (stderr, "failed to process input record - exiting\n");
+      return -4;
+    }
+    stats.count(COUNT_BYTES_IN, fdIn.size());
+    stats.count(COUNT_ROWS_READ, table.size());
+    stats.count(COUNT_ROWS_PARSED, table.size());
+    fdIn.close();
   }
+  
+  //sort the table by alphabetical order based on their city names
+  {
+    PhaseTimer timer(PHASE_SORT);
+    table.sort_by_city(threads);
+  }
+  
+  //build the city index once so each query is a single hash lookup
+  PhaseTimer timer(PHASE_INDEX);
+  *t0 = std::chrono::steady_clock::now();
+  index.build(table);
+  *t1 = std::chrono::steady_clock::now();
+  return 0;
+}
 
-  // Each line of the FED ZIP CSV file is terminated by \n\r, so we
-  // read up to and including the \r for the entire line
-  bytes_read = getdelim (lineptr, n, delim, stream);
-
-  // Remove the \n at the end of the line by replacing with NULL terminator
-  // Expect length of at least 2 for the \n\r at end of a line
-  for (int i = bytes_read - 1; i >= 0; i--) {
-    if ((*lineptr)[i] == '\n') {
-      (*lineptr)[i] = '\0';
+/** Map the table and city index from a snapshot, or load them from the
+* cs2303 file when there is no usable snapshot and write one for next time
+* @infile is the cs2303 file to load
+* @snapfile is the snapshot to start from, or NULL for none
+* @snapshot keeps the mapped snapshot alive
+* @table is filled with the records, sorted by city
+* @index is the city index of the table
+* @threads is the number of threads to sort with
+* @snapped is set to zero (0) if the snapshot was used
+* @t0 is set to the time the index build (or the snapshot load) started
+* @t1 is set to the time it finished
+* @returns 0 for success, or the error of load_table
+*/
+static int load_data(const char *infile, const char *snapfile, Snapshot &snapshot, ZipTable &table,
+                     CityIndex &index, int threads, int *snapped,
+                     std::chrono::steady_clock::time_point *t0,
+                     std::chrono::steady_clock::time_point *t1){
+  *snapped = -1;
+  if (snapfile != NULL) {
+    {
+      PhaseTimer timer(PHASE_LOAD);
+      *snapped = snapshot.open(snapfile, infile, table, index);
+    }
+    *t1 = std::chrono::steady_clock::now();
+    if (*snapped != 0) {
+      fprintf(stderr, "snapshot %s is %s - loading %s\n", snapfile,
+              (*snapped == -4) ? "out of date" : "missing or unusable", infile);
     }
   }
-  //should return a linked list of zipfed
-  return bytes_read;
+  if (*snapped == 0) {
+    return 0;
+  }
+  
+  int status = load_table(infile, table, index, threads, t0, t1);
+  if (status != 0) {
+    return status;
+  }
+  //save the work for the next run; a failure here only costs speed later
+  if (snapfile != NULL) {
+    PhaseTimer timer(PHASE_SNAPSHOT);
+    if (Snapshot::write(snapfile, table, index, infile) != 0) {
+      fprintf(stderr, "cannot write snapshot %s\n", snapfile);
+    }
+  }
+  return 0;
 }
 
 
-/** Comparator function to compare two city names of two parsed lines
-* @zip1 is a Zipfed pointer
-* @zip2 is a Zipfed pointer
-* @returns true if first inputs city name would come before the second inputs city name in an alphabetical list
+/** @brief What each query line asks for */
+typedef enum {
+  QUERY_CITY,               /**< the zips of a city */
+  QUERY_PREFIX,             /**< cities whose names start with the line */
+  QUERY_FUZZY,              /**< cities whose names are close to the line */
+  QUERY_POINT,              /**< zips near a point */
+  QUERY_ZIP                 /**< the records of a zip code */
+} QUERY_MODE;
+
+/** @brief The indexes queries are answered from and the settings of the
+*  query mode
+*/
+struct Lookup {
+  QUERY_MODE mode;            // what each query line asks for
+  const ZipTable *table;      // all records
+  const CityIndex *index;     // city -> zip codes
+  CityTrie trie;              // city names, only for -p and -f
+  GeoIndex geo;               // lat/lon -> zip codes, only for -n and -r
+  ZipIndex zips;              // zip code -> records, only for --by-zip
+  size_t nearest;             // zips wanted per point query with -n
+  double radius;              // km searched per point query with -r
+  size_t max;                 // cities wanted per name search
+  std::vector<GeoHit> hits;   // answers of one point query
+  std::vector<CityMatch> matches; // answers of one name search
+};
+
+/** Answer one query line in the lookup's mode
+* @lookup holds the indexes and the mode
+* @query is the query line
+* @out is the buffer the answer is appended to
+* @returns the number of zip codes, points or cities found
 */
-bool alphabet(Zipfed * zip1, Zipfed * zip2){
-  	std::string city1 = zip1->get_city();
-  	std::string city2 = zip2->get_city();
-  	return city1 < city2;
+static size_t answer(Lookup &lookup, const std::string &query, std::string &out){
+  	switch(lookup.mode){
+  	case QUERY_PREFIX:
+  	case QUERY_FUZZY:
+  		return find_cities(lookup.trie, *lookup.index, query, lookup.mode == QUERY_FUZZY,
+  		                   lookup.max, lookup.matches, out);
+  	case QUERY_POINT:
+  		return find_near(lookup.geo, *lookup.table, query, lookup.nearest, lookup.radius,
+  		                 lookup.hits, out);
+  	case QUERY_ZIP:
+  		return find_records(lookup.zips, query, out);
+  	default:
+  		return find_zips(*lookup.index, query, out);
+  	}
 }
 
+/** Answer one query, recording how long it took when statistics are on
+* @lookup holds the indexes and the query mode
+* @query is one line of input
+* @out is the buffer the answer is appended to
+*/
+static void timed_answer(Lookup &lookup, const std::string &query, std::string &out){
+  	if(!stats.on){
+  		answer(lookup, query, out);
+  		return;
+  	}
+  	uint64_t t0 = stats_clock();
+  	answer(lookup, query, out);
+  	stats.latency.record(stats_clock() - t0);
+  	stats.count(COUNT_QUERIES, 1);
+}
+
+
+/** Answer a batch of zip code queries at once, letting the index overlap
+* the cache misses of many lookups (ZipIndex::find_batch). When statistics
+* are on each query is looked up and timed on its own instead, as zipserver
+* times its requests, so stats.latency holds the latency of every lookup.
+* @zips is the zip index
+* @queries are the query lines, each a zip code
+* @out is the buffer the records are appended to, in query order
+*/
+static void answer_zips(const ZipIndex &zips, const std::vector<std::string> &queries, std::string &out){
+  	if(stats.on){
+  		for(size_t i = 0; i < queries.size(); i++){
+  			uint64_t t0 = stats_clock();
+  			find_records(zips, queries[i], out);
+  			stats.latency.record(stats_clock() - t0);
+  		}
+  		stats.count(COUNT_QUERIES, queries.size());
+  		return;
+  	}
+  	std::vector<uint32_t> codes(queries.size());
+  	std::vector<const ZipEntry *> found(queries.size());
+  	for(size_t i = 0; i < queries.size(); i++){
+  		//no record has this zip, so a line that is not a zip code finds nothing
+  		if(parse_zip_query(queries[i], &codes[i]) != 0){
+  			codes[i] = NO_RECORD;
+  		}
+  	}
+  	zips.find_batch(codes.data(), codes.size(), found.data());
+  	for(size_t i = 0; i < found.size(); i++){
+  		for(const ZipEntry *e = found[i]; e != NULL; e = zips.next(e)){
+  			zips.print(*e, out);
+  		}
+  	}
+  	stats.count(COUNT_QUERIES, queries.size());
+}
+
+
+/** Build a dataset to serve: the table and city index, and the name and
+* zip indexes over them
+* @infile is the cs2303 file to load
+* @snapfile is the snapshot to start from, or NULL for none
+* @threads is the number of threads to sort with
+* @status is set to 0 for success, or the error of load_table
+* @returns the dataset, or NULL if the input cannot be loaded
+*/
+static Dataset *build_dataset(const char *infile, const char *snapfile, int threads, int *status){
+  	Dataset *data = new Dataset;
+  	int snapped;
+  	std::chrono::steady_clock::time_point t0, t1;
+  	*status = load_data(infile, snapfile, data->snapshot, data->table, data->index, threads,
+  	                    &snapped, &t0, &t1);
+  	if(*status != 0){
+  		delete data;
+  		return NULL;
+  	}
+  	PhaseTimer timer(PHASE_INDEX);
+  	data->trie.build(data->index);
+  	data->zips.build(data->table);
+  	return data;
+}
+
+/** Read the waiting events of an inotify watch on a directory
+* @fd is the inotify descriptor
+* @name is the file of interest in the watched directory
+* @returns true if that file was written or moved into place
+*/
+static bool input_changed(int fd, const std::string &name){
+  	alignas(struct inotify_event) char buf[4096];
+  	bool changed = false;
+  	ssize_t got;
+  	while((got = read(fd, buf, sizeof(buf))) > 0){
+  		for(ssize_t at = 0; at < got; ){
+  			const struct inotify_event *ev = (const struct inotify_event *) &buf[at];
+  			if(ev->len > 0 && name == ev->name){
+  				changed = true;
+  			}
+  			at += sizeof(struct inotify_event) + ev->len;
+  		}
+  	}
+  	return changed;
+}
+
+/** Serve queries over a Unix domain socket until SIGINT or SIGTERM,
+* reloading the input on SIGHUP (and with watch, whenever it changes)
+* @sockpath is the path of the socket
+* @infile is the cs2303 file to load
+* @snapfile is the snapshot to start from, or NULL for none
+* @watch is true to reload the input whenever it is rewritten
+* @max is the number of cities answered per prefix query
+* @threads is the number of worker threads
+* @returns 0 for success, the error of load_table if the input cannot be
+*   loaded, -5 if the socket cannot be served
+*/
+static int serve(const char *sockpath, const char *infile, const char *snapfile, bool watch, size_t max,
+                 int threads){
+  	int status;
+  	Dataset *data = build_dataset(infile, snapfile, threads, &status);
+  	if(data == NULL){
+  		return status;
+  	}
+  	size_t records = data->table.size();
+  	ZipServer server(data, max, threads);
+  	
+  	//the workers inherit this mask, so only the signalfd below sees the signals
+  	sigset_t signals;
+  	sigemptyset(&signals);
+  	sigaddset(&signals, SIGINT);
+  	sigaddset(&signals, SIGTERM);
+  	sigaddset(&signals, SIGHUP);
+  	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  	int sig_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+  	
+  	if(sig_fd < 0 || server.open(sockpath) != 0 || server.start() != 0){
+  		fprintf(stderr, "cannot serve on %s: %s\n", sockpath, strerror(errno));
+  		return -5;
+  	}
+  	
+  	//watch the directory, since a file replaced by rename() is a new file
+  	int watch_fd = -1;
+  	std::string dir(infile);
+  	size_t slash = dir.rfind('/');
+  	std::string name = (slash == std::string::npos) ? dir : dir.substr(slash + 1);
+  	dir = (slash == std::string::npos) ? "." : dir.substr(0, slash + 1);
+  	if(watch){
+  		watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  		if(watch_fd < 0 || inotify_add_watch(watch_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0){
+  			fprintf(stderr, "cannot watch %s: %s\n", infile, strerror(errno));
+  			close(sig_fd);
+  			return -5;
+  		}
+  	}
+  	fprintf(stderr, "serving %zu records on %s with %d workers\n", records, sockpath, threads);
+  	
+  	uint64_t changed = 0;       //stats_clock() of the last change not reloaded yet, 0 if none
+  	size_t retired = 0;         //replaced datasets workers may still be reading
+  	bool running = true;
+  	while(running){
+  		struct pollfd fds[2] = {{sig_fd, POLLIN, 0}, {watch_fd, POLLIN, 0}};
+  		int timeout = (retired > 0) ? RECLAIM_MS : (changed != 0) ? WATCH_SETTLE_MS : -1;
+  		if(poll(fds, (watch_fd >= 0) ? 2 : 1, timeout) < 0 && errno != EINTR){
+  			perror("poll");
+  			break;
+  		}
+  		bool reload = false;
+  		struct signalfd_siginfo si;
+  		if((fds[0].revents & POLLIN) && read(sig_fd, &si, sizeof(si)) == sizeof(si)){
+  			reload = (si.ssi_signo == SIGHUP);
+  			running = reload;
+  		}
+  		//a file being written closes (or is renamed) more than once; wait for quiet
+  		if(watch_fd >= 0 && (fds[1].revents & POLLIN) && input_changed(watch_fd, name)){
+  			changed = stats_clock();
+  		}
+  		if(changed != 0 && stats_clock() - changed >= WATCH_SETTLE_MS * 1000000ull){
+  			reload = true;
+  		}
+  		
+  		//the workers keep answering from the old dataset while the new one is built
+  		if(reload && running){
+  			changed = 0;
+  			uint64_t r0 = stats_clock();
+  			Dataset *next = build_dataset(infile, snapfile, threads, &status);
+  			if(next == NULL){
+  				fprintf(stderr, "cannot reload %s - still serving the old data\n", infile);
+  			} else {
+  				records = next->table.size();
+  				server.publish(next);
+  				stats.count(COUNT_RELOADS, 1);
+  				fprintf(stderr, "reloaded %zu records from %s in %.1f ms\n", records, infile,
+  				        (stats_clock() - r0) / 1e6);
+  			}
+  		}
+  		retired = server.reclaim();
+  	}
+  	server.stop();
+  	close(sig_fd);
+  	if(watch_fd >= 0){
+  		close(watch_fd);
+  	}
+  	if(stats.on){
+  		stats.print(stderr);
+  	}
+  	return 0;
+}
 
 
 /** main function to drive program. Input and output file names specified
  * on command line.
  *
  * usage:
- *    fed2cs2301 input_file output_file
+ *    zipcode [-b] [-j threads] [-s snapshot_file] [-n count | -r km | -p | -f | --by-zip] [-m count]
+ *            [--stats[=json]] [--serve=socket_path [--watch]] input_file
  *
- * The input file must already exist. Output file will be created.
+ * The input file must already exist.
  *
  * Approach:
- * 1) Open both input and output files, or fail with error
- * 2) Read a line from input. This is a record of federal zip code data
- *    Note: the first line of the file is header info, not data, ignore it
- * 3) Parse the input line to populate a ZIP_FEDERAL structure
- * 4) Write the ZIP_FEDERAL structure to output file 1 record / line
- *    Note: no column header information will be written out, just  data fields
- * 5) Close output and input files and exit cleanly
+ * 1) Open the input file, or fail with error
+ * 2) Read a line from input. This is a record of cs2303 zip code data
+ * 3) Parse the input line to populate a Zipfed object and add it to the
+ *    column store (ZipTable)
+ * 4) Sort the table by city and build the city index from it
+ * 5) Answer city queries from stdin, one city per line, in any case
+ *
+ * The table is sorted with a counting sort on city rank (see
+ * ZipTable::sort_by_city); -j spreads it over that many threads.
+ *
+ * With -b (batch mode) there is no prompt: all queries are read from stdin,
+ * the answers are written with a single buffered flush at the end, and the
+ * index build time and the query latency are reported on stderr.
  *
- * @param argc is the number of input strings - will be 2
+ * With --stats the time spent loading, sorting, indexing, writing the
+ * snapshot and answering queries, the rows and bytes read, the bytes
+ * written, the heap allocations and a histogram of the latency of each
+ * query (mean and percentiles) are printed on stderr at the end, as text
+ * or with --stats=json as JSON.
+ *
+ * With -s the table and index are mapped from a snapshot file written by
+ * fed2cs2303 -S (or by an earlier run of zipcode -s) instead of steps 1-4.
+ * If the snapshot is missing, damaged, of another version or older than the
+ * input file, the input file is loaded as usual and the snapshot rewritten.
+ *
+ * With -n or -r each query is a point "lat,lon" instead of a city, and a
+ * spatial index (GeoIndex) is built over the table: -n answers the count
+ * nearest zip codes, -r every zip code within km, each as "zip,km" nearest
+ * first.
+ *
+ * With -p or -f a name index (CityTrie) is built over the city names: -p
+ * completes each query as a prefix, -f finds the names within
+ * TRIE_MAX_EDITS edits of it. Up to -m cities (default MAX_MATCHES) are
+ * answered, one "CITY,zip,zip..." line each.
+ *
+ * With --by-zip each query is a zip code and the answer is its records,
+ * one cs2303 line each, from a direct-indexed ZipIndex. With -b as well
+ * the whole batch is looked up with ZipIndex::find_batch.
+ *
+ * With --serve the table and indexes are built once and queries are
+ * answered over a Unix domain socket at socket_path instead of stdin, by
+ * -j worker threads, until the program gets SIGINT or SIGTERM. Each
+ * request asks for the zips of a city, the records of a zip code or the
+ * cities starting with a prefix (up to -m of them); see zipserver.hpp for
+ * the wire format and zipload for a client.
+ *
+ * A server reloads its data without stopping: on SIGHUP, and with --watch
+ * whenever input_file is rewritten (WATCH_SETTLE_MS after the last change),
+ * the input (or the snapshot, with -s) is loaded and indexed again while
+ * the workers keep answering from the old data, then swapped in at once.
+ * The old data is freed when the last request using it is answered. If
+ * the new input cannot be loaded, the old data stays.
+ *
+ * @param argc is the number of input strings - will be 2 or 3
  * @param argv is array of cmd line args -
  *        fed2cs2301 existing_input_file output_file_to_create
  * @return 0 for success. non-zero for error
  */
 int main (int argc, char *argv[]) {
   char infile[SZ_FILENAME];  // Path/name of input file
-  FILE *fdIn;
-  
-  ssize_t chars_read;        // number of chars read for line of input
-  char *inbuf = NULL;        // input file has 1 record per line to buffer
-  size_t sz_inbuf = 0;       // current size of the input record
-  
+  const char *snapfile = NULL; // snapshot to start from, if any
+  Snapshot snapshot;         // keeps the mapped snapshot alive
+  int snapped = -1;          // zero once loaded from the snapshot
 
-  std::forward_list<Zipfed *> llist; // singly linked list of pointers to Zipfed instances
+  bool batch = false;         // answer all queries with one flush
+  int threads = 1;            // threads to sort the table with
+  int modes = 0;              // number of query modes asked for
+  const char *sockpath = NULL; // socket to serve queries on, if any
+  bool watch = false;         // reload the input whenever it changes
+  int opt;
+  static const struct option longopts[] = {
+    {"stats", optional_argument, NULL, 'T'},
+    {"serve", required_argument, NULL, 'U'},
+    {"by-zip", no_argument, NULL, 'Z'},
+    {"watch", no_argument, NULL, 'W'},
+    {NULL, 0, NULL, 0}
+  };
+
+  ZipTable table;             // all records, one column per field
+  CityIndex index;            // city -> zip codes, built after sorting
+  Lookup lookup;              // answers queries from the table and indexes
+  lookup.mode = QUERY_CITY;
+  lookup.table = &table;
+  lookup.index = &index;
+  lookup.nearest = 0;
+  lookup.radius = -1;
+  lookup.max = MAX_MATCHES;
   
   /* Open input file specified on command line
    * Common sense error checking on cmd line parameters
   */
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s input_file\n", argv[0]);
+  while ((opt = getopt_long(argc, argv, "bj:s:n:r:pfm:", longopts, NULL)) != -1) {
+    if (opt == 'b') {
+      batch = true;
+    } else if ((opt == 'j') && (atoi(optarg) > 0)) {
+      threads = atoi(optarg);
+    } else if (opt == 's') {
+      snapfile = optarg;
+    } else if ((opt == 'n') && (atol(optarg) > 0)) {
+      lookup.mode = QUERY_POINT;
+      lookup.nearest = atol(optarg);
+      modes++;
+    } else if ((opt == 'r') && (atof(optarg) >= 0)) {
+      lookup.mode = QUERY_POINT;
+      lookup.radius = atof(optarg);
+      modes++;
+    } else if (opt == 'p') {
+      lookup.mode = QUERY_PREFIX;
+      modes++;
+    } else if (opt == 'f') {
+      lookup.mode = QUERY_FUZZY;
+      modes++;
+    } else if ((opt == 'm') && (atol(optarg) > 0)) {
+      lookup.max = atol(optarg);
+    } else if ((opt == 'T') && (stats.option(optarg) == 0)) {
+      continue;               // --stats or --stats=json
+    } else if (opt == 'U') {
+      sockpath = optarg;
+    } else if (opt == 'Z') {
+      lookup.mode = QUERY_ZIP;
+      modes++;
+    } else if (opt == 'W') {
+      watch = true;
+    } else {
+      break;                  // bad option or value, opt is not -1
+    }
+  }
+  if ((argc - optind != 1) || (modes > 1) || (opt != -1) || (watch && (sockpath == NULL))) {
+    fprintf(stderr, "usage: %s [-b] [-j threads] [-s snapshot_file] [-n count | -r km | -p | -f] [-m count] [--by-zip] [--stats[=json]] [--serve=socket_path [--watch]] input_file\n", argv[0]);
     return -1;
   }
   
-  strncpy(infile, argv[1], SZ_FILENAME-1);
+  strncpy(infile, argv[optind], SZ_FILENAME-1);
 
-  /* Open input files - return error on failure
-   * input for reading
-   */
-  
-  fdIn = fopen(infile, "r");
-  if (fdIn == NULL) {
-    fprintf(stderr, "cannot open %s for input - exiting\n", infile);
-    return -2;
+  if (sockpath != NULL) {
+    return serve(sockpath, infile, snapfile, watch, lookup.max, threads);
   }
   
-  /* Now a loop to read each line of the input file formatted and structured
-   * as downloaded from US Government. Then, each line is loaded into our
-   * zip code data structure before writing it out to the output file.
-   *
-   * Notes: 
-   *  - each line of the input is a zip code record.
-   *    the first line of the input is column hedaders, not data. skip it.
-   *  - each record will be written to ouput on its own line
-   *  - read until EOF on input or error either reading or writing
-   */
-  
-  //chars_read = readln_cs2303 (&inbuf, &sz_inbuf, fdIn);
-  // Now loop to process each line of zip code data in CSV format
-  while ((chars_read = readln_cs2303 (&inbuf, &sz_inbuf, fdIn)) != EOF) {
-    if (chars_read == 0) {  // not EOF, but nothing to process
-      continue;
-    }
-
-    // write the buffer to stdout for debugging
-    #ifdef DEBUG
-      printf("inbuf: %s\n", inbuf);
-    #endif
-    // for each input line we create a new object instance of Zipfed, have the object
-    // parse the input record and initialize itself with the parse result
-    // Nonzero return indicates error parsing
-    Zipfed *pZipfed = new Zipfed();
-    if(pZipfed->parse_zip_cs2303(inbuf) != 0) {
-      fprintf (stderr, "failed to process input record - exiting\n");
-      fclose (fdIn);
-      return -4;
-    }
-    
-    // write the structure to stdout to verify processing during development
-    /* printf ("DEBUG: "); */
-    /* pZipfed->print(); */
-
-    // Add the zip code record into the linked list
-    llist.push_front(pZipfed);
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point t1 = t0;
+  int status = load_data(infile, snapfile, snapshot, table, index, threads, &snapped, &t0, &t1);
+  if (status != 0) {
+    return status;
   }
   
-  //sort the list by alphabetical order based on their city names
-  llist.sort(alphabet);
-  
+  //point and name queries need their own index; city queries never pay for them
+  std::chrono::steady_clock::time_point g0 = std::chrono::steady_clock::now();
+  if (lookup.mode == QUERY_POINT) {
+    PhaseTimer timer(PHASE_INDEX);
+    lookup.geo.build(table);
+  } else if (lookup.mode == QUERY_ZIP) {
+    PhaseTimer timer(PHASE_INDEX);
+    lookup.zips.build(table);
+  } else if (lookup.mode != QUERY_CITY) {
+    PhaseTimer timer(PHASE_INDEX);
+    lookup.trie.build(index);
+  }
+  std::chrono::steady_clock::time_point g1 = std::chrono::steady_clock::now();
   
-  //find the zip code of specific cities
-  printf("Enter the names of the cities whose zip codes you want to find. Make sure your input is ALL CAPS...\n");
   std::string input;
+  std::string output;
   
-  while(getline(std::cin, input)){		//keep going until prompted to stop
-  	if(std::cin.eof()){			//if the input is ctrl-d or end of file
-  		break;				//exit the loop
+  if(batch){
+  	//read every query first, then write all of the answers in one flush
+  	std::vector<std::string> queries;
+  	while(getline(std::cin, input)){
+  		queries.push_back(input);
+  	}
+  	std::chrono::steady_clock::time_point q0 = std::chrono::steady_clock::now();
+  	{
+  		PhaseTimer timer(PHASE_QUERY);
+  		if(lookup.mode == QUERY_ZIP){
+  			answer_zips(lookup.zips, queries, output);
+  		} else {
+  			for(size_t i = 0; i < queries.size(); i++){
+  				timed_answer(lookup, queries[i], output);
+  			}
+  		}
+  	}
+  	std::chrono::steady_clock::time_point q1 = std::chrono::steady_clock::now();
+  	{
+  		PhaseTimer timer(PHASE_WRITE);
+  		fwrite(output.data(), 1, output.size(), stdout);
+  		fflush(stdout);
+  	}
+  	stats.count(COUNT_BYTES_OUT, output.size());
+  	
+  	double build_us = std::chrono::duration<double, std::micro>(t1 - t0).count();
+  	double query_ns = std::chrono::duration<double, std::nano>(q1 - q0).count();
+  	fprintf(stderr, "table: %zu records, %zu bytes\n", table.size(), table.memory());
+  	fprintf(stderr, "index: %zu cities, %zu zips, %s in %.1f us\n", index.cities(), index.size(),
+  	        (snapped == 0) ? "mapped from snapshot" : "built", build_us);
+  	double extra_us = std::chrono::duration<double, std::micro>(g1 - g0).count();
+  	if(lookup.mode == QUERY_POINT){
+  		fprintf(stderr, "geo index: %zu points, %zu bytes, built in %.1f us\n", lookup.geo.size(),
+  		        lookup.geo.memory(), extra_us);
+  	} else if(lookup.mode == QUERY_ZIP){
+  		fprintf(stderr, "zip index: %zu records, %zu bytes, built in %.1f us\n", lookup.zips.size(),
+  		        lookup.zips.memory(), extra_us);
+  	} else if(lookup.mode != QUERY_CITY){
+  		fprintf(stderr, "name index: %zu nodes, %zu bytes, built in %.1f us\n", lookup.trie.size(),
+  		        lookup.trie.memory(), extra_us);
+  	}
+  	fprintf(stderr, "queries: %zu, %.1f ns/query\n", queries.size(), queries.empty() ? 0.0 : query_ns / queries.size());
+  } else {
+  	//find the zip code of specific cities (or near specific points)
+  	if(lookup.mode == QUERY_POINT){
+  		printf("Enter the points (lat,lon) whose nearby zip codes you want to find...\n");
+  	} else if(lookup.mode == QUERY_ZIP){
+  		printf("Enter the zip codes whose records you want to find...\n");
+  	} else if(lookup.mode == QUERY_PREFIX){
+  		printf("Enter the start of the names of the cities whose zip codes you want to find...\n");
+  	} else {
+  		printf("Enter the names of the cities whose zip codes you want to find...\n");
   	}
   	
-  	for(std::forward_list<Zipfed *>::iterator it = llist.begin(); it != llist.end(); it++) {
-      		Zipfed * pTmpZipfed = *it;
-      		if(pTmpZipfed->get_city().compare(input) == 0){			//if the Zipfed field's city name you are currently at is what we're looking for
-      			std::cout << pTmpZipfed->get_zip() << std::endl;	//output the zip for that city
-      		}
- 	}
+  	while(getline(std::cin, input)){		//keep going until prompted to stop
+  		if(std::cin.eof()){			//if the input is ctrl-d or end of file
+  			break;				//exit the loop
+  		}
+  		output.clear();
+  		{
+  			PhaseTimer timer(PHASE_QUERY);
+  			timed_answer(lookup, input, output);
+  		}
+  		fwrite(output.data(), 1, output.size(), stdout);
+  		fflush(stdout);
+  		stats.count(COUNT_BYTES_OUT, output.size());
+  	}
   }
-  
-  /* If you want to see the alphabetically sorted list of Zipfed then you should take these comments out
-  for(std::forward_list<Zipfed *>::iterator it = llist.begin(); it != llist.end(); it++) {
-      		Zipfed * pTmpZipfed = *it;
-      		pTmpZipfed->print();
+  if(stats.on){
+  	stats.print(stderr);
   }
-  std::cout << distance(llist.begin(), llist.end()) << std::endl;		//this line shows that there were no cut fields from the file.
-  */
   
-  
-  /* Free memory before exiting
-   * keep deleting the head until list is empty.
-   * this code is responsible for freeing the zip code data struct
-   * the linked list will free the node form the linked list
-   */
-  while (!llist.empty()) {
-    llist.pop_front();
+  /* If you want to see the alphabetically sorted table then you should take these comments out
+  for(size_t i = 0; i < table.size(); i++) {
+      		output.clear();
+      		table.print(i, output);
+      		fwrite(output.data(), 1, output.size(), stdout);
   }
+  std::cout << table.size() << std::endl;		//this line shows that there were no cut fields from the file.
+  */
   
   return 0;
 }
@@ -5,202 +5,286 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <ctype.h>
 #include <algorithm>
+#include <charconv>
 #include <string>
 #include "zipfed.hpp"
+#include "zipschema.hpp"
 
 /** Default ctor for Zipfed. 
  *  Initialize members to default values.
  */
 Zipfed::Zipfed () {
-  zipcode = "";
+  zipcode = 0;
+  zipdigits = 5;
   zctype = INVALID;
-  city = "";
-  state = "";
   lat = 0.0;
   lon = 0.0;
 }
 
-/** Method to parse a line of data as read and intialize object instance
+/** Ctor for an empty Zipfed keeping its strings in an allocator's memory
  *
- * This method assumes the input file is a CSV format file of ZIP CODE data
- * as supplied by the federal government at:
+ * @param alloc is the allocator, e.g. of an arena
+ */
+Zipfed::Zipfed (const allocator_type &alloc) : city(alloc), state(alloc) {
+  zipcode = 0;
+  zipdigits = 5;
+  zctype = INVALID;
+  lat = 0.0;
+  lon = 0.0;
+}
+
+/** Copy ctor keeping the strings of the copy in an allocator's memory
  *
- *  http://federalgovernmentzipcodes.us/free-zipcode-database-Primary.csv
- * 
- * The function uses strtok library function to parse the file using commas as 
- * tokens.
+ * @param other is the record to copy
+ * @param alloc is the allocator of the copy
+ */
+Zipfed::Zipfed (const Zipfed &other, const allocator_type &alloc)
+  : zipcode(other.zipcode), zipdigits(other.zipdigits), zctype(other.zctype),
+    city(other.city, alloc), state(other.state, alloc), lat(other.lat), lon(other.lon) {
+}
+
+/** Move ctor keeping the strings of the result in an allocator's memory.
+ *  The strings are copied if other uses a different memory resource.
  *
- * @param csv is a pointer to the comma separated value string to parse
- * @return zero (0) if success or non-zero on error.
+ * @param other is the record to move
+ * @param alloc is the allocator of the result
  */
-int Zipfed::parse_zip_federal (char *csv) {
-  const char* delim = ","; // comma is the delimiter
-  const int QUOTE = '\"';  // the quote character, we strip this from input.
-  std::string token;       // This  will be the token we read using strtok
-  int recnum = 0;          // Each record in CSV is sequentially numbered
-  
-  // verify we have a string to parse. Return if we don't
-  if ((csv == NULL) || (strlen(csv) == 0)) {
-    return -1;
-  }
+Zipfed::Zipfed (Zipfed &&other, const allocator_type &alloc)
+  : zipcode(other.zipcode), zipdigits(other.zipdigits), zctype(other.zctype),
+    city(std::move(other.city), alloc), state(std::move(other.state), alloc),
+    lat(other.lat), lon(other.lon) {
+}
 
-  /* The string should be delimited by commas (',') as the token separator.
-   * We call the strtok to get the tokens between the delimiters and process 
-   * accordingly for initializing the ZIP_FEDERAL struct
-   *
-   * NOTE: The very first line of the CSV file contains the column headers.
-   * our stucture can't do anything with that, so object instance is not modified
-   *
-   * NOTE2: Each token is quoted in the input file. We will strip/remove them 
-   */
-  token = strtok(csv, delim);
-  if (strcmp(token.c_str(), "\"RecordNumber\"") == 0) {
-    // The string "RecordNumber" (with quotes) means this is the first line
-    // of the input file containing column identification labels. We can't
-    // handle that so just return an emtpy struct
-    return -3;
-  }
-  // first column is the record num. We don't store this
-  recnum = atoi(token.c_str());
-
-  // second column is the 5-digit zip code as string.
-  // strip the surrounding double quotes
-  // If the zip code is < 5 digits, we prepend '0' to make it a legic zipcode
-  token = strtok(NULL, delim);
-  token.erase(std::remove(token.begin(), token.end(), QUOTE), token.end());
-  while (token.size() < 5) {
-    token.insert(0, 1, '0');
-  }
-  zipcode = token;
-
-  // third column is zip code type as string, we convert to enum after
-  // stripping the surrounding double quotes
-  token = strtok(NULL, delim);
-  token.erase(std::remove(token.begin(), token.end(), QUOTE), token.end());
-  if (token.compare("STANDARD") == 0) {
-    zctype = STANDARD;
-  } else if (token.compare("PO_BOX") == 0) {
-    zctype = PO_BOX;
-  } else if (token.compare("UNIQUE") == 0) {
-    zctype = UNIQUE;
-  } else if (token.compare("MILITARY") == 0) {
-    zctype = MILITARY;
-  } else {
-    zctype = INVALID;
+/** Convert the text of a zip code type column to the enum
+ *
+ * @param token is the column text without quotes
+ * @return the matching ZIPCODE_TYPE, INVALID if it is not recognized
+ */
+ZIPCODE_TYPE parse_zip_type (std::string_view token) {
+  if (token == "STANDARD") {
+    return STANDARD;
+  } else if (token == "PO_BOX") {
+    return PO_BOX;
+  } else if (token == "UNIQUE") {
+    return UNIQUE;
+  } else if (token == "MILITARY") {
+    return MILITARY;
   }
+  return INVALID;
+}
 
-  // fourth column is the city
-  token = strtok(NULL, delim);
-  token.erase(std::remove(token.begin(), token.end(), QUOTE), token.end());
-  city = token;
-
-  // fifth column is the 2-character State code as string
-  token = strtok(NULL, delim);
-  token.erase(std::remove(token.begin(), token.end(), QUOTE), token.end());
-  state = token;
-
-  // sixth column is LocationType, we don't want that - don't process input
-  token = strtok(NULL, delim);
-
-  // seventh & eigth columns are Lat/Lon - these fields are not quoted
-  token = strtok(NULL, delim);
-  lat = std::stof(token);
-  token = strtok(NULL, delim);
-  lon = std::stof(token);
+/** Convert the text of a lat/lon column to a float straight from the
+ *  input bytes, without copying or allocating
+ *
+ * Accepts what strtof does for these columns: leading blanks, an optional
+ * sign, and anything after the number is ignored. The result is correctly
+ * rounded, so it is the same float strtof gives. A number too large or too
+ * small for a float is an error, where strtof would give HUGE_VALF or 0.
+ *
+ * @param token is the column text
+ * @param value is set to the converted number
+ * @return zero (0) if success or non-zero on error: not a number, or out
+ *   of the range of a float
+ */
+int parse_coord (std::string_view token, float *value) {
+  const char *p = token.data();
+  const char *end = p + token.size();
 
-  // Columns 9-11 (Zaxis. Yaxis, Zaxis) we don't care about
-  token = strtok (NULL, delim);
-  token = strtok (NULL, delim);
-  token = strtok (NULL, delim);
+  while ((p < end) && ((*p == ' ') || (*p == '\t'))) {
+    p++;
+  }
+  // from_chars takes '-' but not '+'
+  if ((p < end) && (*p == '+') && (end - p > 1) && (p[1] != '-')) {
+    p++;
+  }
+  std::from_chars_result r = std::from_chars(p, end, *value);
+  return (r.ec != std::errc()) ? -1 : 0;
+}
 
+/** Convert the text of a zip code column to a number
+ *
+ * @param token is the column text without quotes, up to 9 digits
+ * @param zip is set to the zip code
+ * @param digits is set to the number of digits to write it with: those of
+ *   the column, but at least 5, as a short zip is padded with '0'
+ * @return zero (0) if success or non-zero if the column is not a number
+ */
+int parse_zip_number (std::string_view token, uint32_t *zip, uint8_t *digits) {
+  uint32_t n = 0;
+  if (token.size() > 9) {
+    return -1;
+  }
+  for (size_t i = 0; i < token.size(); i++) {
+    unsigned d = (unsigned char) token[i] - '0';
+    if (d > 9) {
+      return -1;
+    }
+    n = n * 10 + d;
+  }
+  *zip = n;
+  *digits = (token.size() < 5) ? 5 : token.size();
   return 0;
 }
 
-
-
-
-//--------------------------------------------------------------------------------
-
-
-
-
-
 /** Method to parse a line of data as read and intialize object instance
  *
  * This method assumes the input file is a CSV format file of ZIP CODE data
  * as supplied by the federal government at:
  *
  *  http://federalgovernmentzipcodes.us/free-zipcode-database-Primary.csv
- * 
- * The function uses strtok library function to parse the file using commas as 
- * tokens.
+ *
+ * The line is split at commas and unquoted in place as FederalSchema says.
+ * The very first line of the file holds the column labels, and returns -3
+ * without modifying the object.
+ *
+ * @param csv is a pointer to the comma separated value string to parse
+ * @return zero (0) if success or non-zero on error.
+ */
+int Zipfed::parse_zip_federal (char *csv) {
+  return parse_line<FederalSchema>(csv);
+}
+
+/** Method to parse a line of data as read and intialize object instance
+ *
+ * This method assumes the input file is a cs2303 file, as fed2cs2303
+ * writes: zip,type,city,state,lat,lon (see Cs2303Schema).
  *
  * @param csv is a pointer to the comma separated value string to parse
  * @return zero (0) if success or non-zero on error.
  */
 int Zipfed::parse_zip_cs2303 (char *csv) {
-  const char* delim = ","; // comma is the delimiter
-  std::string token;       // This  will be the token we read using strtok
-  //float num_tok;
-  int recnum = 0;          // Each record in CSV is sequentially numbered
-  
-  // verify we have a string to parse. Return if we don't
-  if ((csv == NULL) || (strlen(csv) == 0)) {
+  return parse_line<Cs2303Schema>(csv);
+}
+
+/** Method to initialize the object from the fields of a federal record
+ *
+ * This is the same layout parse_zip_federal handles, but the fields were
+ * already split (and unquoted) by a CsvScanner, so nothing is tokenized or
+ * copied here apart from filling the members.
+ *
+ * @param fields are the columns of one record
+ * @param count is the number of columns in fields
+ * @return zero (0) if success or non-zero on error.
+ */
+int Zipfed::parse_fields_federal (const std::string_view *fields, int count) {
+  return parse_fields<FederalSchema>(fields, count);
+}
+
+/** Method to initialize the object from the fields of a cs2303 record
+ *
+ * @param fields are the columns of one record
+ * @param count is the number of columns in fields
+ * @return zero (0) if success or non-zero on error.
+ */
+int Zipfed::parse_fields_cs2303 (const std::string_view *fields, int count) {
+  return parse_fields<Cs2303Schema>(fields, count);
+}
+
+/** Method to initialize the object from the fields of a record of a file
+ *  whose columns were found from its header
+ *
+ * @param map says which column holds which member
+ * @param fields are the columns of one record
+ * @param count is the number of columns in fields
+ * @return zero (0) if success, -1 if the record has too few columns or -2
+ *   if a zip, lat or lon is not a number
+ */
+int Zipfed::parse_fields (const ColumnMap &map, const std::string_view *fields, int count) {
+  if (count < map.size()) {
     return -1;
   }
-
-  /* The string should be delimited by commas (',') as the token separator.
-   * We call the strtok to get the tokens between the delimiters and process 
-   * accordingly for initializing the ZIP_FEDERAL struct
-   *
-   * NOTE: The very first line of the CSV file contains the column headers.
-   * our stucture can't do anything with that, so object instance is not modified
-   *
-   * NOTE2: Each token is quoted in the input file. We will strip/remove them 
-   */
-  // first column is the record num. We don't store this
-  recnum = atoi(token.c_str());
-
-  // second column is the 5-digit zip code as string.
-  // strip the surrounding double quotes
-  // If the zip code is < 5 digits, we prepend '0' to make it a legic zipcode
-  token = strtok(csv, delim);
-  while (token.size() < 5) {
-    token.insert(0, 1, '0');
+  if (parse_zip_number(fields[map.at(FIELD_ZIP)], &zipcode, &zipdigits) != 0) {
+    return -2;
   }
-  zipcode = token;
-
-  // third column is zip code type as string, we convert to enum after
-  // stripping the surrounding double quotes
-  token = strtok(NULL, delim);
-  if (token.compare("STANDARD") == 0) {
-    zctype = STANDARD;
-  } else if (token.compare("PO_BOX") == 0) {
-    zctype = PO_BOX;
-  } else if (token.compare("UNIQUE") == 0) {
-    zctype = UNIQUE;
-  } else if (token.compare("MILITARY") == 0) {
-    zctype = MILITARY;
-  } else {
-    zctype = INVALID;
+  int c = map.at(FIELD_TYPE);
+  zctype = (c < 0) ? INVALID : parse_zip_type(fields[c]);
+  c = map.at(FIELD_CITY);
+  city.assign(fields[c].data(), fields[c].size());
+  c = map.at(FIELD_STATE);
+  state.assign(fields[c].data(), fields[c].size());
+  lat = 0;
+  lon = 0;
+  c = map.at(FIELD_LAT);
+  if ((c >= 0) && (parse_coord(fields[c], &lat) != 0)) {
+    return -2;
+  }
+  c = map.at(FIELD_LON);
+  if ((c >= 0) && (parse_coord(fields[c], &lon) != 0)) {
+    return -2;
   }
+  return 0;
+}
 
-  // fourth column is the city
-  token = strtok(NULL, delim);
-  city = token;
+/** Constructor of a map with no columns, until build is called
+ */
+ColumnMap::ColumnMap () : columns(0) {
+  for (int &c : column) {
+    c = -1;
+  }
+}
 
-  // fifth column is the 2-character State code as string
-  token = strtok(NULL, delim);
-  state = token;
+/** Fold a column name to the form it is looked up by: lower case, without
+ *  '_', ' ' or quotes
+ *
+ * @param name is the name as the header has it
+ * @return the folded name
+ */
+static std::string fold_name (std::string_view name) {
+  std::string folded;
+  for (char c : name) {
+    if ((c != '_') && (c != ' ') && (c != '"')) {
+      folded += (char) tolower((unsigned char) c);
+    }
+  }
+  return folded;
+}
 
-  
-  // seventh & eigth columns are Lat/Lon - these fields are not quoted
-  token = strtok(NULL, delim);
-  lat = std::stof(token);
-  token = strtok(NULL, delim);
-  lon = std::stof(token);
+/** Find the columns of the members from the names of a header line
+ *
+ * The first column with a name of a member is used; other columns are
+ * ignored.
+ *
+ * @param names are the columns of the header line
+ * @param count is the number of columns in names
+ * @param error is set to what is wrong on error
+ * @return zero (0) if success or non-zero if zip, city or state is missing
+ */
+int ColumnMap::build (const std::string_view *names, int count, std::string &error) {
+  static const struct {
+    const char *name;
+    FIELD_KIND kind;
+  } aliases[] = {
+    {"zip", FIELD_ZIP}, {"zipcode", FIELD_ZIP}, {"postalcode", FIELD_ZIP}, {"postcode", FIELD_ZIP},
+    {"type", FIELD_TYPE}, {"zipcodetype", FIELD_TYPE}, {"ziptype", FIELD_TYPE},
+    {"city", FIELD_CITY}, {"place", FIELD_CITY},
+    {"state", FIELD_STATE}, {"st", FIELD_STATE},
+    {"lat", FIELD_LAT}, {"latitude", FIELD_LAT},
+    {"lon", FIELD_LON}, {"long", FIELD_LON}, {"lng", FIELD_LON}, {"longitude", FIELD_LON}
+  };
+  static const char *required[] = {"zip", NULL, "city", "state"};
+
+  *this = ColumnMap();
+  for (int i = 0; i < count; i++) {
+    std::string name = fold_name(names[i]);
+    for (const auto &alias : aliases) {
+      if ((name == alias.name) && (column[alias.kind] < 0)) {
+        column[alias.kind] = i;
+        columns = std::max(columns, i + 1);
+        break;
+      }
+    }
+  }
+  for (int kind = FIELD_ZIP; kind <= FIELD_STATE; kind++) {
+    if ((required[kind] != NULL) && (column[kind] < 0)) {
+      error = std::string("the header has no ") + required[kind] + " column";
+      return -1;
+    }
+  }
   return 0;
 }
 
@@ -216,64 +300,199 @@ int Zipfed::parse_zip_cs2303 (char *csv) {
  * @param pzip is a pointer to ZIP_FEDERAL struct
  */
 void Zipfed::print (void) {
-  //if(strcmp(state.c_str(), "MA") == 0){
-  printf ("%s,", zipcode.c_str());
-  switch (zctype) {
-  case STANDARD:
-    printf("STANDARD,");
-    break;
-  case PO_BOX:
-    printf("PO_BOX,");
-    break;
-  case UNIQUE:
-    printf("UNIQUE,");
-    break;
-  case MILITARY:
-    printf("MILITARY,");
-    break;
-  case INVALID:
-    printf("INVALID,");
-    break;
-  default:
-    printf(",");
-    break;
+  char line[512];
+  if (format_size() <= sizeof(line)) {
+    fwrite(line, 1, format(line, FLOAT_FIXED) - line, stdout);
+  } else {
+    std::string big;
+    print(big);
+    fwrite(big.data(), 1, big.size(), stdout);
   }
-  printf("%s,%s,", city.c_str(), state.c_str());
-  printf("%f,%f\n", lat, lon);
   return;
 }
 
 /**This function writes the standard output to a file instead of the terminal.
+* Every record is written; callers choose which ones with a ZipFilter.
 * @file is the file to which you want to write
 **/
 void Zipfed::print (FILE * file) {
-  if(strcmp(state.c_str(), "MA") == 0){
-  fprintf (file, "%s,", zipcode.c_str());
-  switch (zctype) {
+  char line[512];
+  if (format_size() <= sizeof(line)) {
+    fwrite(line, 1, format(line, FLOAT_FIXED) - line, file);
+  } else {
+    std::string big;
+    print(big);
+    fwrite(big.data(), 1, big.size(), file);
+  }
+  return;
+}
+
+/** This function appends the same line print(FILE *) writes to a buffer,
+* so several threads can format records without sharing a FILE. The buffer
+* only allocates when it has to grow.
+* @out is the buffer to append to
+* @format is how lat/lon are written
+**/
+void Zipfed::print (std::string &out, FLOAT_FORMAT format) {
+  size_t at = out.size();
+  out.resize(at + format_size());
+  out.resize(this->format(&out[at], format) - out.data());
+  return;
+}
+
+/** Largest number of characters format() writes for this record
+ *
+ * @return a size that is always enough for the formatted record
+ */
+size_t Zipfed::format_size (void) const {
+  return ZIP_CHARS + 10 + 2 * (city.size() + state.size()) + 4 + 2 * FLOAT_CHARS + 6;
+}
+
+/** Write the record as a line of the cs2303 format:
+ *  zip,type,city,state,lat,lon and a newline, city and state quoted as
+ *  format_text quotes them
+ *
+ * @param out is where to write, with room for format_size() characters
+ * @param format is how lat/lon are written
+ * @return one past the last character written
+ */
+char *Zipfed::format (char *out, FLOAT_FORMAT format) const {
+  const char *type = zip_type_name(zctype);
+  size_t len = strlen(type);
+
+  out = format_zip(out, zipcode, zipdigits);
+  *out++ = ',';
+  memcpy(out, type, len);
+  out += len;
+  *out++ = ',';
+  out = format_text(out, city);
+  *out++ = ',';
+  out = format_text(out, state);
+  *out++ = ',';
+  out = format_float(out, lat, format);
+  *out++ = ',';
+  out = format_float(out, lon, format);
+  *out++ = '\n';
+  return out;
+}
+
+/** Write a number in decimal
+ *
+ * @param out is where to write, with room for 20 characters
+ * @param n is the number
+ * @return one past the last character written
+ */
+static char *format_uint (char *out, uint64_t n) {
+  char digits[20];
+  int count = 0;
+  do {
+    digits[count++] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+  while (count > 0) {
+    *out++ = digits[--count];
+  }
+  return out;
+}
+
+/** Write a zip code, padded with '0' to a number of digits
+ *
+ * @param out is where to write, with room for ZIP_CHARS characters
+ * @param zip is the zip code
+ * @param digits is the least number of digits to write, at most ZIP_CHARS
+ * @return one past the last character written
+ */
+char *format_zip (char *out, uint32_t zip, int digits) {
+  // a zip longer than digits is written in full
+  int need = 1;
+  for (uint32_t rest = zip; rest >= 10; rest /= 10) {
+    need++;
+  }
+  digits = std::max(digits, need);
+  char *end = out + digits;
+  for (char *p = end - 1; p >= out; p--) {
+    *p = '0' + zip % 10;
+    zip /= 10;
+  }
+  return end;
+}
+
+/** Write a text column, in double quotes if it holds a comma, a quote or a
+ *  line end, with each quote in it doubled, so CsvScanner reads it back
+ *
+ * @param out is where to write, with room for 2 * text.size() + 2 characters
+ * @param text is the column text
+ * @return one past the last character written
+ */
+char *format_text (char *out, std::string_view text) {
+  if (text.find_first_of(",\"\r\n") == std::string_view::npos) {
+    memcpy(out, text.data(), text.size());
+    return out + text.size();
+  }
+  *out++ = '"';
+  for (char c : text) {
+    if (c == '"') {
+      *out++ = '"';
+    }
+    *out++ = c;
+  }
+  *out++ = '"';
+  return out;
+}
+
+/** Write a float without going through printf
+ *
+ * FLOAT_FIXED gives exactly what printf("%f") gives: a float has a 24 bit
+ * mantissa, so the float times 10^6 (= 15625 * 2^6) is exact as a double,
+ * and rounding that to an integer with the default ties-to-even mode
+ * rounds the same way printf does. Numbers too large for the integer path,
+ * infinities and NaN still go to snprintf.
+ *
+ * @param out is where to write, with room for FLOAT_CHARS characters
+ * @param value is the number to write
+ * @param format is how to write it
+ * @return one past the last character written
+ */
+char *format_float (char *out, float value, FLOAT_FORMAT format) {
+  if (format == FLOAT_SHORTEST) {
+    return std::to_chars(out, out + FLOAT_CHARS, value).ptr;
+  }
+  double scaled = fabs((double) value) * 1e6;
+  if (!(scaled < 1e18)) {
+    return out + snprintf(out, FLOAT_CHARS, "%f", value);
+  }
+  uint64_t n = (uint64_t) nearbyint(scaled);
+  uint32_t frac = n % 1000000;
+  if (signbit(value)) {
+    *out++ = '-';
+  }
+  out = format_uint(out, n / 1000000);
+  *out++ = '.';
+  for (int i = 5; i >= 0; i--) {
+    out[i] = '0' + frac % 10;
+    frac /= 10;
+  }
+  return out + 6;
+}
+
+/** Name of a zip code type as it is written in the CSV files
+ *
+ * @param type is the zip code type
+ * @return the name, "" for a value outside the enum
+ */
+const char *zip_type_name (ZIPCODE_TYPE type) {
+  switch (type) {
   case STANDARD:
-    fprintf(file,"STANDARD,");
-    break;
+    return "STANDARD";
   case PO_BOX:
-    fprintf(file, "PO_BOX,");
-    break;
+    return "PO_BOX";
   case UNIQUE:
-    fprintf(file, "UNIQUE,");
-    break;
+    return "UNIQUE";
   case MILITARY:
-    fprintf(file, "MILITARY,");
-    break;
+    return "MILITARY";
   case INVALID:
-    fprintf(file, "INVALID,");
-    break;
+    return "INVALID";
   default:
-    fprintf(file, ",");
-    break;
+    return "";
   }
-  fprintf(file, "%s,%s,", city.c_str(), state.c_str());
-  fprintf(file, "%f,%f\n", lat, lon);
- }
-  return;
 }
-
-
-
@@ -7,8 +7,13 @@
 #ifndef ZIPFED_HPP
 #define ZIPFED_HPP
 
+#include <stdint.h>
 #include <strings.h>
 #include <iostream>
+#include <string>
+#include <string_view>
+#include <memory_resource>
+#include <utility>
 /** @brief Zipcode can be either STANDARD zip codes or PO BOX zip code
  */
 typedef enum {
@@ -19,6 +24,38 @@ typedef enum {
   MILITARY               /**< Military e.g. APO */
 } ZIPCODE_TYPE;
 
+const char *zip_type_name(ZIPCODE_TYPE type);
+
+/** @brief How lat/lon are written when a record is formatted
+ */
+typedef enum {
+  FLOAT_FIXED,           /**< six decimals, byte-identical to printf("%f") */
+  FLOAT_SHORTEST         /**< shortest text that reads back as the same float */
+} FLOAT_FORMAT;
+
+// most characters format_float writes
+#define FLOAT_CHARS (64)
+// most characters format_zip writes
+#define ZIP_CHARS (10)
+
+char *format_float(char *out, float value, FLOAT_FORMAT format);
+char *format_zip(char *out, uint32_t zip, int digits);
+char *format_text(char *out, std::string_view text);
+
+/** @brief The Zipfed member a column is parsed into, which also says how
+ *  its text is read (see zipschema.hpp)
+ */
+typedef enum {
+  FIELD_ZIP,                /**< zip code, up to 9 digits */
+  FIELD_TYPE,               /**< ZIPCODE_TYPE name */
+  FIELD_CITY,               /**< city name, copied */
+  FIELD_STATE,              /**< state code, copied */
+  FIELD_LAT,                /**< latitude in degrees */
+  FIELD_LON                 /**< longitude in degrees */
+} FIELD_KIND;
+
+class ColumnMap;
+
 /** @brief Zip code location types can be ACCEPTABLE or NOT ACCEPTABLE
  *
  * The loctaion is flagged as acceptable or not acceptable. Our application
@@ -34,28 +71,80 @@ typedef enum {
  * This structure is used for reading the input format as  US Fed Gov
  * provides the zip code data in CSV file available for free download.
  * This struct is used to read in the source. 
+ *
+ * The city and state live in memory of the allocator the record is made
+ * with, the heap by default. Records kept in a std::pmr container take the
+ * container's memory resource, so a batch of them on a
+ * std::pmr::monotonic_buffer_resource costs a few large allocations and is
+ * freed at once by releasing the resource.
  */
 class Zipfed {
 private:
-  std::string zipcode;              /**< five digits zip code stored as string */
+  uint32_t zipcode;                 /**< zip code as a number */
+  uint8_t zipdigits;                /**< digits the zip code is written with, at least 5 */
   ZIPCODE_TYPE zctype;              /**< zip code for PO Box or standard region */
-  std::string city;                 /**< Name of city for zip code */
-  std::string state;                /**< State of the zip code */
+  std::pmr::string city;            /**< Name of city for zip code */
+  std::pmr::string state;           /**< State of the zip code */
   float lat;                        /**< Latitude of zip code */
   float lon;                        /**< Longitude of zip code */
+
+  template <FIELD_KIND Kind, bool Line>
+  int parse_field(std::string_view token);
+  template <class Schema, bool Line, size_t... I>
+  int parse_schema(const std::string_view *tokens, std::index_sequence<I...>);
 public:
+  /** allocator of the strings, which makes a Zipfed allocator aware */
+  typedef std::pmr::polymorphic_allocator<char> allocator_type;
+
   Zipfed();                         /**< default constructor for Zipfed */
+  explicit Zipfed(const allocator_type &alloc);
+  Zipfed(const Zipfed &other, const allocator_type &alloc);
+  Zipfed(Zipfed &&other, const allocator_type &alloc);
+  Zipfed(const Zipfed &other) = default;
+  Zipfed(Zipfed &&other) = default;
+  Zipfed &operator=(const Zipfed &other) = default;
+  Zipfed &operator=(Zipfed &&other) = default;
   int parse_zip_federal(char *csv); /**< parse and inialize from line of input */
   int parse_zip_cs2303 (char *csv);
+  int parse_fields_federal(const std::string_view *fields, int count);
+  int parse_fields_cs2303(const std::string_view *fields, int count);
+  template <class Schema>
+  int parse_fields(const std::string_view *fields, int count);   /**< see zipschema.hpp */
+  template <class Schema>
+  int parse_line(char *csv);                                      /**< see zipschema.hpp */
+  int parse_fields(const ColumnMap &map, const std::string_view *fields, int count);
   void print(void);
   void print(FILE * file);
+  void print(std::string &out, FLOAT_FORMAT format = FLOAT_FIXED);
+  size_t format_size(void) const;
+  char *format(char *out, FLOAT_FORMAT format) const;
   /**getter method for the city field
   *@return the string of the city of a Zipfed object
   **/
-  std::string get_city(){return city;}
+  std::string_view get_city() const {return city;}
   /**getter method for the zip code of a Zipfed object
-  *@return the string of the zip of a Zipfed object
+  *@return the zip of a Zipfed object as a number
+  **/
+  uint32_t get_zip() const {return zipcode;}
+  /**getter method for the width of the zip code of a Zipfed object
+  *@return the number of digits the zip is written with (5 unless longer)
+  **/
+  int get_zip_digits() const {return zipdigits;}
+  /**getter method for the state of a Zipfed object
+  *@return the 2-character state code
+  **/
+  std::string_view get_state() const {return state;}
+  /**getter method for the zip code type of a Zipfed object
+  *@return the type of the zip code
+  **/
+  ZIPCODE_TYPE get_type() const {return zctype;}
+  /**getter method for the latitude of a Zipfed object
+  *@return the latitude of the zip code
+  **/
+  float get_lat() const {return lat;}
+  /**getter method for the longitude of a Zipfed object
+  *@return the longitude of the zip code
   **/
-  std::string get_zip(){return zipcode;}
+  float get_lon() const {return lon;}
 };
 #endif // ZIPSTRUCTS
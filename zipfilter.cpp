@@ -0,0 +1,504 @@
+/** Functions supporting record filters given on the command line
+ *
+ * @author Krishna Garg
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <algorithm>
+#include <charconv>
+#include "zipfilter.hpp"
+#include "ziptable.hpp"
+
+// most clauses an expression may expand to
+#define MAX_CLAUSES (4096)
+// characters that end a word and are operators themselves
+#define OPERATORS "(),=!<>"
+
+/** Default ctor for ZipFilter. The filter passes every record until an
+ *  expression is compiled.
+ */
+ZipFilter::ZipFilter () {
+  clauses.push_back(everything());
+  next = 0;
+}
+
+/** @return a clause every record passes */
+ZipFilter::Clause ZipFilter::everything (void) {
+  Clause c;
+  for (int w = 0; w < 4; w++) {
+    c.states[w] = ~(uint64_t) 0;
+  }
+  c.types = (1u << (MILITARY + 1)) - 1;
+  c.zips.push_back(Range{0, UINT32_MAX});
+  c.lat_lo = c.lon_lo = -INFINITY;
+  c.lat_hi = c.lon_hi = INFINITY;
+  return c;
+}
+
+/** Check whether no record can pass a clause
+ *
+ * @param c is the clause
+ * @return true if the clause cannot match
+ */
+bool ZipFilter::empty (const Clause &c) {
+  return ((c.states[0] | c.states[1] | c.states[2] | c.states[3]) == 0) || (c.types == 0) ||
+         c.zips.empty() || !(c.lat_lo <= c.lat_hi) || !(c.lon_lo <= c.lon_hi);
+}
+
+/** Combine two clauses with "and"
+ *
+ * @param a is the first clause
+ * @param b is the second clause
+ * @param out is set to the clause that passes what both pass
+ * @return true unless no record can pass both
+ */
+bool ZipFilter::intersect (const Clause &a, const Clause &b, Clause &out) {
+  for (int w = 0; w < 4; w++) {
+    out.states[w] = a.states[w] & b.states[w];
+  }
+  out.types = a.types & b.types;
+  out.zips.clear();
+  size_t i = 0;
+  size_t j = 0;
+  while ((i < a.zips.size()) && (j < b.zips.size())) {
+    uint32_t lo = std::max(a.zips[i].lo, b.zips[j].lo);
+    uint32_t hi = std::min(a.zips[i].hi, b.zips[j].hi);
+    if (lo <= hi) {
+      out.zips.push_back(Range{lo, hi});
+    }
+    if (a.zips[i].hi < b.zips[j].hi) {
+      i++;
+    } else {
+      j++;
+    }
+  }
+  out.lat_lo = std::max(a.lat_lo, b.lat_lo);
+  out.lat_hi = std::min(a.lat_hi, b.lat_hi);
+  out.lon_lo = std::max(a.lon_lo, b.lon_lo);
+  out.lon_hi = std::min(a.lon_hi, b.lon_hi);
+  return !empty(out);
+}
+
+/** Fold together clauses that differ only in their states
+ *
+ * @param dnf are the clauses, "or"ed together
+ */
+void ZipFilter::merge (std::vector<Clause> &dnf) {
+  for (size_t i = 0; i < dnf.size(); i++) {
+    for (size_t j = i + 1; j < dnf.size(); ) {
+      const Clause &a = dnf[i];
+      const Clause &b = dnf[j];
+      bool same = (a.types == b.types) && (a.zips.size() == b.zips.size()) &&
+                  (a.lat_lo == b.lat_lo) && (a.lat_hi == b.lat_hi) &&
+                  (a.lon_lo == b.lon_lo) && (a.lon_hi == b.lon_hi);
+      for (size_t z = 0; same && (z < a.zips.size()); z++) {
+        same = (a.zips[z].lo == b.zips[z].lo) && (a.zips[z].hi == b.zips[z].hi);
+      }
+      if (same) {
+        for (int w = 0; w < 4; w++) {
+          dnf[i].states[w] |= dnf[j].states[w];
+        }
+        dnf.erase(dnf.begin() + j);
+      } else {
+        j++;
+      }
+    }
+  }
+}
+
+/** Record why compiling failed
+ *
+ * @param what is the part of the expression that was expected
+ * @return -1
+ */
+int ZipFilter::fail (const char *what) {
+  message = std::string("expected ") + what;
+  if (next < tokens.size()) {
+    message += " at offset " + std::to_string(tokens[next].at) + " \"" + tokens[next].text + "\"";
+  } else {
+    message += " at end of filter";
+  }
+  return -1;
+}
+
+/** Read the next token if it is a given word or operator
+ *
+ * @param word is the word, matched ignoring case
+ * @return true if the token was read
+ */
+bool ZipFilter::accept (const char *word) {
+  if ((next < tokens.size()) && (strcasecmp(tokens[next].text.c_str(), word) == 0)) {
+    next++;
+    return true;
+  }
+  return false;
+}
+
+/** Compile an expression into the filter
+ *
+ * @param expr is the expression, see the class description
+ * @return zero (0) if success or -1 if the expression is not valid, in
+ *   which case error() says why and the filter is unchanged
+ */
+int ZipFilter::compile (const char *expr) {
+  tokens.clear();
+  next = 0;
+  for (const char *p = expr; *p != '\0'; ) {
+    if (isspace((unsigned char) *p)) {
+      p++;
+      continue;
+    }
+    Token t;
+    t.at = p - expr;
+    if (strchr(OPERATORS, *p) != NULL) {
+      t.text.assign(p, (p[1] == '=' && strchr("=!<>", *p) != NULL) ? 2 : 1);
+    } else {
+      size_t len = 0;
+      while ((p[len] != '\0') && !isspace((unsigned char) p[len]) && (strchr(OPERATORS, p[len]) == NULL)) {
+        len++;
+      }
+      t.text.assign(p, len);
+    }
+    p += t.text.size();
+    tokens.push_back(t);
+  }
+
+  std::vector<Clause> dnf;
+  if (parse_or(dnf) != 0) {
+    return -1;
+  }
+  if (next < tokens.size()) {
+    return fail("\"and\", \"or\" or the end of the filter");
+  }
+  clauses.swap(dnf);
+  message.clear();
+  return 0;
+}
+
+/** Parse tests joined by "or"
+ *
+ * @param dnf is set to the clauses of the tests
+ * @return zero (0) if success or -1 on error
+ */
+int ZipFilter::parse_or (std::vector<Clause> &dnf) {
+  if (parse_and(dnf) != 0) {
+    return -1;
+  }
+  while (accept("or")) {
+    std::vector<Clause> rhs;
+    if (parse_and(rhs) != 0) {
+      return -1;
+    }
+    dnf.insert(dnf.end(), rhs.begin(), rhs.end());
+    merge(dnf);
+    if (dnf.size() > MAX_CLAUSES) {
+      return fail("a shorter filter");
+    }
+  }
+  return 0;
+}
+
+/** Parse tests joined by "and"
+ *
+ * @param dnf is set to the clauses of the tests
+ * @return zero (0) if success or -1 on error
+ */
+int ZipFilter::parse_and (std::vector<Clause> &dnf) {
+  if (parse_test(dnf) != 0) {
+    return -1;
+  }
+  while (accept("and")) {
+    std::vector<Clause> rhs;
+    std::vector<Clause> both;
+    Clause c;
+    if (parse_test(rhs) != 0) {
+      return -1;
+    }
+    for (size_t i = 0; i < dnf.size(); i++) {
+      for (size_t j = 0; j < rhs.size(); j++) {
+        if (intersect(dnf[i], rhs[j], c)) {
+          both.push_back(c);
+        }
+      }
+    }
+    merge(both);
+    if (both.size() > MAX_CLAUSES) {
+      return fail("a shorter filter");
+    }
+    dnf.swap(both);
+  }
+  return 0;
+}
+
+/** Parse a parenthesized list of words, "(A,B,C)"
+ *
+ * @param items is set to the words
+ * @return zero (0) if success or -1 on error
+ */
+int ZipFilter::parse_list (std::vector<std::string> &items) {
+  if (!accept("(")) {
+    return fail("\"(\"");
+  }
+  do {
+    if ((next >= tokens.size()) || (strchr(OPERATORS, tokens[next].text[0]) != NULL)) {
+      return fail("a value");
+    }
+    items.push_back(tokens[next++].text);
+  } while (accept(","));
+  if (!accept(")")) {
+    return fail("\",\" or \")\"");
+  }
+  return 0;
+}
+
+/** Parse a zip code, up to 9 digits
+ *
+ * @param zip is set to the zip as a number
+ * @return zero (0) if success or -1 on error
+ */
+int ZipFilter::parse_zip (uint32_t *zip) {
+  if (next < tokens.size()) {
+    const std::string &t = tokens[next].text;
+    std::from_chars_result r = std::from_chars(t.data(), t.data() + t.size(), *zip);
+    if ((t.size() <= 9) && (r.ec == std::errc()) && (r.ptr == t.data() + t.size()) && isdigit((unsigned char) t[0])) {
+      next++;
+      return 0;
+    }
+  }
+  return fail("a zip code");
+}
+
+/** Parse a latitude or longitude in degrees
+ *
+ * @param value is set to the number, rounded to float as records are
+ * @return zero (0) if success or -1 on error
+ */
+int ZipFilter::parse_degrees (float *value) {
+  if (next < tokens.size()) {
+    const std::string &t = tokens[next].text;
+    const char *p = t.data() + ((t[0] == '+') ? 1 : 0);
+    std::from_chars_result r = std::from_chars(p, t.data() + t.size(), *value);
+    if ((r.ec == std::errc()) && (r.ptr == t.data() + t.size()) && isfinite(*value)) {
+      next++;
+      return 0;
+    }
+  }
+  return fail("a number");
+}
+
+/** Parse one test, or an expression in parentheses
+ *
+ * @param dnf is set to the clauses of the test
+ * @return zero (0) if success or -1 on error
+ */
+int ZipFilter::parse_test (std::vector<Clause> &dnf) {
+  dnf.clear();
+  if (accept("(")) {
+    if (parse_or(dnf) != 0) {
+      return -1;
+    }
+    return accept(")") ? 0 : fail("\")\"");
+  }
+
+  Clause c = everything();
+  if (accept("state") || accept("type")) {
+    bool state = (strcasecmp(tokens[next - 1].text.c_str(), "state") == 0);
+    bool negate = false;
+    std::vector<std::string> items;
+    if (accept("=") || accept("==") || (negate = accept("!="))) {
+      if ((next >= tokens.size()) || (strchr(OPERATORS, tokens[next].text[0]) != NULL)) {
+        return fail("a value");
+      }
+      items.push_back(tokens[next++].text);
+    } else {
+      negate = accept("not");
+      if (!accept("in")) {
+        return fail(negate ? "\"in\"" : "\"=\", \"!=\", \"in\" or \"not in\"");
+      }
+      if (parse_list(items) != 0) {
+        return -1;
+      }
+    }
+
+    uint64_t states[4] = {0, 0, 0, 0};
+    uint32_t types = 0;
+    for (size_t i = 0; i < items.size(); i++) {
+      std::string &item = items[i];
+      for (size_t k = 0; k < item.size(); k++) {
+        item[k] = toupper((unsigned char) item[k]);
+      }
+      if (state) {
+        if (item.size() != 2) {
+          next--;
+          return fail("a 2 letter state");
+        }
+        uint8_t code = state_intern(item);
+        states[code >> 6] |= (uint64_t) 1 << (code & 63);
+      } else {
+        int t;
+        for (t = INVALID; t <= MILITARY; t++) {
+          if (item == zip_type_name((ZIPCODE_TYPE) t)) {
+            break;
+          }
+        }
+        if (t > MILITARY) {
+          next--;
+          return fail("STANDARD, PO_BOX, UNIQUE, MILITARY or INVALID");
+        }
+        types |= 1u << t;
+      }
+    }
+    if (state) {
+      for (int w = 0; w < 4; w++) {
+        c.states[w] = negate ? ~states[w] : states[w];
+      }
+    } else {
+      c.types &= negate ? ~types : types;
+    }
+  } else if (accept("zip")) {
+    uint32_t lo = 0;
+    uint32_t hi = UINT32_MAX;
+    bool negate = false;
+    uint32_t n = 0;
+    if (accept("=") || accept("==")) {
+      if (parse_zip(&n) != 0) {
+        return -1;
+      }
+      lo = hi = n;
+    } else if (accept("!=")) {
+      if (parse_zip(&n) != 0) {
+        return -1;
+      }
+      lo = hi = n;
+      negate = true;
+    } else if (accept("<") || accept("<=")) {
+      bool strict = (tokens[next - 1].text.size() == 1);
+      if (parse_zip(&n) != 0) {
+        return -1;
+      }
+      if (strict && (n == 0)) {
+        return 0;
+      }
+      hi = strict ? n - 1 : n;
+    } else if (accept(">") || accept(">=")) {
+      bool strict = (tokens[next - 1].text.size() == 1);
+      if (parse_zip(&n) != 0) {
+        return -1;
+      }
+      lo = strict ? n + 1 : n;
+    } else {
+      negate = accept("not");
+      if (!accept("between")) {
+        return fail(negate ? "\"between\"" : "a comparison or \"between\"");
+      }
+      if (parse_zip(&lo) != 0) {
+        return -1;
+      }
+      if (!accept("and")) {
+        return fail("\"and\"");
+      }
+      if (parse_zip(&hi) != 0) {
+        return -1;
+      }
+      if (lo > hi) {
+        std::swap(lo, hi);
+      }
+    }
+    c.zips.clear();
+    if (!negate) {
+      c.zips.push_back(Range{lo, hi});
+    } else {
+      if (lo > 0) {
+        c.zips.push_back(Range{0, lo - 1});
+      }
+      if (hi < UINT32_MAX) {
+        c.zips.push_back(Range{hi + 1, UINT32_MAX});
+      }
+    }
+  } else if (accept("lat") || accept("lon")) {
+    bool lat = (strcasecmp(tokens[next - 1].text.c_str(), "lat") == 0);
+    float lo = -INFINITY;
+    float hi = INFINITY;
+    float v;
+    if (accept("<") || accept("<=")) {
+      bool strict = (tokens[next - 1].text.size() == 1);
+      if (parse_degrees(&v) != 0) {
+        return -1;
+      }
+      hi = strict ? nextafterf(v, -INFINITY) : v;
+    } else if (accept(">") || accept(">=")) {
+      bool strict = (tokens[next - 1].text.size() == 1);
+      if (parse_degrees(&v) != 0) {
+        return -1;
+      }
+      lo = strict ? nextafterf(v, INFINITY) : v;
+    } else {
+      bool negate = accept("not");
+      if (!accept("between")) {
+        return fail(negate ? "\"between\"" : "\"<\", \"<=\", \">\", \">=\" or \"between\"");
+      }
+      if (parse_degrees(&lo) != 0) {
+        return -1;
+      }
+      if (!accept("and")) {
+        return fail("\"and\"");
+      }
+      if (parse_degrees(&hi) != 0) {
+        return -1;
+      }
+      if (lo > hi) {
+        std::swap(lo, hi);
+      }
+      if (negate) {
+        // outside the band is one clause below it or one above it
+        Clause below = c;
+        (lat ? below.lat_hi : below.lon_hi) = nextafterf(lo, -INFINITY);
+        (lat ? c.lat_lo : c.lon_lo) = nextafterf(hi, INFINITY);
+        dnf.push_back(below);
+        dnf.push_back(c);
+        return 0;
+      }
+    }
+    (lat ? c.lat_lo : c.lon_lo) = lo;
+    (lat ? c.lat_hi : c.lon_hi) = hi;
+  } else {
+    return fail("state, type, zip, lat, lon or \"(\"");
+  }
+  if (!empty(c)) {
+    dnf.push_back(c);
+  }
+  return 0;
+}
+
+/** Test a record against the filter
+ *
+ * @param zip is the record
+ * @return true if the record passes
+ */
+bool ZipFilter::match (const Zipfed &zip) const {
+  uint8_t state = state_intern(zip.get_state());
+  uint32_t type = 1u << zip.get_type();
+  uint32_t number = zip.get_zip();
+  float lat = zip.get_lat();
+  float lon = zip.get_lon();
+
+  for (size_t i = 0; i < clauses.size(); i++) {
+    const Clause &c = clauses[i];
+    if ((((c.states[state >> 6] >> (state & 63)) & 1) == 0) || ((c.types & type) == 0)) {
+      continue;
+    }
+    // written so that a record without a position passes an open box
+    if ((lat < c.lat_lo) || (lat > c.lat_hi) || (lon < c.lon_lo) || (lon > c.lon_hi)) {
+      continue;
+    }
+    for (size_t z = 0; z < c.zips.size(); z++) {
+      if ((number >= c.zips[z].lo) && (number <= c.zips[z].hi)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
@@ -0,0 +1,86 @@
+/** Record filters given on the command line
+ *
+ * @author Krishna Garg
+ */
+
+#ifndef ZIPFILTER_HPP
+#define ZIPFILTER_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "zipfed.hpp"
+
+/** @brief Filter over zip code records, compiled once from an expression
+ *
+ * An expression is made of tests joined with "and", "or" and parentheses:
+ *   state = MA               state != MA        state in (MA,NH,RI)
+ *   state not in (MA,NH)     type = STANDARD    type != PO_BOX
+ *   type in (STANDARD,UNIQUE)
+ *   zip between 01000 and 02799               zip not between 1 and 999
+ *   zip = 02139  (also !=, <, <=, > and >=)
+ *   lat between 41 and 43    lon > -73          (also <, <=, >=)
+ * Keywords, states and type names may be written in any case.
+ *
+ * The expression is rewritten as an "or" of clauses that only use "and",
+ * and each clause is stored as a set of states (one bit per interned state
+ * code, see state_intern), a set of types (one bit per ZIPCODE_TYPE),
+ * sorted ranges of zip numbers and a lat/lon box. Clauses that only differ
+ * in their states are merged, so "state = MA or state = NH" is one clause.
+ * Matching a record tests a few bits and compares a few numbers; nothing is
+ * parsed or allocated per record.
+ */
+class ZipFilter {
+private:
+  /** @brief Inclusive range of zip numbers */
+  struct Range {
+    uint32_t lo;                    /**< first zip of the range */
+    uint32_t hi;                    /**< last zip of the range */
+  };
+
+  /** @brief Tests that must all hold */
+  struct Clause {
+    uint64_t states[4];             /**< bit per state code */
+    uint32_t types;                 /**< bit per ZIPCODE_TYPE */
+    std::vector<Range> zips;        /**< sorted, disjoint, not empty */
+    float lat_lo;                   /**< smallest latitude allowed */
+    float lat_hi;                   /**< largest latitude allowed */
+    float lon_lo;                   /**< smallest longitude allowed */
+    float lon_hi;                   /**< largest longitude allowed */
+  };
+
+  /** @brief Word of an expression */
+  struct Token {
+    std::string text;               /**< word, number or operator */
+    size_t at;                      /**< offset of the token in the expression */
+  };
+
+  std::vector<Clause> clauses;      /**< the filter passes if any clause does */
+  std::vector<Token> tokens;        /**< expression being compiled */
+  size_t next;                      /**< next token to read */
+  std::string message;              /**< why the last compile failed */
+
+  static Clause everything(void);
+  static bool empty(const Clause &c);
+  static bool intersect(const Clause &a, const Clause &b, Clause &out);
+  static void merge(std::vector<Clause> &dnf);
+  int fail(const char *what);
+  bool accept(const char *word);
+  int parse_or(std::vector<Clause> &dnf);
+  int parse_and(std::vector<Clause> &dnf);
+  int parse_test(std::vector<Clause> &dnf);
+  int parse_list(std::vector<std::string> &items);
+  int parse_zip(uint32_t *zip);
+  int parse_degrees(float *value);
+public:
+  ZipFilter();
+  int compile(const char *expr);
+  bool match(const Zipfed &zip) const;
+  /** @return why the last call to compile failed */
+  const std::string &error() const {return message;}
+  /** @return the number of clauses the expression compiled to */
+  size_t size() const {return clauses.size();}
+};
+
+#endif // ZIPFILTER_HPP
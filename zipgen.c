@@ -0,0 +1,79 @@
+/** Program to write synthetic zip code files of any size for testing and
+ * benchmarking fed2cs2303 and zipcode.
+ *
+ * @author Krishna Garg
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include "zipsynth.hpp"
+
+// records formatted before each write
+#define BATCH (65536)
+
+/** main function to drive program
+ *
+ * usage:
+ *    zipgen [-c] [-s seed] rows output_file
+ *
+ * Writes rows records in federal format (with the header line), or in
+ * cs2303 format with -c. The output file may be "-" for stdout. The same
+ * seed and rows always give the same file (see ZipSynth).
+ *
+ * @param argc is the number of input strings
+ * @param argv is array of cmd line args - zipgen [-c] [-s seed] rows output_file
+ * @return 0 for success. non-zero for error
+ */
+int main (int argc, char *argv[]) {
+  bool cs2303 = false;       // cs2303 format instead of federal
+  uint64_t seed = 2303;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "cs:")) != -1) {
+    if (opt == 'c') {
+      cs2303 = true;
+    } else if (opt == 's') {
+      seed = strtoull(optarg, NULL, 10);
+    } else {
+      break;
+    }
+  }
+  if ((argc - optind != 2) || (opt != -1) || (atoll(argv[optind]) <= 0)) {
+    fprintf(stderr, "usage: %s [-c] [-s seed] rows output_file\n", argv[0]);
+    return -1;
+  }
+  uint64_t rows = strtoull(argv[optind], NULL, 10);
+  const char *outfile = argv[optind + 1];
+
+  FILE *out = (strcmp(outfile, "-") == 0) ? stdout : fopen(outfile, "w");
+  if (out == NULL) {
+    fprintf(stderr, "cannot open %s for output - exiting\n", outfile);
+    return -3;
+  }
+
+  ZipSynth synth(rows, seed);
+  std::string buf;
+  if (!cs2303) {
+    buf = ZipSynth::federal_header();
+    buf += "\r\n";
+  }
+  for (uint64_t done = 0; done < rows; ) {
+    for (int i = 0; (i < BATCH) && (done < rows); i++, done++) {
+      if (cs2303) {
+        synth.cs2303(buf);
+      } else {
+        synth.federal(buf);
+      }
+    }
+    fwrite(buf.data(), 1, buf.size(), out);
+    buf.clear();
+  }
+  if (fclose(out) != 0) {
+    fprintf(stderr, "cannot write %s - exiting\n", outfile);
+    return -3;
+  }
+  return 0;
+}
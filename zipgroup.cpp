@@ -0,0 +1,672 @@
+/** Functions supporting group-by aggregation of zip code records
+ *
+ * @author Krishna Garg
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <algorithm>
+#include "zipgroup.hpp"
+#include "ziptable.hpp"
+
+// slots the hash tables start with, a power of 2
+#define FIRST_SLOTS (64)
+
+/** @brief Name of a key or aggregate on the command line and in the output */
+struct Word {
+  const char *name;         /**< as written */
+  unsigned value;           /**< GROUP_KEY or AGG_KIND */
+};
+
+// in GROUP_KEY order
+static const Word KEY_WORDS[] = {
+  {"state", GROUP_STATE}, {"type", GROUP_TYPE}, {"city", GROUP_CITY}, {"zip3", GROUP_ZIP3}
+};
+
+static const Word AGG_WORDS[] = {
+  {"count", AGG_COUNT}, {"cities", AGG_CITIES}, {"zips", AGG_ZIPS}, {"centroid", AGG_CENTROID},
+  {"bbox", AGG_BBOX}, {"all", AGG_COUNT | AGG_CITIES | AGG_ZIPS | AGG_CENTROID | AGG_BBOX}
+};
+
+/** Look up one comma separated word of a list
+ *
+ * @param words are the words allowed
+ * @param count is the number of words
+ * @param item is the word, in any case
+ * @param value is set to its value
+ * @return zero (0) if success or -1 if the word is not allowed
+ */
+static int find_word (const Word *words, size_t count, std::string_view item, unsigned *value) {
+  for (size_t i = 0; i < count; i++) {
+    if ((strlen(words[i].name) == item.size()) && (strncasecmp(words[i].name, item.data(), item.size()) == 0)) {
+      *value = words[i].value;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/** Split a comma separated list into its words
+ *
+ * @param list is the list
+ * @return the words, without empty ones
+ */
+static std::vector<std::string_view> split_list (const char *list) {
+  std::vector<std::string_view> items;
+  std::string_view rest(list);
+  while (!rest.empty()) {
+    size_t comma = rest.find(',');
+    std::string_view item = rest.substr(0, comma);
+    if (!item.empty()) {
+      items.push_back(item);
+    }
+    rest.remove_prefix((comma == std::string_view::npos) ? rest.size() : comma + 1);
+  }
+  return items;
+}
+
+/** Name of a key, as given and printed
+ *
+ * @param key is the key
+ * @return "state", "type", "city" or "zip3"
+ */
+const char *group_key_name (GROUP_KEY key) {
+  return KEY_WORDS[key].name;
+}
+
+/** Parse a grouping given on the command line
+ *
+ * @param keys is a comma separated list of state, type, city and zip3, in
+ *   output order, or "total" for one group of every record
+ * @param aggs is a comma separated list of count, cities, zips, centroid,
+ *   bbox and all
+ * @param grouping is set to the grouping
+ * @param error is set to what is wrong if the lists are not valid
+ * @return zero (0) if success or -1 on error
+ */
+int parse_grouping (const char *keys, const char *aggs, Grouping &grouping, std::string &error) {
+  grouping.keys.clear();
+  grouping.aggs = 0;
+  if (strcasecmp(keys, "total") != 0) {
+    std::vector<std::string_view> items = split_list(keys);
+    if (items.empty()) {
+      error = "no keys to group by";
+      return -1;
+    }
+    for (size_t i = 0; i < items.size(); i++) {
+      unsigned key;
+      if (find_word(KEY_WORDS, sizeof(KEY_WORDS) / sizeof(KEY_WORDS[0]), items[i], &key) != 0) {
+        error = "unknown key " + std::string(items[i]);
+        return -1;
+      }
+      if (std::find(grouping.keys.begin(), grouping.keys.end(), (GROUP_KEY) key) != grouping.keys.end()) {
+        error = "key " + std::string(items[i]) + " given twice";
+        return -1;
+      }
+      grouping.keys.push_back((GROUP_KEY) key);
+    }
+  }
+  std::vector<std::string_view> items = split_list(aggs);
+  for (size_t i = 0; i < items.size(); i++) {
+    unsigned agg;
+    if (find_word(AGG_WORDS, sizeof(AGG_WORDS) / sizeof(AGG_WORDS[0]), items[i], &agg) != 0) {
+      error = "unknown aggregate " + std::string(items[i]);
+      return -1;
+    }
+    grouping.aggs |= agg;
+  }
+  if (grouping.aggs == 0) {
+    error = "nothing to compute";
+    return -1;
+  }
+  return 0;
+}
+
+/** Ctor for GroupTable. The table starts with no groups.
+ *
+ * @param grouping is what is grouped and computed
+ */
+GroupTable::GroupTable (const Grouping &grouping) : grouping(grouping) {
+  by_city = std::find(grouping.keys.begin(), grouping.keys.end(), GROUP_CITY) != grouping.keys.end();
+  slots.assign(FIRST_SLOTS, 0);
+  name_at.assign(2, 0);
+  name_slots.assign(FIRST_SLOTS, 0);
+  city_pairs.slots.assign(FIRST_SLOTS, 0);
+  city_pairs.size = 0;
+  zip_pairs.slots.assign(FIRST_SLOTS, 0);
+  zip_pairs.size = 0;
+}
+
+/** FNV-1a hash of a city name
+ *
+ * @param name is the name
+ * @return the 32 bit hash of the name
+ */
+uint32_t GroupTable::hash_name (std::string_view name) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < name.size(); i++) {
+    h ^= (unsigned char) name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/** Mix a 64 bit value into a well spread hash
+ *
+ * @param v is the value
+ * @return the hash
+ */
+static inline uint64_t mix (uint64_t v) {
+  v ^= v >> 33;
+  v *= 0xff51afd7ed558ccdULL;
+  v ^= v >> 33;
+  return v;
+}
+
+/** Add a value to a set, growing it to stay at most half full
+ *
+ * @param set is the set
+ * @param value is the value, not 0
+ * @return true if the value was not in the set
+ */
+bool GroupTable::insert (PairSet &set, uint64_t value) {
+  if ((set.size + 1) * 2 > set.slots.size()) {
+    std::vector<uint64_t> old(set.slots.size() * 2, 0);
+    old.swap(set.slots);
+    size_t mask = set.slots.size() - 1;
+    for (size_t i = 0; i < old.size(); i++) {
+      if (old[i] != 0) {
+        size_t j = mix(old[i]) & mask;
+        while (set.slots[j] != 0) {
+          j = (j + 1) & mask;
+        }
+        set.slots[j] = old[i];
+      }
+    }
+  }
+  size_t mask = set.slots.size() - 1;
+  size_t j = mix(value) & mask;
+  while (set.slots[j] != 0) {
+    if (set.slots[j] == value) {
+      return false;
+    }
+    j = (j + 1) & mask;
+  }
+  set.slots[j] = value;
+  set.size++;
+  return true;
+}
+
+/** An interned city name
+ *
+ * @param id is the id intern returned
+ * @return the name
+ */
+std::string_view GroupTable::name (uint32_t id) const {
+  return std::string_view(names.data() + name_at[id], name_at[id + 1] - name_at[id]);
+}
+
+/** Intern a city name
+ *
+ * @param city is the name
+ * @return its id, the same for every record of the name; "" is 0
+ */
+uint32_t GroupTable::intern (std::string_view city) {
+  if (city.empty()) {
+    return 0;
+  }
+  size_t count = name_at.size() - 1;          // names interned, "" included
+  if (count * 2 > name_slots.size()) {
+    std::vector<uint32_t> old(name_slots.size() * 2, 0);
+    old.swap(name_slots);
+    size_t mask = name_slots.size() - 1;
+    for (size_t i = 0; i < old.size(); i++) {
+      if (old[i] != 0) {
+        size_t j = hash_name(name(old[i])) & mask;
+        while (name_slots[j] != 0) {
+          j = (j + 1) & mask;
+        }
+        name_slots[j] = old[i];
+      }
+    }
+  }
+  size_t mask = name_slots.size() - 1;
+  size_t j = hash_name(city) & mask;
+  while (name_slots[j] != 0) {
+    if (name(name_slots[j]) == city) {
+      return name_slots[j];
+    }
+    j = (j + 1) & mask;
+  }
+  names.append(city.data(), city.size());
+  name_at.push_back(names.size());
+  uint32_t id = count;
+  name_slots[j] = id;
+  return id;
+}
+
+/** Find the group of a key, adding it if it is new
+ *
+ * @param key holds the key fields and their hash
+ * @return the index of the group
+ */
+uint32_t GroupTable::find (const Group &key) {
+  if ((groups.size() + 1) * 2 > slots.size()) {
+    std::vector<uint32_t> old(slots.size() * 2, 0);
+    old.swap(slots);
+    size_t mask = slots.size() - 1;
+    for (size_t i = 0; i < old.size(); i++) {
+      if (old[i] != 0) {
+        size_t j = groups[old[i] - 1].hash & mask;
+        while (slots[j] != 0) {
+          j = (j + 1) & mask;
+        }
+        slots[j] = old[i];
+      }
+    }
+  }
+  size_t mask = slots.size() - 1;
+  size_t j = key.hash & mask;
+  while (slots[j] != 0) {
+    const Group &g = groups[slots[j] - 1];
+    if ((g.hash == key.hash) && (g.state == key.state) && (g.type == key.type) && (g.zip3 == key.zip3) &&
+        (g.city == key.city)) {
+      return slots[j] - 1;
+    }
+    j = (j + 1) & mask;
+  }
+  Group g = key;
+  g.cities = 0;
+  g.zips = 0;
+  g.count = 0;
+  g.lat_sum = 0;
+  g.lon_sum = 0;
+  g.lat_min = g.lon_min = INFINITY;
+  g.lat_max = g.lon_max = -INFINITY;
+  groups.push_back(g);
+  slots[j] = groups.size();
+  return groups.size() - 1;
+}
+
+/** Hash the key fields of a group
+ *
+ * @param state is the state code
+ * @param type is the type
+ * @param zip3 is the first 3 digits of the zip code
+ * @param city is the interned city
+ * @return the hash
+ */
+static inline uint32_t hash_key (uint8_t state, uint8_t type, uint16_t zip3, uint32_t city) {
+  uint64_t k = ((uint64_t) city << 32) | ((uint32_t) zip3 << 16) | ((uint32_t) type << 8) | state;
+  return (uint32_t) (mix(k) >> 32);
+}
+
+/** Add a record to its group
+ *
+ * @param zip is the record
+ */
+void GroupTable::add (const Zipfed &zip) {
+  Group key;
+  key.state = 0;
+  key.type = 0;
+  key.zip3 = 0;
+  key.city = 0;
+  uint32_t city = 0;
+  if (by_city || (grouping.aggs & AGG_CITIES)) {
+    city = intern(zip.get_city());
+  }
+  for (size_t k = 0; k < grouping.keys.size(); k++) {
+    switch (grouping.keys[k]) {
+    case GROUP_STATE:
+      key.state = state_intern(zip.get_state());
+      break;
+    case GROUP_TYPE:
+      key.type = zip.get_type();
+      break;
+    case GROUP_CITY:
+      key.city = city;
+      break;
+    case GROUP_ZIP3: {
+      uint32_t z = zip.get_zip();
+      for (int d = zip.get_zip_digits(); d > 3; d--) {
+        z /= 10;
+      }
+      key.zip3 = z;
+      break;
+    }
+    }
+  }
+  key.hash = hash_key(key.state, key.type, key.zip3, key.city);
+
+  uint32_t i = find(key);
+  Group &g = groups[i];
+  float lat = zip.get_lat();
+  float lon = zip.get_lon();
+  g.count++;
+  g.lat_sum += lat;
+  g.lon_sum += lon;
+  g.lat_min = std::min(g.lat_min, lat);
+  g.lat_max = std::max(g.lat_max, lat);
+  g.lon_min = std::min(g.lon_min, lon);
+  g.lon_max = std::max(g.lon_max, lon);
+  if ((grouping.aggs & AGG_CITIES) && insert(city_pairs, ((uint64_t) (i + 1) << 32) | city)) {
+    g.cities++;
+  }
+  if ((grouping.aggs & AGG_ZIPS) && insert(zip_pairs, ((uint64_t) (i + 1) << 32) | zip.get_zip())) {
+    g.zips++;
+  }
+}
+
+/** Add the groups of another table of the same grouping to this one
+ *
+ * @param other is the table, made by another thread
+ */
+void GroupTable::merge (const GroupTable &other) {
+  std::vector<uint32_t> group_of(other.groups.size());        // other's group -> ours
+  std::vector<uint32_t> city_of(other.name_at.size() - 1, UINT32_MAX); // other's city -> ours
+  city_of[0] = 0;
+
+  for (size_t i = 0; i < other.groups.size(); i++) {
+    const Group &o = other.groups[i];
+    Group key = o;
+    if (o.city != 0) {
+      if (city_of[o.city] == UINT32_MAX) {
+        city_of[o.city] = intern(other.name(o.city));
+      }
+      key.city = city_of[o.city];
+    }
+    key.hash = hash_key(key.state, key.type, key.zip3, key.city);
+    uint32_t j = find(key);
+    group_of[i] = j;
+    Group &g = groups[j];
+    g.count += o.count;
+    g.lat_sum += o.lat_sum;
+    g.lon_sum += o.lon_sum;
+    g.lat_min = std::min(g.lat_min, o.lat_min);
+    g.lat_max = std::max(g.lat_max, o.lat_max);
+    g.lon_min = std::min(g.lon_min, o.lon_min);
+    g.lon_max = std::max(g.lon_max, o.lon_max);
+  }
+  // distinct counts are not additive: merge the pairs they were counted from
+  for (size_t s = 0; s < other.city_pairs.slots.size(); s++) {
+    uint64_t v = other.city_pairs.slots[s];
+    if (v == 0) {
+      continue;
+    }
+    uint32_t c = (uint32_t) v;
+    if (city_of[c] == UINT32_MAX) {
+      city_of[c] = intern(other.name(c));
+    }
+    uint32_t j = group_of[(v >> 32) - 1];
+    if (insert(city_pairs, ((uint64_t) (j + 1) << 32) | city_of[c])) {
+      groups[j].cities++;
+    }
+  }
+  for (size_t s = 0; s < other.zip_pairs.slots.size(); s++) {
+    uint64_t v = other.zip_pairs.slots[s];
+    if (v == 0) {
+      continue;
+    }
+    uint32_t j = group_of[(v >> 32) - 1];
+    if (insert(zip_pairs, ((uint64_t) (j + 1) << 32) | (uint32_t) v)) {
+      groups[j].zips++;
+    }
+  }
+}
+
+/** Order of two groups in the output: by each key in turn
+ *
+ * @param a is a group
+ * @param b is another group
+ * @return true if a comes before b
+ */
+bool GroupTable::less (const Group &a, const Group &b) const {
+  for (size_t k = 0; k < grouping.keys.size(); k++) {
+    int c = 0;
+    switch (grouping.keys[k]) {
+    case GROUP_STATE:
+      c = state_name(a.state).compare(state_name(b.state));
+      break;
+    case GROUP_TYPE:
+      c = (int) a.type - (int) b.type;
+      break;
+    case GROUP_CITY:
+      c = name(a.city).compare(name(b.city));
+      break;
+    case GROUP_ZIP3:
+      c = (int) a.zip3 - (int) b.zip3;
+      break;
+    }
+    if (c != 0) {
+      return c < 0;
+    }
+  }
+  return false;
+}
+
+/** The groups in output order
+ *
+ * @return the index of each group, sorted by key
+ */
+std::vector<uint32_t> GroupTable::sorted (void) const {
+  std::vector<uint32_t> order(groups.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {return less(groups[a], groups[b]);});
+  return order;
+}
+
+/** Append a float as it is written in the output
+ *
+ * @param out is the output
+ * @param value is the value
+ * @param floats is how it is written
+ */
+static void append_float (std::string &out, float value, FLOAT_FORMAT floats) {
+  char buf[FLOAT_CHARS];
+  out.append(buf, format_float(buf, value, floats) - buf);
+}
+
+/** Append a CSV field, quoted if it holds a comma, quote or line end
+ *
+ * @param out is the output
+ * @param text is the field
+ */
+static void append_csv (std::string &out, std::string_view text) {
+  if (text.find_first_of(",\"\r\n") == std::string_view::npos) {
+    out.append(text.data(), text.size());
+    return;
+  }
+  out += '"';
+  for (size_t i = 0; i < text.size(); i++) {
+    if (text[i] == '"') {
+      out += '"';
+    }
+    out += text[i];
+  }
+  out += '"';
+}
+
+/** Append a JSON string
+ *
+ * @param out is the output
+ * @param text is the string
+ */
+static void append_json (std::string &out, std::string_view text) {
+  out += '"';
+  for (size_t i = 0; i < text.size(); i++) {
+    unsigned char c = text[i];
+    if ((c == '"') || (c == '\\')) {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+/** Write the groups as CSV: a header line, then a line per group in key
+ *  order with the keys, then count, cities, zips, lat and lon (the
+ *  centroid) and lat_min, lat_max, lon_min and lon_max (the bounding box),
+ *  whichever were asked for
+ *
+ * @param out receives the text
+ * @param floats is how lat/lon are written
+ */
+void GroupTable::write_csv (std::string &out, FLOAT_FORMAT floats) const {
+  std::vector<uint32_t> order = sorted();
+
+  std::string header;
+  for (size_t k = 0; k < grouping.keys.size(); k++) {
+    header += group_key_name(grouping.keys[k]);
+    header += ',';
+  }
+  if (grouping.aggs & AGG_COUNT) {
+    header += "count,";
+  }
+  if (grouping.aggs & AGG_CITIES) {
+    header += "cities,";
+  }
+  if (grouping.aggs & AGG_ZIPS) {
+    header += "zips,";
+  }
+  if (grouping.aggs & AGG_CENTROID) {
+    header += "lat,lon,";
+  }
+  if (grouping.aggs & AGG_BBOX) {
+    header += "lat_min,lat_max,lon_min,lon_max,";
+  }
+  header.back() = '\n';
+  out += header;
+
+  char buf[32];
+  for (size_t n = 0; n < order.size(); n++) {
+    const Group &g = groups[order[n]];
+    for (size_t k = 0; k < grouping.keys.size(); k++) {
+      switch (grouping.keys[k]) {
+      case GROUP_STATE:
+        append_csv(out, state_name(g.state));
+        break;
+      case GROUP_TYPE:
+        out += zip_type_name((ZIPCODE_TYPE) g.type);
+        break;
+      case GROUP_CITY:
+        append_csv(out, name(g.city));
+        break;
+      case GROUP_ZIP3:
+        snprintf(buf, sizeof(buf), "%03u", (unsigned) g.zip3);
+        out += buf;
+        break;
+      }
+      out += ',';
+    }
+    if (grouping.aggs & AGG_COUNT) {
+      snprintf(buf, sizeof(buf), "%llu,", (unsigned long long) g.count);
+      out += buf;
+    }
+    if (grouping.aggs & AGG_CITIES) {
+      snprintf(buf, sizeof(buf), "%u,", g.cities);
+      out += buf;
+    }
+    if (grouping.aggs & AGG_ZIPS) {
+      snprintf(buf, sizeof(buf), "%u,", g.zips);
+      out += buf;
+    }
+    if (grouping.aggs & AGG_CENTROID) {
+      append_float(out, (float) (g.lat_sum / g.count), floats);
+      out += ',';
+      append_float(out, (float) (g.lon_sum / g.count), floats);
+      out += ',';
+    }
+    if (grouping.aggs & AGG_BBOX) {
+      append_float(out, g.lat_min, floats);
+      out += ',';
+      append_float(out, g.lat_max, floats);
+      out += ',';
+      append_float(out, g.lon_min, floats);
+      out += ',';
+      append_float(out, g.lon_max, floats);
+      out += ',';
+    }
+    out.back() = '\n';
+  }
+}
+
+/** Write the groups as a JSON array with an object per group in key
+ *  order, named as the CSV columns are
+ *
+ * @param out receives the text
+ * @param floats is how lat/lon are written
+ */
+void GroupTable::write_json (std::string &out, FLOAT_FORMAT floats) const {
+  std::vector<uint32_t> order = sorted();
+
+  char buf[32];
+  out += '[';
+  for (size_t n = 0; n < order.size(); n++) {
+    const Group &g = groups[order[n]];
+    out += (n == 0) ? "\n      {" : ",\n      {";
+    for (size_t k = 0; k < grouping.keys.size(); k++) {
+      out += '"';
+      out += group_key_name(grouping.keys[k]);
+      out += "\": ";
+      switch (grouping.keys[k]) {
+      case GROUP_STATE:
+        append_json(out, state_name(g.state));
+        break;
+      case GROUP_TYPE:
+        append_json(out, zip_type_name((ZIPCODE_TYPE) g.type));
+        break;
+      case GROUP_CITY:
+        append_json(out, name(g.city));
+        break;
+      case GROUP_ZIP3:
+        snprintf(buf, sizeof(buf), "\"%03u\"", (unsigned) g.zip3);
+        out += buf;
+        break;
+      }
+      out += ", ";
+    }
+    if (grouping.aggs & AGG_COUNT) {
+      snprintf(buf, sizeof(buf), "\"count\": %llu, ", (unsigned long long) g.count);
+      out += buf;
+    }
+    if (grouping.aggs & AGG_CITIES) {
+      snprintf(buf, sizeof(buf), "\"cities\": %u, ", g.cities);
+      out += buf;
+    }
+    if (grouping.aggs & AGG_ZIPS) {
+      snprintf(buf, sizeof(buf), "\"zips\": %u, ", g.zips);
+      out += buf;
+    }
+    if (grouping.aggs & AGG_CENTROID) {
+      out += "\"lat\": ";
+      append_float(out, (float) (g.lat_sum / g.count), floats);
+      out += ", \"lon\": ";
+      append_float(out, (float) (g.lon_sum / g.count), floats);
+      out += ", ";
+    }
+    if (grouping.aggs & AGG_BBOX) {
+      out += "\"lat_min\": ";
+      append_float(out, g.lat_min, floats);
+      out += ", \"lat_max\": ";
+      append_float(out, g.lat_max, floats);
+      out += ", \"lon_min\": ";
+      append_float(out, g.lon_min, floats);
+      out += ", \"lon_max\": ";
+      append_float(out, g.lon_max, floats);
+      out += ", ";
+    }
+    out.resize(out.size() - 2);
+    out += '}';
+  }
+  out += order.empty() ? "]" : "\n    ]";
+}
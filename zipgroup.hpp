@@ -0,0 +1,112 @@
+/** Group-by aggregation of zip code records
+ *
+ * @author Krishna Garg
+ */
+
+#ifndef ZIPGROUP_HPP
+#define ZIPGROUP_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "zipfed.hpp"
+
+// most keys in one grouping
+#define MAX_GROUP_KEYS (4)
+
+/** @brief What records are grouped by
+ */
+typedef enum {
+  GROUP_STATE,              /**< the state */
+  GROUP_TYPE,               /**< the ZIPCODE_TYPE */
+  GROUP_CITY,               /**< the city name */
+  GROUP_ZIP3                /**< the first 3 digits of the zip code */
+} GROUP_KEY;
+
+/** @brief What is computed for each group, one bit each
+ */
+typedef enum {
+  AGG_COUNT = 1,            /**< the number of records */
+  AGG_CITIES = 2,           /**< the number of distinct city names */
+  AGG_ZIPS = 4,             /**< the number of distinct zip codes */
+  AGG_CENTROID = 8,         /**< the mean lat and lon */
+  AGG_BBOX = 16             /**< the smallest and largest lat and lon */
+} AGG_KIND;
+
+/** @brief One group-by: the keys records are grouped by and what is
+ *  computed for each group
+ */
+struct Grouping {
+  std::vector<GROUP_KEY> keys;      /**< the keys, in output order */
+  unsigned aggs;                    /**< AGG_KIND bits */
+};
+
+int parse_grouping(const char *keys, const char *aggs, Grouping &grouping, std::string &error);
+const char *group_key_name(GROUP_KEY key);
+
+/** @brief The groups of one grouping over the records added so far
+ *
+ * Every worker thread adds its records to a table of its own, and the
+ * tables are merged at the end, so adding a record takes no lock. Groups
+ * are found with an open-addressing (linear probing) hash table over the
+ * packed key: the state code (see state_intern), the type, the zip3 and
+ * the interned city. Distinct cities and zip codes of a group are counted
+ * with hash sets of (group, city) and (group, zip) pairs, which are merged
+ * like the groups, so the counts stay exact across threads.
+ */
+class GroupTable {
+private:
+  /** @brief The key and running aggregates of one group */
+  struct Group {
+    uint8_t state;                  /**< state code, 0 if not a key */
+    uint8_t type;                   /**< ZIPCODE_TYPE, 0 if not a key */
+    uint16_t zip3;                  /**< first 3 digits, 0 if not a key */
+    uint32_t city;                  /**< interned city, 0 if not a key */
+    uint32_t hash;                  /**< hash of the key */
+    uint32_t cities;                /**< distinct cities */
+    uint32_t zips;                  /**< distinct zip codes */
+    uint64_t count;                 /**< records */
+    double lat_sum;                 /**< sum of latitudes */
+    double lon_sum;                 /**< sum of longitudes */
+    float lat_min;                  /**< smallest latitude */
+    float lat_max;                  /**< largest latitude */
+    float lon_min;                  /**< smallest longitude */
+    float lon_max;                  /**< largest longitude */
+  };
+
+  /** @brief Open-addressing set of nonzero 64 bit values */
+  struct PairSet {
+    std::vector<uint64_t> slots;    /**< the values, 0 for an empty slot */
+    size_t size;                    /**< values in the set */
+  };
+
+  Grouping grouping;                /**< what is grouped and computed */
+  bool by_city;                     /**< cities must be interned */
+  std::vector<Group> groups;        /**< the groups, in order of first record */
+  std::vector<uint32_t> slots;      /**< group index + 1 per slot, 0 if empty */
+  std::string names;                /**< interned city names, back to back */
+  std::vector<uint32_t> name_at;    /**< start of each name, one more than names; id 0 is "" */
+  std::vector<uint32_t> name_slots; /**< name id per slot, 0 if empty */
+  PairSet city_pairs;               /**< (group + 1, city) pairs seen */
+  PairSet zip_pairs;                /**< (group + 1, zip) pairs seen */
+
+  static uint32_t hash_name(std::string_view name);
+  static bool insert(PairSet &set, uint64_t value);
+  std::string_view name(uint32_t id) const;
+  uint32_t intern(std::string_view city);
+  uint32_t find(const Group &key);
+  bool less(const Group &a, const Group &b) const;
+  std::vector<uint32_t> sorted(void) const;
+public:
+  explicit GroupTable(const Grouping &grouping);
+  void add(const Zipfed &zip);
+  void merge(const GroupTable &other);
+  /** @return the number of groups */
+  size_t size() const {return groups.size();}
+  void write_csv(std::string &out, FLOAT_FORMAT floats) const;
+  void write_json(std::string &out, FLOAT_FORMAT floats) const;
+};
+
+#endif // ZIPGROUP_HPP
@@ -0,0 +1,919 @@
+/** Functions supporting the lookup indexes over zip code records
+ *
+ * @author Krishna Garg
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+#include "zipindex.hpp"
+
+// longest city name find_zips looks up
+#define CITY_NAME (500)
+// longest point query find_near reads
+#define POINT_TEXT (64)
+
+/** Default ctor for CityIndex. The index is empty until build() is called.
+ */
+CityIndex::CityIndex () {
+  mask = 0;
+}
+
+/** FNV-1a hash of a city name
+ *
+ * @param key is the first character of the name (need not be terminated)
+ * @param len is the number of characters in the name
+ * @return the 32 bit hash of the name
+ */
+uint32_t CityIndex::hash (const char *key, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char) key[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/** Build the index from a table of records sorted by city
+ *
+ * Records of the same city must be adjacent in the table (as they are after
+ * ZipTable::sort_by_city). Each run of equal cities becomes one entry and
+ * its zips are copied in table order.
+ *
+ * @param sorted is the table of records, sorted by city
+ */
+void CityIndex::build (const ZipTable &sorted) {
+  std::vector<Entry> runs;
+  std::vector<char> names;
+  std::vector<uint32_t> codes;
+  std::vector<uint8_t> widths;
+
+  for (size_t i = 0; i < sorted.size(); i++) {
+    // the table stores each name once, so a run continues while the
+    // record points at the same name
+    if ((i == 0) || (sorted.get_city_id(i) != sorted.get_city_id(i - 1))) {
+      std::string_view city = sorted.get_city(i);
+      Entry e;
+      e.key_off = names.size();
+      e.key_len = city.size();
+      e.zip_off = codes.size();
+      e.zip_cnt = 0;
+      names.insert(names.end(), city.begin(), city.end());
+      runs.push_back(e);
+    }
+    codes.push_back(sorted.get_zip(i));
+    widths.push_back(sorted.get_zip_digits(i));
+    runs.back().zip_cnt++;
+  }
+
+  // size the table to a power of two at least twice the number of cities
+  // so probe sequences stay short
+  size_t cap = 16;
+  while (cap < runs.size() * 2) {
+    cap <<= 1;
+  }
+  std::vector<uint32_t> table(cap, 0);
+  std::vector<uint32_t> cached(cap, 0);
+  mask = cap - 1;
+
+  // place each entry in the first free slot of its probe sequence
+  for (uint32_t e = 0; e < runs.size(); e++) {
+    uint32_t h = hash(&names[runs[e].key_off], runs[e].key_len);
+    uint32_t i = h & mask;
+    while (table[i] != 0) {
+      i = (i + 1) & mask;
+    }
+    table[i] = e + 1;
+    cached[i] = h;
+  }
+
+  slots.assign(std::move(table));
+  hashes.assign(std::move(cached));
+  entries.assign(std::move(runs));
+  keys.assign(std::move(names));
+  zips.assign(std::move(codes));
+  digits.assign(std::move(widths));
+}
+
+/** Find the zip codes of a city
+ *
+ * @param city is the city name to look for (need not be terminated)
+ * @param len is the number of characters in city
+ * @param count is set to the number of zips found (0 if the city is unknown)
+ * @return pointer to the first zip of the city's run, or NULL if not found
+ */
+const uint32_t *CityIndex::lookup (const char *city, size_t len, size_t *count) const {
+  *count = 0;
+  if (slots.size() == 0) {
+    return NULL;
+  }
+
+  uint32_t h = hash(city, len);
+  for (uint32_t i = h & mask; slots[i] != 0; i = (i + 1) & mask) {
+    if (hashes[i] != h) {
+      continue;
+    }
+    const Entry &e = entries[slots[i] - 1];
+    if ((e.key_len == len) && (memcmp(&keys[e.key_off], city, len) == 0)) {
+      *count = e.zip_cnt;
+      return &zips[e.zip_off];
+    }
+  }
+  return NULL;
+}
+
+/** Upper case of an ASCII character, other bytes unchanged
+ *
+ * @param c is the character
+ * @return its upper case
+ */
+static inline char fold (char c) {
+  return ((c >= 'a') && (c <= 'z')) ? c - 'a' + 'A' : c;
+}
+
+/** @brief State of one fuzzy search, shared by every level of the walk */
+struct CityTrie::Search {
+  char word[TRIE_MAX_WORD];         /**< the query, folded */
+  size_t len;                       /**< characters in word */
+  unsigned edits;                   /**< largest distance accepted */
+  uint8_t rows[256][TRIE_MAX_WORD + 1]; /**< Levenshtein row per depth */
+  std::vector<CityMatch> *out;      /**< matches found */
+};
+
+/** Build the subtree over positions [lo, hi) of the sorted names
+ *
+ * @param names are the folded names in trie order
+ * @param lo is the first name of the subtree
+ * @param hi is one past its last name
+ * @param depth is the length of the path to the subtree; every name in
+ *   the range starts with the same depth characters
+ * @return the node of the subtree
+ */
+uint32_t CityTrie::grow (const std::vector<std::string> &names, uint32_t lo, uint32_t hi, size_t depth) {
+  uint32_t n = nodes.size();
+  Node node;
+  node.lo = lo;
+  node.hi = hi;
+
+  // names that end here sort before the longer ones
+  uint32_t i = lo;
+  while ((i < hi) && (names[i].size() == depth)) {
+    i++;
+  }
+  node.nterm = i - lo;
+
+  // one edge per distinct next character
+  node.nedges = 0;
+  for (uint32_t j = i; j < hi; j++) {
+    if ((j == i) || (names[j][depth] != names[j - 1][depth])) {
+      node.nedges++;
+    }
+  }
+  node.edges = labels.size();
+  labels.resize(labels.size() + node.nedges);
+  children.resize(children.size() + node.nedges);
+  nodes.push_back(node);
+
+  uint32_t edge = node.edges;
+  while (i < hi) {
+    uint32_t j = i + 1;
+    while ((j < hi) && (names[j][depth] == names[i][depth])) {
+      j++;
+    }
+    labels[edge] = names[i][depth];
+    uint32_t child = grow(names, i, j, depth + 1);
+    children[edge++] = child;
+    i = j;
+  }
+  return n;
+}
+
+/** Build the trie over every city of an index
+ *
+ * @param index is the city index; the trie refers to cities by their
+ *   number in it, so it must outlive the trie unchanged
+ */
+void CityTrie::build (const CityIndex &index) {
+  std::vector<std::string> folded(index.cities());
+  for (size_t e = 0; e < folded.size(); e++) {
+    std::string_view name = index.city(e);
+    folded[e].resize(name.size());
+    std::transform(name.begin(), name.end(), folded[e].begin(), fold);
+  }
+
+  // the index is sorted already; folding only reorders mixed case names
+  order.resize(folded.size());
+  for (size_t e = 0; e < order.size(); e++) {
+    order[e] = e;
+  }
+  std::stable_sort(order.begin(), order.end(), [&folded](uint32_t a, uint32_t b) {
+    return folded[a] < folded[b];
+  });
+  std::vector<std::string> names(folded.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    names[i].swap(folded[order[i]]);
+  }
+
+  nodes.clear();
+  labels.clear();
+  children.clear();
+  grow(names, 0, names.size(), 0);
+}
+
+/** Find the cities whose names start with a prefix, ignoring case
+ *
+ * @param prefix is the start of the name (need not be terminated)
+ * @param len is the number of characters in prefix
+ * @param max is the largest number of cities wanted
+ * @param out is set to the cities found, in alphabetical order (so an exact
+ *   match comes first)
+ * @return the number of cities found
+ */
+size_t CityTrie::complete (const char *prefix, size_t len, size_t max, std::vector<CityMatch> &out) const {
+  out.clear();
+  if (nodes.empty()) {
+    return 0;
+  }
+  uint32_t n = 0;
+  for (size_t d = 0; d < len; d++) {
+    char c = fold(prefix[d]);
+    const Node &node = nodes[n];
+    uint32_t e = node.edges;
+    while ((e < node.edges + node.nedges) && (labels[e] != c)) {
+      e++;
+    }
+    if (e == node.edges + node.nedges) {
+      return 0;
+    }
+    n = children[e];
+  }
+  for (uint32_t i = nodes[n].lo; (i < nodes[n].hi) && (out.size() < max); i++) {
+    CityMatch match = {order[i], 0};
+    out.push_back(match);
+  }
+  return out.size();
+}
+
+/** Visit a node during a fuzzy search. Its row of the Levenshtein table is
+ *  already filled in; this reports its names and descends to its children.
+ *
+ * Only the band of cells within edits of the diagonal can stay within the
+ * limit, so each row is computed for that band alone, with a cell just
+ * outside it on each side holding a value over the limit.
+ *
+ * @param search is the search
+ * @param node is the node to visit
+ * @param depth is the length of the path to node
+ */
+void CityTrie::walk (Search &search, uint32_t node, size_t depth) const {
+  const Node &here = nodes[node];
+  const uint8_t *row = search.rows[depth];
+  size_t m = search.len;
+  size_t k = search.edits;
+  uint8_t over = k + 1;
+
+  if ((depth + k >= m) && (row[m] <= k)) {
+    for (uint32_t i = here.lo; i < here.lo + here.nterm; i++) {
+      CityMatch match = {order[i], row[m]};
+      search.out->push_back(match);
+    }
+  }
+  if ((depth + 1 >= 256) || (depth + 1 > m + k)) {
+    return;
+  }
+
+  size_t d = depth + 1;
+  size_t lo = (d > k) ? d - k : 0;
+  size_t hi = std::min(m, d + k);
+  uint8_t *next = search.rows[d];
+  for (uint32_t e = here.edges; e < here.edges + here.nedges; e++) {
+    char c = labels[e];
+    uint8_t best = over;
+    size_t j = lo;
+    if (j == 0) {
+      next[0] = (d < over) ? d : over;
+      best = next[0];
+      j = 1;
+    } else {
+      next[j - 1] = over;
+    }
+    for (; j <= hi; j++) {
+      uint8_t v = std::min(row[j], next[j - 1]) + 1;
+      v = std::min(v, (uint8_t) (row[j - 1] + (search.word[j - 1] != c)));
+      v = std::min(v, over);
+      next[j] = v;
+      best = std::min(best, v);
+    }
+    if (hi < m) {
+      next[hi + 1] = over;
+    }
+    if (best <= k) {
+      walk(search, children[e], d);
+    }
+  }
+}
+
+/** Find the cities whose names are within a few edits of a word, ignoring
+ *  case
+ *
+ * @param word is the word (need not be terminated)
+ * @param len is the number of characters in word, at most TRIE_MAX_WORD
+ * @param edits is the largest Levenshtein distance accepted, at most
+ *   TRIE_MAX_EDITS
+ * @param max is the largest number of cities wanted
+ * @param out is set to the cities found, closest first and alphabetical
+ *   among equally close ones
+ * @return the number of cities found
+ */
+size_t CityTrie::fuzzy (const char *word, size_t len, unsigned edits, size_t max, std::vector<CityMatch> &out) const {
+  Search search;
+
+  out.clear();
+  if (nodes.empty() || (len > TRIE_MAX_WORD)) {
+    return 0;
+  }
+  for (size_t j = 0; j < len; j++) {
+    search.word[j] = fold(word[j]);
+  }
+  search.len = len;
+  search.edits = std::min(edits, (unsigned) TRIE_MAX_EDITS);
+  search.out = &out;
+  for (size_t j = 0; j <= len; j++) {
+    search.rows[0][j] = j;
+  }
+  walk(search, 0, 0);
+
+  std::stable_sort(out.begin(), out.end(), [](const CityMatch &a, const CityMatch &b) {
+    return a.edits < b.edits;
+  });
+  if (out.size() > max) {
+    out.resize(max);
+  }
+  return out.size();
+}
+
+// most points in a leaf of the spatial index
+#define GEO_LEAF (16)
+// slack on box distances for the rounding of float coordinates, in chord
+// units of the unit sphere (about 60 m); it only makes pruning less eager
+#define GEO_SLACK (1e-5)
+// deepest a spatial index can get with 32 bit point numbers
+#define GEO_DEPTH (64)
+
+/** Order of spatial answers: nearest first, ties by table position
+ *
+ * @param a is one answer
+ * @param b is the other answer
+ * @return true if a comes before b
+ */
+static inline bool geo_before (const GeoHit &a, const GeoHit &b) {
+  return (a.km < b.km) || ((a.km == b.km) && (a.rec < b.rec));
+}
+
+/** Position of a point on the unit sphere
+ *
+ * @param lat is the latitude in degrees
+ * @param lon is the longitude in degrees
+ * @param p is set to x, y and z
+ */
+static void sphere_point (double lat, double lon, double p[3]) {
+  const double rad = M_PI / 180.0;
+  p[0] = cos(lat * rad) * cos(lon * rad);
+  p[1] = cos(lat * rad) * sin(lon * rad);
+  p[2] = sin(lat * rad);
+}
+
+/** Straight-line distance through the unit sphere matching a distance
+ *
+ * @param km is a great-circle distance
+ * @return the chord length of that distance on the unit sphere
+ */
+static double chord (double km) {
+  double half = km / (2.0 * EARTH_RADIUS_KM);
+  return (half >= M_PI / 2) ? 2.0 : 2.0 * sin(half);
+}
+
+/** Squared distance from a point to a bounding box
+ *
+ * @param q is the point
+ * @param lo is the low corner of the box
+ * @param hi is the high corner of the box
+ * @return zero inside the box, else the squared distance to its surface
+ */
+static inline double box_distance2 (const double q[3], const float lo[3], const float hi[3]) {
+  double d2 = 0;
+  for (int i = 0; i < 3; i++) {
+    double d = (q[i] < lo[i]) ? lo[i] - q[i] : (q[i] > hi[i]) ? q[i] - hi[i] : 0.0;
+    d2 += d * d;
+  }
+  return d2;
+}
+
+/** The k records nearest to a point, by scanning the whole table
+ *
+ * The reference for GeoIndex::nearest.
+ *
+ * @param table is the table to scan
+ * @param lat is the latitude of the query point in degrees
+ * @param lon is the longitude of the query point in degrees
+ * @param k is the number of records wanted
+ * @param out is set to the answers, nearest first
+ * @return the number of answers (k, or fewer if the table is smaller)
+ */
+size_t nearest_scan (const ZipTable &table, double lat, double lon, size_t k, std::vector<GeoHit> &out) {
+  out.clear();
+  for (size_t i = 0; i < table.size(); i++) {
+    GeoHit hit = {haversine_km(lat, lon, table.get_lat(i), table.get_lon(i)), (uint32_t) i};
+    if (out.size() < k) {
+      out.push_back(hit);
+      std::push_heap(out.begin(), out.end(), geo_before);
+    } else if ((k > 0) && geo_before(hit, out.front())) {
+      std::pop_heap(out.begin(), out.end(), geo_before);
+      out.back() = hit;
+      std::push_heap(out.begin(), out.end(), geo_before);
+    }
+  }
+  std::sort_heap(out.begin(), out.end(), geo_before);
+  return out.size();
+}
+
+/** The records within a distance of a point, by scanning the whole table
+ *
+ * The reference for GeoIndex::within.
+ *
+ * @param table is the table to scan
+ * @param lat is the latitude of the query point in degrees
+ * @param lon is the longitude of the query point in degrees
+ * @param km is the largest distance wanted
+ * @param out is set to the answers, nearest first
+ * @return the number of answers
+ */
+size_t within_scan (const ZipTable &table, double lat, double lon, double km, std::vector<GeoHit> &out) {
+  out.clear();
+  for (size_t i = 0; i < table.size(); i++) {
+    double d = haversine_km(lat, lon, table.get_lat(i), table.get_lon(i));
+    if (d <= km) {
+      GeoHit hit = {d, (uint32_t) i};
+      out.push_back(hit);
+    }
+  }
+  std::sort(out.begin(), out.end(), geo_before);
+  return out.size();
+}
+
+/** Build the subtree over points [begin, end)
+ *
+ * @param points are the points in table order; they are reordered so the
+ *   points of every subtree are contiguous
+ * @param begin is the first point of the subtree
+ * @param end is one past its last point
+ * @return the node of the subtree
+ */
+uint32_t GeoIndex::split (std::vector<Point> &points, uint32_t begin, uint32_t end) {
+  uint32_t n = nodes.size();
+  Node node;
+  for (int d = 0; d < 3; d++) {
+    node.lo[d] = 2.0f;
+    node.hi[d] = -2.0f;
+  }
+  for (uint32_t i = begin; i < end; i++) {
+    for (int d = 0; d < 3; d++) {
+      node.lo[d] = std::min(node.lo[d], points[i].p[d]);
+      node.hi[d] = std::max(node.hi[d], points[i].p[d]);
+    }
+  }
+  node.begin = begin;
+  node.end = end;
+  node.left = 0;
+  node.right = 0;
+  nodes.push_back(node);
+  if (end - begin <= GEO_LEAF) {
+    return n;
+  }
+
+  // cut the widest side of the box at the median
+  int dim = 0;
+  for (int d = 1; d < 3; d++) {
+    if (node.hi[d] - node.lo[d] > node.hi[dim] - node.lo[dim]) {
+      dim = d;
+    }
+  }
+  uint32_t mid = begin + (end - begin) / 2;
+  std::nth_element(points.begin() + begin, points.begin() + mid, points.begin() + end,
+                   [dim](const Point &a, const Point &b) {return a.p[dim] < b.p[dim];});
+  uint32_t left = split(points, begin, mid);
+  uint32_t right = split(points, mid, end);
+  nodes[n].left = left;
+  nodes[n].right = right;
+  return n;
+}
+
+/** Build the index over every record of a table
+ *
+ * @param table is the table of records; the index refers to records by
+ *   position, so the table must not be reordered afterwards
+ */
+void GeoIndex::build (const ZipTable &table) {
+  size_t n = table.size();
+  std::vector<Point> points(n);
+  for (size_t i = 0; i < n; i++) {
+    double p[3];
+    sphere_point(table.get_lat(i), table.get_lon(i), p);
+    for (int d = 0; d < 3; d++) {
+      points[i].p[d] = p[d];
+    }
+    points[i].rec = i;
+  }
+  nodes.clear();
+  nodes.reserve(4 * n / GEO_LEAF + 1);
+  if (n > 0) {
+    split(points, 0, n);
+  }
+
+  // store the points in tree order so a leaf is one contiguous run
+  lats.resize(n);
+  lons.resize(n);
+  recs.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    recs[i] = points[i].rec;
+    lats[i] = table.get_lat(recs[i]);
+    lons[i] = table.get_lon(recs[i]);
+  }
+}
+
+/** The k records nearest to a point
+ *
+ * Walks the tree nearer child first, keeping the best k answers so far in
+ * a heap and skipping every subtree whose box is farther away than the
+ * k-th best answer.
+ *
+ * @param lat is the latitude of the query point in degrees
+ * @param lon is the longitude of the query point in degrees
+ * @param k is the number of records wanted
+ * @param out is set to the answers, nearest first
+ * @return the number of answers (k, or fewer if the index is smaller)
+ */
+size_t GeoIndex::nearest (double lat, double lon, size_t k, std::vector<GeoHit> &out) const {
+  uint32_t stack[GEO_DEPTH];
+  int top = 0;
+  double q[3];
+  double bound = 2.0 + GEO_SLACK;   // chord of the k-th best answer so far
+
+  out.clear();
+  if ((k == 0) || nodes.empty()) {
+    return 0;
+  }
+  sphere_point(lat, lon, q);
+  stack[top++] = 0;
+  while (top > 0) {
+    const Node &node = nodes[stack[--top]];
+    if (box_distance2(q, node.lo, node.hi) > bound * bound) {
+      continue;
+    }
+    if (node.left == 0) {
+      for (uint32_t i = node.begin; i < node.end; i++) {
+        GeoHit hit = {haversine_km(lat, lon, lats[i], lons[i]), recs[i]};
+        if (out.size() < k) {
+          out.push_back(hit);
+          std::push_heap(out.begin(), out.end(), geo_before);
+        } else if (geo_before(hit, out.front())) {
+          std::pop_heap(out.begin(), out.end(), geo_before);
+          out.back() = hit;
+          std::push_heap(out.begin(), out.end(), geo_before);
+        } else {
+          continue;
+        }
+        if (out.size() == k) {
+          bound = chord(out.front().km) + GEO_SLACK;
+        }
+      }
+      continue;
+    }
+    // push the farther child first so the nearer one is searched first
+    const Node &l = nodes[node.left];
+    const Node &r = nodes[node.right];
+    bool left_first = box_distance2(q, l.lo, l.hi) <= box_distance2(q, r.lo, r.hi);
+    stack[top++] = left_first ? node.right : node.left;
+    stack[top++] = left_first ? node.left : node.right;
+  }
+  std::sort_heap(out.begin(), out.end(), geo_before);
+  return out.size();
+}
+
+/** The records within a distance of a point
+ *
+ * @param lat is the latitude of the query point in degrees
+ * @param lon is the longitude of the query point in degrees
+ * @param km is the largest distance wanted
+ * @param out is set to the answers, nearest first
+ * @return the number of answers
+ */
+size_t GeoIndex::within (double lat, double lon, double km, std::vector<GeoHit> &out) const {
+  uint32_t stack[GEO_DEPTH];
+  int top = 0;
+  double q[3];
+  double bound = chord(km) + GEO_SLACK;
+
+  out.clear();
+  if (nodes.empty() || !(km >= 0)) {
+    return 0;
+  }
+  sphere_point(lat, lon, q);
+  stack[top++] = 0;
+  while (top > 0) {
+    const Node &node = nodes[stack[--top]];
+    if (box_distance2(q, node.lo, node.hi) > bound * bound) {
+      continue;
+    }
+    if (node.left == 0) {
+      for (uint32_t i = node.begin; i < node.end; i++) {
+        double d = haversine_km(lat, lon, lats[i], lons[i]);
+        if (d <= km) {
+          GeoHit hit = {d, recs[i]};
+          out.push_back(hit);
+        }
+      }
+      continue;
+    }
+    stack[top++] = node.right;
+    stack[top++] = node.left;
+  }
+  std::sort(out.begin(), out.end(), geo_before);
+  return out.size();
+}
+
+/** Default ctor for ZipIndex. The index is empty until build() is called.
+ */
+ZipIndex::ZipIndex () {
+  table = NULL;
+  count = 0;
+}
+
+/** Build the index over a table
+ *
+ * @param table is the table, which must outlive the index
+ */
+void ZipIndex::build (const ZipTable &table) {
+  ZipEntry empty;
+  memset(&empty, 0, sizeof(empty));
+  empty.rec = NO_RECORD;
+  std::vector<ZipEntry> first(ZIP_SLOTS, empty);
+  std::vector<ZipEntry> more;
+
+  // counting sort of the records by slot, keeping table order in a slot
+  std::vector<uint32_t> start(ZIP_SLOTS + 1, 0);
+  for (size_t i = 0; i < table.size(); i++) {
+    start[table.get_zip(i) % ZIP_SLOTS + 1]++;
+  }
+  for (size_t s = 0; s < ZIP_SLOTS; s++) {
+    start[s + 1] += start[s];
+  }
+  std::vector<uint32_t> order(table.size());
+  std::vector<uint32_t> fill(start.begin(), start.end() - 1);
+  for (size_t i = 0; i < table.size(); i++) {
+    order[fill[table.get_zip(i) % ZIP_SLOTS]++] = i;
+  }
+
+  more.reserve(table.size() - std::min(table.size(), (size_t) ZIP_SLOTS));
+  for (size_t s = 0; s < ZIP_SLOTS; s++) {
+    uint32_t *b = &order[start[s]];
+    uint32_t *e = &order[start[s + 1]];
+    if (b == e) {
+      continue;
+    }
+    // only zips of more than 5 digits share a slot with another zip
+    auto by_zip = [&table](uint32_t x, uint32_t y) {return table.get_zip(x) < table.get_zip(y);};
+    if (!std::is_sorted(b, e, by_zip)) {
+      std::stable_sort(b, e, by_zip);
+    }
+    for (uint32_t *r = b; r < e; r++) {
+      ZipEntry entry;
+      memset(&entry, 0, sizeof(entry));
+      entry.zip = table.get_zip(*r);
+      entry.rec = *r;
+      entry.city = table.get_city_id(*r);
+      entry.lat = table.get_lat(*r);
+      entry.lon = table.get_lon(*r);
+      entry.state = table.get_state_code(*r);
+      entry.type = table.get_type(*r);
+      entry.digits = table.get_zip_digits(*r);
+      // the overflow of a slot is contiguous, so each entry links to the next one
+      entry.next = (r + 1 < e) ? more.size() + 1 + (r != b) : 0;
+      if (r == b) {
+        first[s] = entry;
+      } else {
+        more.push_back(entry);
+      }
+    }
+  }
+
+  slots.swap(first);
+  overflow.swap(more);
+  this->table = &table;
+  count = table.size();
+}
+
+/** Find the first record of a zip code
+ *
+ * @param zip is the zip code
+ * @return the record (next() gives the others), NULL if there is none
+ */
+const ZipEntry *ZipIndex::find (uint32_t zip) const {
+  if (slots.empty()) {
+    return NULL;
+  }
+  const ZipEntry *e = &slots[zip % ZIP_SLOTS];
+  if (e->rec == NO_RECORD) {
+    return NULL;
+  }
+  while (e->zip != zip) {
+    if ((e->next == 0) || (e->zip > zip)) {
+      return NULL;
+    }
+    e = &overflow[e->next - 1];
+  }
+  return e;
+}
+
+// lookups find_batch runs ahead of to prefetch their slots
+#define ZIP_PREFETCH (16)
+
+/** Find the first record of each of many zip codes. The slots of later
+ *  zips are prefetched while earlier ones are looked up, so the cache
+ *  misses of a batch overlap instead of following one another.
+ *
+ * @param zips are the zip codes
+ * @param n is the number of zip codes
+ * @param out is set to the first record of each zip, NULL if there is none
+ */
+void ZipIndex::find_batch (const uint32_t *zips, size_t n, const ZipEntry **out) const {
+  if (slots.empty()) {
+    std::fill(out, out + n, (const ZipEntry *) NULL);
+    return;
+  }
+  const ZipEntry *base = slots.data();
+  for (size_t i = 0; i < n; i++) {
+    if (i + ZIP_PREFETCH < n) {
+      __builtin_prefetch(base + zips[i + ZIP_PREFETCH] % ZIP_SLOTS);
+    }
+    out[i] = find(zips[i]);
+  }
+}
+
+/** Append a record to a buffer in the cs2303 output format, as
+ *  ZipTable::print writes it
+ *
+ * @param e is a record of the index
+ * @param out is the buffer to append to
+ */
+void ZipIndex::print (const ZipEntry &e, std::string &out) const {
+  print_record(out, e.zip, e.digits, (ZIPCODE_TYPE) e.type, table->city_name(e.city), state_name(e.state), e.lat, e.lon);
+}
+
+/** Look up one city in the index and append its zip codes to a buffer
+ *
+ * @param index is the city index to search
+ * @param city is the name of the city in any case (names are stored ALL CAPS)
+ * @param out is the buffer the zip codes are appended to, one per line
+ * @return the number of zip codes found for the city
+ */
+size_t find_zips (const CityIndex &index, std::string_view city, std::string &out) {
+  char upper[CITY_NAME];
+  size_t count = 0;
+  if (city.size() >= sizeof(upper)) {
+    return 0;
+  }
+  for (size_t i = 0; i < city.size(); i++) {
+    upper[i] = toupper((unsigned char) city[i]);
+  }
+  const uint32_t *zips = index.lookup(upper, city.size(), &count);
+  char line[ZIP_CHARS + 1];
+  for (size_t i = 0; i < count; i++) {
+    char *end = format_zip(line, zips[i], index.zip_digits(&zips[i]));
+    *end++ = '\n';
+    out.append(line, end - line);
+  }
+  return count;
+}
+
+/** Convert a zip code query to a number
+ *
+ * @param query is the text, 1 to 9 digits
+ * @param zip is set to the zip code
+ * @return zero (0) if success or -1 if the query is not a zip code
+ */
+int parse_zip_query (std::string_view query, uint32_t *zip) {
+  uint32_t n = 0;
+  if (query.empty() || (query.size() > 9)) {
+    return -1;
+  }
+  for (size_t i = 0; i < query.size(); i++) {
+    unsigned d = (unsigned char) query[i] - '0';
+    if (d > 9) {
+      return -1;
+    }
+    n = n * 10 + d;
+  }
+  *zip = n;
+  return 0;
+}
+
+/** Look up one zip code in the index and append its records to a buffer
+ *
+ * @param index is the zip index to search
+ * @param query is the zip code, up to 9 digits
+ * @param out is the buffer the records are appended to, as cs2303 lines
+ * @return the number of records found, 0 if the query is not a zip code
+ */
+size_t find_records (const ZipIndex &index, std::string_view query, std::string &out) {
+  uint32_t zip;
+  if (parse_zip_query(query, &zip) != 0) {
+    return 0;
+  }
+  size_t found = 0;
+  for (const ZipEntry *e = index.find(zip); e != NULL; e = index.next(e), found++) {
+    index.print(*e, out);
+  }
+  return found;
+}
+
+/** Search the city names for a prefix or a misspelling and append the
+ *  cities found with their zip codes to a buffer
+ *
+ * @param trie is the name index to search
+ * @param index is the city index the trie was built from
+ * @param query is the prefix or the misspelt name, in any case
+ * @param fuzzy is true to match names within TRIE_MAX_EDITS edits of query,
+ *   false to match names starting with query
+ * @param max is the largest number of cities wanted
+ * @param matches is scratch space for the cities found, reused between queries
+ * @param out is the buffer the answers are appended to, one "CITY,zip,zip..."
+ *   line per city, best first
+ * @return the number of cities found
+ */
+size_t find_cities (const CityTrie &trie, const CityIndex &index, std::string_view query, bool fuzzy,
+                    size_t max, std::vector<CityMatch> &matches, std::string &out) {
+  size_t found = fuzzy ? trie.fuzzy(query.data(), query.size(), TRIE_MAX_EDITS, max, matches)
+                       : trie.complete(query.data(), query.size(), max, matches);
+  char line[ZIP_CHARS + 1];
+  for (size_t i = 0; i < found; i++) {
+    size_t count;
+    const uint32_t *zips = index.city_zips(matches[i].city, &count);
+    std::string_view city = index.city(matches[i].city);
+    out.append(city.data(), city.size());
+    for (size_t z = 0; z < count; z++) {
+      line[0] = ',';
+      out.append(line, format_zip(line + 1, zips[z], index.zip_digits(&zips[z])) - line);
+    }
+    out.push_back('\n');
+  }
+  return found;
+}
+
+/** Answer one spatial query and append the zip codes found to a buffer
+ *
+ * @param geo is the spatial index to search
+ * @param table is the table the index was built over
+ * @param query is a point as "lat,lon" (or "lat lon") in degrees
+ * @param k is the number of nearest zip codes wanted, 0 to use km instead
+ * @param km is the radius in km within which every zip code is wanted
+ * @param hits is scratch space for the answers, reused between queries
+ * @param out is the buffer the answers are appended to, one "zip,km" per
+ *   line, nearest first
+ * @return the number of zip codes found, 0 if the query is not a point
+ */
+size_t find_near (const GeoIndex &geo, const ZipTable &table, std::string_view query, size_t k,
+                  double km, std::vector<GeoHit> &hits, std::string &out) {
+  char text[POINT_TEXT];
+  if (query.size() >= sizeof(text)) {
+    return 0;
+  }
+  memcpy(text, query.data(), query.size());
+  text[query.size()] = '\0';
+
+  char *end;
+  double lat = strtod(text, &end);
+  if (end == text) {
+    return 0;
+  }
+  while ((*end == ',') || (*end == ' ') || (*end == '\t')) {
+    end++;
+  }
+  const char *rest = end;
+  double lon = strtod(rest, &end);
+  if (end == rest) {
+    return 0;
+  }
+
+  size_t count = (k > 0) ? geo.nearest(lat, lon, k, hits) : geo.within(lat, lon, km, hits);
+  char line[48];
+  for (size_t i = 0; i < count; i++) {
+    char *p = format_zip(line, table.get_zip(hits[i].rec), table.get_zip_digits(hits[i].rec));
+    p += snprintf(p, line + sizeof(line) - p, ",%.3f\n", hits[i].km);
+    out.append(line, p - line);
+  }
+  return count;
+}
@@ -0,0 +1,259 @@
+/** Lookup indexes built over parsed zip code records
+ *
+ * @author Krishna Garg
+ */
+
+#ifndef ZIPINDEX_HPP
+#define ZIPINDEX_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "ziptable.hpp"
+#include "geodist.hpp"
+
+/** @brief City to zip code index
+ *
+ * An open-addressing (linear probing) hash table keyed by city name. Every
+ * distinct city owns one entry, and the entry refers to a contiguous run of
+ * zip codes in a flat array, so a lookup touches the slot array, the key pool
+ * and one run of zips and never allocates.
+ *
+ * The index is built once from a table that is already sorted by city, which
+ * makes the zips of one city adjacent and keeps them in table order.
+ */
+class CityIndex {
+private:
+  /** @brief One distinct city and the run of zips that belong to it */
+  struct Entry {
+    uint32_t key_off;               /**< offset of the city name in keys */
+    uint32_t key_len;               /**< length of the city name */
+    uint32_t zip_off;               /**< first zip of the run in zips */
+    uint32_t zip_cnt;               /**< number of zips in the run */
+  };
+
+  Column<uint32_t> slots;           /**< entry number + 1, zero when empty */
+  Column<uint32_t> hashes;          /**< cached hash of the slot's key */
+  Column<Entry> entries;            /**< one entry per distinct city */
+  Column<char> keys;                /**< city names, back to back */
+  Column<uint32_t> zips;            /**< zip code runs, one run per entry */
+  Column<uint8_t> digits;           /**< digits each zip of zips is written with */
+  uint32_t mask;                    /**< slots.size() - 1 */
+
+  static uint32_t hash(const char *key, size_t len);
+  friend class Snapshot;
+public:
+  CityIndex();
+  void build(const ZipTable &sorted);
+  const uint32_t *lookup(const char *city, size_t len, size_t *count) const;
+  /** @return the number of distinct cities in the index */
+  size_t cities() const {return entries.size();}
+  /** @return the number of zip codes in the index */
+  size_t size() const {return zips.size();}
+  /** @return the name of city e, cities being numbered in sorted order */
+  std::string_view city(size_t e) const {
+    return std::string_view(&keys[entries[e].key_off], entries[e].key_len);
+  }
+  /** @return the digits zip z is written with, z being one of the zips
+   *  lookup() or city_zips() gave */
+  int zip_digits(const uint32_t *z) const {return digits[z - zips.data()];}
+  /** @return the zips of city e, count set to how many there are */
+  const uint32_t *city_zips(size_t e, size_t *count) const {
+    *count = entries[e].zip_cnt;
+    return &zips[entries[e].zip_off];
+  }
+};
+
+// largest edit distance CityTrie::fuzzy accepts
+#define TRIE_MAX_EDITS (2)
+// longest word CityTrie::fuzzy accepts
+#define TRIE_MAX_WORD (64)
+
+/** @brief One answer of a city name search */
+struct CityMatch {
+  uint32_t city;                    /**< city number in the CityIndex */
+  uint32_t edits;                   /**< edit distance to the query, 0 for prefixes */
+};
+
+/** @brief Case-insensitive prefix and fuzzy search over city names
+ *
+ * A trie over the distinct names of a CityIndex, folded to upper case.
+ * The names arrive sorted, so the cities below any node are a contiguous
+ * range of the trie's city order and a prefix completion is a walk down
+ * the query followed by reading that range. Fuzzy search walks the trie
+ * once with a row of the Levenshtein table per depth, sharing the rows of
+ * common prefixes and giving up on a subtree as soon as every entry of the
+ * row is over the limit.
+ *
+ * Nodes, edge labels and children are flat arrays; the children of a node
+ * are contiguous and sorted by label.
+ */
+class CityTrie {
+private:
+  /** @brief A node: the names that start with the path to it */
+  struct Node {
+    uint32_t lo;                    /**< first position in order below the node */
+    uint32_t hi;                    /**< one past the last position */
+    uint32_t edges;                 /**< first edge of the node */
+    uint16_t nedges;                /**< number of edges */
+    uint16_t nterm;                 /**< names ending here, positions lo.. */
+  };
+
+  std::vector<Node> nodes;          /**< node 0 is the root */
+  std::vector<char> labels;         /**< upper case character of each edge */
+  std::vector<uint32_t> children;   /**< node each edge leads to */
+  std::vector<uint32_t> order;      /**< city numbers in folded name order */
+
+  struct Search;
+
+  uint32_t grow(const std::vector<std::string> &names, uint32_t lo, uint32_t hi, size_t depth);
+  void walk(Search &search, uint32_t node, size_t depth) const;
+public:
+  void build(const CityIndex &index);
+  size_t complete(const char *prefix, size_t len, size_t max, std::vector<CityMatch> &out) const;
+  size_t fuzzy(const char *word, size_t len, unsigned edits, size_t max, std::vector<CityMatch> &out) const;
+  /** @return the number of nodes in the trie */
+  size_t size() const {return nodes.size();}
+  /** @return bytes of heap held by the trie */
+  size_t memory() const {
+    return nodes.capacity() * sizeof(Node) + labels.capacity() +
+           (children.capacity() + order.capacity()) * sizeof(uint32_t);
+  }
+};
+
+/** @brief One answer of a spatial query: a record and its distance */
+struct GeoHit {
+  double km;                        /**< haversine distance to the query */
+  uint32_t rec;                     /**< position of the record in the table */
+};
+
+size_t nearest_scan(const ZipTable &table, double lat, double lon, size_t k, std::vector<GeoHit> &out);
+size_t within_scan(const ZipTable &table, double lat, double lon, double km, std::vector<GeoHit> &out);
+
+/** @brief Spatial index answering nearest-zip and radius queries
+ *
+ * A k-d tree over the records' positions as points on the unit sphere
+ * (x, y, z), so straight-line distance orders points the same way as the
+ * great-circle distance and nothing special happens at the poles or the
+ * date line. Each node keeps the bounding box of its points; the points'
+ * lat/lon are stored in tree order in flat arrays, a leaf being a short
+ * contiguous run of them.
+ *
+ * The boxes only prune the search. Every candidate that survives is
+ * measured with haversine_km on the table's own lat/lon, so the answers
+ * are exactly those of a linear scan (nearest_scan, within_scan),
+ * including the order of ties.
+ */
+class GeoIndex {
+private:
+  /** @brief A subtree: its bounding box and its run of points */
+  struct Node {
+    float lo[3];                    /**< smallest x, y, z in the subtree */
+    float hi[3];                    /**< largest x, y, z in the subtree */
+    uint32_t begin;                 /**< first point of the subtree */
+    uint32_t end;                   /**< one past its last point */
+    uint32_t left;                  /**< first child node, 0 for a leaf */
+    uint32_t right;                 /**< second child node, 0 for a leaf */
+  };
+
+  /** @brief A point while the tree is being built */
+  struct Point {
+    float p[3];                     /**< x, y, z on the unit sphere */
+    uint32_t rec;                   /**< position of the record in the table */
+  };
+
+  std::vector<Node> nodes;          /**< node 0 is the root */
+  std::vector<float> lats;          /**< latitude of each point, tree order */
+  std::vector<float> lons;          /**< longitude of each point, tree order */
+  std::vector<uint32_t> recs;       /**< table position of each point */
+
+  uint32_t split(std::vector<Point> &points, uint32_t begin, uint32_t end);
+public:
+  void build(const ZipTable &table);
+  size_t nearest(double lat, double lon, size_t k, std::vector<GeoHit> &out) const;
+  size_t within(double lat, double lon, double km, std::vector<GeoHit> &out) const;
+  /** @return the number of points in the index */
+  size_t size() const {return recs.size();}
+  /** @return bytes of heap held by the index */
+  size_t memory() const {
+    return nodes.capacity() * sizeof(Node) + (lats.capacity() + lons.capacity()) * sizeof(float) +
+           recs.capacity() * sizeof(uint32_t);
+  }
+};
+
+// slots of a ZipIndex, one per 5-digit zip code
+#define ZIP_SLOTS (100000)
+
+/** @brief One record as a ZipIndex keeps it: everything a zip lookup
+ *  answers, in 32 bytes that never straddle a cache line
+ */
+struct alignas(32) ZipEntry {
+  uint32_t zip;                     /**< zip code as a number */
+  uint32_t rec;                     /**< position of the record in the table, NO_RECORD if empty */
+  uint32_t city;                    /**< city id of the record (ZipTable::get_city_id) */
+  uint32_t next;                    /**< next record of the slot in the overflow, + 1; 0 if none */
+  float lat;                        /**< latitude of the zip */
+  float lon;                        /**< longitude of the zip */
+  uint8_t state;                    /**< interned state code */
+  uint8_t type;                     /**< ZIPCODE_TYPE of the zip */
+  uint8_t digits;                   /**< digits the zip is written with */
+};
+
+// rec of an empty ZipEntry
+#define NO_RECORD (0xFFFFFFFFu)
+
+/** @brief Zip code to record index
+ *
+ * A direct-indexed table of ZIP_SLOTS entries: the first record of zip z
+ * sits in slot z itself (z % ZIP_SLOTS for zips of more than 5 digits), so
+ * a lookup is one cache miss for the entry and at most one more for the
+ * city name. A zip with several records (one zip, several city names) has
+ * the others in an overflow array chained from the slot; a slot's chain is
+ * contiguous and ordered by zip, then table position.
+ *
+ * The entries copy the fields of the records, so the table is only read
+ * for city names.
+ */
+class ZipIndex {
+private:
+  std::vector<ZipEntry> slots;      /**< one entry per slot */
+  std::vector<ZipEntry> overflow;   /**< the other records of each slot */
+  const ZipTable *table;            /**< table the index was built from, for city names */
+  size_t count;                     /**< records in the index */
+public:
+  ZipIndex();
+  void build(const ZipTable &table);
+  const ZipEntry *find(uint32_t zip) const;
+  /** Next record with the same zip code
+   *
+   * @param e is a record found by find() or next()
+   * @return the next record of e's zip, NULL if there is none
+   */
+  const ZipEntry *next(const ZipEntry *e) const {
+    if (e->next == 0) {
+      return NULL;
+    }
+    const ZipEntry *n = &overflow[e->next - 1];
+    return (n->zip == e->zip) ? n : NULL;
+  }
+  void find_batch(const uint32_t *zips, size_t n, const ZipEntry **out) const;
+  void print(const ZipEntry &e, std::string &out) const;
+  /** @return the number of records in the index */
+  size_t size() const {return count;}
+  /** @return bytes of heap held by the index */
+  size_t memory() const {
+    return (slots.capacity() + overflow.capacity()) * sizeof(ZipEntry);
+  }
+};
+
+size_t find_zips(const CityIndex &index, std::string_view city, std::string &out);
+int parse_zip_query(std::string_view query, uint32_t *zip);
+size_t find_records(const ZipIndex &index, std::string_view query, std::string &out);
+size_t find_cities(const CityTrie &trie, const CityIndex &index, std::string_view query, bool fuzzy,
+                   size_t max, std::vector<CityMatch> &matches, std::string &out);
+size_t find_near(const GeoIndex &geo, const ZipTable &table, std::string_view query, size_t k,
+                 double km, std::vector<GeoHit> &hits, std::string &out);
+
+#endif // ZIPINDEX_HPP
@@ -0,0 +1,445 @@
+/** Program to enrich any CSV file that has a zip code column with the
+ * city, state, lat and lon of each zip code, streaming it through a
+ * multithreaded read -> join -> write pipeline.
+ *
+ * @author Krishna Garg
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include "zipfed.hpp"
+#include "csvscan.hpp"
+#include "blockpipe.hpp"
+#include "ziptable.hpp"
+#include "zipindex.hpp"
+#include "zipstats.hpp"
+
+// bytes of input handed to a worker at a time
+#define BLOCK_SIZE (1 << 20)
+// blocks per worker thread, so reading and writing overlap the joins
+#define BLOCKS_PER_THREAD (3)
+// most columns looked at before the join column
+#define MAX_COLUMNS (256)
+// names of the appended columns, for the header line
+#define JOIN_HEADER ",zip_city,zip_state,zip_lat,zip_lon"
+// appended to rows whose zip code is unknown
+#define JOIN_MISSING ",,,,"
+
+/** @brief The appended columns of every zip code, formatted once
+ *
+ * A direct index: the text of zip z is text[at[z], at[z + 1]), empty for
+ * zip codes with no record. Joining a row is then one array lookup and one
+ * copy, whatever the number of rows.
+ */
+struct JoinColumns {
+  std::vector<uint32_t> at;         /**< start of each zip's text, ZIP_SLOTS + 1 entries */
+  std::string text;                 /**< ",city,state,lat,lon" of every zip, back to back */
+};
+
+/** @brief How rows are joined, shared by every worker thread
+ */
+struct Join {
+  JoinColumns columns;              /**< the text appended per zip code */
+  int key;                          /**< column holding the zip code, from 0 */
+  bool inner;                       /**< drop rows whose zip code is unknown */
+};
+
+/** @brief Rows a worker joined, summed once the workers are done
+ */
+struct JoinCount {
+  uint64_t rows;                    /**< rows of the input */
+  uint64_t matched;                 /**< rows whose zip code was found */
+};
+
+/** Format the appended columns of every zip code in a table
+ *
+ * A zip code with several records gets the first of them in the file
+ * (the federal file lists a zip's primary city first).
+ *
+ * @param table is the zip code table, in file order
+ * @param floats is how lat/lon are written
+ * @param columns is filled with the text of each zip code
+ */
+static void format_columns (const ZipTable &table, FLOAT_FORMAT floats, JoinColumns &columns) {
+  ZipIndex zips;
+  std::vector<char> buf;
+
+  zips.build(table);
+  columns.at.resize(ZIP_SLOTS + 1);
+  columns.text.clear();
+  for (uint32_t zip = 0; zip < ZIP_SLOTS; zip++) {
+    columns.at[zip] = columns.text.size();
+    const ZipEntry *e = zips.find(zip);
+    if (e == NULL) {
+      continue;
+    }
+    std::string_view city = table.city_name(e->city);
+    std::string_view state = state_name(e->state);
+    buf.resize(2 * (city.size() + state.size()) + 4 + 2 * FLOAT_CHARS + 4);
+    char *p = buf.data();
+    *p++ = ',';
+    p = format_text(p, city);
+    *p++ = ',';
+    p = format_text(p, state);
+    *p++ = ',';
+    p = format_float(p, e->lat, floats);
+    *p++ = ',';
+    p = format_float(p, e->lon, floats);
+    columns.text.append(buf.data(), p - buf.data());
+  }
+  columns.at[ZIP_SLOTS] = columns.text.size();
+}
+
+/** Read the zip code of a row. Leading zeros lost by spreadsheets and
+ *  ZIP+4 codes ("01234-5678" or 9 digits) are accepted.
+ *
+ * @param field is the join column of the row
+ * @param zip is set to the 5 digit zip code
+ * @return zero (0) if success or -1 if the field is not a zip code
+ */
+static int join_key (std::string_view field, uint32_t *zip) {
+  while (!field.empty() && (field.front() == ' ')) {
+    field.remove_prefix(1);
+  }
+  while (!field.empty() && (field.back() == ' ')) {
+    field.remove_suffix(1);
+  }
+  size_t dash = field.find('-');
+  if ((dash != std::string_view::npos) && (dash == 5) && (field.size() == 10)) {
+    field = field.substr(0, 5);     // ZIP+4
+  } else if (field.size() == 9) {
+    field = field.substr(0, 5);     // ZIP+4 without the dash
+  }
+  if (field.size() > 5) {
+    return -1;
+  }
+  return parse_zip_query(field, zip);
+}
+
+/** Join every row of a block into the block's output. Runs on a worker
+ *  thread.
+ *
+ * Each row is copied as it is, less its line end, then the columns of its
+ * zip code are appended, or empty columns if the zip code is unknown (the
+ * row is dropped instead for an inner join). Blank lines are dropped.
+ *
+ * @param b is the block, its in is joined into its out
+ * @param join is how rows are joined
+ * @param count is set to the rows of the block
+ */
+static void join_block (Block &b, const Join &join, JoinCount &count) {
+  std::string_view fields[MAX_COLUMNS];
+  const char *p = b.in.data();
+  const char *end = p + b.in.size();
+
+  b.out.clear();
+  b.out.reserve(b.in.size() + b.in.size() / 2);
+  count.rows = 0;
+  count.matched = 0;
+  while (p < end) {
+    const char *nl = (const char *) memchr(p, '\n', end - p);
+    const char *next = (nl != NULL) ? nl + 1 : end;
+    const char *last = (nl != NULL) ? nl : end;   // end of the row, before \r\n
+    if ((last > p) && (last[-1] == '\r')) {
+      last--;
+    }
+    if (last == p) {
+      p = next;
+      continue;
+    }
+    count.rows++;
+
+    CsvScanner scanner(p, last - p);
+    uint32_t zip;
+    size_t from = 0;
+    size_t to = 0;
+    if ((scanner.next(fields, join.key + 1) > join.key) && (join_key(fields[join.key], &zip) == 0)) {
+      from = join.columns.at[zip];
+      to = join.columns.at[zip + 1];
+    }
+    if (to > from) {
+      count.matched++;
+    }
+    if ((to > from) || !join.inner) {
+      b.out.append(p, last - p);
+      if (to > from) {
+        b.out.append(join.columns.text, from, to - from);
+      } else {
+        b.out.append(JOIN_MISSING);
+      }
+      if (next > last) {
+        b.out.append(last, next - last);
+      } else {
+        b.out += '\n';              // last line of the input had no newline
+      }
+    }
+    p = next;
+  }
+}
+
+/** Worker thread: join blocks in input order until the input ends
+ *
+ * @param pipe is the pipeline
+ * @param join is how rows are joined
+ * @param total is set to the rows the worker joined
+ * @param convert receives the time spent joining
+ */
+static void join_worker (BlockPipe &pipe, const Join &join, JoinCount &total, PhaseTotal &convert) {
+  Block *b;
+  total.rows = 0;
+  total.matched = 0;
+  while ((b = pipe.take()) != NULL) {
+    JoinCount count;
+    {
+      PhaseTimer timer(convert);
+      join_block(*b, join, count);
+    }
+    stats.count(COUNT_ROWS_READ, count.rows);
+    stats.count(COUNT_ROWS_PARSED, count.rows);
+    if (join.inner) {
+      stats.count(COUNT_ROWS_FILTERED, count.rows - count.matched);
+    }
+    total.rows += count.rows;
+    total.matched += count.matched;
+    pipe.finish(b, 0);
+  }
+}
+
+/** Writer thread: write the joined blocks in input order and free them
+ *  for the reader
+ *
+ * @param pipe is the pipeline
+ * @param out is the output file
+ * @param write receives the time spent writing
+ */
+static void write_blocks (BlockPipe &pipe, FILE *out, PhaseTotal &write) {
+  Block *b;
+  while ((b = pipe.next_done()) != NULL) {
+    {
+      PhaseTimer timer(write);
+      if (fwrite(b->out.data(), 1, b->out.size(), out) != b->out.size()) {
+        pipe.fail(-3);
+        return;
+      }
+    }
+    stats.count(COUNT_BYTES_OUT, b->out.size());
+    pipe.release(b);
+  }
+}
+
+/** Find the join column named on the command line
+ *
+ * @param spec is a column number counting from 1, or a column name
+ * @param header is the header line, or empty if the input has none
+ * @return the column, counting from 0, or -1 if there is no such column
+ */
+static int find_column (const char *spec, std::string_view header) {
+  std::string_view fields[MAX_COLUMNS];
+
+  if (strspn(spec, "0123456789") == strlen(spec)) {
+    int n = atoi(spec);
+    return ((n >= 1) && (n <= MAX_COLUMNS)) ? n - 1 : -1;
+  }
+  CsvScanner scanner(header.data(), header.size());
+  int n = scanner.next(fields, MAX_COLUMNS);
+  for (int i = 0; i < n && i < MAX_COLUMNS; i++) {
+    if ((fields[i].size() == strlen(spec)) && (strncasecmp(fields[i].data(), spec, fields[i].size()) == 0)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/** main function to drive program
+ *
+ * usage:
+ *    zipjoin [-j threads] [-k column] [-i] [-n] [-g] [--stats[=json]] zip_file input_file output_file
+ *
+ * zip_file is a cs2303 file (see fed2cs2303). input_file is any CSV file
+ * with a zip code column, chosen with -k by its name in the header line or
+ * by its number counting from 1 (default "zip"). Each row of input_file is
+ * written to output_file with four columns appended: the city, state, lat
+ * and lon of its zip code, or four empty columns if the zip code is not
+ * known. The header line gets JOIN_HEADER appended. Either file name may be
+ * "-" for stdin / stdout.
+ *
+ * Approach:
+ * 1) Load zip_file and format the appended columns of every zip code once,
+ *    in a direct index by zip code (see JoinColumns)
+ * 2) Read input_file in blocks of complete lines on this thread
+ * 3) Worker threads (-j, default 1) join the rows of each block: find the
+ *    zip code column, look it up and copy the row and its columns out
+ * 4) A writer thread writes the joined blocks in input order
+ *
+ * The stages overlap, and a block is only read into once the writer is done
+ * with it, so memory use is BLOCKS_PER_THREAD blocks per worker whatever
+ * the size of the input, and rows come out in input order.
+ *
+ * With -i (inner join) rows whose zip code is not known are dropped
+ * instead. With -n the input has no header line, and -k must be a number.
+ * With -g lat/lon are written as the shortest text that reads back as the
+ * same float. With --stats the time spent reading, joining (summed over
+ * the workers) and writing, the rows and the bytes are printed on stderr
+ * at the end; the rows an inner join drops count as filtered.
+ *
+ * Rows are split at newlines, so a quoted field must not hold one.
+ *
+ * @param argc is the number of input strings
+ * @param argv is array of cmd line args -
+ *        zipjoin [-j threads] [-k column] [-i] [-n] [-g] [--stats[=json]] zip_file input_file output_file
+ * @return 0 for success. non-zero for error
+ */
+int main (int argc, char *argv[]) {
+  const char *keyspec = "zip";     // the join column, by name or number
+  bool header = true;             // the first line names the columns
+  FLOAT_FORMAT floats = FLOAT_FIXED;
+  int threads = 1;
+  Join join;
+  int opt;
+  static const struct option longopts[] = {
+    {"stats", optional_argument, NULL, 'T'},
+    {NULL, 0, NULL, 0}
+  };
+
+  join.inner = false;
+  while ((opt = getopt_long(argc, argv, "j:k:ing", longopts, NULL)) != -1) {
+    if ((opt == 'j') && (atoi(optarg) > 0)) {
+      threads = atoi(optarg);
+    } else if (opt == 'k') {
+      keyspec = optarg;
+    } else if (opt == 'i') {
+      join.inner = true;
+    } else if (opt == 'n') {
+      header = false;
+    } else if (opt == 'g') {
+      floats = FLOAT_SHORTEST;
+    } else if ((opt == 'T') && (stats.option(optarg) == 0)) {
+      continue;
+    } else {
+      break;
+    }
+  }
+  if ((argc - optind != 3) || (opt != -1)) {
+    fprintf(stderr, "usage: %s [-j threads] [-k column] [-i] [-n] [-g] [--stats[=json]] zip_file input_file output_file\n", argv[0]);
+    return -1;
+  }
+  const char *zipfile = argv[optind];
+  const char *infile = argv[optind + 1];
+  const char *outfile = argv[optind + 2];
+
+  // the zip codes: parsed once, then only the formatted columns are kept
+  {
+    MappedFile zipdata;
+    ZipTable table;
+    PhaseTimer timer(PHASE_LOAD);
+    if (zipdata.open(zipfile) != 0) {
+      fprintf(stderr, "cannot open %s for input - exiting\n", zipfile);
+      return -2;
+    }
+    if (table.load_cs2303(zipdata.data(), zipdata.size()) != 0) {
+      fprintf(stderr, "failed to process input record - exiting\n");
+      return -4;
+    }
+    format_columns(table, floats, join.columns);
+  }
+
+  int fdIn = (strcmp(infile, "-") == 0) ? STDIN_FILENO : open(infile, O_RDONLY);
+  if (fdIn < 0) {
+    fprintf(stderr, "cannot open %s for input - exiting\n", infile);
+    return -2;
+  }
+  FILE *out = (strcmp(outfile, "-") == 0) ? stdout : fopen(outfile, "w");
+  if (out == NULL) {
+    fprintf(stderr, "cannot open %s for output - exiting\n", outfile);
+    close(fdIn);
+    return -3;
+  }
+
+  LineBlockReader reader(fdIn, BLOCK_SIZE);
+  const char *block;
+  long sz_block;
+  {
+    PhaseTimer timer(PHASE_READ);
+    sz_block = reader.next(&block);
+  }
+
+  // the header line names the join column and is written straight away
+  std::string_view first;
+  if (header && (sz_block > 0)) {
+    std::string_view line = take_line(&block, &sz_block);
+    first = line;
+    while (!first.empty() && ((first.back() == '\n') || (first.back() == '\r'))) {
+      first.remove_suffix(1);
+    }
+    fwrite(first.data(), 1, first.size(), out);
+    fputs(JOIN_HEADER, out);
+    fwrite(line.data() + first.size(), 1, line.size() - first.size(), out);
+    if (line.back() != '\n') {
+      fputc('\n', out);
+    }
+    stats.count(COUNT_BYTES_IN, line.size());
+  }
+  join.key = find_column(keyspec, first);
+  if (join.key < 0) {
+    fprintf(stderr, "no column %s in %s - exiting\n", keyspec, infile);
+    if (fdIn != STDIN_FILENO) {
+      close(fdIn);
+    }
+    if (out != stdout) {
+      fclose(out);
+    }
+    return -1;
+  }
+
+  BlockPipe pipe(threads * BLOCKS_PER_THREAD, true);
+  std::vector<JoinCount> counts(threads);
+  std::vector<PhaseTotal> converts(threads, PhaseTotal(PHASE_CONVERT));
+  PhaseTotal writes(PHASE_WRITE);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.push_back(std::thread(join_worker, std::ref(pipe), std::cref(join), std::ref(counts[t]),
+                                  std::ref(converts[t])));
+  }
+  std::thread writer(write_blocks, std::ref(pipe), out, std::ref(writes));
+
+  // read each block into the next free one, until the input ends
+  int status = 0;
+  if (pipe.pump(reader, block, sz_block) != 0) {
+    fprintf(stderr, "cannot read %s - exiting\n", infile);
+    status = -2;
+  }
+  pipe.close();
+  uint64_t rows = 0;
+  uint64_t matched = 0;
+  for (size_t t = 0; t < workers.size(); t++) {
+    workers[t].join();
+    converts[t].report();
+    rows += counts[t].rows;
+    matched += counts[t].matched;
+  }
+  writer.join();
+  writes.report();
+
+  if (fdIn != STDIN_FILENO) {
+    close(fdIn);
+  }
+  if (((fclose(out) != 0) || (pipe.error() != 0)) && (status == 0)) {
+    fprintf(stderr, "cannot write %s - exiting\n", outfile);
+    status = -3;
+  }
+  fprintf(stderr, "joined %llu rows, %llu with a known zip code\n", (unsigned long long) rows,
+          (unsigned long long) matched);
+  if (stats.on) {
+    stats.print(stderr);
+  }
+  return status;
+}
@@ -0,0 +1,274 @@
+/** Load generator for the zipcode server (zipcode --serve): many
+ * connections, each keeping a window of pipelined requests in flight,
+ * reporting throughput and the latency of each request.
+ *
+ * @author Krishna Garg
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include "zipserver.hpp"
+#include "zipstats.hpp"
+
+// most requests a connection may have in flight
+#define MAX_DEPTH (4096)
+// bytes read from the socket per recv
+#define RECV_BYTES (65536)
+
+/** @brief What one connection did */
+struct Client {
+  std::thread thread;               /**< the thread driving the connection */
+  size_t first;                     /**< query it starts with */
+  uint64_t requests;                /**< requests it sends */
+  uint64_t replies[3];              /**< replies received, by REPLY_STATUS */
+  uint64_t bytes;                   /**< bytes of replies received */
+  LatencyHistogram latency;         /**< send to reply time of each request */
+  int status;                       /**< zero (0) or the errno that stopped it */
+};
+
+/** Connect to the server
+ *
+ * @param path is the path of the server's socket
+ * @return the socket, or -1 on error (errno tells why)
+ */
+static int connect_to (const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if ((fd >= 0) && (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/** Send the whole of a buffer
+ *
+ * @param fd is the socket
+ * @param data is the buffer
+ * @return zero (0) if success or -1 on error
+ */
+static int send_all (int fd, const std::string &data) {
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+    if (n > 0) {
+      done += n;
+    } else if ((n < 0) && (errno == EINTR)) {
+      continue;
+    } else {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** Drive one connection: keep depth requests in flight until all of its
+ *  requests are answered. Requests go out in batches, each time a read
+ *  brings in replies, as a pipelining client would send them. With
+ *  half_close every request is sent at once and the sending side shut
+ *  down before any reply is read, so the server must answer all of them
+ *  after it has seen the end of the requests.
+ *
+ * @param client receives the results
+ * @param path is the path of the server's socket
+ * @param op is the SERVER_OP of every request
+ * @param queries are the query texts, used in turn from client.first
+ * @param depth is the number of requests kept in flight
+ * @param half_close sends everything and shuts down writing first
+ */
+static void drive (Client &client, const char *path, uint8_t op,
+                   const std::vector<std::string> &queries, size_t depth, bool half_close) {
+  int fd = connect_to(path);
+  if (fd < 0) {
+    client.status = errno;
+    return;
+  }
+  if (half_close) {
+    depth = (client.requests > 0) ? client.requests : 1;
+  }
+  std::vector<uint64_t> sent_at(depth);   // send time of each request in flight, a ring
+  std::string out;
+  std::string in;
+  char buf[RECV_BYTES];
+  uint64_t sent = 0;
+  uint64_t done = 0;
+  size_t next = client.first;
+
+  while (done < client.requests) {
+    out.clear();
+    uint64_t now = stats_clock();
+    while ((sent < client.requests) && (sent - done < depth)) {
+      frame_append(out, op, queries[next]);
+      next = (next + 1 < queries.size()) ? next + 1 : 0;
+      sent_at[sent % depth] = now;
+      sent++;
+    }
+    if (!out.empty() && (send_all(fd, out) != 0)) {
+      client.status = errno;
+      break;
+    }
+    if (half_close && !out.empty() && (shutdown(fd, SHUT_WR) != 0)) {
+      client.status = errno;
+      break;
+    }
+
+    ssize_t got = recv(fd, buf, sizeof(buf), 0);
+    if (got <= 0) {
+      if ((got < 0) && (errno == EINTR)) {
+        continue;
+      }
+      client.status = (got == 0) ? ECONNRESET : errno;
+      break;
+    }
+    now = stats_clock();
+    in.append(buf, got);
+    client.bytes += got;
+    size_t at = 0;
+    while ((in.size() - at >= FRAME_HEADER) && (in.size() - at >= 4 + (size_t) frame_length(&in[at]))) {
+      uint8_t status = in[at + 4];
+      client.replies[(status <= (uint8_t) REPLY_BAD_REQUEST) ? status : (uint8_t) REPLY_BAD_REQUEST]++;
+      client.latency.record(now - sent_at[done % depth]);
+      done++;
+      at += 4 + frame_length(&in[at]);
+    }
+    in.erase(0, at);
+  }
+  close(fd);
+}
+
+/** main function to drive program
+ *
+ * usage:
+ *    zipload [-c connections] [-n requests] [-d depth] [-s] [-z | -p] query_file socket_path
+ *
+ * Each line of query_file is one query: a city name, or with -z a zip code
+ * and with -p the start of a city name. Every connection runs on its own
+ * thread and keeps depth requests in flight (1 for one request at a time)
+ * until it has sent its share of the requests, cycling through the queries
+ * from its own starting point. With -s each connection instead sends all
+ * of its requests at once, shuts down its sending side and then reads the
+ * replies, as a batch client would; its share of requests must then fit
+ * in what the server buffers (1 MB of requests). The results are written to stdout as one
+ * JSON object: requests, seconds, requests/s, the replies by status and
+ * the latency of the requests (mean, percentiles, max) in nanoseconds.
+ *
+ * @param argc is the number of input strings
+ * @param argv is array of cmd line args -
+ *        zipload [-c connections] [-n requests] [-d depth] [-s] [-z | -p] query_file socket_path
+ * @return 0 for success. non-zero for error
+ */
+int main (int argc, char *argv[]) {
+  int connections = 4;
+  uint64_t requests = 100000;
+  size_t depth = 16;
+  uint8_t op = OP_CITY;
+  bool half_close = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:n:d:szp")) != -1) {
+    if ((opt == 'c') && (atoi(optarg) > 0)) {
+      connections = atoi(optarg);
+    } else if ((opt == 'n') && (atoll(optarg) > 0)) {
+      requests = strtoull(optarg, NULL, 10);
+    } else if ((opt == 'd') && (atoi(optarg) > 0) && (atoi(optarg) <= MAX_DEPTH)) {
+      depth = atoi(optarg);
+    } else if (opt == 's') {
+      half_close = true;
+    } else if (opt == 'z') {
+      op = OP_ZIP;
+    } else if (opt == 'p') {
+      op = OP_PREFIX;
+    } else {
+      break;
+    }
+  }
+  if ((argc - optind != 2) || (opt != -1)) {
+    fprintf(stderr, "usage: %s [-c connections] [-n requests] [-d depth] [-s] [-z | -p] query_file socket_path\n", argv[0]);
+    return -1;
+  }
+  const char *queryfile = argv[optind];
+  const char *path = argv[optind + 1];
+
+  std::vector<std::string> queries;
+  FILE *in = fopen(queryfile, "r");
+  if (in == NULL) {
+    fprintf(stderr, "cannot open %s for input - exiting\n", queryfile);
+    return -2;
+  }
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, in)) > 0) {
+    while ((len > 0) && ((line[len - 1] == '\n') || (line[len - 1] == '\r'))) {
+      len--;
+    }
+    if ((len > 0) && (len <= MAX_QUERY)) {
+      queries.push_back(std::string(line, len));
+    }
+  }
+  free(line);
+  fclose(in);
+  if (queries.empty()) {
+    fprintf(stderr, "no queries in %s - exiting\n", queryfile);
+    return -2;
+  }
+
+  std::vector<Client> clients(connections);
+  uint64_t t0 = stats_clock();
+  for (int i = 0; i < connections; i++) {
+    Client &c = clients[i];
+    c.first = (queries.size() * i) / connections;
+    c.requests = requests / connections + ((uint64_t) i < requests % connections);
+    memset(c.replies, 0, sizeof(c.replies));
+    c.bytes = 0;
+    c.status = 0;
+    c.thread = std::thread(drive, std::ref(c), path, op, std::cref(queries), depth, half_close);
+  }
+  LatencyHistogram latency;
+  uint64_t replies[3] = {0, 0, 0};
+  uint64_t bytes = 0;
+  int status = 0;
+  for (int i = 0; i < connections; i++) {
+    Client &c = clients[i];
+    c.thread.join();
+    latency.merge(c.latency);
+    for (int s = 0; s < 3; s++) {
+      replies[s] += c.replies[s];
+    }
+    bytes += c.bytes;
+    if ((c.status != 0) && (status == 0)) {
+      status = c.status;
+    }
+  }
+  double secs = (stats_clock() - t0) / 1e9;
+
+  if (status != 0) {
+    fprintf(stderr, "cannot query %s: %s\n", path, strerror(status));
+  }
+  printf("{\"connections\": %d, \"depth\": %zu, \"requests\": %llu, \"seconds\": %.6f, "
+         "\"requests_per_sec\": %.0f, \"ok\": %llu, \"not_found\": %llu, \"bad_request\": %llu, "
+         "\"reply_bytes\": %llu, \"latency_ns\": {\"mean\": %.1f, \"p50\": %llu, \"p90\": %llu, "
+         "\"p99\": %llu, \"p999\": %llu, \"max\": %llu}}\n",
+         connections, depth, (unsigned long long) latency.count(), secs,
+         (secs > 0) ? latency.count() / secs : 0.0, (unsigned long long) replies[REPLY_OK],
+         (unsigned long long) replies[REPLY_NOT_FOUND], (unsigned long long) replies[REPLY_BAD_REQUEST],
+         (unsigned long long) bytes, latency.mean(), (unsigned long long) latency.percentile(50),
+         (unsigned long long) latency.percentile(90), (unsigned long long) latency.percentile(99),
+         (unsigned long long) latency.percentile(99.9), (unsigned long long) latency.max());
+  return (status != 0) ? -3 : 0;
+}
@@ -0,0 +1,126 @@
+/** Read-copy-update pointer: lock-free reads of data that is replaced as a
+ *  whole while it is being read
+ *
+ * @author Krishna Garg
+ */
+
+#ifndef ZIPRCU_HPP
+#define ZIPRCU_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+/** @brief Pointer to an immutable object that a writer replaces while a
+ *  fixed set of readers keep reading, epoch style
+ *
+ * Each reader has a slot in which it pins the epoch it entered in while it
+ * uses the object, and clears it (0) when it leaves; entering and leaving
+ * are an atomic load and store each, so readers never wait. publish()
+ * swaps in a new object with one atomic exchange and bumps the epoch; the
+ * old object is retired with that epoch and reclaim() deletes it once no
+ * reader is pinned to an earlier epoch, i.e. once the last reader that
+ * could have seen it has left. Only one thread may publish and reclaim.
+ *
+ * A reader must not keep a pointer from enter() after leave().
+ */
+template <class T>
+class RcuPointer {
+private:
+  /** @brief The slot of one reader, on its own cache line */
+  struct alignas(64) Reader {
+    std::atomic<uint64_t> pinned;   /**< epoch entered in, 0 when outside */
+  };
+
+  /** @brief An object replaced but perhaps still being read */
+  struct Retired {
+    T *object;                      /**< the object */
+    uint64_t epoch;                 /**< readers entered before this may hold it */
+  };
+
+  std::atomic<T *> current;         /**< the object readers get */
+  std::atomic<uint64_t> epoch;      /**< bumped by every publish, from 1 */
+  std::vector<Reader> readers;      /**< one slot per reader */
+  std::vector<Retired> retired;     /**< objects waiting to be deleted */
+
+public:
+  /** Ctor for RcuPointer
+   *
+   * @param count is the number of readers, numbered 0 to count - 1
+   * @param object is the first object, owned from now on (may be NULL)
+   */
+  RcuPointer(int count, T *object) : current(object), epoch(1), readers(count) {
+    for (int r = 0; r < count; r++) {
+      readers[r].pinned.store(0);
+    }
+  }
+
+  /** Dtor for RcuPointer. No reader may be inside. */
+  ~RcuPointer() {
+    for (size_t i = 0; i < retired.size(); i++) {
+      delete retired[i].object;
+    }
+    delete current.load();
+  }
+
+  RcuPointer(const RcuPointer &) = delete;
+  RcuPointer &operator=(const RcuPointer &) = delete;
+
+  /** Start reading
+   *
+   * @param r is the reader
+   * @return the current object, valid until leave(r)
+   */
+  const T *enter(int r) {
+    readers[r].pinned.store(epoch.load(std::memory_order_acquire), std::memory_order_seq_cst);
+    return current.load(std::memory_order_seq_cst);
+  }
+
+  /** Stop reading
+   *
+   * @param r is the reader
+   */
+  void leave(int r) {
+    readers[r].pinned.store(0, std::memory_order_release);
+  }
+
+  /** Replace the object. The old one is deleted by a later reclaim().
+   *
+   * @param object is the new object, owned from now on
+   */
+  void publish(T *object) {
+    T *old = current.exchange(object, std::memory_order_seq_cst);
+    uint64_t e = epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+    if (old != NULL) {
+      Retired r = {old, e};
+      retired.push_back(r);
+    }
+  }
+
+  /** Delete the replaced objects no reader can still hold
+   *
+   * @return the number of replaced objects still waiting
+   */
+  size_t reclaim() {
+    uint64_t oldest = UINT64_MAX;   // earliest epoch a reader is pinned to
+    for (size_t r = 0; r < readers.size(); r++) {
+      uint64_t e = readers[r].pinned.load(std::memory_order_seq_cst);
+      if ((e != 0) && (e < oldest)) {
+        oldest = e;
+      }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < retired.size(); i++) {
+      if (retired[i].epoch <= oldest) {
+        delete retired[i].object;
+      } else {
+        retired[kept++] = retired[i];
+      }
+    }
+    retired.resize(kept);
+    return kept;
+  }
+};
+
+#endif // ZIPRCU_HPP
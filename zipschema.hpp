@@ -0,0 +1,206 @@
+/** Column layouts of zip code CSV files, declared once and turned into
+ *  parsers by the compiler
+ *
+ * @author Krishna Garg
+ */
+
+#ifndef ZIPSCHEMA_HPP
+#define ZIPSCHEMA_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <iterator>
+#include "zipfed.hpp"
+
+/** @brief One column of a layout: where it is and what it becomes
+ */
+struct FieldSpec {
+  int column;               /**< position in the line, from 0 */
+  FIELD_KIND kind;          /**< member it is parsed into */
+  bool quoted;              /**< written in double quotes, which parse_line removes */
+};
+
+/** @brief Layout of the federal file (free-zipcode-database-Primary.csv)
+ *
+ * A schema is a struct with a constexpr array of FieldSpec named fields,
+ * listing the columns in the order they are parsed, and header, the text
+ * of the first column of a header line (NULL if the files have none).
+ * Columns not listed are skipped without being looked at.
+ */
+struct FederalSchema {
+  static constexpr FieldSpec fields[] = {
+    {1, FIELD_ZIP, true}, {2, FIELD_TYPE, true}, {3, FIELD_CITY, true}, {4, FIELD_STATE, true},
+    {6, FIELD_LAT, false}, {7, FIELD_LON, false}
+  };
+  static constexpr const char *header = "RecordNumber";
+};
+
+/** @brief Layout of the cs2303 file fed2cs2303 writes: zip,type,city,state,lat,lon
+ *
+ * The city and state are in double quotes when they hold a comma or a quote
+ * (see format_text).
+ */
+struct Cs2303Schema {
+  static constexpr FieldSpec fields[] = {
+    {0, FIELD_ZIP, false}, {1, FIELD_TYPE, false}, {2, FIELD_CITY, true}, {3, FIELD_STATE, true},
+    {4, FIELD_LAT, false}, {5, FIELD_LON, false}
+  };
+  static constexpr const char *header = NULL;
+};
+
+/** Number of columns a line of a schema must have: one past the last
+ *  column it uses
+ *
+ * @return the number of columns
+ */
+template <class Schema>
+constexpr int schema_columns () {
+  int n = 0;
+  for (const FieldSpec &f : Schema::fields) {
+    n = (f.column + 1 > n) ? f.column + 1 : n;
+  }
+  return n;
+}
+
+int parse_zip_number(std::string_view token, uint32_t *zip, uint8_t *digits);
+int parse_coord(std::string_view token, float *value);
+ZIPCODE_TYPE parse_zip_type(std::string_view token);
+
+/** Parse one column into its member
+ *
+ * @param token is the column text, without quotes
+ * @return zero (0) if success or -2 if a zip, lat or lon is not a number
+ *   (or, for a line, missing)
+ */
+template <FIELD_KIND Kind, bool Line>
+int Zipfed::parse_field (std::string_view token) {
+  if constexpr ((Kind == FIELD_ZIP) || (Kind == FIELD_LAT) || (Kind == FIELD_LON)) {
+    if (Line && (token.data() == NULL)) {
+      return -2;
+    }
+  }
+  if constexpr (Kind == FIELD_ZIP) {
+    return (parse_zip_number(token, &zipcode, &zipdigits) != 0) ? -2 : 0;
+  } else if constexpr (Kind == FIELD_TYPE) {
+    zctype = parse_zip_type(token);
+  } else if constexpr (Kind == FIELD_CITY) {
+    city.assign(token.data(), token.size());
+  } else if constexpr (Kind == FIELD_STATE) {
+    state.assign(token.data(), token.size());
+  } else if constexpr (Kind == FIELD_LAT) {
+    return (parse_coord(token, &lat) != 0) ? -2 : 0;
+  } else {
+    return (parse_coord(token, &lon) != 0) ? -2 : 0;
+  }
+  return 0;
+}
+
+/** Parse the columns of a schema in the order it lists them, one call per
+ *  column, unrolled at compile time; stops at the first that fails
+ *
+ * @param tokens are the columns of the line
+ * @return zero (0) if success or non-zero on error.
+ */
+template <class Schema, bool Line, size_t... I>
+int Zipfed::parse_schema (const std::string_view *tokens, std::index_sequence<I...>) {
+  int status = 0;
+  ((status = (status == 0) ? parse_field<Schema::fields[I].kind, Line>(tokens[Schema::fields[I].column]) : status),
+   ...);
+  return status;
+}
+
+/** Method to initialize the object from the fields of a record laid out as
+ *  a schema says (see FederalSchema)
+ *
+ * @param fields are the columns of one record, split and unquoted by a
+ *   CsvScanner or CsvIndexScanner
+ * @param count is the number of columns in fields
+ * @return zero (0) if success, -1 if the record has too few columns, -2 if
+ *   a zip, lat or lon is not a number or -3 for a header line
+ */
+template <class Schema>
+int Zipfed::parse_fields (const std::string_view *fields, int count) {
+  if (count < schema_columns<Schema>()) {
+    return -1;
+  }
+  if constexpr (Schema::header != NULL) {
+    if (fields[0] == Schema::header) {
+      return -3;
+    }
+  }
+  return parse_schema<Schema, false>(fields, std::make_index_sequence<std::size(Schema::fields)>());
+}
+
+/** Method to parse a line laid out as a schema says and initialize the
+ *  object
+ *
+ * The line is split at commas as strtok splits it, only as far as the last
+ * column the schema uses, and the double quotes of quoted columns are
+ * removed in place, so nothing is copied or allocated but the city and
+ * state. A column the line does not have is empty.
+ *
+ * @param csv is the line, without its line end; it is modified
+ * @return zero (0) if success or non-zero on error, as parse_fields
+ */
+template <class Schema>
+int Zipfed::parse_line (char *csv) {
+  constexpr int columns = schema_columns<Schema>();
+  std::string_view tokens[columns];
+  bool quoted[columns] = {};
+  for (const FieldSpec &f : Schema::fields) {
+    quoted[f.column] = f.quoted;
+  }
+  quoted[0] = quoted[0] || (Schema::header != NULL);  // so a quoted header is recognised
+
+  if ((csv == NULL) || (*csv == '\0')) {
+    return -1;
+  }
+  char *save = NULL;
+  char *token = strtok_r(csv, ",", &save);
+  for (int c = 0; (c < columns) && (token != NULL); c++) {
+    char *out = token;
+    for (char *p = token; *p != '\0'; p++) {
+      if (!quoted[c] || (*p != '"')) {
+        *out++ = *p;
+      }
+    }
+    tokens[c] = std::string_view(token, out - token);
+    token = (c + 1 < columns) ? strtok_r(NULL, ",", &save) : NULL;
+  }
+  if constexpr (Schema::header != NULL) {
+    if (tokens[0] == Schema::header) {
+      return -3;
+    }
+  }
+  return parse_schema<Schema, true>(tokens, std::make_index_sequence<std::size(Schema::fields)>());
+}
+
+/** @brief Where the columns of a CSV file with a header line are, found at
+ *  run time from the names in the header
+ *
+ * For files whose layout is not known when the program is compiled. Each
+ * record costs a loop over the mapped columns instead of the unrolled code
+ * of a schema. Column names are matched in any case and with or without
+ * '_' and ' ': zip, zipcode, zip code, postal code, postcode; type,
+ * zipcodetype, zip type; city, place; state, st; lat, latitude; lon, long,
+ * lng, longitude. zip, city and state must be there; a missing type is
+ * INVALID and a missing lat or lon is 0.
+ */
+class ColumnMap {
+private:
+  int column[FIELD_LON + 1];        /**< column of each FIELD_KIND, -1 if missing */
+  int columns;                      /**< one past the last column used */
+public:
+  ColumnMap();
+  int build(const std::string_view *names, int count, std::string &error);
+  /** @return the number of columns a record must have */
+  int size() const {return columns;}
+  /** @return the column of a member, -1 if the file does not have it */
+  int at(FIELD_KIND kind) const {return column[kind];}
+};
+
+#endif // ZIPSCHEMA_HPP
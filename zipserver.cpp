@@ -0,0 +1,359 @@
+/** Functions supporting the zip code lookup server
+ *
+ * @author Krishna Garg
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "zipserver.hpp"
+
+// epoll events handled per wait
+#define MAX_EVENTS (64)
+// bytes read from a socket per recv
+#define RECV_BYTES (65536)
+// bytes of replies waiting for a client before it is not read from
+#define MAX_PENDING (1 << 20)
+
+/** Ctor for ZipServer. Nothing is served until open() and start().
+ *
+ * @param data is the dataset to answer from, owned by the server from now on
+ * @param max is the largest number of cities answered per prefix query
+ * @param threads is the number of workers
+ */
+ZipServer::ZipServer (Dataset *data, size_t max, int threads)
+  : data(threads, data), max(max), threads(threads) {
+  listen_fd = -1;
+  stop_fd = -1;
+  inode = 0;
+}
+
+/** Dtor for ZipServer. Stops the workers if they are still running.
+ */
+ZipServer::~ZipServer () {
+  stop();
+}
+
+/** Create the socket and start listening on it. A socket left at path by
+ *  an earlier server is replaced; any other file there is an error.
+ *
+ * @param path is the path of the socket
+ * @return zero (0) if success or -1 on error (errno tells why)
+ */
+int ZipServer::open (const char *path) {
+  struct sockaddr_un addr;
+  struct stat st;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  if ((lstat(path, &st) == 0) && S_ISSOCK(st.st_mode)) {
+    unlink(path);
+  }
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if ((listen_fd < 0) || (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)) {
+    return -1;
+  }
+  this->path = path;
+  if ((lstat(path, &st) != 0) || (listen(listen_fd, SOMAXCONN) != 0)) {
+    return -1;
+  }
+  inode = st.st_ino;
+  stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return (stop_fd < 0) ? -1 : 0;
+}
+
+/** Start the worker threads. Returns once they are running.
+ *
+ * @return zero (0) if success or -1 on error (errno tells why)
+ */
+int ZipServer::start (void) {
+  struct epoll_event ev;
+
+  workers.resize(threads);
+  for (int i = 0; i < threads; i++) {
+    workers[i].id = i;
+    workers[i].epfd = -1;
+  }
+  for (int i = 0; i < threads; i++) {
+    Worker &w = workers[i];
+    w.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (w.epfd < 0) {
+      return -1;
+    }
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &listen_fd;
+    if (epoll_ctl(w.epfd, EPOLL_CTL_ADD, listen_fd, &ev) != 0) {
+      return -1;
+    }
+    // never read, so it wakes every worker for good once written
+    ev.events = EPOLLIN;
+    ev.data.ptr = &stop_fd;
+    if (epoll_ctl(w.epfd, EPOLL_CTL_ADD, stop_fd, &ev) != 0) {
+      return -1;
+    }
+  }
+  for (int i = 0; i < threads; i++) {
+    workers[i].thread = std::thread(&ZipServer::serve, this, std::ref(workers[i]));
+  }
+  return 0;
+}
+
+/** Stop the workers, close every connection and remove the socket. The
+ *  latency of the requests answered is added to stats.latency.
+ */
+void ZipServer::stop (void) {
+  if (stop_fd >= 0) {
+    uint64_t one = 1;
+    if (write(stop_fd, &one, sizeof(one)) != sizeof(one)) {
+      perror("eventfd");
+    }
+  }
+  for (size_t i = 0; i < workers.size(); i++) {
+    Worker &w = workers[i];
+    if (w.thread.joinable()) {
+      w.thread.join();
+    }
+    stats.latency.merge(w.latency);
+    if (w.epfd >= 0) {
+      close(w.epfd);
+    }
+  }
+  workers.clear();
+  if (listen_fd >= 0) {
+    // a newer server may have taken the path over, and its socket stays
+    struct stat st;
+    if ((lstat(path.c_str(), &st) == 0) && (st.st_ino == inode)) {
+      unlink(path.c_str());
+    }
+    close(listen_fd);
+    listen_fd = -1;
+  }
+  if (stop_fd >= 0) {
+    close(stop_fd);
+    stop_fd = -1;
+  }
+}
+
+/** Replace the dataset. Requests answered from now on use the new one;
+ *  the old one is deleted by reclaim() once no worker can be using it.
+ *  Only one thread may publish and reclaim.
+ *
+ * @param data is the new dataset, owned by the server from now on
+ */
+void ZipServer::publish (Dataset *data) {
+  this->data.publish(data);
+}
+
+/** Delete the replaced datasets no worker is answering from any more
+ *
+ * @return the number of replaced datasets still in use
+ */
+size_t ZipServer::reclaim (void) {
+  return data.reclaim();
+}
+
+/** Event loop of one worker, until stop() is called
+ *
+ * @param w is the worker
+ */
+void ZipServer::serve (Worker &w) {
+  struct epoll_event events[MAX_EVENTS];
+  bool running = true;
+
+  while (running) {
+    int n = epoll_wait(w.epfd, events, MAX_EVENTS, -1);
+    if ((n < 0) && (errno != EINTR)) {
+      perror("epoll_wait");
+      break;
+    }
+    // whatever is published while these events are handled waits for the next wait
+    const Dataset *d = data.enter(w.id);
+    for (int i = 0; i < n; i++) {
+      void *ptr = events[i].data.ptr;
+      if (ptr == &listen_fd) {
+        accept_all(w);
+      } else if (ptr == &stop_fd) {
+        running = false;
+      } else {
+        Connection &c = *(Connection *) ptr;
+        bool open = true;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+          // read what has come, until the socket is empty or the client is done
+          char buf[RECV_BYTES];
+          while (!c.closed && (c.in.size() < MAX_PENDING)) {
+            ssize_t got = recv(c.fd, buf, sizeof(buf), 0);
+            if (got > 0) {
+              c.in.append(buf, got);
+            } else if (got == 0) {
+              c.closed = true;
+            } else if (errno == EINTR) {
+              continue;
+            } else {
+              open = (errno == EAGAIN) || (errno == EWOULDBLOCK);
+              break;
+            }
+          }
+        }
+        if (open) {
+          // a client done sending still gets every reply: pump() only leaves
+          // c.out empty once c.in holds no complete request
+          open = pump(w, c, *d) && !(c.closed && c.out.empty());
+        }
+        if (!open) {
+          close(c.fd);
+          w.conns.erase(c.fd);
+        }
+      }
+    }
+    data.leave(w.id);
+  }
+  for (std::unordered_map<int, Connection>::iterator it = w.conns.begin(); it != w.conns.end(); ++it) {
+    close(it->first);
+  }
+  w.conns.clear();
+}
+
+/** Accept every connection waiting on the listening socket
+ *
+ * @param w is the worker that owns the connections from now on
+ */
+void ZipServer::accept_all (Worker &w) {
+  struct epoll_event ev;
+  int fd;
+
+  // another worker may take them first, and then accept4 fails with EAGAIN
+  while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    Connection &c = w.conns[fd];
+    c.fd = fd;
+    c.events = EPOLLIN;
+    c.closed = false;
+    c.sent = 0;
+    ev.events = c.events;
+    ev.data.ptr = &c;
+    if (epoll_ctl(w.epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      close(fd);
+      w.conns.erase(fd);
+    }
+  }
+}
+
+/** Answer the complete requests of a connection and send the replies,
+ *  for as long as the client keeps up
+ *
+ * @param w is the worker of the connection
+ * @param c is the connection
+ * @param d is the dataset to answer from
+ * @return true to keep the connection, false to close it (error, or a
+ *   frame that is not the protocol)
+ */
+bool ZipServer::pump (Worker &w, Connection &c, const Dataset &d) {
+  for (;;) {
+    size_t at = 0;
+    size_t answered = 0;
+    while ((c.out.size() - c.sent < MAX_PENDING) && (c.in.size() - at >= FRAME_HEADER)) {
+      uint32_t len = frame_length(&c.in[at]);
+      if ((len < 1) || (len > MAX_QUERY + 1)) {
+        return false;
+      }
+      if (c.in.size() - at < 4 + len) {
+        break;
+      }
+      answer(w, d, c.in[at + 4], std::string_view(&c.in[at + FRAME_HEADER], len - 1), c.out);
+      at += 4 + len;
+      answered++;
+    }
+    c.in.erase(0, at);
+    stats.count(COUNT_QUERIES, answered);
+
+    while (c.sent < c.out.size()) {
+      ssize_t n = send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent, MSG_NOSIGNAL);
+      if (n > 0) {
+        c.sent += n;
+        stats.count(COUNT_BYTES_OUT, n);
+      } else if ((n < 0) && (errno == EINTR)) {
+        continue;
+      } else if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+        break;
+      } else {
+        return false;
+      }
+    }
+    if (c.sent == c.out.size()) {
+      c.out.clear();
+      c.sent = 0;
+    } else if (c.sent > 0) {
+      c.out.erase(0, c.sent);
+      c.sent = 0;
+    }
+
+    // all sent and more requests waiting: they were held back by MAX_PENDING
+    if (!c.out.empty() || (c.in.size() < FRAME_HEADER) ||
+        (c.in.size() < 4 + (size_t) frame_length(c.in.data()))) {
+      break;
+    }
+  }
+
+  // wait for room to send, not for more requests, while replies are waiting
+  uint32_t want = c.out.empty() ? EPOLLIN : EPOLLOUT;
+  if (want != c.events) {
+    struct epoll_event ev;
+    ev.events = want;
+    ev.data.ptr = &c;
+    if (epoll_ctl(w.epfd, EPOLL_CTL_MOD, c.fd, &ev) != 0) {
+      return false;
+    }
+    c.events = want;
+  }
+  return true;
+}
+
+/** Answer one request and append the reply frame to a buffer
+ *
+ * @param w is the worker answering it
+ * @param d is the dataset to answer from
+ * @param op is the SERVER_OP of the request
+ * @param query is the text of the request
+ * @param out is the buffer the reply is appended to
+ */
+void ZipServer::answer (Worker &w, const Dataset &d, uint8_t op, std::string_view query, std::string &out) {
+  uint64_t t0 = stats.on ? stats_clock() : 0;
+  size_t at = out.size();
+  size_t found = 0;
+  uint8_t status = REPLY_OK;
+
+  out.append(FRAME_HEADER, '\0');
+  if (op == OP_CITY) {
+    found = find_zips(d.index, query, out);
+  } else if (op == OP_ZIP) {
+    found = find_records(d.zips, query, out);
+  } else if (op == OP_PREFIX) {
+    found = find_cities(d.trie, d.index, query, false, max, w.matches, out);
+  } else {
+    status = REPLY_BAD_REQUEST;
+  }
+  if ((status == REPLY_OK) && (found == 0)) {
+    status = REPLY_NOT_FOUND;
+  }
+
+  uint32_t len = out.size() - at - 4;
+  out[at] = (char) len;
+  out[at + 1] = (char) (len >> 8);
+  out[at + 2] = (char) (len >> 16);
+  out[at + 3] = (char) (len >> 24);
+  out[at + 4] = (char) status;
+  if (t0 != 0) {
+    w.latency.record(stats_clock() - t0);
+  }
+}
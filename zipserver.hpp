@@ -0,0 +1,149 @@
+/** Lookup server answering zip code queries over a Unix domain socket
+ *
+ * @author Krishna Garg
+ */
+
+#ifndef ZIPSERVER_HPP
+#define ZIPSERVER_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <unordered_map>
+#include "ziptable.hpp"
+#include "zipindex.hpp"
+#include "zipstats.hpp"
+#include "snapshot.hpp"
+#include "ziprcu.hpp"
+
+/* Wire format. Every message is a frame: a 4-byte little-endian length of
+ * the rest of the frame, a code byte, then text. The code of a request is
+ * what it asks for (SERVER_OP) and its text is the query; the code of a
+ * reply is a REPLY_STATUS and its text the answer, in the format zipcode
+ * prints. Replies come back in the order the requests of a connection were
+ * sent, so a client may send many requests before it reads any reply.
+ */
+
+// bytes of a frame before its text: the length and the code
+#define FRAME_HEADER (5)
+// longest query text a request may carry
+#define MAX_QUERY (1024)
+
+/** @brief What a request asks for
+ */
+typedef enum {
+  OP_CITY = 'C',            /**< the zip codes of a city, one per line */
+  OP_ZIP = 'Z',             /**< the records of a zip code, as cs2303 lines */
+  OP_PREFIX = 'P'           /**< cities starting with the text, "CITY,zip,zip..." lines */
+} SERVER_OP;
+
+/** @brief How a request was answered
+ */
+typedef enum {
+  REPLY_OK,                 /**< the answer is the text */
+  REPLY_NOT_FOUND,          /**< nothing matched, no text */
+  REPLY_BAD_REQUEST         /**< the code is unknown, no text */
+} REPLY_STATUS;
+
+/** Append a frame to a buffer
+ *
+ * @param out is the buffer
+ * @param code is the SERVER_OP of a request or the REPLY_STATUS of a reply
+ * @param text is the query or the answer
+ */
+inline void frame_append(std::string &out, uint8_t code, std::string_view text) {
+  uint32_t len = text.size() + 1;
+  char header[FRAME_HEADER] = {(char) len, (char) (len >> 8), (char) (len >> 16), (char) (len >> 24),
+                               (char) code};
+  out.append(header, FRAME_HEADER);
+  out.append(text.data(), text.size());
+}
+
+/** Length field of the frame starting at p
+ *
+ * @param p is the first byte of the frame, with at least 4 bytes there
+ * @return the number of bytes of the frame after the length field
+ */
+inline uint32_t frame_length(const char *p) {
+  const unsigned char *b = (const unsigned char *) p;
+  return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+/** @brief Everything queries are answered from: the records and their
+ *  indexes, built together and never changed once served
+ */
+struct Dataset {
+  Snapshot snapshot;                  /**< keeps table and index mapped, if loaded from a snapshot */
+  ZipTable table;                     /**< all records, sorted by city */
+  CityIndex index;                    /**< city -> zip codes */
+  CityTrie trie;                      /**< city names, for prefix queries */
+  ZipIndex zips;                      /**< zip code -> records */
+};
+
+/** @brief Serves city, zip and prefix queries over a Unix domain socket
+ *
+ * The dataset is built by the caller and only read here, so any number of
+ * threads can answer from it. It can be replaced while the server runs:
+ * publish() swaps in a new one through an RcuPointer, requests that arrive
+ * afterwards are answered from it, and the old one is deleted by reclaim()
+ * once no worker is still answering from it. Workers never wait for a
+ * reload; they pin the dataset only while handling the events of one
+ * epoll_wait. Each worker thread runs
+ * its own epoll loop; all of them wait on the listening socket
+ * (EPOLLEXCLUSIVE wakes one per connection) and a connection stays with
+ * the worker that accepted it, so its requests are answered in order with
+ * no hand-off between threads. Every complete request that has arrived is
+ * answered before the replies are sent with one send(), which is what makes
+ * pipelined requests cheap. A client that does not read its replies is not
+ * read from either once MAX_PENDING bytes of replies wait for it.
+ */
+class ZipServer {
+private:
+  /** @brief One client connection */
+  struct Connection {
+    int fd;                           /**< the socket */
+    uint32_t events;                  /**< epoll events asked for */
+    bool closed;                      /**< the client has finished sending */
+    std::string in;                   /**< bytes received and not yet answered */
+    std::string out;                  /**< replies not yet sent */
+    size_t sent;                      /**< bytes at the start of out already sent */
+  };
+
+  /** @brief A thread with its own epoll set, connections and scratch space */
+  struct Worker {
+    std::thread thread;               /**< the thread running serve() */
+    int id;                           /**< its reader number in data */
+    int epfd;                         /**< its epoll set */
+    std::unordered_map<int, Connection> conns;  /**< its connections by socket */
+    std::vector<CityMatch> matches;   /**< answers of one prefix query */
+    LatencyHistogram latency;         /**< time to answer each request */
+  };
+
+  RcuPointer<Dataset> data;           /**< the dataset answered from */
+  size_t max;                         /**< cities answered per prefix query */
+  int threads;                        /**< number of workers */
+  std::string path;                   /**< path of the socket */
+  ino_t inode;                        /**< inode of the socket at path */
+  int listen_fd;                      /**< the listening socket, -1 if not open */
+  int stop_fd;                        /**< eventfd that tells the workers to stop */
+  std::vector<Worker> workers;        /**< the worker threads */
+
+  void serve(Worker &w);
+  void accept_all(Worker &w);
+  bool pump(Worker &w, Connection &c, const Dataset &d);
+  void answer(Worker &w, const Dataset &d, uint8_t op, std::string_view query, std::string &out);
+public:
+  ZipServer(Dataset *data, size_t max, int threads);
+  ~ZipServer();
+  int open(const char *path);
+  int start(void);
+  void stop();
+  void publish(Dataset *data);
+  size_t reclaim(void);
+};
+
+#endif // ZIPSERVER_HPP
@@ -0,0 +1,312 @@
+/** Program to sort zip code records larger than memory by city (or any
+ * other keys) into a cs2303 file, and optionally a snapshot of it for
+ * zipcode.
+ *
+ * @author Krishna Garg
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include "zipfed.hpp"
+#include "zipschema.hpp"
+#include "csvscan.hpp"
+#include "zipfilter.hpp"
+#include "extsort.hpp"
+#include "ziptable.hpp"
+#include "zipindex.hpp"
+#include "snapshot.hpp"
+#include "zipstats.hpp"
+
+// bytes of input parsed at a time
+#define BLOCK_SIZE (1 << 20)
+// most columns of a record looked at, also for files with a header (-H)
+#define MAX_FIELDS (32)
+// keys sorted by when none is given
+#define DEFAULT_KEYS "city"
+// megabytes of memory used when -M is not given
+#define DEFAULT_MEMORY (256)
+// output buffered before each write
+#define OUT_BUFFER (1 << 20)
+
+/** Append a sorted record to a buffer in the cs2303 output format
+ *
+ * @param out is the buffer to append to
+ * @param rec is the record
+ * @param format is how lat/lon are written
+ */
+static void format_sorted (std::string &out, const SortedRecord &rec, FLOAT_FORMAT format) {
+  const char *name = zip_type_name(rec.type);
+  size_t len = strlen(name);
+
+  size_t at = out.size();
+  out.resize(at + ZIP_CHARS + len + 2 * (rec.city.size() + rec.state.size()) + 4 + 2 * FLOAT_CHARS + 6);
+  char *p = &out[at];
+  p = format_zip(p, rec.zip, rec.digits);
+  *p++ = ',';
+  memcpy(p, name, len);
+  p += len;
+  *p++ = ',';
+  p = format_text(p, rec.city);
+  *p++ = ',';
+  p = format_text(p, rec.state);
+  *p++ = ',';
+  p = format_float(p, rec.lat, format);
+  *p++ = ',';
+  p = format_float(p, rec.lon, format);
+  *p++ = '\n';
+  out.resize(p - out.data());
+}
+
+/** main function to drive program
+ *
+ * usage:
+ *    zipsort [-j threads] [-c | -H] [-k keys] [-f filter] [-M megabytes] [-T temp_dir] [-g] [-S snapshot_file] [--stats[=json]] input_file output_file
+ *
+ * input_file is the federal zip code file (or a cs2303 file with -c, or
+ * with -H any CSV file whose header line names its columns, see
+ * ColumnMap); it may be any size, and compressed. Its records, those that
+ * pass the filter given with -f (see ZipFilter), are written to
+ * output_file in cs2303 format sorted by the keys given with -k, a comma
+ * separated list of zip, type, city, state, lat and lon, most significant
+ * first; default "city". Records with equal keys keep their input order,
+ * so sorting by city gives the order zipcode keeps its table in. Either
+ * file name may be "-" for stdin / stdout. The header line of a federal
+ * file later in the input, as cat a.csv b.csv gives, is skipped.
+ *
+ * Approach (see ExternalSort):
+ * 1) Pack records into a run of at most -M megabytes (default 256); when
+ *    it is full, sort it on -j threads and write it to an unlinked
+ *    temporary file in -T temp_dir (default $TMPDIR, else /tmp)
+ * 2) Merge the runs with a loser tree, reading each in large blocks, and
+ *    write the records in order; an input that fits in one run is never
+ *    written to a temporary file
+ *
+ * With -S a snapshot of the output is written too, for zipcode -s; the
+ * records go into its table as they come out of the merge, already in
+ * city order, so nothing is sorted again. This needs the keys to start
+ * with city and the table (about 19 bytes a record) to fit in memory.
+ *
+ * With -g lat/lon are written as the shortest text that reads back as the
+ * same float. With --stats the time spent reading, parsing and writing
+ * runs (convert), merging (sort) and writing, the rows and the bytes are
+ * printed on stderr at the end.
+ *
+ * @param argc is the number of input strings
+ * @param argv is array of cmd line args -
+ *        zipsort [-j threads] [-c | -H] [-k keys] [-f filter] [-M megabytes] [-T temp_dir] [-g] [-S snapshot_file] [--stats[=json]] input_file output_file
+ * @return 0 for success. non-zero for error
+ */
+int main (int argc, char *argv[]) {
+  const char *list = DEFAULT_KEYS;
+  const char *expr = NULL;
+  const char *tmpdir = getenv("TMPDIR");
+  const char *snapfile = NULL;
+  size_t memory = DEFAULT_MEMORY;
+  FLOAT_FORMAT floats = FLOAT_FIXED;
+  bool cs2303 = false;
+  bool mapped = false;
+  int threads = 1;
+  ZipFilter filter;
+  ColumnMap columns;
+  std::vector<FIELD_KIND> keys;
+  std::string error;
+  int opt;
+  static const struct option longopts[] = {
+    {"stats", optional_argument, NULL, 'A'},
+    {NULL, 0, NULL, 0}
+  };
+
+  while ((opt = getopt_long(argc, argv, "j:cHk:f:M:T:gS:", longopts, NULL)) != -1) {
+    if ((opt == 'j') && (atoi(optarg) > 0)) {
+      threads = atoi(optarg);
+    } else if (opt == 'c') {
+      cs2303 = true;
+    } else if (opt == 'H') {
+      mapped = true;
+    } else if (opt == 'k') {
+      list = optarg;
+    } else if (opt == 'f') {
+      expr = optarg;
+    } else if ((opt == 'M') && (atol(optarg) > 0)) {
+      memory = atol(optarg);
+    } else if (opt == 'T') {
+      tmpdir = optarg;
+    } else if (opt == 'g') {
+      floats = FLOAT_SHORTEST;
+    } else if (opt == 'S') {
+      snapfile = optarg;
+    } else if ((opt == 'A') && (stats.option(optarg) == 0)) {
+      continue;
+    } else {
+      break;
+    }
+  }
+  if ((argc - optind != 2) || (opt != -1) || (cs2303 && mapped) ||
+      ((snapfile != NULL) && (strcmp(argv[optind + 1], "-") == 0))) {
+    fprintf(stderr, "usage: %s [-j threads] [-c | -H] [-k keys] [-f filter] [-M megabytes] [-T temp_dir] [-g] [-S snapshot_file] [--stats[=json]] input_file output_file\n", argv[0]);
+    return -1;
+  }
+  if (parse_sort_keys(list, keys, error) != 0) {
+    fprintf(stderr, "bad keys: %s\n", error.c_str());
+    return -1;
+  }
+  if ((snapfile != NULL) && (keys[0] != FIELD_CITY)) {
+    fprintf(stderr, "a snapshot needs the records sorted by city first\n");
+    return -1;
+  }
+  if ((expr != NULL) && (filter.compile(expr) != 0)) {
+    fprintf(stderr, "bad filter: %s\n", filter.error().c_str());
+    return -1;
+  }
+  if ((tmpdir == NULL) || (*tmpdir == '\0')) {
+    tmpdir = "/tmp";
+  }
+  const char *infile = argv[optind];
+  const char *outfile = argv[optind + 1];
+
+  int fdIn = (strcmp(infile, "-") == 0) ? STDIN_FILENO : open(infile, O_RDONLY);
+  if (fdIn < 0) {
+    fprintf(stderr, "cannot open %s for input - exiting\n", infile);
+    return -2;
+  }
+
+  // pack every record into runs, writing each out as it fills
+  ExternalSort sorter(keys, memory << 20, tmpdir, threads);
+  LineBlockReader reader(fdIn, BLOCK_SIZE);
+  std::string_view fields[MAX_FIELDS];
+  int nfields;
+  Zipfed zip;
+  const char *block;
+  long sz_block;
+  bool header = !cs2303;             // the federal file starts with column names, as -H files do
+  int status = 0;
+  for (;;) {
+    {
+      PhaseTimer timer(PHASE_READ);
+      sz_block = reader.next(&block);
+    }
+    if (sz_block <= 0) {
+      break;
+    }
+    stats.count(COUNT_BYTES_IN, sz_block);
+    PhaseTimer timer(PHASE_CONVERT);
+    CsvIndexScanner scanner(block, sz_block);
+    if (header) {
+      nfields = scanner.next(fields, MAX_FIELDS);
+      if (mapped && (columns.build(fields, (nfields == EOF) ? 0 : nfields, error) != 0)) {
+        fprintf(stderr, "cannot use %s: %s - exiting\n", infile, error.c_str());
+        status = -4;
+        break;
+      }
+      header = false;
+    }
+    uint64_t rows = 0;
+    uint64_t dropped = 0;
+    while ((status == 0) && ((nfields = scanner.next(fields, MAX_FIELDS)) != EOF)) {
+      int parsed;
+      if (mapped) {
+        parsed = zip.parse_fields(columns, fields, nfields);
+      } else if (cs2303) {
+        parsed = zip.parse_fields<Cs2303Schema>(fields, nfields);
+      } else {
+        parsed = zip.parse_fields<FederalSchema>(fields, nfields);
+      }
+      if (parsed == -3) {
+        continue;                    // the header of a file concatenated onto the input
+      }
+      rows++;
+      if (parsed != 0) {
+        fprintf(stderr, "failed to process input record - exiting\n");
+        status = -4;
+      } else if (!filter.match(zip)) {
+        dropped++;
+      } else if (sorter.add(zip) != 0) {
+        fprintf(stderr, "cannot sort: %s - exiting\n", sorter.error().c_str());
+        status = -5;
+      }
+    }
+    stats.count(COUNT_ROWS_READ, rows);
+    stats.count(COUNT_ROWS_PARSED, rows - (status == -4));
+    stats.count(COUNT_ROWS_FILTERED, dropped);
+    if (status != 0) {
+      break;
+    }
+  }
+  if (sz_block < 0) {
+    fprintf(stderr, "cannot read %s - exiting\n", infile);
+    status = -2;
+  }
+  if (fdIn != STDIN_FILENO) {
+    close(fdIn);
+  }
+  if (status != 0) {
+    return status;
+  }
+  {
+    PhaseTimer timer(PHASE_SORT);
+    if (sorter.finish() != 0) {
+      fprintf(stderr, "cannot sort: %s - exiting\n", sorter.error().c_str());
+      return -5;
+    }
+  }
+
+  FILE *out = (strcmp(outfile, "-") == 0) ? stdout : fopen(outfile, "w");
+  if (out == NULL) {
+    fprintf(stderr, "cannot open %s for output - exiting\n", outfile);
+    return -3;
+  }
+  // the merge runs as the output is written
+  ZipTable table;
+  SortedRecord rec;
+  std::string text;
+  int got;
+  {
+    PhaseTimer timer(PHASE_WRITE);
+    while ((got = sorter.next(&rec)) > 0) {
+      format_sorted(text, rec, floats);
+      if ((snapfile != NULL) && (table.add(rec.zip, rec.type, rec.city, rec.state, rec.lat, rec.lon, rec.digits) != 0)) {
+        fprintf(stderr, "cannot keep %.*s in the snapshot - exiting\n", (int) rec.city.size(), rec.city.data());
+        got = -1;
+        break;
+      }
+      if (text.size() >= OUT_BUFFER) {
+        fwrite(text.data(), 1, text.size(), out);
+        stats.count(COUNT_BYTES_OUT, text.size());
+        text.clear();
+      }
+    }
+    fwrite(text.data(), 1, text.size(), out);
+    stats.count(COUNT_BYTES_OUT, text.size());
+  }
+  if (got < 0) {
+    if (!sorter.error().empty()) {
+      fprintf(stderr, "cannot sort: %s - exiting\n", sorter.error().c_str());
+    }
+    status = -5;
+  }
+  if ((fclose(out) != 0) && (status == 0)) {
+    fprintf(stderr, "cannot write %s - exiting\n", outfile);
+    status = -3;
+  }
+
+  if ((status == 0) && (snapfile != NULL)) {
+    PhaseTimer timer(PHASE_SNAPSHOT);
+    CityIndex index;
+    index.build(table);
+    if (Snapshot::write(snapfile, table, index, outfile) != 0) {
+      fprintf(stderr, "cannot write snapshot %s - exiting\n", snapfile);
+      status = -3;
+    }
+  }
+  if (stats.on) {
+    stats.print(stderr);
+  }
+  return status;
+}
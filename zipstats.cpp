@@ -0,0 +1,305 @@
+/** Functions supporting run time statistics
+ *
+ * @author Krishna Garg
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "zipstats.hpp"
+
+Stats stats;
+
+static std::atomic<uint64_t> alloc_count(0);   // calls to operator new
+static std::atomic<uint64_t> alloc_bytes(0);   // bytes asked of operator new
+
+/** Count an allocation, while statistics are on
+ *
+ * @param size is the number of bytes wanted
+ */
+static inline void count_allocation (size_t size) {
+  if (stats.on) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+  }
+}
+
+/** Global operator new, counting every allocation while statistics are
+ *  on. new[] and the nothrow forms all come here. As the default one does,
+ *  it calls the new handler until the memory is there or there is none.
+ *
+ * @param size is the number of bytes wanted
+ * @return the memory
+ */
+void *operator new (size_t size) {
+  count_allocation(size);
+  for (;;) {
+    void *p = malloc((size > 0) ? size : 1);
+    if (p != NULL) {
+      return p;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (handler == NULL) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+/** Global operator delete, the partner of operator new above
+ *
+ * @param p is memory from operator new
+ */
+void operator delete (void *p) noexcept {
+  free(p);
+}
+
+/** Global sized operator delete
+ *
+ * @param p is memory from operator new
+ */
+void operator delete (void *p, size_t) noexcept {
+  free(p);
+}
+
+/** Global aligned operator new, counting every allocation while
+ *  statistics are on. Memory resources such as
+ *  std::pmr::new_delete_resource() come here.
+ *
+ * @param size is the number of bytes wanted
+ * @param align is the alignment wanted
+ * @return the memory
+ */
+void *operator new (size_t size, std::align_val_t align) {
+  count_allocation(size);
+  size_t a = (size_t) align;
+  for (;;) {
+    void *p = aligned_alloc(a, (size + a - 1) / a * a + ((size == 0) ? a : 0));
+    if (p != NULL) {
+      return p;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (handler == NULL) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+/** Global aligned operator delete, the partner of operator new above
+ *
+ * @param p is memory from operator new
+ */
+void operator delete (void *p, std::align_val_t) noexcept {
+  free(p);
+}
+
+/** Global sized aligned operator delete
+ *
+ * @param p is memory from operator new
+ */
+void operator delete (void *p, size_t, std::align_val_t) noexcept {
+  free(p);
+}
+
+/** @return the number of heap allocations made so far */
+uint64_t allocations (void) {
+  return alloc_count.load(std::memory_order_relaxed);
+}
+
+/** @return the number of bytes allocated so far */
+uint64_t allocated_bytes (void) {
+  return alloc_bytes.load(std::memory_order_relaxed);
+}
+
+/** Default ctor for LatencyHistogram. The histogram starts empty.
+ */
+LatencyHistogram::LatencyHistogram () {
+  memset(counts, 0, sizeof(counts));
+  total = 0;
+  sum = 0;
+  largest = 0;
+}
+
+/** Bucket a value falls in
+ *
+ * @param ns is the value
+ * @return the bucket
+ */
+int LatencyHistogram::bucket (uint64_t ns) {
+  if (ns < LINEAR) {
+    return ns;
+  }
+  int k = 63 - __builtin_clzll(ns);
+  int b = LINEAR + (k - 6) * SUB + ((ns >> (k - 5)) & (SUB - 1));
+  return (b < BUCKETS) ? b : BUCKETS - 1;
+}
+
+/** Largest value that falls in a bucket
+ *
+ * @param b is the bucket
+ * @return the value
+ */
+uint64_t LatencyHistogram::value (int b) {
+  if (b < LINEAR) {
+    return b;
+  }
+  int k = 6 + (b - LINEAR) / SUB;
+  uint64_t lo = (uint64_t) (SUB + (b - LINEAR) % SUB) << (k - 5);
+  return lo + ((uint64_t) 1 << (k - 5)) - 1;
+}
+
+/** Add a value
+ *
+ * @param ns is the value, in nanoseconds
+ */
+void LatencyHistogram::record (uint64_t ns) {
+  counts[bucket(ns)]++;
+  total++;
+  sum += ns;
+  if (ns > largest) {
+    largest = ns;
+  }
+}
+
+/** Add the values of another histogram
+ *
+ * @param other is the histogram to add, e.g. of another thread
+ */
+void LatencyHistogram::merge (const LatencyHistogram &other) {
+  for (int b = 0; b < BUCKETS; b++) {
+    counts[b] += other.counts[b];
+  }
+  total += other.total;
+  sum += other.sum;
+  if (other.largest > largest) {
+    largest = other.largest;
+  }
+}
+
+/** Value below which a share of the values fall
+ *
+ * @param p is the share, in percent
+ * @return the value, to within the width of its bucket
+ */
+uint64_t LatencyHistogram::percentile (double p) const {
+  if (total == 0) {
+    return 0;
+  }
+  uint64_t want = (uint64_t) (p / 100.0 * total + 0.5);
+  if (want < 1) {
+    want = 1;
+  }
+  uint64_t seen = 0;
+  for (int b = 0; b < BUCKETS; b++) {
+    seen += counts[b];
+    if (seen >= want) {
+      return (value(b) < largest) ? value(b) : largest;
+    }
+  }
+  return largest;
+}
+
+/** Names of the phases as printed */
+static const char *const PHASE_NAMES[PHASES] = {
+  "read", "convert", "write", "load", "sort", "index", "snapshot", "query"
+};
+
+/** Names of the counters as printed */
+static const char *const COUNTER_NAMES[COUNTERS] = {
+  "rows_read", "rows_parsed", "rows_filtered", "bytes_in", "bytes_out", "queries",
+  "reloads"
+};
+
+/** Default ctor for Stats. Statistics start off and at zero.
+ */
+Stats::Stats () {
+  for (int c = 0; c < COUNTERS; c++) {
+    counters[c].store(0);
+  }
+  for (int p = 0; p < PHASES; p++) {
+    phase_ns[p] = 0;
+    phase_runs[p] = 0;
+  }
+  on = false;
+  json = false;
+}
+
+/** Turn statistics on from the argument of --stats
+ *
+ * @param arg is NULL or "human" for text, "json" for JSON
+ * @return zero (0) if success or -1 if arg is neither
+ */
+int Stats::option (const char *arg) {
+  if ((arg == NULL) || (strcmp(arg, "human") == 0)) {
+    json = false;
+  } else if (strcmp(arg, "json") == 0) {
+    json = true;
+  } else {
+    return -1;
+  }
+  on = true;
+  return 0;
+}
+
+/** Print the statistics
+ *
+ * @param out is where to print them
+ */
+void Stats::print (FILE *out) const {
+  static const double PERCENTILES[] = {50, 90, 99, 99.9};
+  static const char *const PERCENTILE_NAMES[] = {"p50", "p90", "p99", "p999"};
+
+  if (json) {
+    fprintf(out, "{\"phases_ms\": {");
+    const char *sep = "";
+    for (int p = 0; p < PHASES; p++) {
+      if (phase_runs[p] > 0) {
+        fprintf(out, "%s\"%s\": %.3f", sep, PHASE_NAMES[p], phase_ns[p] / 1e6);
+        sep = ", ";
+      }
+    }
+    fprintf(out, "}, \"counters\": {");
+    for (int c = 0; c < COUNTERS; c++) {
+      fprintf(out, "%s\"%s\": %llu", (c > 0) ? ", " : "", COUNTER_NAMES[c],
+              (unsigned long long) counters[c].load());
+    }
+    fprintf(out, ", \"allocations\": %llu, \"allocated_bytes\": %llu}",
+            (unsigned long long) allocations(), (unsigned long long) allocated_bytes());
+    if (latency.count() > 0) {
+      fprintf(out, ", \"latency_ns\": {\"count\": %llu, \"mean\": %.1f",
+              (unsigned long long) latency.count(), latency.mean());
+      for (int i = 0; i < 4; i++) {
+        fprintf(out, ", \"%s\": %llu", PERCENTILE_NAMES[i],
+                (unsigned long long) latency.percentile(PERCENTILES[i]));
+      }
+      fprintf(out, ", \"max\": %llu}", (unsigned long long) latency.max());
+    }
+    fprintf(out, "}\n");
+    return;
+  }
+
+  uint64_t all = 0;
+  for (int p = 0; p < PHASES; p++) {
+    all += phase_ns[p];
+  }
+  fprintf(out, "%-10s %8s %12s %6s\n", "phase", "runs", "ms", "share");
+  for (int p = 0; p < PHASES; p++) {
+    if (phase_runs[p] > 0) {
+      fprintf(out, "%-10s %8llu %12.3f %5.1f%%\n", PHASE_NAMES[p], (unsigned long long) phase_runs[p],
+              phase_ns[p] / 1e6, (all > 0) ? 100.0 * phase_ns[p] / all : 0.0);
+    }
+  }
+  for (int c = 0; c < COUNTERS; c++) {
+    fprintf(out, "%-14s %14llu\n", COUNTER_NAMES[c], (unsigned long long) counters[c].load());
+  }
+  fprintf(out, "%-14s %14llu (%llu bytes)\n", "allocations", (unsigned long long) allocations(),
+          (unsigned long long) allocated_bytes());
+  if (latency.count() > 0) {
+    fprintf(out, "latency ns: mean %.0f", latency.mean());
+    for (int i = 0; i < 4; i++) {
+      fprintf(out, ", %s %llu", PERCENTILE_NAMES[i], (unsigned long long) latency.percentile(PERCENTILES[i]));
+    }
+    fprintf(out, ", max %llu\n", (unsigned long long) latency.max());
+  }
+}
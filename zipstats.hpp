@@ -0,0 +1,170 @@
+/** Run time statistics: phase timers, counters and latency histograms
+ *
+ * @author Krishna Garg
+ */
+
+#ifndef ZIPSTATS_HPP
+#define ZIPSTATS_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+
+/** @brief Phases of a run that are timed
+ */
+typedef enum {
+  PHASE_READ,               /**< reading input blocks */
+  PHASE_CONVERT,            /**< parsing, filtering and formatting records */
+  PHASE_WRITE,              /**< writing output */
+  PHASE_LOAD,               /**< loading a table from a file or snapshot */
+  PHASE_SORT,               /**< sorting a table */
+  PHASE_INDEX,              /**< building lookup indexes */
+  PHASE_SNAPSHOT,           /**< writing a snapshot */
+  PHASE_QUERY,              /**< answering queries */
+  PHASES
+} PHASE;
+
+/** @brief Things that are counted
+ */
+typedef enum {
+  COUNT_ROWS_READ,          /**< records found in the input */
+  COUNT_ROWS_PARSED,        /**< records parsed without error */
+  COUNT_ROWS_FILTERED,      /**< parsed records the filter dropped */
+  COUNT_BYTES_IN,           /**< bytes of input read */
+  COUNT_BYTES_OUT,          /**< bytes of output written */
+  COUNT_QUERIES,            /**< queries answered */
+  COUNT_RELOADS,            /**< datasets reloaded while serving */
+  COUNTERS
+} COUNTER;
+
+/** @brief Histogram of latencies in nanoseconds, HDR style
+ *
+ * Values below 64 have a bucket each; above that every power of two is cut
+ * into 32 buckets, so any value is known to within about 3% in a fixed
+ * array of counts, whatever its range (up to about 18 minutes).
+ */
+class LatencyHistogram {
+private:
+  static const int SUB = 32;        /**< buckets per power of two */
+  static const int LINEAR = 64;     /**< values with a bucket each */
+  static const int BUCKETS = LINEAR + (40 - 6) * SUB;
+  uint64_t counts[BUCKETS];         /**< values that fell in each bucket */
+  uint64_t total;                   /**< number of values */
+  uint64_t sum;                     /**< sum of the values */
+  uint64_t largest;                 /**< largest value */
+
+  static int bucket(uint64_t ns);
+  static uint64_t value(int bucket);
+public:
+  LatencyHistogram();
+  void record(uint64_t ns);
+  void merge(const LatencyHistogram &other);
+  uint64_t percentile(double p) const;
+  /** @return the number of values recorded */
+  uint64_t count() const {return total;}
+  /** @return the mean of the values recorded */
+  double mean() const {return (total > 0) ? (double) sum / total : 0.0;}
+  /** @return the largest value recorded */
+  uint64_t max() const {return largest;}
+};
+
+/** @brief Statistics of one run of a program
+ *
+ * Off unless a program is run with --stats. Phases are timed on the main
+ * thread, worker threads keep a PhaseTotal of their own; counters may be
+ * bumped from any thread, and are bumped once per block or slice rather
+ * than per record, so the cost is a few atomic adds per megabyte when on
+ * and a test of a flag when off. Heap allocations are counted the same
+ * way, by the global operator new of zipstats.cpp in every program that
+ * links it, from the time statistics are turned on.
+ */
+class Stats {
+private:
+  std::atomic<uint64_t> counters[COUNTERS];  /**< value of each counter */
+  uint64_t phase_ns[PHASES];        /**< time spent in each phase */
+  uint64_t phase_runs[PHASES];      /**< times each phase was entered */
+public:
+  bool on;                          /**< true to collect and print statistics */
+  bool json;                        /**< print as JSON instead of text */
+  LatencyHistogram latency;         /**< latency of each query */
+
+  Stats();
+  /** add n to a counter */
+  void count(COUNTER c, uint64_t n) {
+    if (on) {
+      counters[c].fetch_add(n, std::memory_order_relaxed);
+    }
+  }
+  /** add time spent in a phase, over runs times it was entered */
+  void add_time(PHASE p, uint64_t ns, uint64_t runs = 1) {
+    phase_ns[p] += ns;
+    phase_runs[p] += runs;
+  }
+  /** @return the time spent in a phase so far */
+  uint64_t time(PHASE p) const {return phase_ns[p];}
+  int option(const char *arg);
+  void print(FILE *out) const;
+};
+
+extern Stats stats;
+
+uint64_t allocations(void);
+uint64_t allocated_bytes(void);
+
+/** @return nanoseconds on the monotonic clock */
+inline uint64_t stats_clock() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/** @brief Time a worker thread spends in a phase. Only the thread that
+ *  owns it adds to it; the main thread adds it to stats once the worker
+ *  is joined, so the time of every worker is summed.
+ */
+class PhaseTotal {
+private:
+  PHASE phase;                      /**< phase being timed */
+  uint64_t ns;                      /**< time spent in it so far */
+  uint64_t runs;                    /**< times it was entered */
+public:
+  explicit PhaseTotal(PHASE p) : phase(p), ns(0), runs(0) {}
+  /** add time spent in the phase */
+  void add(uint64_t t) {
+    ns += t;
+    runs++;
+  }
+  /** add the total to stats, after the worker is joined */
+  void report() const {
+    if (runs > 0) {
+      stats.add_time(phase, ns, runs);
+    }
+  }
+};
+
+/** @brief Adds the time until it goes out of scope to a phase, when
+ *  statistics are on: to stats on the main thread, or to a PhaseTotal on
+ *  a worker thread
+ */
+class PhaseTimer {
+private:
+  PHASE phase;                      /**< phase being timed */
+  PhaseTotal *total;                /**< where the time goes, NULL for stats */
+  uint64_t t0;                      /**< start, 0 when not timing */
+public:
+  explicit PhaseTimer(PHASE p) : phase(p), total(NULL), t0(stats.on ? stats_clock() : 0) {}
+  explicit PhaseTimer(PhaseTotal &to) : phase(PHASES), total(&to), t0(stats.on ? stats_clock() : 0) {}
+  ~PhaseTimer() {
+    if (t0 == 0) {
+      return;
+    }
+    if (total != NULL) {
+      total->add(stats_clock() - t0);
+    } else {
+      stats.add_time(phase, stats_clock() - t0);
+    }
+  }
+};
+
+#endif // ZIPSTATS_HPP
@@ -0,0 +1,291 @@
+/** Functions supporting synthetic zip code records
+ *
+ * @author Krishna Garg
+ */
+
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <algorithm>
+#include <unordered_set>
+#include "zipsynth.hpp"
+
+// Zipf exponent of city name popularity
+#define NAME_SKEW (0.8)
+// most states one city name is found in
+#define NAME_STATES (4)
+// zips a place spreads its records over
+#define PLACE_ZIPS (8)
+
+/** @brief A state, where its zips are and how many people live there */
+struct SynthState {
+  const char *code;                 /**< USPS code */
+  float lat;                        /**< latitude of the middle of the state */
+  float lon;                        /**< longitude of the middle of the state */
+  int first;                        /**< first 3 digit zip prefix */
+  int last;                         /**< last 3 digit zip prefix */
+  float people;                     /**< population in millions */
+};
+
+static const SynthState STATES[] = {
+  {"AL", 32.8, -86.8, 350, 369, 5.0}, {"AK", 61.4, -152.3, 995, 999, 0.7},
+  {"AZ", 34.2, -111.7, 850, 865, 7.3}, {"AR", 34.9, -92.4, 716, 729, 3.0},
+  {"CA", 37.2, -119.4, 900, 961, 39.0}, {"CO", 39.0, -105.5, 800, 816, 5.8},
+  {"CT", 41.6, -72.7, 60, 69, 3.6}, {"DE", 39.0, -75.5, 197, 199, 1.0},
+  {"DC", 38.9, -77.0, 200, 205, 0.7}, {"FL", 28.6, -82.4, 320, 349, 22.0},
+  {"GA", 32.7, -83.4, 300, 319, 10.9}, {"HI", 20.8, -156.3, 967, 968, 1.4},
+  {"ID", 44.4, -114.6, 832, 838, 1.9}, {"IL", 40.0, -89.2, 600, 629, 12.6},
+  {"IN", 39.9, -86.3, 460, 479, 6.8}, {"IA", 42.1, -93.5, 500, 528, 3.2},
+  {"KS", 38.5, -98.4, 660, 679, 2.9}, {"KY", 37.5, -85.3, 400, 427, 4.5},
+  {"LA", 31.1, -92.0, 700, 714, 4.6}, {"ME", 45.4, -69.2, 39, 49, 1.4},
+  {"MD", 39.0, -76.8, 206, 219, 6.2}, {"MA", 42.3, -71.8, 10, 27, 7.0},
+  {"MI", 44.3, -85.4, 480, 499, 10.0}, {"MN", 46.3, -94.3, 550, 567, 5.7},
+  {"MS", 32.7, -89.7, 386, 397, 2.9}, {"MO", 38.4, -92.5, 630, 658, 6.2},
+  {"MT", 47.0, -109.6, 590, 599, 1.1}, {"NE", 41.5, -99.8, 680, 693, 2.0},
+  {"NV", 39.3, -116.6, 889, 898, 3.2}, {"NH", 43.7, -71.6, 30, 38, 1.4},
+  {"NJ", 40.2, -74.7, 70, 89, 9.3}, {"NM", 34.4, -106.1, 870, 884, 2.1},
+  {"NY", 42.9, -75.5, 100, 149, 19.6}, {"NC", 35.6, -79.4, 270, 289, 10.7},
+  {"ND", 47.5, -100.5, 580, 588, 0.8}, {"OH", 40.3, -82.8, 430, 459, 11.8},
+  {"OK", 35.6, -97.5, 730, 749, 4.0}, {"OR", 43.9, -120.6, 970, 979, 4.2},
+  {"PA", 40.9, -77.8, 150, 196, 13.0}, {"RI", 41.7, -71.5, 28, 29, 1.1},
+  {"SC", 33.9, -80.9, 290, 299, 5.3}, {"SD", 44.4, -100.2, 570, 577, 0.9},
+  {"TN", 35.9, -86.4, 370, 385, 7.1}, {"TX", 31.5, -99.3, 750, 799, 30.0},
+  {"UT", 39.3, -111.7, 840, 847, 3.4}, {"VT", 44.1, -72.7, 50, 59, 0.6},
+  {"VA", 37.5, -78.9, 220, 246, 8.7}, {"WA", 47.4, -120.5, 980, 994, 7.8},
+  {"WV", 38.6, -80.6, 247, 268, 1.8}, {"WI", 44.6, -89.9, 530, 549, 5.9},
+  {"WY", 43.0, -107.6, 820, 831, 0.6}, {"PR", 18.2, -66.5, 6, 9, 3.2}
+};
+#define STATE_COUNT (sizeof(STATES) / sizeof(STATES[0]))
+
+/** Words put in front of some names */
+static const char *const LEADS[] = {
+  "NORTH ", "SOUTH ", "EAST ", "WEST ", "NEW ", "FORT ", "LAKE ", "MOUNT ",
+  "PORT ", "SAINT ", "GREAT ", "OLD "
+};
+
+/** Parts names are glued together from */
+static const char *const PARTS[] = {
+  "SPRING", "FIELD", "BROOK", "WOOD", "HAVEN", "MILL", "RIVER", "GREEN",
+  "ASH", "OAK", "WATER", "BRIDGE", "STONE", "HILL", "CLIFF", "CHESTER",
+  "TON", "VILLE", "BURG", "DALE", "FORD", "MONT", "LAND", "CREST", "GLEN",
+  "ROCK", "FAIR", "BEL", "MAR", "CAM", "LEX", "SALEM", "MAN", "BER", "LIN",
+  "HAM", "SHIRE", "VIEW", "BAY", "WELL", "WORTH", "BURY", "LEY", "MOOR",
+  "PINE", "CEDAR", "MAPLE", "ELM", "FRANK", "CLAY", "WASHING",
+  "FRANKLIN", "MADISON", "JACK", "SON", "GRAND", "ROSE", "AUBURN", "ALBA",
+  "NY", "HOLLY", "SAND", "BRAD", "DOVER", "CAN", "TER", "LOR", "ING"
+};
+
+/** Words put after some names */
+static const char *const TAILS[] = {
+  " CENTER", " JUNCTION", " HEIGHTS", " FALLS", " CITY", " SPRINGS", " BEACH",
+  " VALLEY"
+};
+
+/** Mix a number into a well spread 64 bit hash (splitmix64)
+ *
+ * @param x is the number
+ * @return the hash
+ */
+static uint64_t mix (uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/** Pick from a cumulative distribution
+ *
+ * @param cdf is the distribution, ending in 1
+ * @param u is a number in [0, 1)
+ * @return the index picked
+ */
+static size_t pick (const std::vector<double> &cdf, double u) {
+  size_t i = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+  return std::min(i, cdf.size() - 1);
+}
+
+/** Round a number to two decimals, as the federal file writes positions
+ *
+ * @param x is the number
+ * @return x rounded to 0.01, as a float
+ */
+static float centi (double x) {
+  return (float) (nearbyint(x * 100) / 100);
+}
+
+/** Ctor for ZipSynth. Makes the city names for a file of a given size.
+ *
+ * @param rows is the number of records that will be made; it only sets
+ *   how many distinct city names there are
+ * @param seed picks the names, places and records
+ */
+ZipSynth::ZipSynth (uint64_t rows, uint64_t seed) {
+  this->seed = seed;
+  rng = mix(seed);
+  count = 0;
+
+  // about 28k names for the 80k rows of the federal file
+  double want = 100 * sqrt((double) rows);
+  want = std::max(50.0, std::min(want, std::max(rows / 2.0, 50.0)));
+  size_t n = (size_t) std::min(want, 2e6);
+
+  std::unordered_set<std::string> seen;
+  uint64_t h = mix(seed ^ 0x6e616d6573ULL);
+  size_t parts = sizeof(PARTS) / sizeof(PARTS[0]);
+  while (names.size() < n) {
+    h = mix(h);
+    std::string name;
+    if (h % 10 == 0) {
+      name = LEADS[(h >> 8) % (sizeof(LEADS) / sizeof(LEADS[0]))];
+    }
+    int pieces = 2 + ((h >> 16) % 7 == 0) + (names.size() > 100000) + (names.size() > 1000000);
+    for (int p = 0; p < pieces; p++) {
+      name += PARTS[(h >> (20 + 9 * p)) % parts];
+    }
+    if ((h >> 58) == 0) {
+      name += TAILS[(h >> 4) % (sizeof(TAILS) / sizeof(TAILS[0]))];
+    }
+    if (seen.insert(name).second) {
+      names.push_back(name);
+    }
+  }
+
+  cdf.resize(names.size());
+  double sum = 0;
+  for (size_t i = 0; i < names.size(); i++) {
+    sum += 1.0 / pow(i + 1.0, NAME_SKEW);
+    cdf[i] = sum;
+  }
+  for (size_t i = 0; i < cdf.size(); i++) {
+    cdf[i] /= sum;
+  }
+
+  state_cdf.resize(STATE_COUNT);
+  sum = 0;
+  for (size_t s = 0; s < STATE_COUNT; s++) {
+    sum += STATES[s].people;
+    state_cdf[s] = sum;
+  }
+  for (size_t s = 0; s < STATE_COUNT; s++) {
+    state_cdf[s] /= sum;
+  }
+}
+
+/** Next number of the record sequence
+ *
+ * @return a random 64 bit number
+ */
+uint64_t ZipSynth::random (void) {
+  rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+  return mix(rng);
+}
+
+/** Make the next record
+ *
+ * @param rec is set to the record
+ */
+void ZipSynth::make (Record &rec) {
+  uint64_t r = random();
+  size_t name = pick(cdf, (r >> 11) * (1.0 / 9007199254740992.0));
+
+  // a name lives in up to NAME_STATES states, mostly in its first
+  uint64_t where = random();
+  int copy = ((where & 3) == 0) ? 1 + (where >> 2) % (NAME_STATES - 1) : 0;
+  uint64_t place = mix(seed ^ (name * NAME_STATES + copy));
+  int s = pick(state_cdf, (place >> 11) * (1.0 / 9007199254740992.0));
+  const SynthState &st = STATES[s];
+
+  // each place has its own block of zips and its own spot in the state
+  uint32_t span = (st.last - st.first + 1) * 100 - PLACE_ZIPS;
+  uint32_t base = st.first * 100 + (uint32_t) (mix(place) % span);
+  double dlat = ((mix(place + 1) >> 11) * (1.0 / 9007199254740992.0) - 0.5) * 3.0;
+  double dlon = ((mix(place + 2) >> 11) * (1.0 / 9007199254740992.0) - 0.5) * 4.0;
+
+  uint64_t v = random();
+  rec.zip = base + (uint32_t) (v % PLACE_ZIPS);
+  unsigned kind = (v >> 8) % 100;
+  rec.type = (kind < 72) ? STANDARD : (kind < 92) ? PO_BOX : (kind < 99) ? UNIQUE : MILITARY;
+  rec.city = &names[name];
+  rec.state = s;
+  rec.lat = centi(st.lat + dlat + ((int) ((v >> 20) % 11) - 5) * 0.01);
+  rec.lon = centi(st.lon + dlon + ((int) ((v >> 28) % 11) - 5) * 0.01);
+  count++;
+}
+
+/** Column names of the federal file
+ *
+ * @return the first line of a federal file, without its line ending
+ */
+const char *ZipSynth::federal_header (void) {
+  return "\"RecordNumber\",\"Zipcode\",\"ZipCodeType\",\"City\",\"State\",\"LocationType\",\"Lat\","
+         "\"Long\",\"Xaxis\",\"Yaxis\",\"Zaxis\",\"WorldRegion\",\"Country\",\"LocationText\","
+         "\"Location\",\"Decommisioned\",\"TaxReturnsFiled\",\"EstimatedPopulation\",\"TotalWages\",\"Notes\"";
+}
+
+/** Append the next record in federal format, numbered and ending in \r\n
+ *  like the downloaded file
+ *
+ * @param out is the buffer to append to
+ */
+void ZipSynth::federal (std::string &out) {
+  Record rec;
+  make(rec);
+  const std::string &city = *rec.city;
+  const char *state = STATES[rec.state].code;
+  const char *type = zip_type_name(rec.type);
+  char buf[FLOAT_CHARS];
+
+  out += std::to_string(count);
+  out += ",\"";
+  out.append(buf, format_zip(buf, rec.zip, 1) - buf);
+  out += "\",\"";
+  out += type;
+  out += "\",\"";
+  out += city;
+  out += "\",\"";
+  out += state;
+  out += "\",\"PRIMARY\",";
+  out.append(buf, format_float(buf, rec.lat, FLOAT_SHORTEST) - buf);
+  out += ',';
+  out.append(buf, format_float(buf, rec.lon, FLOAT_SHORTEST) - buf);
+  out += ",0.38,-0.87,0.3,\"NA\",\"US\",\"";
+  // LocationText is the city in title case
+  for (size_t i = 0; i < city.size(); i++) {
+    out += ((i == 0) || (city[i - 1] == ' ')) ? city[i] : (char) tolower((unsigned char) city[i]);
+  }
+  out += ", ";
+  out += state;
+  out += "\",\"NA-US-";
+  out += state;
+  out += '-';
+  out += city;
+  out += "\",\"false\",,,,\r\n";
+}
+
+/** Append the next record in cs2303 format, as fed2cs2303 writes it
+ *
+ * @param out is the buffer to append to
+ */
+void ZipSynth::cs2303 (std::string &out) {
+  Record rec;
+  make(rec);
+  const std::string &city = *rec.city;
+  const char *type = zip_type_name(rec.type);
+  size_t at = out.size();
+
+  out.resize(at + ZIP_CHARS + strlen(type) + city.size() + 2 + 2 * FLOAT_CHARS + 6);
+  char *p = &out[at];
+  p = format_zip(p, rec.zip, 5);
+  *p++ = ',';
+  p = std::copy(type, type + strlen(type), p);
+  *p++ = ',';
+  p = std::copy(city.begin(), city.end(), p);
+  *p++ = ',';
+  p = std::copy(STATES[rec.state].code, STATES[rec.state].code + 2, p);
+  *p++ = ',';
+  p = format_float(p, rec.lat, FLOAT_FIXED);
+  *p++ = ',';
+  p = format_float(p, rec.lon, FLOAT_FIXED);
+  *p++ = '\n';
+  out.resize(p - out.data());
+}
@@ -0,0 +1,61 @@
+/** Synthetic zip code records for tests and benchmarks
+ *
+ * @author Krishna Garg
+ */
+
+#ifndef ZIPSYNTH_HPP
+#define ZIPSYNTH_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "zipfed.hpp"
+
+/** @brief Deterministic generator of realistic zip code records
+ *
+ * Makes any number of records that look like the federal database: city
+ * names built from common place name parts, drawn with a Zipf distribution
+ * so a few names (SPRINGFIELD, say) are everywhere and most are rare; the
+ * same name turns up in several states, each (name, state) pair being one
+ * place with its own zip range and position near its state; states are
+ * weighted by population, and types are mostly STANDARD with some PO_BOX,
+ * UNIQUE and MILITARY zips. The number of distinct names grows with the
+ * square root of the number of records, as it does when real files are
+ * merged.
+ *
+ * The same seed and size always give the same records, in federal or in
+ * cs2303 format. Converting the federal text with fed2cs2303 gives the
+ * cs2303 text of the records it keeps, byte for byte.
+ */
+class ZipSynth {
+private:
+  std::vector<std::string> names;   /**< distinct city names, most common first */
+  std::vector<double> cdf;          /**< Zipf distribution over names */
+  std::vector<double> state_cdf;    /**< population distribution over states */
+  uint64_t seed;                    /**< seed the names and places come from */
+  uint64_t rng;                     /**< state of the record sequence */
+  uint64_t count;                   /**< records made so far */
+
+  /** @brief Fields of one generated record */
+  struct Record {
+    uint32_t zip;                   /**< zip code as a number */
+    ZIPCODE_TYPE type;              /**< type of the zip */
+    const std::string *city;        /**< name of the city */
+    int state;                      /**< index of the state */
+    float lat;                      /**< latitude, two decimals */
+    float lon;                      /**< longitude, two decimals */
+  };
+
+  uint64_t random(void);
+  void make(Record &rec);
+public:
+  ZipSynth(uint64_t rows, uint64_t seed = 2303);
+  static const char *federal_header(void);
+  void federal(std::string &out);
+  void cs2303(std::string &out);
+  /** @return the number of distinct city names records are drawn from */
+  size_t city_names() const {return names.size();}
+};
+
+#endif // ZIPSYNTH_HPP
@@ -0,0 +1,441 @@
+/** Functions supporting the column store for zip code records
+ *
+ * @author Krishna Garg
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "ziptable.hpp"
+#include "csvscan.hpp"
+
+// most columns of a record we look at
+#define MAX_FIELDS (12)
+// longest city name the pool can hold (its length is stored in one byte)
+#define MAX_CITY (255)
+// fewest records sorted by one thread
+#define MIN_SORT_SLICE (65536)
+
+/** USPS codes, interned in this order so codes are the same on every run */
+static const char *const KNOWN_STATES[] = {
+  "AL", "AK", "AZ", "AR", "CA", "CO", "CT", "DE", "DC", "FL", "GA", "HI",
+  "ID", "IL", "IN", "IA", "KS", "KY", "LA", "ME", "MD", "MA", "MI", "MN",
+  "MS", "MO", "MT", "NE", "NV", "NH", "NJ", "NM", "NY", "NC", "ND", "OH",
+  "OK", "OR", "PA", "RI", "SC", "SD", "TN", "TX", "UT", "VT", "VA", "WA",
+  "WV", "WI", "WY", "AS", "GU", "MP", "PR", "VI", "FM", "MH", "PW", "AA",
+  "AE", "AP"
+};
+
+static uint8_t state_codes[1 << 16];   // two state bytes -> code, 0 if new
+static char state_names[256][3];       // code -> name, code 0 is ""
+static int state_next = 1;             // next code to hand out
+static std::mutex state_lock;          // guards handing out codes
+
+/** Give a new code to a two byte state. Caller holds state_lock.
+ *
+ * @param key is the two bytes of the state as a 16 bit number
+ * @return the new code, or 0 if all 255 codes are taken
+ */
+static uint8_t state_assign (unsigned key) {
+  if (state_codes[key] == 0 && state_next < 256) {
+    state_names[state_next][0] = key >> 8;
+    state_names[state_next][1] = key & 0xff;
+    state_names[state_next][2] = '\0';
+    // publish the code only after its name is in place
+    __atomic_store_n(&state_codes[key], (uint8_t) state_next, __ATOMIC_RELEASE);
+    state_next++;
+  }
+  return state_codes[key];
+}
+
+/** Turn a 2-character state into its 1 byte code
+ *
+ * Known USPS codes always get the same code. Other two character states
+ * are given the next free code the first time they are seen. Anything
+ * that is not two characters long maps to code 0, whose name is "".
+ *
+ * @param state is the state to intern
+ * @return the code of the state
+ */
+uint8_t state_intern (std::string_view state) {
+  static std::once_flag seeded;
+  std::call_once(seeded, []() {
+    std::lock_guard<std::mutex> guard(state_lock);
+    for (size_t i = 0; i < sizeof(KNOWN_STATES) / sizeof(KNOWN_STATES[0]); i++) {
+      state_assign(((unsigned char) KNOWN_STATES[i][0] << 8) | (unsigned char) KNOWN_STATES[i][1]);
+    }
+  });
+
+  if (state.size() != 2) {
+    return 0;
+  }
+  unsigned key = ((unsigned char) state[0] << 8) | (unsigned char) state[1];
+  uint8_t code = __atomic_load_n(&state_codes[key], __ATOMIC_ACQUIRE);
+  if (code != 0) {
+    return code;
+  }
+  std::lock_guard<std::mutex> guard(state_lock);
+  return state_assign(key);
+}
+
+/** Turn a state code back into its 2-character state
+ *
+ * @param code is a code returned by state_intern
+ * @return the state, "" for code 0 or a code never handed out
+ */
+std::string_view state_name (uint8_t code) {
+  return std::string_view(state_names[code], strlen(state_names[code]));
+}
+
+/** Default ctor for ZipTable. The table starts empty.
+ */
+ZipTable::ZipTable () {
+  distinct = 0;
+}
+
+/** FNV-1a hash of a city name
+ *
+ * @param key is the name
+ * @return the 32 bit hash of the name
+ */
+static uint32_t city_hash (std::string_view key) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < key.size(); i++) {
+    h ^= (unsigned char) key[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/** Find a city name in the pool, adding it if it is not there yet
+ *
+ * @param city is the name to find
+ * @return the offset of the name's entry in pool
+ */
+uint32_t ZipTable::intern (std::string_view city) {
+  std::vector<char> &names = pool.edit();
+
+  // keep the dedup table at most half full, rehashing every name in the
+  // pool when it grows (this also covers a pool that came from a snapshot)
+  if ((distinct + 1) * 2 > slots.size()) {
+    size_t cap = 1024;
+    while (cap < (distinct + 1) * 4) {
+      cap <<= 1;
+    }
+    slots.assign(cap, 0);
+    for (size_t off = 0; off < names.size(); off += (unsigned char) names[off] + 2) {
+      uint32_t j = city_hash(std::string_view(&names[off + 1], (unsigned char) names[off])) & (cap - 1);
+      while (slots[j] != 0) {
+        j = (j + 1) & (cap - 1);
+      }
+      slots[j] = off + 1;
+    }
+  }
+
+  uint32_t mask = slots.size() - 1;
+  uint32_t j = city_hash(city) & mask;
+  for (; slots[j] != 0; j = (j + 1) & mask) {
+    const char *p = &names[slots[j] - 1];
+    if (std::string_view(p + 1, (unsigned char) p[0]) == city) {
+      return slots[j] - 1;
+    }
+  }
+
+  uint32_t off = names.size();
+  names.push_back((char) city.size());
+  names.insert(names.end(), city.begin(), city.end());
+  names.push_back('\0');
+  pool.commit();
+  slots[j] = off + 1;
+  distinct++;
+  return off;
+}
+
+/** Append a parsed record to the table
+ *
+ * @param zip is the record to copy
+ * @return zero (0) if success or non-zero if the record cannot be stored
+ *   (city name too long)
+ */
+int ZipTable::add (const Zipfed &zip) {
+  return add(zip.get_zip(), zip.get_type(), zip.get_city(), zip.get_state(), zip.get_lat(), zip.get_lon(),
+             zip.get_zip_digits());
+}
+
+/** Append a record given field by field, as it comes out of an
+ *  ExternalSort
+ *
+ * @param zip is the zip code
+ * @param type is the zip code type
+ * @param city is the city name
+ * @param state is the state code
+ * @param lat is the latitude
+ * @param lon is the longitude
+ * @param zipdigits is the number of digits the zip is written with
+ * @return zero (0) if success or non-zero if the record cannot be stored
+ *   (city name too long)
+ */
+int ZipTable::add (uint32_t zip, ZIPCODE_TYPE type, std::string_view city, std::string_view state,
+                   float lat, float lon, uint8_t zipdigits) {
+  if (city.size() > MAX_CITY) {
+    return -1;
+  }
+
+  zips.push_back(zip);
+  digits.push_back(zipdigits);
+  states.push_back(state_intern(state));
+  types.push_back((uint8_t) type);
+  lats.push_back(lat);
+  lons.push_back(lon);
+  cities.push_back(intern(city));
+  return 0;
+}
+
+/** Parse the records of a federal format file into the table
+ *
+ * @param data is the text of the file; its first line is column labels
+ * @param size is the number of bytes of text
+ * @return zero (0) if success or non-zero on error.
+ */
+int ZipTable::load_federal (const char *data, size_t size) {
+  std::string_view fields[MAX_FIELDS];
+  int nfields;
+  Zipfed zip;
+
+  CsvIndexScanner scanner(data, size);
+  scanner.next(fields, MAX_FIELDS);           // column labels
+  while ((nfields = scanner.next(fields, MAX_FIELDS)) != -1) {
+    int parsed = zip.parse_fields_federal(fields, nfields);
+    if (parsed == -3) {
+      continue;                                // the labels of a concatenated file
+    }
+    if ((parsed != 0) || (add(zip) != 0)) {
+      return -4;
+    }
+  }
+  return 0;
+}
+
+/** Parse the records of a cs2303 format file into the table
+ *
+ * @param data is the text of the file
+ * @param size is the number of bytes of text
+ * @return zero (0) if success or non-zero on error.
+ */
+int ZipTable::load_cs2303 (const char *data, size_t size) {
+  std::string_view fields[MAX_FIELDS];
+  int nfields;
+  Zipfed zip;
+
+  CsvIndexScanner scanner(data, size);
+  while ((nfields = scanner.next(fields, MAX_FIELDS)) != -1) {
+    if ((zip.parse_fields_cs2303(fields, nfields) != 0) || (add(zip) != 0)) {
+      return -4;
+    }
+  }
+  return 0;
+}
+
+/** Reorder a column by a permutation
+ *
+ * @param column is the column to reorder
+ * @param order lists the old position of each new position
+ */
+template <class T>
+static void permute (Column<T> &column, const std::vector<uint32_t> &order) {
+  std::vector<T> sorted(column.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    sorted[i] = column[order[i]];
+  }
+  column.assign(std::move(sorted));
+}
+
+/** Run tasks on a number of threads, the calling thread being one of them
+ *
+ * @param threads is the number of threads to use
+ * @param tasks is the number of tasks
+ * @param task is called once with each task number 0 .. tasks - 1
+ */
+template <class F>
+static void run_parallel (int threads, size_t tasks, F task) {
+  std::atomic<size_t> next(0);
+  auto work = [&]() {
+    size_t t;
+    while ((t = next.fetch_add(1)) < tasks) {
+      task(t);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int t = 1; t < threads; t++) {
+    workers.push_back(std::thread(work));
+  }
+  work();
+  for (size_t t = 0; t < workers.size(); t++) {
+    workers[t].join();
+  }
+}
+
+/** @brief A distinct city name, keyed by its first 8 bytes */
+struct CityKey {
+  uint64_t prefix;                  /**< first 8 bytes, big endian, zero padded */
+  uint32_t off;                     /**< offset of the name in the pool */
+};
+
+/** Sort the records alphabetically by city
+ *
+ * Names are interned, so the distinct names (far fewer than the records)
+ * are sorted once, mostly by comparing 8 byte prefixes as numbers, and
+ * every name gets its rank. The records are then ordered by rank with a
+ * counting sort: one pass to count the records of each rank and one pass
+ * to place them, touching the city column in order and never comparing
+ * strings. With more than one thread each thread counts and places its own
+ * slice of the records, and the columns are reordered side by side.
+ *
+ * The sort is stable, so the zips of one city stay in the order they were
+ * added.
+ *
+ * @param threads is the number of threads to sort with
+ */
+void ZipTable::sort_by_city (int threads) {
+  size_t n = size();
+  const char *names = pool.data();
+
+  // rank the distinct names, equal names (if the pool repeats one) sharing a rank
+  std::vector<CityKey> keys;
+  for (size_t off = 0; off < pool.size(); off += (unsigned char) names[off] + 2) {
+    size_t len = (unsigned char) names[off];
+    uint64_t prefix = 0;
+    for (size_t k = 0; k < 8; k++) {
+      prefix = (prefix << 8) | ((k < len) ? (unsigned char) names[off + 1 + k] : 0);
+    }
+    keys.push_back(CityKey{prefix, (uint32_t) off});
+  }
+  auto name = [names](uint32_t off) {
+    return std::string_view(names + off + 1, (unsigned char) names[off]);
+  };
+  std::sort(keys.begin(), keys.end(), [&name](const CityKey &a, const CityKey &b) {
+    return (a.prefix != b.prefix) ? (a.prefix < b.prefix) : (name(a.off) < name(b.off));
+  });
+  std::vector<uint32_t> rank(pool.size());
+  uint32_t ranks = 0;
+  for (size_t k = 0; k < keys.size(); k++) {
+    if ((k > 0) && ((keys[k].prefix != keys[k - 1].prefix) || (name(keys[k].off) != name(keys[k - 1].off)))) {
+      ranks++;
+    }
+    rank[keys[k].off] = ranks;
+  }
+  ranks++;
+
+  // counting sort of the records by rank, one slice of records per thread
+  if ((threads < 1) || (n < MIN_SORT_SLICE)) {
+    threads = 1;
+  }
+  size_t slices = std::min((size_t) threads, n / MIN_SORT_SLICE + 1);
+  std::vector<std::vector<uint32_t>> counts(slices, std::vector<uint32_t>(ranks, 0));
+  run_parallel(threads, slices, [&](size_t t) {
+    uint32_t *count = counts[t].data();
+    for (size_t i = n * t / slices; i < n * (t + 1) / slices; i++) {
+      count[rank[cities[i]]]++;
+    }
+  });
+  uint32_t at = 0;
+  for (uint32_t r = 0; r < ranks; r++) {
+    for (size_t t = 0; t < slices; t++) {
+      uint32_t c = counts[t][r];
+      counts[t][r] = at;
+      at += c;
+    }
+  }
+  std::vector<uint32_t> order(n);
+  run_parallel(threads, slices, [&](size_t t) {
+    uint32_t *place = counts[t].data();
+    for (size_t i = n * t / slices; i < n * (t + 1) / slices; i++) {
+      order[place[rank[cities[i]]]++] = i;
+    }
+  });
+
+  run_parallel(threads, 7, [&](size_t column) {
+    switch (column) {
+    case 0:
+      permute(zips, order);
+      break;
+    case 6:
+      permute(digits, order);
+      break;
+    case 1:
+      permute(states, order);
+      break;
+    case 2:
+      permute(types, order);
+      break;
+    case 3:
+      permute(lats, order);
+      break;
+    case 4:
+      permute(lons, order);
+      break;
+    default:
+      permute(cities, order);
+      break;
+    }
+  });
+}
+
+/** Append a record to a buffer in the cs2303 output format:
+ *  zip,type,city,state,lat,lon and a newline, city and state quoted as
+ *  format_text quotes them
+ *
+ * @param out is the buffer to append to
+ * @param zip is the zip code
+ * @param digits is the least number of digits to write the zip with
+ * @param type is the zip code type
+ * @param city is the city name
+ * @param state is the state
+ * @param lat is the latitude
+ * @param lon is the longitude
+ */
+void print_record (std::string &out, uint32_t zip, int digits, ZIPCODE_TYPE type, std::string_view city,
+                   std::string_view state, float lat, float lon) {
+  const char *name = zip_type_name(type);
+  size_t len = strlen(name);
+
+  size_t at = out.size();
+  out.resize(at + ZIP_CHARS + len + 2 * (city.size() + state.size()) + 4 + 2 * FLOAT_CHARS + 6);
+  char *p = &out[at];
+  p = format_zip(p, zip, digits);
+  *p++ = ',';
+  memcpy(p, name, len);
+  p += len;
+  *p++ = ',';
+  p = format_text(p, city);
+  *p++ = ',';
+  p = format_text(p, state);
+  *p++ = ',';
+  p = format_float(p, lat, FLOAT_FIXED);
+  *p++ = ',';
+  p = format_float(p, lon, FLOAT_FIXED);
+  *p++ = '\n';
+  out.resize(p - out.data());
+}
+
+/** Append record i to a buffer in the cs2303 output format
+ *
+ * @param i is the position of the record
+ * @param out is the buffer to append to
+ */
+void ZipTable::print (size_t i, std::string &out) const {
+  print_record(out, zips[i], digits[i], get_type(i), get_city(i), get_state(i), lats[i], lons[i]);
+}
+
+/** Bytes of memory held by the table
+ *
+ * @return the heap held by the columns, pool and dedup table; columns
+ *   attached to a snapshot are not counted
+ */
+size_t ZipTable::memory (void) const {
+  return zips.memory() + digits.memory() + states.memory() + types.memory() + lats.memory() +
+         lons.memory() + cities.memory() + pool.memory() +
+         slots.capacity() * sizeof(uint32_t);
+}
@@ -0,0 +1,153 @@
+/** Compact column store for zip code records
+ *
+ * @author Krishna Garg
+ */
+
+#ifndef ZIPTABLE_HPP
+#define ZIPTABLE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "zipfed.hpp"
+
+uint8_t state_intern(std::string_view state);
+std::string_view state_name(uint8_t code);
+void print_record(std::string &out, uint32_t zip, int digits, ZIPCODE_TYPE type, std::string_view city,
+                  std::string_view state, float lat, float lon);
+
+/** @brief Array that owns its elements or views elements owned elsewhere
+ *
+ * While a table is being built the elements live in a vector the column
+ * owns. A column can instead be attached to memory it does not own (for
+ * example a memory mapped snapshot file); readers see the same interface
+ * either way.
+ */
+template <class T>
+class Column {
+private:
+  std::vector<T> own;               /**< elements, when the column owns them */
+  const T *ptr;                     /**< first element */
+  size_t len;                       /**< number of elements */
+
+  /** point at the owned vector again after it changed */
+  void sync() {ptr = own.data(); len = own.size();}
+public:
+  Column() : ptr(NULL), len(0) {}
+  /** copy a column; a copy of an owning column owns its own elements */
+  Column(const Column &other) : own(other.own), ptr(other.ptr), len(other.len) {
+    if (!own.empty()) {
+      sync();
+    }
+  }
+  /** assign a column; the result owns its elements if other did */
+  Column &operator=(const Column &other) {
+    own = other.own;
+    ptr = other.ptr;
+    len = other.len;
+    if (!own.empty()) {
+      sync();
+    }
+    return *this;
+  }
+  /** append an element, copying attached elements into the column first */
+  void push_back(const T &value) {edit().push_back(value); sync();}
+  /** take over the elements of a vector */
+  void assign(std::vector<T> &&values) {own.swap(values); sync();}
+  /** view n elements at p without copying them; p must outlive the column */
+  void attach(const T *p, size_t n) {std::vector<T>().swap(own); ptr = p; len = n;}
+  /** @return the owned vector, holding a copy of attached elements */
+  std::vector<T> &edit() {
+    if ((len > 0) && (ptr != own.data())) {
+      own.assign(ptr, ptr + len);
+    }
+    return own;
+  }
+  /** resynchronize after changing the vector returned by edit() */
+  void commit() {sync();}
+  /** @return element i */
+  const T &operator[](size_t i) const {return ptr[i];}
+  /** @return the first element */
+  const T *data() const {return ptr;}
+  /** @return the number of elements */
+  size_t size() const {return len;}
+  /** @return bytes of heap held by the column (0 when attached) */
+  size_t memory() const {return own.capacity() * sizeof(T);}
+};
+
+/** @brief Zip code records stored as columns
+ *
+ * Holds the same fields as Zipfed, one array per field: the zip as a
+ * number and the digits it is written with, the state as a 1 byte interned
+ * code (see state_intern), the type as a byte, lat and lon as packed floats
+ * and the city as an offset into a string pool in which each distinct name
+ * is stored once. A record costs 19 bytes plus its share of the pool, and a
+ * scan over one field walks one contiguous array.
+ *
+ * Records are addressed by position; the get_ methods mirror the Zipfed
+ * getters.
+ */
+class ZipTable {
+private:
+  Column<uint32_t> zips;            /**< zip code as a number */
+  Column<uint8_t> digits;           /**< digits the zip is written with, at least 5 */
+  Column<uint8_t> states;           /**< interned state code */
+  Column<uint8_t> types;            /**< ZIPCODE_TYPE of the zip */
+  Column<float> lats;               /**< latitude of the zip */
+  Column<float> lons;               /**< longitude of the zip */
+  Column<uint32_t> cities;          /**< offset of the city name in pool */
+  Column<char> pool;                /**< length byte, name, '\0' per city */
+  std::vector<uint32_t> slots;      /**< pool offset + 1 per distinct city */
+  size_t distinct;                  /**< number of names in pool */
+
+  uint32_t intern(std::string_view city);
+  friend class Snapshot;
+public:
+  ZipTable();
+  int add(const Zipfed &zip);
+  int add(uint32_t zip, ZIPCODE_TYPE type, std::string_view city, std::string_view state, float lat, float lon,
+          uint8_t zipdigits = 5);
+  int load_federal(const char *data, size_t size);
+  int load_cs2303(const char *data, size_t size);
+  void sort_by_city(int threads = 1);
+  void print(size_t i, std::string &out) const;
+  size_t memory(void) const;
+
+  /** @return the number of records in the table */
+  size_t size() const {return zips.size();}
+  /** @return the number of distinct city names in the table */
+  size_t city_count() const {return distinct;}
+  /** @return the zip code of record i */
+  uint32_t get_zip(size_t i) const {return zips[i];}
+  /** @return the number of digits the zip of record i is written with */
+  int get_zip_digits(size_t i) const {return digits[i];}
+  /** @return the zip code type of record i */
+  ZIPCODE_TYPE get_type(size_t i) const {return (ZIPCODE_TYPE) types[i];}
+  /** @return the interned state code of record i */
+  uint8_t get_state_code(size_t i) const {return states[i];}
+  /** @return the 2-character state of record i */
+  std::string_view get_state(size_t i) const {return state_name(states[i]);}
+  /** @return the latitude of record i */
+  float get_lat(size_t i) const {return lats[i];}
+  /** @return the longitude of record i */
+  float get_lon(size_t i) const {return lons[i];}
+  /** @return the latitudes of all records, one contiguous array */
+  const float *lat_data() const {return lats.data();}
+  /** @return the longitudes of all records, one contiguous array */
+  const float *lon_data() const {return lons.data();}
+  /** @return an id of record i's city, equal ids mean equal names */
+  uint32_t get_city_id(size_t i) const {return cities[i];}
+  /** @return the city of record i */
+  std::string_view get_city(size_t i) const {
+    return city_name(cities[i]);
+  }
+  /** @return the city name of a city id (see get_city_id) */
+  std::string_view city_name(uint32_t id) const {
+    const char *p = &pool[id];
+    return std::string_view(p + 1, (unsigned char) p[0]);
+  }
+};
+
+#endif // ZIPTABLE_HPP